@@ -1,48 +1,190 @@
 #ifndef __OVERLAY_UTILS_HPP__
 #define __OVERLAY_UTILS_HPP__
 
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <memory>
+#include <string>
+#include <tuple>
 #include <vector>
 
 #include <process/collect.hpp>
+#include <process/defer.hpp>
+#include <process/dispatch.hpp>
 #include <process/io.hpp>
 #include <process/future.hpp>
+#include <process/id.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
 #include <process/subprocess.hpp>
 
+#include <process/metrics/counter.hpp>
+#include <process/metrics/metrics.hpp>
+#include <process/metrics/pull_gauge.hpp>
+#include <process/metrics/timer.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/lambda.hpp>
+#include <stout/option.hpp>
+#include <stout/path.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/dup.hpp>
+#include <stout/os/fcntl.hpp>
 #include <stout/os/killtree.hpp>
+#include <stout/os/mktemp.hpp>
+#include <stout/os/rm.hpp>
 #include <stout/os/shell.hpp>
+#include <stout/os/write.hpp>
 
 namespace mesos {
 namespace modules {
 namespace common {
 
-// Exec's a command.
-inline process::Future<std::string> runCommand(
+// Commands which are queued run in the order of their priority, and
+// in the order they were queued within a priority.
+enum class Priority
+{
+  HIGH = 0,
+  NORMAL = 1,
+  LOW = 2
+};
+
+
+namespace internal {
+
+// The most commands which run at once, and which wait to be run.
+constexpr size_t MAX_RUNNING_COMMANDS = 4;
+constexpr size_t MAX_QUEUED_COMMANDS = 1024;
+
+// The most output of a command which is kept. A command whose stdout
+// is longer fails, while its stderr, which is only used for error
+// messages, is truncated.
+constexpr size_t MAX_STDOUT_SIZE = 16 * 1024 * 1024;
+constexpr size_t MAX_STDERR_SIZE = 64 * 1024;
+
+
+struct Output
+{
+  explicit Output(size_t _limit)
+    : limit(_limit), truncated(false), buffer(64 * 1024) {}
+
+  const size_t limit;
+  std::string data;
+  bool truncated;
+  std::vector<char> buffer;
+};
+
+
+inline process::Future<Nothing> _read(
+    int_fd fd,
+    const std::shared_ptr<Output>& output)
+{
+  return process::io::read(fd, output->buffer.data(), output->buffer.size())
+    .then([fd, output](size_t length) -> process::Future<Nothing> {
+      if (length == 0) {
+        return Nothing();
+      }
+
+      const size_t left =
+        output->limit - std::min(output->limit, output->data.size());
+
+      output->data.append(output->buffer.data(), std::min(length, left));
+      output->truncated = output->truncated || length > left;
+
+      return _read(fd, output);
+    });
+}
+
+
+// Reads `fd` until EOF into `output`. Whatever does not fit is read
+// and dropped, so that the command never blocks on a full pipe.
+inline process::Future<Nothing> read(
+    int_fd fd,
+    const std::shared_ptr<Output>& output)
+{
+  // Like `io::read`, use our own non-blocking copy of `fd`.
+  Try<int_fd> dup = os::dup(fd);
+  if (dup.isError()) {
+    return process::Failure("Failed to duplicate fd: " + dup.error());
+  }
+
+  Try<Nothing> nonblock = os::nonblock(dup.get());
+  if (nonblock.isError()) {
+    os::close(dup.get());
+    return process::Failure("Failed to set O_NONBLOCK: " + nonblock.error());
+  }
+
+  return _read(dup.get(), output)
+    .onAny([dup](const process::Future<Nothing>&) {
+      os::close(dup.get());
+    });
+}
+
+
+// Exec's a command, see `runCommand`.
+inline process::Future<std::string> execute(
     const std::string& command,
     const std::vector<std::string>& argv,
-    const Duration& timeout = Milliseconds(5000))
+    const Duration& timeout,
+    const Option<std::string>& input)
 {
+  std::string in = "/dev/null";
+  if (input.isSome()) {
+    Try<std::string> path = os::mktemp();
+    if (path.isError()) {
+      return process::Failure(
+          "Unable to create the input of '" + command + "': " + path.error());
+    }
+
+    Try<Nothing> write = os::write(path.get(), input.get());
+    if (write.isError()) {
+      os::rm(path.get());
+      return process::Failure(
+          "Unable to write the input of '" + command + "': " + write.error());
+    }
+
+    in = path.get();
+  }
+
   Try<process::Subprocess> s = process::subprocess(
       command,
       argv,
-      process::Subprocess::PATH("/dev/null"),
+      process::Subprocess::PATH(in),
       process::Subprocess::PIPE(),
       process::Subprocess::PIPE());
 
+  // NOTE: The input file is opened before `subprocess` returns, so we
+  // can remove it right away.
+  if (input.isSome()) {
+    os::rm(in);
+  }
+
   if (s.isError()) {
     return process::Failure(
         "Unable to execute '" + command + "': " + s.error());
   }
   pid_t pid = s->pid();
 
+  std::shared_ptr<Output> out(new Output(MAX_STDOUT_SIZE));
+  std::shared_ptr<Output> err(new Output(MAX_STDERR_SIZE));
+
   typedef std::tuple<
       process::Future<Option<int>>,
-      process::Future<std::string>,
-      process::Future<std::string>> ProcessTuple;
+      process::Future<Nothing>,
+      process::Future<Nothing>> ProcessTuple;
 
+  // NOTE: Discarding the returned future kills the subprocess, which
+  // is then reaped in the background.
   return await(
       s->status(),
-      process::io::read(s->out().get()),
-      process::io::read(s->err().get()))
+      read(s->out().get(), out),
+      read(s->err().get(), err))
     .after(timeout, [=](const process::Future<ProcessTuple> &future) ->
         process::Future<ProcessTuple> {
       // Kill the process explicitly and wait for the reaper to reap
@@ -51,13 +193,12 @@ inline process::Future<std::string> runCommand(
       os::killtree(pid, SIGKILL);
       return future.then(
           [=](const ProcessTuple& t) -> process::Future<ProcessTuple> {
-            return std::make_tuple(
-                -1,
-                "",
-                "timeout after " + stringify(timeout));
+            err->data = "timeout after " + stringify(timeout);
+            return std::make_tuple(-1, Nothing(), Nothing());
           });
     })
-    .then([command](const ProcessTuple& t) -> process::Future<std::string> {
+    .then([command, out, err](const ProcessTuple& t)
+        -> process::Future<std::string> {
       process::Future<Option<int>> status = std::get<0>(t);
       if (!status.isReady()) {
         return process::Failure(
@@ -69,27 +210,414 @@ inline process::Future<std::string> runCommand(
         return process::Failure("Failed to reap the subprocess");
       }
 
-      process::Future<std::string> out = std::get<1>(t);
-      if (!out.isReady()) {
+      process::Future<Nothing> _out = std::get<1>(t);
+      if (!_out.isReady()) {
         return process::Failure(
-            "Failed to read stderr from the subprocess: " +
-            (out.isFailed() ? out.failure() : "discarded"));
+            "Failed to read stdout from the subprocess: " +
+            (_out.isFailed() ? _out.failure() : "discarded"));
       }
 
-      process::Future<std::string> err = std::get<2>(t);
-      if (!err.isReady()) {
+      process::Future<Nothing> _err = std::get<2>(t);
+      if (!_err.isReady()) {
         return process::Failure(
             "Failed to read stderr from the subprocess: " +
-            (err.isFailed() ? err.failure() : "discarded"));
+            (_err.isFailed() ? _err.failure() : "discarded"));
       }
 
       if (status.get() != 0) {
         return process::Failure(
-            "Failed to execute '" + command + "': " + err.get());
+            "Failed to execute '" + command + "': " + err->data);
+      }
+
+      if (out->truncated) {
+        return process::Failure(
+            "Output of '" + command + "' exceeds " +
+            stringify(MAX_STDOUT_SIZE) + " bytes");
       }
 
-      return out.get();
+      return out->data;
+    })
+    .onDiscard([pid]() {
+      os::killtree(pid, SIGKILL);
     });
+}
+
+
+// Runs the commands of all the modules loaded in a process, at most
+// `MAX_RUNNING_COMMANDS` at a time, so that e.g. `iptables` commands
+// do not push each other past their timeout while waiting for the
+// xtables lock. A command which is identical to one which is queued
+// or running (same arguments and input) shares its result, even if it
+// was given a different timeout, and the queued one is promoted to the
+// higher of their priorities. Each caller gets its own future, and the
+// command is only dropped from the queue, or killed, once all of its
+// callers have discarded theirs.
+class CommandExecutorProcess : public process::Process<CommandExecutorProcess>
+{
+public:
+  CommandExecutorProcess()
+    : ProcessBase(process::ID::generate("command-executor")),
+      running(0),
+      metrics(this) {}
+
+  process::Future<std::string> run(
+      const std::string& command,
+      const std::vector<std::string>& argv,
+      const Duration& timeout,
+      const Option<std::string>& input,
+      Priority priority)
+  {
+    const std::string separator(1, '\0');
+
+    std::string key = command + separator + strings::join(separator, argv);
+    if (input.isSome()) {
+      key += separator + input.get();
+    }
+
+    if (commands.contains(key)) {
+      ++metrics.deduplicated;
+      promote(key, priority);
+      return caller(key);
+    }
+
+    if (_queued() >= MAX_QUEUED_COMMANDS) {
+      ++metrics.rejected;
+      return process::Failure(
+          "Unable to execute '" + command + "': too many commands queued");
+    }
+
+    // Scripts are accounted for by their first command.
+    std::string name = command;
+    if (command == os::Shell::name && argv.size() > 2) {
+      std::vector<std::string> tokens = strings::tokenize(argv[2], " ");
+      if (!tokens.empty()) {
+        name = tokens[0];
+      }
+    }
+
+    Command queued;
+    queued.key = key;
+    queued.name = name;
+    queued.command = command;
+    queued.argv = argv;
+    queued.timeout = timeout;
+    queued.input = input;
+
+    queues[static_cast<size_t>(priority)].push_back(queued);
+
+    commands.put(key, Shared(queued.promise->future()));
+
+    schedule();
+
+    return caller(key);
+  }
+
+private:
+  struct Command
+  {
+    Command() : promise(new process::Promise<std::string>()) {}
+
+    std::string key;
+    std::string name;
+    std::string command;
+    std::vector<std::string> argv;
+    Duration timeout;
+    Option<std::string> input;
+    process::Owned<process::Promise<std::string>> promise;
+  };
+
+  // The result of a queued or running command, and the number of its
+  // callers which have not discarded their future.
+  struct Shared
+  {
+    explicit Shared(const process::Future<std::string>& _future)
+      : future(_future), callers(0) {}
+
+    process::Future<std::string> future;
+    size_t callers;
+  };
+
+  // Latency and failures of the commands with the same executable, e.g.
+  // `command_executor/iptables/latency_ms`.
+  struct CommandMetrics
+  {
+    explicit CommandMetrics(const std::string& name)
+      : latency("command_executor/" + name + "/latency", Hours(1)),
+        failures("command_executor/" + name + "/failures")
+    {
+      process::metrics::add(latency);
+      process::metrics::add(failures);
+    }
+
+    ~CommandMetrics()
+    {
+      process::metrics::remove(latency);
+      process::metrics::remove(failures);
+    }
+
+    process::metrics::Timer<Milliseconds> latency;
+    process::metrics::Counter failures;
+  };
+
+  struct Metrics
+  {
+    explicit Metrics(CommandExecutorProcess* process)
+      : queued(
+            "command_executor/queued",
+            process::defer(process, &CommandExecutorProcess::_queued)),
+        running(
+            "command_executor/running",
+            process::defer(process, &CommandExecutorProcess::_running)),
+        deduplicated("command_executor/deduplicated"),
+        rejected("command_executor/rejected")
+    {
+      process::metrics::add(queued);
+      process::metrics::add(running);
+      process::metrics::add(deduplicated);
+      process::metrics::add(rejected);
+    }
+
+    ~Metrics()
+    {
+      process::metrics::remove(queued);
+      process::metrics::remove(running);
+      process::metrics::remove(deduplicated);
+      process::metrics::remove(rejected);
+    }
+
+    process::metrics::PullGauge queued;
+    process::metrics::PullGauge running;
+    process::metrics::Counter deduplicated;
+    process::metrics::Counter rejected;
+  };
+
+  // Moves the command `key`, if it is queued at a lower priority, to
+  // the end of the queue of `priority`.
+  void promote(const std::string& key, Priority priority)
+  {
+    const size_t lowest = static_cast<size_t>(Priority::LOW);
+
+    for (size_t i = static_cast<size_t>(priority) + 1; i <= lowest; i++) {
+      std::deque<Command>& queue = queues[i];
+
+      std::deque<Command>::iterator command = std::find_if(
+          queue.begin(),
+          queue.end(),
+          [&key](const Command& command) { return command.key == key; });
+
+      if (command != queue.end()) {
+        queues[static_cast<size_t>(priority)].push_back(*command);
+        queue.erase(command);
+        return;
+      }
+    }
+  }
+
+  // Returns a future for a new caller of the command `key`, which is
+  // completed with the result of the command. Discarding it does not
+  // affect the other callers.
+  process::Future<std::string> caller(const std::string& key)
+  {
+    Shared& shared = commands.at(key);
+    shared.callers++;
+
+    std::shared_ptr<process::Promise<std::string>> promise(
+        new process::Promise<std::string>());
+
+    shared.future
+      .onAny([promise](const process::Future<std::string>& result) {
+        if (result.isReady()) {
+          promise->set(result.get());
+        } else if (result.isFailed()) {
+          promise->fail(result.failure());
+        } else {
+          promise->discard();
+        }
+      });
+
+    promise->future()
+      .onDiscard(process::defer(
+          self(),
+          &CommandExecutorProcess::abandon,
+          key,
+          shared.future));
+
+    return promise->future();
+  }
+
+  // Called when a caller of the command `key` discards its future.
+  // Once all of them have, the command is dropped from its queue, or
+  // killed if it is running.
+  void abandon(
+      const std::string& key,
+      const process::Future<std::string>& future)
+  {
+    // The command may have finished, and another one with the same
+    // arguments and input may have been queued since.
+    if (!commands.contains(key) || commands.at(key).future != future) {
+      return;
+    }
+
+    if (--commands.at(key).callers > 0) {
+      return;
+    }
+
+    foreach (std::deque<Command>& queue, queues) {
+      std::deque<Command>::iterator command = std::find_if(
+          queue.begin(),
+          queue.end(),
+          [&key](const Command& command) { return command.key == key; });
+
+      if (command != queue.end()) {
+        process::Owned<process::Promise<std::string>> promise =
+          command->promise;
+
+        queue.erase(command);
+        commands.erase(key);
+
+        promise->discard();
+        return;
+      }
+    }
+
+    // The command is running, this discards the future of `execute`,
+    // which kills the subprocess. It is forgotten right away, so that a
+    // new caller does not get the discarded result.
+    commands.at(key).future.discard();
+    commands.erase(key);
+  }
+
+  void schedule()
+  {
+    foreach (std::deque<Command>& queue, queues) {
+      while (!queue.empty() && running < MAX_RUNNING_COMMANDS) {
+        Command command = queue.front();
+        queue.pop_front();
+
+        running++;
+
+        CommandMetrics* _metrics = commandMetrics(command.name);
+
+        command.promise->associate(
+            _metrics->latency.time(execute(
+                command.command,
+                command.argv,
+                command.timeout,
+                command.input)));
+
+        command.promise->future()
+          .onAny(process::defer(
+              self(),
+              &CommandExecutorProcess::finished,
+              command.key,
+              command.name,
+              lambda::_1));
+      }
+    }
+  }
+
+  void finished(
+      const std::string& key,
+      const std::string& name,
+      const process::Future<std::string>& result)
+  {
+    running--;
+
+    if (commands.contains(key) && commands.at(key).future == result) {
+      commands.erase(key);
+    }
+
+    if (!result.isReady()) {
+      ++commandMetrics(name)->failures;
+    }
+
+    schedule();
+  }
+
+  CommandMetrics* commandMetrics(const std::string& command)
+  {
+    std::string name = Path(command).basename();
+
+    foreach (char& c, name) {
+      if (!isalnum(c) && c != '-' && c != '_' && c != '.') {
+        c = '_';
+      }
+    }
+
+    if (!perCommand.contains(name)) {
+      perCommand[name].reset(new CommandMetrics(name));
+    }
+
+    return perCommand.at(name).get();
+  }
+
+  double _queued()
+  {
+    size_t queued = 0;
+    foreach (const std::deque<Command>& queue, queues) {
+      queued += queue.size();
+    }
+
+    return queued;
+  }
+
+  double _running()
+  {
+    return running;
+  }
+
+  // Queued commands, by priority.
+  std::deque<Command> queues[3];
+
+  // Queued and running commands, by their arguments and input.
+  hashmap<std::string, Shared> commands;
+
+  size_t running;
+
+  hashmap<std::string, process::Owned<CommandMetrics>> perCommand;
+
+  Metrics metrics;
+};
+
+
+inline CommandExecutorProcess* executor()
+{
+  // NOTE: The executor is never terminated, like the other processes
+  // libprocess spawns for itself.
+  static CommandExecutorProcess* process = []() {
+    CommandExecutorProcess* process = new CommandExecutorProcess();
+    process::spawn(process);
+    return process;
+  }();
+
+  return process;
+}
+
+} // namespace internal {
+
+
+// Exec's a command. If `input` is given it is fed to the command on
+// its stdin, e.g. for the `restore` commands of `ipset` and
+// `iptables`.
+//
+// The command is queued with the given `priority` on the executor
+// shared by all the modules, see `internal::CommandExecutorProcess`.
+// The `timeout` starts once the command is run.
+inline process::Future<std::string> runCommand(
+    const std::string& command,
+    const std::vector<std::string>& argv,
+    const Duration& timeout = Milliseconds(5000),
+    const Option<std::string>& input = None(),
+    Priority priority = Priority::NORMAL)
+{
+  return process::dispatch(
+      internal::executor(),
+      &internal::CommandExecutorProcess::run,
+      command,
+      argv,
+      timeout,
+      input,
+      priority);
 };
 
 
@@ -97,11 +625,12 @@ inline process::Future<std::string> runCommand(
 // chain shell commands.
 inline process::Future<std::string> runScriptCommand(
     const std::string& command,
-    const Duration& timeout = Milliseconds(5000))
+    const Duration& timeout = Milliseconds(5000),
+    Priority priority = Priority::NORMAL)
 {
   std::vector<std::string> argv = {os::Shell::arg0, os::Shell::arg1, command};
 
-  return runCommand(os::Shell::name, argv, timeout);
+  return runCommand(os::Shell::name, argv, timeout, None(), priority);
 };
 
 } // namespace common {
@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include <zlib.h>
+
+#include <string>
+
+#include <stout/error.hpp>
+#include <stout/nothing.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include "compressor.hpp"
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+namespace {
+
+// How much the output grows at once while compressing.
+const size_t OUTPUT_CHUNK_SIZE = 16 * 1024;
+
+// Selects the gzip wrapper, rather than the zlib one, in `deflateInit2`.
+const int GZIP_WINDOW_BITS = 15 + 16;
+
+} // namespace {
+
+
+Try<Compressor*> Compressor::create(int level)
+{
+  Compressor* compressor = new Compressor();
+
+  int result = deflateInit2(
+      &compressor->stream,
+      level,
+      Z_DEFLATED,
+      GZIP_WINDOW_BITS,
+      8,
+      Z_DEFAULT_STRATEGY);
+
+  if (result != Z_OK) {
+    delete compressor;
+    return Error(
+        "Failed to initialize compression: " + stringify(zError(result)));
+  }
+
+  return compressor;
+}
+
+
+Compressor::Compressor()
+  : uncompressed(0)
+{
+  memset(&stream, 0, sizeof(stream));
+}
+
+
+Compressor::~Compressor()
+{
+  deflateEnd(&stream);
+}
+
+
+Try<Nothing> Compressor::write(
+    const char* data,
+    size_t length,
+    std::string* out)
+{
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = length;
+
+  uncompressed += length;
+
+  return deflate(Z_NO_FLUSH, out);
+}
+
+
+Try<Nothing> Compressor::finish(std::string* out)
+{
+  if (uncompressed == 0) {
+    return Nothing();
+  }
+
+  stream.next_in = nullptr;
+  stream.avail_in = 0;
+
+  Try<Nothing> result = deflate(Z_FINISH, out);
+  if (result.isError()) {
+    return result;
+  }
+
+  // The next write starts a new member, with a new gzip header.
+  deflateReset(&stream);
+  uncompressed = 0;
+
+  return Nothing();
+}
+
+
+Try<Nothing> Compressor::deflate(int flush, std::string* out)
+{
+  while (true) {
+    const size_t offset = out->size();
+    out->resize(offset + OUTPUT_CHUNK_SIZE);
+
+    stream.next_out = reinterpret_cast<Bytef*>(&(*out)[offset]);
+    stream.avail_out = OUTPUT_CHUNK_SIZE;
+
+    int result = ::deflate(&stream, flush);
+
+    out->resize(offset + OUTPUT_CHUNK_SIZE - stream.avail_out);
+
+    if (result == Z_STREAM_ERROR) {
+      return Error("Failed to compress: " + stringify(zError(result)));
+    }
+
+    // Without flushing, all input has been consumed once there is room
+    // left in the output. A finished member ends the stream instead.
+    if (flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_out != 0) {
+      return Nothing();
+    }
+  }
+}
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
@@ -0,0 +1,56 @@
+#ifndef __JOURNALD_COMPRESSOR_HPP__
+#define __JOURNALD_COMPRESSOR_HPP__
+
+#include <zlib.h>
+
+#include <string>
+
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// Compresses a stream of logs into a series of gzip members.
+//
+// Each member can be decompressed on its own, and a file made up of
+// consecutive members is a valid gzip file, so a leading log file is
+// readable (e.g. with `zcat`) up to its last finished member.
+class Compressor
+{
+public:
+  // Uses the zlib compression `level`. Defaults to the fastest level,
+  // as the compression happens on the logger's write path.
+  static Try<Compressor*> create(int level = Z_BEST_SPEED);
+
+  ~Compressor();
+
+  // Compresses `length` bytes of `data` into the current member,
+  // which is started if necessary. Any compressed output is appended
+  // to `out`; zlib may hold back some of it until the member is
+  // finished.
+  Try<Nothing> write(const char* data, size_t length, std::string* out);
+
+  // Finishes the current member, if any, and appends the remaining
+  // compressed output to `out`.
+  Try<Nothing> finish(std::string* out);
+
+  // The number of uncompressed bytes in the current member.
+  size_t pending() const { return uncompressed; }
+
+private:
+  Compressor();
+
+  Try<Nothing> deflate(int flush, std::string* out);
+
+  z_stream stream;
+  size_t uncompressed;
+};
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_COMPRESSOR_HPP__
@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h> // For `struct iovec`.
+#include <sys/un.h>
+
+#include <map>
+#include <string>
+
+#include <stout/error.hpp>
+#include <stout/flags.hpp>
+#include <stout/foreach.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/path.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/int_fd.hpp>
+#include <stout/os/mkdir.hpp>
+#include <stout/os/rm.hpp>
+
+#include "daemon.hpp"
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+namespace {
+
+// The amount of data received along with the file descriptor.
+// The rest of the data is read separately.
+const size_t RECEIVE_BUFFER_SIZE = 4096;
+
+
+Try<struct sockaddr_un> address(const std::string& path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path)) {
+    return Error("Daemon socket path '" + path + "' is too long");
+  }
+
+  memcpy(address.sun_path, path.data(), path.size());
+
+  return address;
+}
+
+
+void encode(const std::string& value, std::string* out)
+{
+  const uint32_t length = value.size();
+  for (int i = 0; i < 4; i++) {
+    out->push_back(static_cast<char>((length >> (8 * i)) & 0xff));
+  }
+
+  out->append(value);
+}
+
+
+Try<std::string> decode(const std::string& data, size_t* offset)
+{
+  if (data.size() - *offset < 4) {
+    return Error("Unexpected end of flags");
+  }
+
+  uint32_t length = 0;
+  for (int i = 0; i < 4; i++) {
+    length |= static_cast<uint32_t>(
+        static_cast<unsigned char>(data[*offset + i])) << (8 * i);
+  }
+
+  *offset += 4;
+
+  if (data.size() - *offset < length) {
+    return Error("Unexpected end of flags");
+  }
+
+  std::string value = data.substr(*offset, length);
+  *offset += length;
+
+  return value;
+}
+
+} // namespace {
+
+
+Try<int_fd> listenDaemon(const std::string& path)
+{
+  Try<struct sockaddr_un> _address = address(path);
+  if (_address.isError()) {
+    return Error(_address.error());
+  }
+
+  Try<Nothing> mkdir = os::mkdir(Path(path).dirname());
+  if (mkdir.isError()) {
+    return Error(
+        "Failed to create directory for '" + path + "': " + mkdir.error());
+  }
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoError("Failed to create daemon socket");
+  }
+
+  if (::bind(
+          fd,
+          (struct sockaddr*) &_address.get(),
+          sizeof(_address.get())) < 0) {
+    if (errno != EADDRINUSE) {
+      ErrnoError error("Failed to bind '" + path + "'");
+      os::close(fd);
+      return error;
+    }
+
+    // Only replace the socket if nobody listens on it anymore, which
+    // happens when a previous daemon has exited.
+    Try<int_fd> connection = connectDaemon(path);
+    if (connection.isSome()) {
+      os::close(connection.get());
+      os::close(fd);
+      return Error("Another daemon is already listening on '" + path + "'");
+    }
+
+    Try<Nothing> rm = os::rm(path);
+    if (rm.isError()) {
+      os::close(fd);
+      return Error("Failed to remove stale '" + path + "': " + rm.error());
+    }
+
+    if (::bind(
+            fd,
+            (struct sockaddr*) &_address.get(),
+            sizeof(_address.get())) < 0) {
+      ErrnoError error("Failed to bind '" + path + "'");
+      os::close(fd);
+      return error;
+    }
+  }
+
+  // Only the agent, which runs as the same user as the daemon, should
+  // be able to hand over pipes.
+  if (::chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0) {
+    ErrnoError error("Failed to chmod '" + path + "'");
+    os::close(fd);
+    return error;
+  }
+
+  if (::listen(fd, SOMAXCONN) < 0) {
+    ErrnoError error("Failed to listen on '" + path + "'");
+    os::close(fd);
+    return error;
+  }
+
+  return fd;
+}
+
+
+Try<int_fd> connectDaemon(const std::string& path)
+{
+  Try<struct sockaddr_un> _address = address(path);
+  if (_address.isError()) {
+    return Error(_address.error());
+  }
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoError("Failed to create daemon socket");
+  }
+
+  if (::connect(
+          fd,
+          (struct sockaddr*) &_address.get(),
+          sizeof(_address.get())) < 0) {
+    ErrnoError error("Failed to connect to '" + path + "'");
+    os::close(fd);
+    return error;
+  }
+
+  return fd;
+}
+
+
+Try<Nothing> sendFd(int_fd socket, int_fd fd, const std::string& data)
+{
+  // The file descriptor is attached to the first byte of data,
+  // so there must be at least one.
+  if (data.empty()) {
+    return Error("Expected data to send along with the file descriptor");
+  }
+
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  memset(&control, 0, sizeof(control));
+
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data.data());
+  iov.iov_len = data.size();
+
+  struct msghdr header;
+  memset(&header, 0, sizeof(header));
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = &control;
+  header.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t result;
+  do {
+    result = ::sendmsg(socket, &header, MSG_NOSIGNAL);
+  } while (result < 0 && errno == EINTR);
+
+  if (result < 0) {
+    return ErrnoError("Failed to send file descriptor");
+  }
+
+  // Send the remaining data, if it did not fit into the socket buffer.
+  size_t sent = result;
+  while (sent < data.size()) {
+    result = ::send(
+        socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result < 0) {
+      return ErrnoError("Failed to send data");
+    }
+
+    sent += result;
+  }
+
+  if (::shutdown(socket, SHUT_WR) < 0) {
+    return ErrnoError("Failed to shutdown connection");
+  }
+
+  return Nothing();
+}
+
+
+Try<int_fd> receiveFd(int_fd socket, std::string* data)
+{
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  memset(&control, 0, sizeof(control));
+
+  char buffer[RECEIVE_BUFFER_SIZE];
+
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer);
+
+  struct msghdr header;
+  memset(&header, 0, sizeof(header));
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = &control;
+  header.msg_controllen = sizeof(control);
+
+  ssize_t result;
+  do {
+    result = ::recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+  } while (result < 0 && errno == EINTR);
+
+  if (result < 0) {
+    return ErrnoError("Failed to receive file descriptor");
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+  if (cmsg == nullptr ||
+      cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    return Error("Expected a file descriptor");
+  }
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if ((header.msg_flags & MSG_CTRUNC) != 0) {
+    os::close(fd);
+    return Error("Received truncated control message");
+  }
+
+  data->append(buffer, result);
+
+  return fd;
+}
+
+std::string encodeFlags(const flags::FlagsBase& flags)
+{
+  std::string data;
+  foreachvalue (const flags::Flag& flag, flags) {
+    Option<std::string> value = flag.stringify(flags);
+    if (value.isSome()) {
+      encode(flag.effective_name().value, &data);
+      encode(value.get(), &data);
+    }
+  }
+
+  return data;
+}
+
+
+Try<std::map<std::string, std::string>> decodeFlags(const std::string& data)
+{
+  std::map<std::string, std::string> values;
+
+  size_t offset = 0;
+  while (offset < data.size()) {
+    Try<std::string> name = decode(data, &offset);
+    if (name.isError()) {
+      return Error(name.error());
+    }
+
+    Try<std::string> value = decode(data, &offset);
+    if (value.isError()) {
+      return Error(value.error());
+    }
+
+    values[name.get()] = value.get();
+  }
+
+  return values;
+}
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
@@ -0,0 +1,66 @@
+#ifndef __JOURNALD_DAEMON_HPP__
+#define __JOURNALD_DAEMON_HPP__
+
+#include <map>
+#include <string>
+
+#include <stout/flags.hpp>
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/int_fd.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// The default socket on which the shared logger daemon accepts pipes.
+const std::string DEFAULT_DAEMON_SOCKET =
+  "/run/mesos/mesos-journald-logger.sock";
+
+
+// Helpers for handing pipes over to the shared logger daemon, or to a
+// standby logger (see `--standby`).
+//
+// The daemon accepts one connection per pipe. The client sends the
+// read-end of the pipe via `SCM_RIGHTS`, along with the logger flags
+// for that pipe (see `encodeFlags`), and then shuts down its side of
+// the connection. The daemon replies with an empty message if it has
+// started logging from the pipe, or with an error message.
+//
+// A standby logger receives a single pipe the same way, on its stdin,
+// but does not reply.
+
+// Creates a unix socket, which accepts connections on `path`.
+// Stale sockets, which no daemon is listening on anymore, are replaced.
+Try<int_fd> listenDaemon(const std::string& path);
+
+// Connects to the daemon listening on `path`.
+Try<int_fd> connectDaemon(const std::string& path);
+
+// Sends the file descriptor `fd`, followed by `data`, over the
+// connection `socket`, and then shuts down the writing side of the
+// connection. If `socket` is non-blocking, this fails rather than
+// waits if `data` does not fit into the socket buffer.
+Try<Nothing> sendFd(int_fd socket, int_fd fd, const std::string& data);
+
+// Receives a file descriptor sent via `sendFd` over the connection
+// `socket`. Any data received along with the file descriptor is
+// appended to `data`.
+Try<int_fd> receiveFd(int_fd socket, std::string* data);
+
+// Serializes all flags which have a value, like they would be passed
+// on the command line. For each flag, the name and the value are each
+// written as a 32-bit little-endian length, followed by the bytes.
+std::string encodeFlags(const flags::FlagsBase& flags);
+
+// Parses flags serialized via `encodeFlags`, which can then be loaded
+// via `FlagsBase::load`.
+Try<std::map<std::string, std::string>> decodeFlags(const std::string& data);
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_DAEMON_HPP__
@@ -1,30 +1,56 @@
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <map>
 #include <string>
 #include <vector>
 
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h> // For `struct iovec`.
 
 #include <systemd/sd-journal.h>
 
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/clock.hpp>
 #include <process/dispatch.hpp>
 #include <process/future.hpp>
 #include <process/id.hpp>
 #include <process/io.hpp>
+#include <process/owned.hpp>
 #include <process/process.hpp>
+#include <process/time.hpp>
 
 #include <stout/check.hpp>
 #include <stout/error.hpp>
 #include <stout/exit.hpp>
+#include <stout/foreach.hpp>
+#include <stout/lambda.hpp>
 #include <stout/nothing.hpp>
 #include <stout/path.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/strings.hpp>
 #include <stout/try.hpp>
 
 #include <stout/os/chdir.hpp>
+#include <stout/os/close.hpp>
+#include <stout/os/pipe.hpp>
 #include <stout/os/pagesize.hpp>
+#include <stout/os/rename.hpp>
 #include <stout/os/shell.hpp>
 #include <stout/os/su.hpp>
 
+#include "compressor.hpp"
+#include "daemon.hpp"
 #include "journald.hpp"
+#include "native_journal.hpp"
+#include "rate_limiter.hpp"
+#include "rotator.hpp"
+#include "stats.hpp"
 
 
 using namespace process;
@@ -42,95 +68,211 @@ Try<int_fd> create(const std::string& name, unsigned int flags);
 } // namespace internal {
 } // namespace mesos {
 
+
+// The journald field which holds the content of each log line.
+const char MESSAGE_PREFIX[] = "MESSAGE=";
+const size_t MESSAGE_PREFIX_SIZE = sizeof(MESSAGE_PREFIX) - 1;
+
+// How often the number of lines dropped by the journald rate limit
+// is written to journald, while lines are being dropped.
+const Duration SUPPRESSION_NOTICE_INTERVAL = Seconds(1);
+
+
+// Maps the `--stats_file`, if any. Returns `nullptr` if there is none,
+// or if it cannot be mapped.
+//
+// NOTE: Logging does not depend on the stats, so the logger keeps its
+// stats in private memory if they cannot be shared.
+static Stats* shareStats(const Flags& flags)
+{
+  if (flags.stats_file.isNone()) {
+    return nullptr;
+  }
+
+  Try<Stats*> stats = mapStats(flags.stats_file.get());
+  if (stats.isError()) {
+    std::cerr << "Failed to share stats: " << stats.error() << std::endl;
+    return nullptr;
+  }
+
+  return stats.get();
+}
+
 class JournaldLoggerProcess : public Process<JournaldLoggerProcess>
 {
 public:
-  static Try<JournaldLoggerProcess*> create(const Flags& flags)
+  // If a `pipe` is given, the logger reads from it instead of stdin,
+  // and takes ownership of it. This is used by the shared logger daemon,
+  // which does not run inside the sandbox, so the absolute path of the
+  // leading log file is used in that case.
+  // Takes ownership of the `stats`, if any, if this succeeds. See
+  // `shareStats`.
+  static Try<JournaldLoggerProcess*> create(
+      const Flags& flags,
+      const Option<int_fd>& pipe = None(),
+      Stats* stats = nullptr)
   {
     Option<int_fd> configMemFd;
 
+    const std::string logPath = pipe.isSome()
+      ? flags.logrotate_filename.get()
+      : Path(flags.logrotate_filename.get()).basename();
+
     // Calculate the size of the buffer that is used for reading from
     // the `incoming` pipe.
-    const size_t bufferSize = os::pagesize();
+    const size_t bufferSize = flags.read_buffer_size.bytes();
 
     if (flags.destination_type == "logrotate" ||
         flags.destination_type == "journald+logrotate") {
-      // Populate the `logrotate` configuration file.
-      // See `Flags::logrotate_options` for the format.
-      //
-      // NOTE: We specify a size of `--max_size - bufferSize` because
-      // `logrotate` has slightly different size semantics. `logrotate`
-      // will rotate when the max size is *exceeded*. We rotate to keep
-      // files *under* the max size.
-      const std::string config =
-        "\"" + Path(flags.logrotate_filename.get()).basename() + "\" {\n" +
-        flags.logrotate_options.getOrElse("") + "\n" +
-        "size " + stringify(flags.logrotate_max_size.bytes() - bufferSize) +
-        "\n}";
-
-      // Create a temporary anonymous file, which can be accessed by a child
-      // process by opening a `/proc/self/fd/<FD of anonymous file>`.
-      // This file is automatically removed on process termination, so we don't
-      // need to garbage collect it.
-      // We use the `memfd` file to pass the configuration to `logrotate`.
-      Try<int_fd> memFd =
-        mesos::internal::memfd::create("mesos_logrotate", 0);
-
-      if (memFd.isError()) {
+      // A single read must always fit into a log file.
+      if (flags.logrotate_max_size.bytes() < bufferSize) {
         return Error(
-            "Failed to create memfd file '" +
-            flags.logrotate_filename.get() + "': " + memFd.error());
+            "Expected --logrotate_max_size of at least --read_buffer_size (" +
+            stringify(flags.read_buffer_size) + ")");
       }
 
-      Try<Nothing> write = os::write(memFd.get(), config);
-      if (write.isError()) {
-        os::close(memFd.get());
+      // Only the native engine knows how to rotate a compressed file.
+      if (flags.logrotate_inline_compression &&
+          flags.logrotate_engine != "native") {
         return Error(
-            "Failed to write memfd file '" + flags.logrotate_filename.get() +
-            "': " + write.error());
+            "Expected --logrotate_engine=native with "
+            "--logrotate_inline_compression");
       }
 
-      // `logrotate` requires configuration file to have 0644 or 0444
-      // permissions.
-      if (fchmod(memFd.get(), S_IRUSR | S_IRGRP | S_IROTH) == -1) {
-        ErrnoError error("Failed to chmod memfd file '" +
-                         flags.logrotate_filename.get() + "'");
-        os::close(memFd.get());
-        return error;
+      // The native engine does not need a `logrotate` configuration.
+      if (flags.logrotate_engine == "logrotate") {
+        // Populate the `logrotate` configuration file.
+        // See `Flags::logrotate_options` for the format.
+        //
+        // NOTE: We specify a size of `--max_size - bufferSize` because
+        // `logrotate` has slightly different size semantics. `logrotate`
+        // will rotate when the max size is *exceeded*. We rotate to keep
+        // files *under* the max size.
+        const std::string config =
+          "\"" + logPath + "\" {\n" +
+          flags.logrotate_options.getOrElse("") + "\n" +
+          "size " + stringify(flags.logrotate_max_size.bytes() - bufferSize) +
+          "\n}";
+
+        // Create a temporary anonymous file, which can be accessed by a
+        // child process by opening a `/proc/self/fd/<FD of anonymous file>`.
+        // This file is automatically removed on process termination, so we
+        // don't need to garbage collect it.
+        // We use the `memfd` file to pass the configuration to `logrotate`.
+        Try<int_fd> memFd =
+          mesos::internal::memfd::create("mesos_logrotate", 0);
+
+        if (memFd.isError()) {
+          return Error(
+              "Failed to create memfd file '" +
+              flags.logrotate_filename.get() + "': " + memFd.error());
+        }
+
+        Try<Nothing> write = os::write(memFd.get(), config);
+        if (write.isError()) {
+          os::close(memFd.get());
+          return Error(
+              "Failed to write memfd file '" + flags.logrotate_filename.get() +
+              "': " + write.error());
+        }
+
+        // `logrotate` requires configuration file to have 0644 or 0444
+        // permissions.
+        if (fchmod(memFd.get(), S_IRUSR | S_IRGRP | S_IROTH) == -1) {
+          ErrnoError error("Failed to chmod memfd file '" +
+                           flags.logrotate_filename.get() + "'");
+          os::close(memFd.get());
+          return error;
+        }
+
+        configMemFd = memFd.get();
       }
+    }
 
-      configMemFd = memFd.get();
+    Owned<Compressor> compressor;
+    if ((flags.destination_type == "logrotate" ||
+         flags.destination_type == "journald+logrotate") &&
+        flags.logrotate_inline_compression) {
+      Try<Compressor*> create = Compressor::create();
+      if (create.isError()) {
+        return Error("Failed to create compressor: " + create.error());
+      }
+
+      compressor.reset(create.get());
     }
 
-    return new JournaldLoggerProcess(flags, configMemFd, bufferSize);
+    Owned<NativeJournal> journal;
+    if ((flags.destination_type == "journald" ||
+         flags.destination_type == "journald+logrotate") &&
+        flags.journald_transport == "native") {
+      Try<NativeJournal*> create = NativeJournal::create(flags.parsed_labels);
+      if (create.isError()) {
+        if (configMemFd.isSome()) {
+          os::close(configMemFd.get());
+        }
+
+        return Error("Failed to create native journal: " + create.error());
+      }
+
+      journal.reset(create.get());
+    }
+
+    return new JournaldLoggerProcess(
+        flags,
+        pipe,
+        logPath,
+        configMemFd,
+        bufferSize,
+        journal,
+        compressor,
+        stats);
   }
 
   virtual ~JournaldLoggerProcess()
   {
+    if (pipe.isSome()) {
+      os::close(pipe.get());
+    }
+
     if (configMemFd.isSome()) {
       os::close(configMemFd.get());
     }
 
-    if (buffer != NULL) {
-      delete[] buffer;
-      buffer = NULL;
+    if (allocation != nullptr) {
+      delete[] allocation;
+      allocation = nullptr;
+      buffer = nullptr;
     }
 
-    if (entries != NULL) {
+    if (entries != nullptr) {
       for (int i = 0; i < num_entries - 1; i++) {
-        if (entries != NULL) {
-          delete[] (char*) entries[i].iov_base;
-          entries[i].iov_base = NULL;
-        }
+        delete[] (char*) entries[i].iov_base;
+        entries[i].iov_base = nullptr;
       }
 
       delete[] entries;
-      entries = NULL;
+      entries = nullptr;
     }
 
     if (leading.isSome()) {
       os::close(leading.get());
     }
+
+    if (teePipe.isSome()) {
+      os::close(teePipe->at(0));
+      os::close(teePipe->at(1));
+    }
+
+    // NOTE: We do not inject the termination, so that all pending
+    // rotations are completed before the logger exits.
+    if (rotator.get() != nullptr) {
+      terminate(rotator.get(), false);
+      wait(rotator.get());
+    }
+
+    if (stats != &privateStats) {
+      unmapStats(stats);
+    }
   }
 
   // Prepares and starts the loop which reads from stdin and writes to
@@ -154,11 +296,15 @@ public:
     }
 
     // NOTE: This is a prerequisuite for `io::read`.
-    Try<Nothing> nonblock = os::nonblock(STDIN_FILENO);
+    Try<Nothing> nonblock = os::nonblock(input);
     if (nonblock.isError()) {
       return Failure("Failed to set nonblocking pipe: " + nonblock.error());
     }
 
+    if (splicing) {
+      prepare_splice();
+    }
+
     // NOTE: This does not block.
     loop();
 
@@ -166,18 +312,62 @@ public:
   }
 
   // Reads from stdin and writes to journald.
+  //
+  // NOTE: The continuations are deferred onto this process, as they
+  // share the log rotation and compression state with `flush_member`.
   void loop()
   {
-    io::read(STDIN_FILENO, buffer, bufferSize)
-      .then([&](size_t readSize) -> Future<Nothing> {
+    if (splicing) {
+      io::poll(input, io::READ)
+        .then(defer(self(), [this](short) -> Future<Nothing> {
+          Stopwatch watch;
+          watch.start();
+
+          Try<bool> result = flags.destination_type == "logrotate"
+            ? splice_logrotate()
+            : tee_logrotate();
+
+          increment(&stats->writeBlockedNanos, watch.elapsed().ns());
+
+          if (result.isError()) {
+            promise.fail("Failed to write: " + result.error());
+            return Nothing();
+          }
+
+          // Check if EOF has been reached on the input stream.
+          if (!result.get()) {
+            finish();
+            return Nothing();
+          }
+
+          // Use `dispatch` to limit the size of the call stack.
+          dispatch(self(), &JournaldLoggerProcess::loop);
+
+          return Nothing();
+        }));
+
+      return;
+    }
+
+    io::read(input, buffer, bufferSize)
+      .then(defer(self(), [this](size_t readSize) -> Future<Nothing> {
         // Check if EOF has been reached on the input stream.
         // This indicates that the container (whose logs are being
         // piped to this process) has exited.
         if (readSize <= 0) {
-          promise.set(Nothing());
+          finish();
           return Nothing();
         }
 
+        increment(&stats->bytesRead, readSize);
+
+        // The pipe can only hold more data if this read filled the
+        // buffer, in which case it is worth asking how much.
+        record_pipe_fill(readSize == bufferSize ? pipe_available() : 0);
+
+        Stopwatch watch;
+        watch.start();
+
         if (flags.destination_type == "journald" ||
             flags.destination_type == "journald+logrotate") {
           // Write the bytes to journald.
@@ -198,39 +388,262 @@ public:
           }
         }
 
+        increment(&stats->writeBlockedNanos, watch.elapsed().ns());
+
         // Use `dispatch` to limit the size of the call stack.
         dispatch(self(), &JournaldLoggerProcess::loop);
 
         return Nothing();
-      });
+      }));
+  }
+
+  // Completes the logging once the input stream has been closed.
+  void finish()
+  {
+    // Write out any trailing line which was not newline-terminated.
+    if (flags.destination_type == "journald" ||
+        flags.destination_type == "journald+logrotate") {
+      flush_partial();
+
+      if (suppressedLines > 0) {
+        notify_suppressed();
+      }
+
+      if (journal.get() != nullptr) {
+        // Even if the write fails, we ignore the error.
+        journal->flush();
+        record_journal_errors();
+      }
+    }
+
+    // Write out the last gzip member.
+    if (compressor.get() != nullptr) {
+      finish_member();
+    }
+
+    set(&stats->finished, 1);
+
+    promise.set(Nothing());
   }
 
   // Writes the buffer from stdin to the journald.
   // Any `flags.journald_labels` will be prepended to each line.
+  //
+  // Lines are found by scanning the buffer in place. Complete lines
+  // are sent straight out of the buffer, while a trailing incomplete
+  // line is kept in `partial` until the rest of it has been read.
   Try<Nothing> write_journald(size_t readSize)
   {
-    // We may be reading more than one log line at once,
-    // but we need to add labels for each line.
-    std::string logs(buffer, readSize);
-    std::vector<std::string> lines = strings::split(logs, "\n");
+    char* cursor = buffer;
+    char* end = buffer + readSize;
 
-    foreach (const std::string& line, lines) {
-      if (line.empty()) {
-        continue;
+    size_t lines = 0;
+    while (cursor < end) {
+      char* newline =
+        static_cast<char*>(::memchr(cursor, '\n', end - cursor));
+
+      if (newline == nullptr) {
+        append_partial(cursor, end - cursor);
+        break;
+      }
+
+      lines++;
+
+      if (partial.size() > MESSAGE_PREFIX_SIZE) {
+        // This completes a line started by a previous read.
+        append_partial(cursor, newline - cursor);
+        flush_partial();
+      } else if (newline > cursor) {
+        send_line(cursor, newline - cursor);
       }
 
-      const std::string entry = "MESSAGE=" + line;
+      cursor = newline + 1;
+    }
 
-      entries[num_entries - 1].iov_len = entry.length();
-      entries[num_entries - 1].iov_base = const_cast<char*>(entry.c_str());
+    increment(&stats->linesRead, lines);
 
-      sd_journal_sendv(entries, num_entries);
+    if (suppressedLines > 0 &&
+        Clock::now() - notified >= SUPPRESSION_NOTICE_INTERVAL) {
+      notify_suppressed();
+    }
+
+    if (journal.get() != nullptr) {
+      // Even if the write fails, we ignore the error.
+      journal->flush();
+      record_journal_errors();
     }
 
     // Even if the write fails, we ignore the error.
     return Nothing();
   }
 
+  // Sends a single line, which is located inside `buffer`, to journald.
+  //
+  // NOTE: To avoid copying the line, the `MESSAGE_PREFIX_SIZE` bytes in
+  // front of the line are temporarily overwritten with the field name.
+  // These bytes are either part of a line which has already been sent,
+  // or the headroom reserved in front of `buffer`. They are restored
+  // afterwards, as the buffer may also be written to the sandbox.
+  void send_line(char* line, size_t length)
+  {
+    if (!admit(length)) {
+      return;
+    }
+
+    // The native journal references the line as a separate `iovec`,
+    // so no field name needs to be written in front of it.
+    if (journal.get() != nullptr) {
+      journal->append(line, length);
+      return;
+    }
+
+    char* field = line - MESSAGE_PREFIX_SIZE;
+
+    char saved[MESSAGE_PREFIX_SIZE];
+    ::memcpy(saved, field, MESSAGE_PREFIX_SIZE);
+    ::memcpy(field, MESSAGE_PREFIX, MESSAGE_PREFIX_SIZE);
+
+    entries[num_entries - 1].iov_len = MESSAGE_PREFIX_SIZE + length;
+    entries[num_entries - 1].iov_base = field;
+
+    sendv();
+
+    ::memcpy(field, saved, MESSAGE_PREFIX_SIZE);
+  }
+
+  // Sends the current `entries` via `sd_journal_sendv`.
+  // Even if the write fails, we ignore the error, other than counting it.
+  void sendv()
+  {
+    const int result = sd_journal_sendv(entries, num_entries);
+    if (result < 0) {
+      increment(&stats->journaldErrors);
+
+      if (result == -EAGAIN || result == -ENOBUFS) {
+        increment(&stats->journaldEagains);
+      }
+    }
+  }
+
+  // Copies the error counts of the native journal into the stats.
+  void record_journal_errors()
+  {
+    set(&stats->journaldErrors, journal->errors());
+    set(&stats->journaldEagains, journal->eagains());
+  }
+
+  // Adds part of a line to the carry-over buffer.
+  // The carry-over buffer holds at most `bufferSize` bytes of a line.
+  // Longer lines are split into multiple journald entries.
+  void append_partial(const char* data, size_t length)
+  {
+    while (length > 0) {
+      const size_t count = std::min(
+          length,
+          bufferSize - (partial.size() - MESSAGE_PREFIX_SIZE));
+
+      partial.append(data, count);
+      data += count;
+      length -= count;
+
+      if (partial.size() - MESSAGE_PREFIX_SIZE == bufferSize) {
+        flush_partial();
+      }
+    }
+  }
+
+  // Sends the content of the carry-over buffer (if any) to journald.
+  void flush_partial()
+  {
+    if (partial.size() == MESSAGE_PREFIX_SIZE) {
+      return;
+    }
+
+    if (!admit(partial.size() - MESSAGE_PREFIX_SIZE)) {
+      partial.resize(MESSAGE_PREFIX_SIZE);
+      return;
+    }
+
+    if (journal.get() != nullptr) {
+      // NOTE: The entry must be sent before the carry-over buffer is
+      // reused, as the native journal does not copy the message.
+      journal->append(
+          partial.data() + MESSAGE_PREFIX_SIZE,
+          partial.size() - MESSAGE_PREFIX_SIZE);
+
+      // Even if the write fails, we ignore the error.
+      journal->flush();
+
+      partial.resize(MESSAGE_PREFIX_SIZE);
+      return;
+    }
+
+    entries[num_entries - 1].iov_len = partial.size();
+    entries[num_entries - 1].iov_base = const_cast<char*>(partial.data());
+
+    sendv();
+
+    // NOTE: This keeps the capacity of the string, so the carry-over
+    // buffer is only allocated once.
+    partial.resize(MESSAGE_PREFIX_SIZE);
+  }
+
+
+  // Applies the journald rate limit to a line of `length` bytes.
+  // Returns whether the line should be sent to journald.
+  bool admit(size_t length)
+  {
+    if (limiter.isNone() || limiter->acquire(length)) {
+      if (suppressedLines > 0 &&
+          Clock::now() - notified >= SUPPRESSION_NOTICE_INTERVAL) {
+        notify_suppressed();
+      }
+
+      return true;
+    }
+
+    // With the `sample` policy, some of the lines beyond the limit
+    // are sent anyway.
+    if (flags.journald_rate_limit_policy == "sample" &&
+        overLimit++ % flags.journald_rate_limit_sample_rate == 0) {
+      return true;
+    }
+
+    suppressedLines++;
+    suppressedBytes += length;
+
+    return false;
+  }
+
+  // Sends an entry with the number of lines dropped by the rate limit
+  // since the last such entry.
+  void notify_suppressed()
+  {
+    notice = std::string(MESSAGE_PREFIX) + NAME + ": Suppressed " +
+      stringify(suppressedLines) + " lines (" +
+      stringify(Bytes(suppressedBytes)) +
+      ") exceeding the journald rate limit";
+
+    if (journal.get() != nullptr) {
+      // NOTE: The native journal does not copy the message, so the
+      // notice is flushed before `notice` can be reused.
+      journal->append(
+          notice.data() + MESSAGE_PREFIX_SIZE,
+          notice.size() - MESSAGE_PREFIX_SIZE);
+
+      // Even if the write fails, we ignore the error.
+      journal->flush();
+    } else {
+      entries[num_entries - 1].iov_len = notice.size();
+      entries[num_entries - 1].iov_base = const_cast<char*>(notice.data());
+
+      sendv();
+    }
+
+    suppressedLines = 0;
+    suppressedBytes = 0;
+    notified = Clock::now();
+  }
 
   // Writes the buffer from stdin to the leading log file.
   // When the number of written bytes exceeds `--logrotate_max_size`,
@@ -243,21 +656,14 @@ public:
       rotate();
     }
 
-    // If the leading log file is not open, open it.
-    // NOTE: We open the file in append-mode as `logrotate` may sometimes fail.
-    if (leading.isNone()) {
-      std::string basename = Path(flags.logrotate_filename.get()).basename();
-
-      Try<int> open = os::open(
-          basename,
-          O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
-          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-      if (open.isError()) {
-        return Error("Failed to open '" + basename + "': " + open.error());
-      }
+    Try<Nothing> open = open_leading();
+    if (open.isError()) {
+      return open;
+    }
 
-      leading = open.get();
+    if (compressor.get() != nullptr) {
+      write_compressed(buffer, readSize);
+      return Nothing();
     }
 
     // Write from stdin to `leading`.
@@ -276,14 +682,413 @@ public:
     return Nothing();
   }
 
-  // Calls `logrotate` on the leading log file and resets the `bytesWritten`.
+  // Compresses the bytes into the current gzip member, and writes
+  // whatever compressed output is ready to the leading log file.
+  void write_compressed(const char* data, size_t length)
+  {
+    const bool started = compressor->pending() == 0;
+
+    compressed.clear();
+    Try<Nothing> result = compressor->write(data, length, &compressed);
+
+    if (result.isSome() &&
+        compressor->pending() >=
+          flags.logrotate_compression_flush_size.bytes()) {
+      result = compressor->finish(&compressed);
+      members++;
+    } else if (started) {
+      // Make sure the member is finished in time, even if the container
+      // stops logging. The member count tells whether it still is the
+      // same member by then.
+      delay(flags.logrotate_compression_flush_interval,
+            self(),
+            &JournaldLoggerProcess::flush_member,
+            members);
+    }
+
+    // NOTE: We do not exit on error here, see `write_logrotate`.
+    if (result.isError()) {
+      std::cerr << result.error() << std::endl;
+    }
+
+    write_leading(compressed);
+  }
+
+  // Finishes the given gzip member, unless that has happened already.
+  void flush_member(size_t member)
+  {
+    if (member == members) {
+      finish_member();
+    }
+  }
+
+  // Finishes the current gzip member, if any, and writes the rest of
+  // its compressed output to the leading log file.
+  void finish_member()
+  {
+    if (compressor->pending() == 0) {
+      return;
+    }
+
+    compressed.clear();
+    Try<Nothing> result = compressor->finish(&compressed);
+    if (result.isError()) {
+      std::cerr << result.error() << std::endl;
+    }
+
+    members++;
+
+    write_leading(compressed);
+  }
+
+  // Appends compressed output to the leading log file, which is open
+  // while a gzip member is in progress.
+  void write_leading(const std::string& data)
+  {
+    if (data.empty() || leading.isNone()) {
+      return;
+    }
+
+    Try<Nothing> result = os::write(leading.get(), data);
+    if (result.isError()) {
+      std::cerr << "Failed to write: " << result.error() << std::endl;
+    }
+
+    bytesWritten += data.size();
+  }
+
+  // Opens the leading log file, unless it is already open.
+  Try<Nothing> open_leading()
+  {
+    if (leading.isSome()) {
+      return Nothing();
+    }
+
+    // NOTE: We open the file in append-mode as `logrotate` may sometimes
+    // fail. `splice` does not accept files in append-mode though, so in
+    // that case we seek to the end of the file instead. As the leading
+    // log file is always reopened after a rotation, and nothing else
+    // writes to it, the two behave the same.
+    Try<int> open = os::open(
+        leadingPath,
+        O_WRONLY | O_CREAT | O_CLOEXEC | (splicing ? 0 : O_APPEND),
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (open.isError()) {
+      return Error("Failed to open '" + leadingPath + "': " + open.error());
+    }
+
+    if (splicing && ::lseek(open.get(), 0, SEEK_END) < 0) {
+      ErrnoError error("Failed to seek '" + leadingPath + "'");
+      os::close(open.get());
+      return error;
+    }
+
+    leading = open.get();
+
+    return Nothing();
+  }
+
+  // Checks whether stdin can be spliced, and disables splicing if not.
+  void prepare_splice()
+  {
+    struct stat s;
+    if (::fstat(input, &s) < 0 || !S_ISFIFO(s.st_mode)) {
+      splicing = false;
+      return;
+    }
+
+    // The copy of stdin for journald is made through an internal pipe.
+    if (flags.destination_type == "journald+logrotate") {
+      Try<std::array<int_fd, 2>> pipe = os::pipe();
+      if (pipe.isError()) {
+        disable_splice("Failed to create pipe: " + pipe.error());
+        return;
+      }
+
+      teePipe = pipe.get();
+    }
+  }
+
+  // Switches to reading stdin for the rest of the logger's lifetime.
+  void disable_splice(const std::string& message)
+  {
+    std::cerr << message << "; falling back to reading stdin" << std::endl;
+
+    splicing = false;
+  }
+
+  // Returns how many bytes to move from stdin at once. This is limited
+  // to `bufferSize`, so that rotations happen at the same points as
+  // when reading stdin.
+  size_t splice_size()
+  {
+    const size_t available = pipe_available();
+    record_pipe_fill(available);
+
+    if (available == 0) {
+      // We will find out whether this is EOF once we try to move data.
+      return 1;
+    }
+
+    return std::min(available, bufferSize);
+  }
+
+  // Returns the number of bytes waiting on stdin.
+  size_t pipe_available() const
+  {
+    int available = 0;
+    if (::ioctl(input, FIONREAD, &available) < 0 || available <= 0) {
+      return 0;
+    }
+
+    return available;
+  }
+
+  void record_pipe_fill(size_t fill)
+  {
+    set(&stats->pipeFill, fill);
+
+    if (fill > stats->pipeFillMax.load(std::memory_order_relaxed)) {
+      set(&stats->pipeFillMax, fill);
+    }
+  }
+
+  // Moves the bytes from stdin to the leading log file, without
+  // copying them into user space. Used for the `logrotate` destination.
+  // Returns false if EOF has been reached on stdin.
+  Try<bool> splice_logrotate()
+  {
+    const size_t length = splice_size();
+
+    // Rotate the log file if it might grow beyond `--logrotate_max_size`.
+    if (bytesWritten + length > flags.logrotate_max_size.bytes()) {
+      rotate();
+    }
+
+    Try<Nothing> open = open_leading();
+    if (open.isError()) {
+      return Error(open.error());
+    }
+
+    ssize_t moved = ::splice(
+        input,
+        nullptr,
+        leading.get(),
+        nullptr,
+        length,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (moved == 0) {
+      return false;
+    }
+
+    if (moved < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        // NOTE: The bytes are still in the pipe, so they will be read
+        // and written on the next iteration.
+        disable_splice(ErrnoError("Failed to splice").message);
+      }
+
+      return true;
+    }
+
+    increment(&stats->bytesRead, moved);
+    bytesWritten += moved;
+
+    return true;
+  }
+
+  // Duplicates the bytes on stdin, so that only the copy bound for
+  // journald is read into user space, while the original bytes are
+  // moved to the leading log file. Used for the `journald+logrotate`
+  // destination. Returns false if EOF has been reached on stdin.
+  Try<bool> tee_logrotate()
+  {
+    CHECK_SOME(teePipe);
+
+    ssize_t length = ::tee(
+        input,
+        teePipe->at(1),
+        splice_size(),
+        SPLICE_F_NONBLOCK);
+
+    if (length == 0) {
+      return false;
+    }
+
+    if (length < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        disable_splice(ErrnoError("Failed to tee").message);
+      }
+
+      return true;
+    }
+
+    increment(&stats->bytesRead, length);
+
+    // NOTE: The internal pipe is empty before each `tee`, so this reads
+    // exactly the bytes which have just been duplicated.
+    Try<Nothing> read = read_fully(teePipe->at(0), buffer, length);
+    if (read.isError()) {
+      return Error("Failed to read duplicated bytes: " + read.error());
+    }
+
+    // Write the bytes to journald.
+    Try<Nothing> result = write_journald(length);
+    if (result.isError()) {
+      return Error(result.error());
+    }
+
+    // Rotate the log file if it will grow beyond `--logrotate_max_size`.
+    if (bytesWritten + length > flags.logrotate_max_size.bytes()) {
+      rotate();
+    }
+
+    Try<Nothing> open = open_leading();
+    if (open.isError()) {
+      return Error(open.error());
+    }
+
+    // Move the original bytes to the leading log file.
+    size_t moved = 0;
+    while (moved < static_cast<size_t>(length)) {
+      ssize_t result = ::splice(
+          input,
+          nullptr,
+          leading.get(),
+          nullptr,
+          length - moved,
+          SPLICE_F_MOVE);
+
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (result <= 0) {
+        break;
+      }
+
+      moved += result;
+    }
+
+    if (moved < static_cast<size_t>(length)) {
+      // The remaining bytes have already been sent to journald, so they
+      // must be consumed from stdin here, rather than on the next
+      // iteration. We still hold a copy of them in `buffer`.
+      ErrnoError error("Failed to splice");
+
+      std::vector<char> discarded(length - moved);
+      Try<Nothing> drain =
+        read_fully(input, discarded.data(), discarded.size());
+
+      if (drain.isError()) {
+        return Error("Failed to read stdin: " + drain.error());
+      }
+
+      // NOTE: We do not exit on error here, see `write_logrotate`.
+      Try<Nothing> write = os::write(
+          leading.get(),
+          std::string(buffer + moved, length - moved));
+
+      if (write.isError()) {
+        std::cerr << "Failed to write: " << write.error() << std::endl;
+      }
+
+      disable_splice(error.message);
+    }
+
+    bytesWritten += length;
+
+    return true;
+  }
+
+  // Reads exactly `length` bytes, which must already be available.
+  static Try<Nothing> read_fully(int fd, char* data, size_t length)
+  {
+    while (length > 0) {
+      ssize_t result = ::read(fd, data, length);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (result < 0) {
+        return ErrnoError();
+      }
+
+      if (result == 0) {
+        return Error("Unexpected EOF");
+      }
+
+      data += result;
+      length -= result;
+    }
+
+    return Nothing();
+  }
+
+  // Rotates the leading log file and resets the `bytesWritten`.
   void rotate()
   {
+    Stopwatch watch;
+    watch.start();
+
+    _rotate();
+
+    const Duration elapsed = watch.elapsed();
+
+    increment(&stats->rotations);
+    increment(&stats->rotationNanos, elapsed.ns());
+
+    size_t bucket = 0;
+    while (bucket < ROTATION_DURATION_BUCKETS - 1 &&
+           elapsed >= ROTATION_DURATION_BOUNDS[bucket]) {
+      bucket++;
+    }
+
+    increment(&stats->rotationDurations[bucket]);
+  }
+
+  void _rotate()
+  {
+    // A compressed leading log file must end with a finished member.
+    if (compressor.get() != nullptr) {
+      finish_member();
+    }
+
     if (leading.isSome()) {
       os::close(leading.get());
       leading = None();
     }
 
+    if (rotator.get() != nullptr) {
+      // Move the leading log file out of the way, so that the next
+      // write opens a fresh one. The rotator numbers, prunes and
+      // compresses the rotated file in the background.
+      // NOTE: The rotated file gets a unique name, as the rotator may
+      // still be busy with a previous rotation.
+      // NOTE: If the rename fails, we will continue appending to the
+      // existing leading log file, like we do when `logrotate` fails.
+      const std::string rotated =
+        logPath + ROTATING_INFIX + stringify(rotations++);
+
+      Try<Nothing> rename = os::rename(leadingPath, rotated);
+      if (rename.isError()) {
+        std::cerr << "Failed to rotate '" << leadingPath << "': "
+                  << rename.error() << std::endl;
+      } else {
+        dispatch(
+            rotator.get(),
+            &LogRotatorProcess::rotate,
+            rotated,
+            compressor.get() != nullptr ? GZIP_SUFFIX : "");
+      }
+
+      // Reset the number of bytes written.
+      bytesWritten = 0;
+      return;
+    }
+
     // Call `logrotate` to move around the files.
     // NOTE: If `logrotate` fails for whatever reason, we will ignore
     // the error and continue logging.  In case the leading log file
@@ -291,7 +1096,7 @@ public:
     // leading log file.
     os::shell(
         flags.logrotate_path +
-        " --state \"" + Path(flags.logrotate_filename.get()).basename() +
+        " --state \"" + logPath +
         LOGROTATE_STATE_SUFFIX + "\" \"" + configPath.get() + "\"");
 
     // Reset the number of bytes written.
@@ -301,37 +1106,138 @@ public:
 private:
   explicit JournaldLoggerProcess(
       const Flags& _flags,
+      const Option<int_fd>& _pipe,
+      const std::string& _logPath,
       const Option<int_fd>& _configMemFd,
-      size_t _bufferSize)
+      size_t _bufferSize,
+      const Owned<NativeJournal>& _journal,
+      const Owned<Compressor>& _compressor,
+      Stats* _stats)
     : ProcessBase(process::ID::generate("logrotate-logger")),
       flags(_flags),
+      pipe(_pipe),
+      input(_pipe.getOrElse(STDIN_FILENO)),
+      logPath(_logPath),
+      leadingPath(
+          _compressor.get() != nullptr ? _logPath + GZIP_SUFFIX : _logPath),
       configMemFd(_configMemFd),
-      buffer(new char[_bufferSize]),
+      journal(_journal),
+      allocation(new char[MESSAGE_PREFIX_SIZE + _bufferSize]),
+      buffer(allocation + MESSAGE_PREFIX_SIZE),
       bufferSize(_bufferSize),
       leading(None()),
-      bytesWritten(0)
+      bytesWritten(0),
+      splicing(
+          flags.logrotate_splice &&
+          _compressor.get() == nullptr &&
+          (flags.destination_type == "logrotate" ||
+           flags.destination_type == "journald+logrotate")),
+      rotations(0),
+      compressor(_compressor),
+      members(0),
+      overLimit(0),
+      suppressedLines(0),
+      suppressedBytes(0),
+      notified(Clock::now()),
+      privateStats(),
+      stats(_stats != nullptr ? _stats : &privateStats),
+      num_entries(0),
+      entries(nullptr)
   {
     if (configMemFd.isSome()) {
       configPath = "/proc/self/fd/" + stringify(configMemFd.get());
     }
+
+    if ((flags.destination_type == "logrotate" ||
+         flags.destination_type == "journald+logrotate") &&
+        flags.logrotate_engine == "native") {
+      rotator.reset(new LogRotatorProcess(
+          logPath,
+          flags.logrotate_max_files,
+          flags.logrotate_compress));
+
+      spawn(rotator.get());
+    }
+
+    if (flags.journald_rate_limit_bytes.bytes() > 0 ||
+        flags.journald_rate_limit_lines > 0) {
+      limiter = RateLimiter(
+          flags.journald_rate_limit_bytes,
+          flags.journald_rate_limit_lines);
+    }
+
+    partial.reserve(MESSAGE_PREFIX_SIZE + bufferSize);
+    partial.assign(MESSAGE_PREFIX, MESSAGE_PREFIX_SIZE);
   }
 
   const Flags flags;
+
+  // The pipe handed over by the shared logger daemon, if any.
+  // Otherwise, the logger reads from stdin.
+  const Option<int_fd> pipe;
+  const int_fd input;
+
+  // The path of the leading log file. This is relative to the sandbox,
+  // unless the logger runs inside the shared logger daemon.
+  // Other files are named after `logPath`, while the leading log file
+  // itself is `leadingPath`, which differs when it is compressed.
+  const std::string logPath;
+  const std::string leadingPath;
+
   const Option<int_fd> configMemFd;
   Option<std::string> configPath;
 
+  // Used instead of `sd_journal_sendv` for `--journald_transport=native`.
+  Owned<NativeJournal> journal;
+
   // For reading from stdin.
+  // The `buffer` is preceded by `MESSAGE_PREFIX_SIZE` bytes of headroom
+  // inside `allocation`. See `send_line`.
+  char* allocation;
   char* buffer;
   const size_t bufferSize;
 
+  // Holds a line which spans multiple reads, prefixed with the
+  // `MESSAGE_PREFIX`.  See `write_journald`.
+  std::string partial;
+
   // For writing and rotating the leading log file.
   Option<int> leading;
   size_t bytesWritten;
 
+  // Used for `--logrotate_splice`. This is reset if splicing turns out
+  // to be unsupported, in which case stdin is read like usual.
+  bool splicing;
+  Option<std::array<int_fd, 2>> teePipe;
+
+  // Used for `--logrotate_engine=native`.
+  Owned<LogRotatorProcess> rotator;
+  size_t rotations;
+
+  // Used for `--logrotate_inline_compression`. The `members` count the
+  // finished gzip members, while `compressed` holds compressed output
+  // on its way to the leading log file.
+  Owned<Compressor> compressor;
+  size_t members;
+  std::string compressed;
+
+  // Used for the `--journald_rate_limit_*` flags.
+  Option<RateLimiter> limiter;
+  size_t overLimit;
+  size_t suppressedLines;
+  size_t suppressedBytes;
+  Time notified;
+  std::string notice;
+
+  // The counters shared with the agent, see `stats.hpp`. These point
+  // to `privateStats` if the stats file could not be created.
+  Stats privateStats;
+  Stats* const stats;
+
   // Used as arguments for `sd_journal_sendv`.
   // This contains one more entry than the number of `--labels`.
-  // The last entry holds a pointer to a stack-allocated C-string,
-  // which is changed each time we write to journald.
+  // The last entry holds a pointer to the current line, which is
+  // changed each time we write to journald.
   int num_entries;
   struct iovec* entries;
 
@@ -341,6 +1247,268 @@ private:
 };
 
 
+// Logs from the pipes of any number of containers, which are handed over
+// to this daemon on a unix socket. See `daemon.hpp` for the protocol.
+//
+// Each pipe is served by its own `JournaldLoggerProcess`, so the labels
+// and rotation settings of each pipe are kept separate. All of these
+// processes share the libprocess worker threads and event loop of
+// this daemon, instead of each running in a subprocess of its own.
+class LoggerDaemonProcess : public Process<LoggerDaemonProcess>
+{
+public:
+  static Try<LoggerDaemonProcess*> create(const std::string& path)
+  {
+    Try<int_fd> listener = listenDaemon(path);
+    if (listener.isError()) {
+      return Error(listener.error());
+    }
+
+    return new LoggerDaemonProcess(listener.get());
+  }
+
+  virtual ~LoggerDaemonProcess()
+  {
+    os::close(listener);
+  }
+
+  // Accepts pipes until the daemon's socket fails.
+  Future<Nothing> run()
+  {
+    accept();
+
+    return promise.future();
+  }
+
+private:
+  explicit LoggerDaemonProcess(int_fd _listener)
+    : ProcessBase(process::ID::generate("logger-daemon")),
+      listener(_listener) {}
+
+  void accept()
+  {
+    io::poll(listener, io::READ)
+      .onAny(defer(self(), &LoggerDaemonProcess::_accept, lambda::_1));
+  }
+
+  void _accept(const Future<short>& future)
+  {
+    if (!future.isReady()) {
+      promise.fail(
+          "Failed to wait for connections: " +
+          (future.isFailed() ? future.failure() : "discarded"));
+      return;
+    }
+
+    int connection =
+      ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (connection < 0 &&
+        errno != EAGAIN &&
+        errno != EWOULDBLOCK &&
+        errno != EINTR &&
+        errno != ECONNABORTED) {
+      // NOTE: We keep serving the pipes we already have, and back off
+      // because errors like EMFILE would otherwise keep the socket
+      // readable.
+      std::cerr << ErrnoError("Failed to accept connection").message
+                << std::endl;
+
+      delay(Seconds(1), self(), &LoggerDaemonProcess::accept);
+      return;
+    }
+
+    if (connection >= 0) {
+      receive(connection);
+    }
+
+    accept();
+  }
+
+  // Reads a pipe and its flags from a new connection, starts logging
+  // from the pipe, and replies once this has succeeded or failed.
+  void receive(int_fd connection)
+  {
+    // Only the daemon's own user is allowed to hand over pipes, as the
+    // daemon writes to whatever files the flags of each pipe name.
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (::getsockopt(
+            connection,
+            SOL_SOCKET,
+            SO_PEERCRED,
+            &credentials,
+            &length) < 0 ||
+        credentials.uid != ::geteuid()) {
+      os::close(connection);
+      return;
+    }
+
+    io::poll(connection, io::READ)
+      .then(defer(self(), [=](short) -> Future<Nothing> {
+        std::string data;
+        Try<int_fd> pipe = receiveFd(connection, &data);
+        if (pipe.isError()) {
+          return Failure(pipe.error());
+        }
+
+        return io::read(connection)
+          .then(defer(self(), [=](const std::string& rest) {
+            return start(pipe.get(), data + rest);
+          }))
+          .onAny([=](const Future<Nothing>& future) {
+            // The pipe is only owned by a logger if it has been started.
+            if (!future.isReady()) {
+              os::close(pipe.get());
+            }
+          });
+      }))
+      .onAny(defer(
+          self(), &LoggerDaemonProcess::reply, connection, lambda::_1));
+  }
+
+  void reply(int_fd connection, const Future<Nothing>& future)
+  {
+    std::string message;
+    if (!future.isReady()) {
+      message = future.isFailed() ? future.failure() : "discarded";
+      std::cerr << "Failed to start logging from pipe: " << message
+                << std::endl;
+    }
+
+    // NOTE: The reply is small enough to fit into the socket buffer.
+    // Even if the write fails, we ignore the error, as the client also
+    // notices the failure when the connection is closed without reply.
+    ::send(connection, message.data(), message.size(), MSG_NOSIGNAL);
+    os::close(connection);
+  }
+
+  // Starts a logger for the given pipe, which takes ownership of the
+  // pipe if this succeeds.
+  Future<Nothing> start(int_fd pipe, const std::string& data)
+  {
+    Try<std::map<std::string, std::string>> values = decodeFlags(data);
+    if (values.isError()) {
+      return Failure("Failed to parse flags: " + values.error());
+    }
+
+    Flags flags;
+    Try<flags::Warnings> load = flags.load(values.get());
+    if (load.isError()) {
+      return Failure("Failed to load flags: " + load.error());
+    }
+
+    if (flags.logrotate_filename.isNone()) {
+      return Failure("Expected --logrotate_filename");
+    }
+
+    // The daemon cannot switch to the user, and must not write to the
+    // files of another user as its own (see `--daemon_socket`).
+    if (flags.user.isSome()) {
+      return Failure("Cannot log as user '" + flags.user.get() + "'");
+    }
+
+    Stats* stats = shareStats(flags);
+
+    Try<JournaldLoggerProcess*> logger =
+      JournaldLoggerProcess::create(flags, pipe, stats);
+
+    if (logger.isError()) {
+      if (stats != nullptr) {
+        unmapStats(stats);
+      }
+
+      return Failure("Failed to create logger process: " + logger.error());
+    }
+
+    // NOTE: The logger is deleted by libprocess once it has terminated.
+    const UPID pid = spawn(logger.get(), true);
+    const std::string filename = flags.logrotate_filename.get();
+
+    dispatch(pid, &JournaldLoggerProcess::run)
+      .onAny([pid, filename](const Future<Nothing>& status) {
+        if (!status.isReady()) {
+          std::cerr << "Failed to log to '" << filename << "': "
+                    << (status.isFailed() ? status.failure() : "discarded")
+                    << std::endl;
+        }
+
+        terminate(pid);
+      });
+
+    return Nothing();
+  }
+
+  const int_fd listener;
+
+  // Used to capture when the daemon's socket has failed.
+  Promise<Nothing> promise;
+};
+
+
+// Receives the pipe of a standby logger on stdin, along with the flags
+// for that pipe, which are loaded into `flags`. The pipe then replaces
+// stdin. See `--standby`.
+Try<Nothing> awaitHandoff(Flags* flags)
+{
+  // NOTE: Libprocess is initialized beforehand, so that a container's
+  // logs do not wait for it once the pipe has been handed over.
+  process::initialize();
+
+  std::string data;
+  Try<int_fd> pipe = receiveFd(STDIN_FILENO, &data);
+  if (pipe.isError()) {
+    return Error(pipe.error());
+  }
+
+  char buffer[4096];
+  while (true) {
+    ssize_t length = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (length < 0) {
+      ErrnoError error("Failed to read flags");
+      os::close(pipe.get());
+      return error;
+    }
+
+    if (length == 0) {
+      break;
+    }
+
+    data.append(buffer, length);
+  }
+
+  Try<std::map<std::string, std::string>> values = decodeFlags(data);
+  if (values.isError()) {
+    os::close(pipe.get());
+    return Error("Failed to parse flags: " + values.error());
+  }
+
+  Try<flags::Warnings> load = flags->load(values.get());
+  if (load.isError()) {
+    os::close(pipe.get());
+    return Error("Failed to load flags: " + load.error());
+  }
+
+  foreach (const flags::Warning& warning, load->warnings) {
+    LOG(WARNING) << warning.message;
+  }
+
+  if (::dup2(pipe.get(), STDIN_FILENO) < 0) {
+    ErrnoError error("Failed to replace stdin");
+    os::close(pipe.get());
+    return error;
+  }
+
+  os::close(pipe.get());
+
+  return Nothing();
+}
+
+
 int main(int argc, char** argv)
 {
   Flags flags;
@@ -357,6 +1525,49 @@ int main(int argc, char** argv)
     LOG(WARNING) << warning.message;
   }
 
+  // In daemon mode, this command does not log from its own stdin, so
+  // none of the other flags apply.
+  if (flags.daemon_socket.isSome()) {
+    Try<LoggerDaemonProcess*> daemon =
+      LoggerDaemonProcess::create(flags.daemon_socket.get());
+
+    if (daemon.isError()) {
+      EXIT(EXIT_FAILURE)
+        << Error("Failed to create logger daemon: " + daemon.error());
+    }
+
+    spawn(daemon.get());
+
+    Future<Nothing> status =
+      dispatch(daemon.get(), &LoggerDaemonProcess::run);
+
+    status.await();
+
+    if (!status.isReady()) {
+      LOG(ERROR) << "Logger daemon failed: "
+                 << (status.isFailed() ? status.failure() : "discarded");
+    }
+
+    terminate(daemon.get());
+    wait(daemon.get());
+
+    delete daemon.get();
+
+    return status.isReady() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // A standby logger waits for the pipe to log from, along with the
+  // flags for that pipe, and then proceeds as if it had been spawned
+  // with those.
+  if (flags.standby) {
+    Try<Nothing> handoff = awaitHandoff(&flags);
+    if (handoff.isError()) {
+      EXIT(EXIT_FAILURE)
+        << Error("Failed to receive pipe for standby logger: " +
+                 handoff.error());
+    }
+  }
+
   // Change the current working directory to the container's sandbox directory.
   // This is to handle the case that the nested container's user is a non-root
   // user and different from its parent container's user, in which case the
@@ -373,6 +1584,9 @@ int main(int argc, char** argv)
         "Failed to switch working directory for journald logger").message;
   }
 
+  // The stats file is only accessible to the agent's user.
+  Stats* stats = shareStats(flags);
+
   // If the `--user` flag is set, change the UID of this process to that user.
   if (flags.user.isSome()) {
     Try<Nothing> result = os::su(flags.user.get());
@@ -384,7 +1598,8 @@ int main(int argc, char** argv)
   }
 
   // Asynchronously control the flow and size of logs.
-  Try<JournaldLoggerProcess*> process = JournaldLoggerProcess::create(flags);
+  Try<JournaldLoggerProcess*> process =
+    JournaldLoggerProcess::create(flags, None(), stats);
   if (process.isError()) {
     EXIT(EXIT_FAILURE)
       << Error("Failed to create logger process: " + process.error());
@@ -7,6 +7,8 @@
 
 #include <mesos/mesos.hpp>
 
+#include <stout/bytes.hpp>
+#include <stout/duration.hpp>
 #include <stout/error.hpp>
 #include <stout/flags.hpp>
 #include <stout/json.hpp>
@@ -53,6 +55,21 @@ struct Flags : public virtual flags::FlagsBase
           return None();
         });
 
+    add(&Flags::journald_transport,
+        "journald_transport",
+        "Determines how logs are sent to journald.\n"
+        "'libsystemd' sends every line via 'sd_journal_sendv'.\n"
+        "'native' speaks the native journal protocol over the journal\n"
+        "socket directly, sending all lines of a read in one batch.",
+        "libsystemd",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "libsystemd" && value != "native") {
+            return Error("Invalid journald transport: " + value);
+          }
+
+          return None();
+        });
+
     add(&Flags::journald_labels,
         "journald_labels",
         "Labels to append to each line of logs written to journald.\n"
@@ -89,10 +106,73 @@ struct Flags : public virtual flags::FlagsBase
           return None();
         });
 
+    add(&Flags::journald_rate_limit_bytes,
+        "journald_rate_limit_bytes",
+        "Maximum number of bytes per second written to journald.\n"
+        "Bursts of up to this many bytes are allowed.  Lines beyond the\n"
+        "limit are handled according to '--journald_rate_limit_policy'.\n"
+        "Defaults to 0 (no limit).",
+        Bytes(0));
+
+    add(&Flags::journald_rate_limit_lines,
+        "journald_rate_limit_lines",
+        "Maximum number of lines per second written to journald.\n"
+        "Bursts of up to this many lines are allowed.  Lines beyond the\n"
+        "limit are handled according to '--journald_rate_limit_policy'.\n"
+        "Defaults to 0 (no limit).",
+        0u);
+
+    add(&Flags::journald_rate_limit_policy,
+        "journald_rate_limit_policy",
+        "Determines what happens to lines beyond the journald rate limit.\n"
+        "'drop' drops them.  'sample' writes one in every\n"
+        "'--journald_rate_limit_sample_rate' of them, and drops the rest.\n"
+        "Either way, the number of dropped lines is written to journald\n"
+        "periodically.  Lines are always written to the sandbox.",
+        "drop",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "drop" && value != "sample") {
+            return Error("Invalid journald rate limit policy: " + value);
+          }
+
+          return None();
+        });
+
+    add(&Flags::journald_rate_limit_sample_rate,
+        "journald_rate_limit_sample_rate",
+        "With '--journald_rate_limit_policy=sample', one in this many\n"
+        "lines beyond the journald rate limit is still written.",
+        100u,
+        [](const size_t& value) -> Option<Error> {
+          if (value < 1u) {
+            return Error(
+                "Expected --journald_rate_limit_sample_rate of at least 1");
+          }
+
+          return None();
+        });
+
+    add(&Flags::read_buffer_size,
+        "read_buffer_size",
+        "Size, in bytes, of the buffer used to read from STDIN.\n"
+        "Lines longer than this buffer are split into multiple entries\n"
+        "when written to journald.\n"
+        "Defaults to 1 (memory) page.  Must be at least 1 (memory) page.",
+        Bytes(os::pagesize()),
+        [](const Bytes& value) -> Option<Error> {
+          if (value.bytes() < os::pagesize()) {
+            return Error(
+                "Expected --read_buffer_size of at least " +
+                stringify(os::pagesize()) + " bytes");
+          }
+          return None();
+        });
+
     add(&Flags::logrotate_max_size,
         "logrotate_max_size",
         "Maximum size, in bytes, of a single log file.\n"
-        "Defaults to 10 MB.  Must be at least 1 (memory) page.",
+        "Defaults to 10 MB.  Must be at least 1 (memory) page\n"
+        "and no smaller than '--read_buffer_size'.",
         Megabytes(10),
         [](const Bytes& value) -> Option<Error> {
           if (value.bytes() < os::pagesize()) {
@@ -153,23 +233,130 @@ struct Flags : public virtual flags::FlagsBase
           return None();
         });
 
+    add(&Flags::logrotate_engine,
+        "logrotate_engine",
+        "Determines how the leading log file is rotated.\n"
+        "'logrotate' runs '--logrotate_path' with a configuration derived\n"
+        "from '--logrotate_options'.\n"
+        "'native' rotates the file inside this command: the leading log\n"
+        "file is renamed and replaced right away, while numbering, pruning\n"
+        "and compression of rotated files happen in the background.\n"
+        "See '--logrotate_max_files' and '--logrotate_compress'.",
+        "logrotate",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "logrotate" && value != "native") {
+            return Error("Invalid logrotate engine: " + value);
+          }
+
+          return None();
+        });
+
+    add(&Flags::logrotate_max_files,
+        "logrotate_max_files",
+        "Number of rotated log files to keep with\n"
+        "'--logrotate_engine=native'.  Rotated files are named\n"
+        "'<logrotate_filename>.1' (most recent) up to\n"
+        "'<logrotate_filename>.<logrotate_max_files>'.",
+        5u);
+
+    add(&Flags::logrotate_compress,
+        "logrotate_compress",
+        "Whether rotated log files are gzip compressed with\n"
+        "'--logrotate_engine=native'.  Compressed files get a '.gz' suffix.",
+        false);
+
+    add(&Flags::logrotate_splice,
+        "logrotate_splice",
+        "Whether logs are moved from stdin to the leading log file with\n"
+        "'splice', without copying them through this command.  With the\n"
+        "'journald+logrotate' destination, stdin is duplicated with 'tee'\n"
+        "so that only the journald copy is read.  Falls back to reading\n"
+        "stdin if stdin is not a pipe, or if splicing fails.",
+        false);
+
+    add(&Flags::logrotate_inline_compression,
+        "logrotate_inline_compression",
+        "Whether the leading log file is gzip compressed as it is written,\n"
+        "so that rotated files need not be compressed after the fact.\n"
+        "The leading log file is then '<logrotate_filename>.gz', and is\n"
+        "written as a series of gzip members, each of which can be\n"
+        "decompressed on its own.  '--logrotate_max_size' then applies\n"
+        "to the compressed size.  Requires '--logrotate_engine=native';\n"
+        "'--logrotate_compress' and '--logrotate_splice' are ignored.",
+        false);
+
+    add(&Flags::logrotate_compression_flush_size,
+        "logrotate_compression_flush_size",
+        "With '--logrotate_inline_compression', a gzip member is finished\n"
+        "and written out once it holds this many uncompressed bytes.",
+        Megabytes(1));
+
+    add(&Flags::logrotate_compression_flush_interval,
+        "logrotate_compression_flush_interval",
+        "With '--logrotate_inline_compression', a gzip member is finished\n"
+        "and written out at most this long after it has been started,\n"
+        "so that logs show up in the leading log file in a timely manner.",
+        Seconds(5));
+
     add(&Flags::user,
         "user",
         "The user this command should run as.");
+
+    add(&Flags::stats_file,
+        "stats_file",
+        "If specified, the stats of this command, such as the number of\n"
+        "bytes read, are shared on this file, e.g. so that the agent can\n"
+        "expose them as metrics.  The file must already exist, and is\n"
+        "opened before switching to '--user'.  Otherwise the stats are\n"
+        "kept in private memory.");
+
+    add(&Flags::daemon_socket,
+        "daemon_socket",
+        "If specified, this command runs as a daemon which logs from any\n"
+        "number of pipes, instead of logging from STDIN.  Pipes are handed\n"
+        "over on this unix socket, along with the flags of each pipe.\n"
+        "All other flags are ignored in this mode.  Since the daemon runs\n"
+        "as a single user, pipes whose flags set '--user' are refused.");
+
+    add(&Flags::standby,
+        "standby",
+        "If true, this command starts up without a pipe to log from.\n"
+        "STDIN must be a unix socket, on which a single pipe is handed\n"
+        "over, along with the flags for that pipe.  This command then logs\n"
+        "from the pipe, as if it had been given as STDIN.",
+        false);
   }
 
   std::string destination_type;
 
+  std::string journald_transport;
   Option<std::string> journald_labels;
+  Bytes journald_rate_limit_bytes;
+  size_t journald_rate_limit_lines;
+  std::string journald_rate_limit_policy;
+  size_t journald_rate_limit_sample_rate;
 
   // Values populated during validation.
   Labels parsed_labels;
 
+  Bytes read_buffer_size;
+
   Bytes logrotate_max_size;
   Option<std::string> logrotate_options;
   Option<std::string> logrotate_filename;
   std::string logrotate_path;
+  std::string logrotate_engine;
+  size_t logrotate_max_files;
+  bool logrotate_compress;
+  bool logrotate_splice;
+  bool logrotate_inline_compression;
+  Bytes logrotate_compression_flush_size;
+  Duration logrotate_compression_flush_interval;
   Option<std::string> user;
+  Option<std::string> stats_file;
+
+  Option<std::string> daemon_socket;
+  bool standby;
 };
 
 } // namespace logger {
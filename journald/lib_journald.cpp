@@ -1,8 +1,17 @@
 #include <array>
+#include <deque>
+#include <list>
 #include <map>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include <stddef.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+
 #include <mesos/mesos.hpp>
 #include <mesos/type_utils.hpp>
 
@@ -11,25 +20,45 @@
 #include <mesos/slave/container_logger.hpp>
 #include <mesos/slave/containerizer.hpp>
 
+#include <process/after.hpp>
+#include <process/clock.hpp>
+#include <process/collect.hpp>
+#include <process/defer.hpp>
+#include <process/delay.hpp>
 #include <process/dispatch.hpp>
 #include <process/future.hpp>
+#include <process/io.hpp>
 #include <process/process.hpp>
 #include <process/subprocess.hpp>
+#include <process/time.hpp>
+
+#include <process/metrics/metrics.hpp>
+#include <process/metrics/pull_gauge.hpp>
 
 #include <stout/bytes.hpp>
+#include <stout/duration.hpp>
+#include <stout/hashmap.hpp>
 #include <stout/jsonify.hpp>
 #include <stout/try.hpp>
 #include <stout/nothing.hpp>
 #include <stout/path.hpp>
+#include <stout/result.hpp>
 #include <stout/stringify.hpp>
 #include <stout/strings.hpp>
 
 #include <stout/os/environment.hpp>
+#include <stout/os/exists.hpp>
 #include <stout/os/fcntl.hpp>
 #include <stout/os/killtree.hpp>
+#include <stout/os/ls.hpp>
+#include <stout/os/mkdir.hpp>
+#include <stout/os/rm.hpp>
+#include <stout/os/su.hpp>
 
+#include "daemon.hpp"
 #include "journald.hpp"
 #include "lib_journald.hpp"
+#include "stats.hpp"
 
 
 using namespace mesos;
@@ -43,6 +72,10 @@ using mesos::slave::ContainerConfig;
 using mesos::slave::ContainerLogger;
 using mesos::slave::ContainerIO;
 
+using mesos::journald::logger::Stats;
+
+using process::metrics::PullGauge;
+
 // Forward declare some functions located in `src/linux/systemd.cpp`.
 // This is not exposed in the Mesos public headers, but is necessary to
 // keep the ContainerLogger's companion binaries alive if the agent dies.
@@ -65,11 +98,47 @@ namespace journald {
 const Bytes LABEL_PADDING_SIZE =
   Bytes(string("{\"key\":\"\",\"value\":\"\"},").size());
 
+// How long to wait for a newly spawned logger daemon to accept pipes.
+const Duration DAEMON_STARTUP_TIMEOUT = Seconds(10);
+const Duration DAEMON_STARTUP_INTERVAL = Milliseconds(50);
+
+// How often the metrics of exited loggers are removed.
+// See `--logger_metrics`.
+const Duration METRICS_SWEEP_INTERVAL = Seconds(10);
+
+// How long to keep the metrics of a logger whose stats file cannot
+// be read, e.g. because the logger has not created it yet.
+const Duration METRICS_GRACE_PERIOD = Minutes(1);
+
 class JournaldContainerLoggerProcess :
   public Process<JournaldContainerLoggerProcess>
 {
 public:
-  JournaldContainerLoggerProcess(const Flags& _flags) : flags(_flags) {}
+  JournaldContainerLoggerProcess(const Flags& _flags)
+    : flags(_flags),
+      environment(loggerEnvironment())
+  {
+    Result<string> user = os::user();
+    if (user.isSome()) {
+      agentUser = user.get();
+    }
+  }
+
+  virtual ~JournaldContainerLoggerProcess()
+  {
+    // NOTE: Standby loggers exit once their socket is closed.
+    foreach (const Standby& standby, pool) {
+      os::close(standby.socket);
+    }
+
+    foreachvalue (const LoggerMetrics& metrics, loggerMetrics) {
+      foreach (const PullGauge& gauge, metrics.gauges) {
+        process::metrics::remove(gauge);
+      }
+
+      os::close(metrics.fd);
+    }
+  }
 
   // Spawns two subprocesses that read from their stdin and write to
   // journald along with labels to disambiguate the logs from other containers.
@@ -77,30 +146,6 @@ public:
       const ContainerID& containerId,
       const ContainerConfig& containerConfig)
   {
-    // Prepare the environment for the container logger subprocess.
-    // We inherit agent environment variables except for those
-    // LIBPROCESS or MESOS prefixed environment variables. See MESOS-6747.
-    std::map<std::string, std::string> environment;
-
-    foreachpair (const std::string& key, const std::string& value,
-                 os::environment()) {
-      if (!strings::startsWith(key, "LIBPROCESS_") &&
-          !strings::startsWith(key, "MESOS_")) {
-        environment.emplace(key, value);
-      }
-    }
-
-    // Make sure the libprocess of the subprocess can properly
-    // initialize and find the IP. Since we don't need to use the TCP
-    // socket for communication, it's OK to use a local address.
-    environment.emplace("LIBPROCESS_IP", "127.0.0.1");
-
-    // Use the number of worker threads for libprocess that was passed
-    // in through the flags.
-    CHECK_GT(flags.libprocess_num_worker_threads, 0u);
-    environment["LIBPROCESS_NUM_WORKER_THREADS"] =
-      stringify(flags.libprocess_num_worker_threads);
-
     // Copy the global logger flags.
     // These will act as the defaults in case the container environment
     // overrides a subset of them.
@@ -108,6 +153,19 @@ public:
     overriddenFlags.destination_type = flags.destination_type;
     overriddenFlags.logrotate_max_stdout_size = flags.logrotate_max_stdout_size;
     overriddenFlags.logrotate_max_stderr_size = flags.logrotate_max_stderr_size;
+    overriddenFlags.logrotate_max_stdout_files =
+      flags.logrotate_max_stdout_files;
+    overriddenFlags.logrotate_max_stderr_files =
+      flags.logrotate_max_stderr_files;
+    overriddenFlags.logrotate_compress = flags.logrotate_compress;
+    overriddenFlags.journald_rate_limit_bytes =
+      flags.journald_rate_limit_bytes;
+    overriddenFlags.journald_rate_limit_lines =
+      flags.journald_rate_limit_lines;
+    overriddenFlags.journald_rate_limit_policy =
+      flags.journald_rate_limit_policy;
+    overriddenFlags.journald_rate_limit_sample_rate =
+      flags.journald_rate_limit_sample_rate;
 
     // TODO(jieyu): Consider merge labels with container specific
     // extra labels from the environment, instead of overwriting.
@@ -131,24 +189,30 @@ public:
         }
       }
 
-      // We will error out if there are unknown flags with the same prefix.
-      Try<flags::Warnings> load = overriddenFlags.load(containerEnvironment);
+      // Most containers do not override anything, in which case
+      // there is nothing to load.
+      if (!containerEnvironment.empty()) {
+        // We will error out if there are unknown flags with the same prefix.
+        Try<flags::Warnings> load =
+          overriddenFlags.load(containerEnvironment);
 
-      if (load.isError()) {
-        return Failure(
-            "Failed to load container logger settings: " + load.error());
-      }
+        if (load.isError()) {
+          return Failure(
+              "Failed to load container logger settings: " + load.error());
+        }
 
-      // Log any flag warnings.
-      foreach (const flags::Warning& warning, load->warnings) {
-        LOG(WARNING) << warning.message;
+        // Log any flag warnings.
+        foreach (const flags::Warning& warning, load->warnings) {
+          LOG(WARNING) << warning.message;
+        }
       }
     }
 
     // TODO(josephw): Custom options would allow tasks to execute arbitrary
     // scripts in logrotate's `postrotate` clause or add rotation of arbitrary
-    // files.  This is disabled in favor of more targeted options in future,
-    // such as ints for the number of files to keep, or bools for compression.
+    // files.  This is disabled in favor of more targeted options, such as
+    // `logrotate_max_*_files` or `logrotate_compress` (which are only
+    // supported by the native engine for now).
     // See: https://issues.apache.org/jira/browse/MESOS-9564
     // and https://jira.mesosphere.com/browse/DCOS-47733.
     overriddenFlags.logrotate_stdout_options = flags.logrotate_stdout_options;
@@ -225,13 +289,32 @@ public:
     // Derive the AgentID from the sandbox directory, which always
     // occurs after the `slaves` directory.
     // See: src/slave/paths.hpp in the Mesos codebase for more info.
-    vector<string> sandboxTokens =
-      strings::tokenize(containerConfig.directory(), "/");
-
+    //
+    // NOTE: All sandboxes of an agent share the same prefix, so the
+    // AgentID is only derived again if the prefix changes, e.g. when
+    // the agent registers with a new AgentID.
     Option<string> agentId = None();
-    for (int i = sandboxTokens.size() - 2; i >= 0; i -= 2) {
-      if (sandboxTokens[i] == "slaves") {
-        agentId = sandboxTokens[i + 1];
+    if (agentDirectory.isSome() &&
+        strings::startsWith(
+            containerConfig.directory(), agentDirectory->first)) {
+      agentId = agentDirectory->second;
+    } else {
+      vector<string> sandboxTokens =
+        strings::tokenize(containerConfig.directory(), "/");
+
+      for (int i = sandboxTokens.size() - 2; i >= 0; i -= 2) {
+        if (sandboxTokens[i] == "slaves") {
+          agentId = sandboxTokens[i + 1];
+
+          // Remember the directory of the agent, up to the AgentID.
+          agentDirectory = std::make_pair(
+              "/" + strings::join(
+                  "/",
+                  vector<string>(
+                      sandboxTokens.begin(),
+                      sandboxTokens.begin() + i + 2)) + "/",
+              agentId.get());
+        }
       }
     }
 
@@ -263,60 +346,115 @@ public:
     }
     labels.add_labels()->CopyFrom(label);
 
-    // NOTE: We manually construct a pipe here instead of using
-    // `Subprocess::PIPE` so that the ownership of the FDs is properly
-    // represented.  The `Subprocess` spawned below owns the read-end
-    // of the pipe and will be solely responsible for closing that end.
-    // The ownership of the write-end will be passed to the caller
-    // of this function.
-    Try<array<int, 2>> pipefd = os::pipe();
-    if (pipefd.isError()) {
-      return Failure("Failed to create pipe: " + pipefd.error());
-    }
-
-    Subprocess::IO::InputFileDescriptors outfds;
-    outfds.read = pipefd->at(0);
-    outfds.write = pipefd->at(1);
-
     label.set_key("STREAM");
     label.set_value("STDOUT");
     labels.add_labels()->CopyFrom(label);
 
     mesos::journald::logger::Flags outFlags;
     outFlags.destination_type = overriddenFlags.destination_type;
+    outFlags.read_buffer_size = flags.read_buffer_size;
+    outFlags.journald_transport = flags.journald_transport;
 
     outFlags.journald_labels = stringify(JSON::protobuf(labels));
+    outFlags.journald_rate_limit_bytes =
+      overriddenFlags.journald_rate_limit_bytes;
+    outFlags.journald_rate_limit_lines =
+      overriddenFlags.journald_rate_limit_lines;
+    outFlags.journald_rate_limit_policy =
+      overriddenFlags.journald_rate_limit_policy;
+    outFlags.journald_rate_limit_sample_rate =
+      overriddenFlags.journald_rate_limit_sample_rate;
 
     outFlags.logrotate_max_size = overriddenFlags.logrotate_max_stdout_size;
     outFlags.logrotate_options = overriddenFlags.logrotate_stdout_options;
     outFlags.logrotate_filename =
       path::join(containerConfig.directory(), "stdout");
     outFlags.logrotate_path = flags.logrotate_path;
+    outFlags.logrotate_engine = flags.logrotate_engine;
+    outFlags.logrotate_splice = flags.logrotate_splice;
+    outFlags.logrotate_inline_compression = flags.logrotate_inline_compression;
+    outFlags.logrotate_compression_flush_size =
+      flags.logrotate_compression_flush_size;
+    outFlags.logrotate_compression_flush_interval =
+      flags.logrotate_compression_flush_interval;
+    outFlags.logrotate_max_files = overriddenFlags.logrotate_max_stdout_files;
+    outFlags.logrotate_compress = overriddenFlags.logrotate_compress;
     outFlags.user = containerConfig.has_user()
       ? Option<string>(containerConfig.user())
       : Option<string>::none();
 
-    // If we are on systemd, then extend the life of the process as we
-    // do with the executor. Any grandchildren's lives will also be
-    // extended.
-    std::vector<Subprocess::ParentHook> parentHooks;
-    if (systemd::enabled()) {
-      parentHooks.emplace_back(Subprocess::ParentHook(
-          &systemd::mesos::extendLifetime));
+    labels.mutable_labels()->DeleteSubrange(labels.labels().size() - 1, 1);
+    label.set_key("STREAM");
+    label.set_value("STDERR");
+    labels.add_labels()->CopyFrom(label);
+
+    mesos::journald::logger::Flags errFlags;
+    errFlags.destination_type = overriddenFlags.destination_type;
+    errFlags.read_buffer_size = flags.read_buffer_size;
+    errFlags.journald_transport = flags.journald_transport;
+
+    errFlags.journald_labels = stringify(JSON::protobuf(labels));
+    errFlags.journald_rate_limit_bytes =
+      overriddenFlags.journald_rate_limit_bytes;
+    errFlags.journald_rate_limit_lines =
+      overriddenFlags.journald_rate_limit_lines;
+    errFlags.journald_rate_limit_policy =
+      overriddenFlags.journald_rate_limit_policy;
+    errFlags.journald_rate_limit_sample_rate =
+      overriddenFlags.journald_rate_limit_sample_rate;
+
+    errFlags.logrotate_max_size = overriddenFlags.logrotate_max_stderr_size;
+    errFlags.logrotate_options = overriddenFlags.logrotate_stderr_options;
+    errFlags.logrotate_filename =
+      path::join(containerConfig.directory(), "stderr");
+    errFlags.logrotate_path = flags.logrotate_path;
+    errFlags.logrotate_engine = flags.logrotate_engine;
+    errFlags.logrotate_splice = flags.logrotate_splice;
+    errFlags.logrotate_inline_compression = flags.logrotate_inline_compression;
+    errFlags.logrotate_compression_flush_size =
+      flags.logrotate_compression_flush_size;
+    errFlags.logrotate_compression_flush_interval =
+      flags.logrotate_compression_flush_interval;
+    errFlags.logrotate_max_files = overriddenFlags.logrotate_max_stderr_files;
+    errFlags.logrotate_compress = overriddenFlags.logrotate_compress;
+    errFlags.user = containerConfig.has_user()
+      ? Option<string>(containerConfig.user())
+      : Option<string>::none();
+
+    if (flags.logger_metrics) {
+      outFlags.stats_file = addMetrics(containerId, "stdout");
+      errFlags.stats_file = addMetrics(containerId, "stderr");
     }
 
-    // Spawn a process to handle stdout.
-    Try<Subprocess> outProcess = subprocess(
-        path::join(flags.companion_dir, mesos::journald::logger::NAME),
-        {mesos::journald::logger::NAME},
-        Subprocess::FD(outfds.read, Subprocess::IO::OWNED),
-        Subprocess::PATH("/dev/null"),
-        Subprocess::FD(STDERR_FILENO),
-        &outFlags,
-        environment,
-        None(),
-        parentHooks,
-        {Subprocess::ChildHook::SETSID()});
+    // NOTE: The daemon runs as the agent's user and cannot switch to
+    // the user of a container. As it would then write to files in a
+    // sandbox owned by that user, e.g. through symlinks planted by the
+    // container, containers of other users still get loggers of their
+    // own.
+    if (flags.logger_mode == "daemon" &&
+        (outFlags.user.isNone() || outFlags.user == agentUser)) {
+      outFlags.user = None();
+      errFlags.user = None();
+      return handoff(outFlags, errFlags);
+    }
+
+    // NOTE: We manually construct a pipe here instead of using
+    // `Subprocess::PIPE` so that the ownership of the FDs is properly
+    // represented.  The `Subprocess` spawned below owns the read-end
+    // of the pipe and will be solely responsible for closing that end.
+    // The ownership of the write-end will be passed to the caller
+    // of this function.
+    Try<array<int, 2>> pipefd = os::pipe();
+    if (pipefd.isError()) {
+      return Failure("Failed to create pipe: " + pipefd.error());
+    }
+
+    Subprocess::IO::InputFileDescriptors outfds;
+    outfds.read = pipefd->at(0);
+    outfds.write = pipefd->at(1);
+
+    // Start a process to handle stdout.
+    Try<pid_t> outProcess = launch(outfds.read, outFlags);
 
     if (outProcess.isError()) {
       os::close(outfds.write.get());
@@ -328,7 +466,7 @@ public:
     pipefd = os::pipe();
     if (pipefd.isError()) {
       os::close(outfds.write.get());
-      os::killtree(outProcess->pid(), SIGKILL);
+      os::killtree(outProcess.get(), SIGKILL);
       return Failure("Failed to create pipe: " + pipefd.error());
     }
 
@@ -336,54 +474,546 @@ public:
     errfds.read = pipefd->at(0);
     errfds.write = pipefd->at(1);
 
-    labels.mutable_labels()->DeleteSubrange(labels.labels().size() - 1, 1);
-    label.set_key("STREAM");
-    label.set_value("STDERR");
-    labels.add_labels()->CopyFrom(label);
+    // Start a process to handle stderr.
+    Try<pid_t> errProcess = launch(errfds.read, errFlags);
 
-    mesos::journald::logger::Flags errFlags;
-    errFlags.destination_type = overriddenFlags.destination_type;
+    if (errProcess.isError()) {
+      os::close(outfds.write.get());
+      os::close(errfds.write.get());
+      os::killtree(outProcess.get(), SIGKILL);
+      return Failure("Failed to create logger process: " + errProcess.error());
+    }
 
-    errFlags.journald_labels = stringify(JSON::protobuf(labels));
+    // NOTE: The ownership of these FDs is given to the caller of this function.
+    ContainerIO io;
+    io.out = ContainerIO::IO::FD(outfds.write.get());
+    io.err = ContainerIO::IO::FD(errfds.write.get());
+    return io;
+  }
 
-    errFlags.logrotate_max_size = overriddenFlags.logrotate_max_stderr_size;
-    errFlags.logrotate_options = overriddenFlags.logrotate_stderr_options;
-    errFlags.logrotate_filename =
-      path::join(containerConfig.directory(), "stderr");
-    errFlags.logrotate_path = flags.logrotate_path;
-    errFlags.user = containerConfig.has_user()
-      ? Option<string>(containerConfig.user())
-      : Option<string>::none();
+protected:
+  virtual void initialize()
+  {
+    // The daemon takes the pipes of all containers, so it needs no
+    // standby loggers.
+    if (flags.logger_mode != "daemon") {
+      refill();
+    }
+
+    if (flags.logger_metrics) {
+      Try<Nothing> mkdir = os::mkdir(flags.logger_stats_dir);
+      if (mkdir.isError()) {
+        LOG(WARNING) << "Failed to create '" << flags.logger_stats_dir
+                     << "': " << mkdir.error();
+      } else if (::chmod(flags.logger_stats_dir.c_str(), S_IRWXU) < 0) {
+        LOG(WARNING) << ErrnoError(
+            "Failed to chmod '" + flags.logger_stats_dir + "'").message;
+      }
+
+      // The loggers of a previous agent have their stats files mapped
+      // already, so removing them does not affect these loggers.
+      Try<std::list<string>> entries = os::ls(flags.logger_stats_dir);
+      if (entries.isSome()) {
+        foreach (const string& entry, entries.get()) {
+          if (strings::endsWith(
+                  entry, mesos::journald::logger::STATS_SUFFIX)) {
+            os::rm(path::join(flags.logger_stats_dir, entry));
+          }
+        }
+      }
+
+      delay(METRICS_SWEEP_INTERVAL, self(), &Self::sweep);
+    }
+  }
+
+private:
+  // A logger subprocess which has been started ahead of time, and which
+  // waits for a pipe to be handed over on `socket`. See `--standby`.
+  struct Standby
+  {
+    pid_t pid;
+    int_fd socket;
+  };
+
+  // The metrics exposing the stats file of a single logger.
+  struct LoggerMetrics
+  {
+    Time added;
+    int_fd fd;
+    std::vector<PullGauge> gauges;
+  };
+
+  // Creates the stats file of the logger of a container's `stream`,
+  // and exposes the stats as metrics. Returns the path of the stats
+  // file, for the logger's `--stats_file`. See `--logger_metrics`.
+  Option<string> addMetrics(
+      const ContainerID& containerId,
+      const string& stream)
+  {
+    const string path = path::join(
+        flags.logger_stats_dir,
+        stringify(containerId) + "." + stream +
+          mesos::journald::logger::STATS_SUFFIX);
 
-    // Spawn a process to handle stderr.
-    Try<Subprocess> errProcess = subprocess(
+    if (loggerMetrics.contains(path)) {
+      return path;
+    }
+
+    // NOTE: A stats file left behind for the same container, e.g. by
+    // a failed launch, is replaced.
+    if (os::exists(path)) {
+      os::rm(path);
+    }
+
+    Try<int_fd> fd = mesos::journald::logger::createStats(path);
+    if (fd.isError()) {
+      LOG(WARNING) << "Failed to create stats file for container "
+                   << containerId << ": " << fd.error();
+      return None();
+    }
+
+    const string prefix = "containerizer/journald_logger/" +
+      stringify(containerId) + "/" + stream + "/";
+
+    LoggerMetrics metrics;
+    metrics.added = Clock::now();
+    metrics.fd = fd.get();
+
+    auto add = [&](const string& name, size_t offset, double scale) {
+      metrics.gauges.emplace_back(
+          prefix + name,
+          defer(self(), &Self::readGauge, path, offset, scale));
+    };
+
+    // The stats hold times in nanoseconds.
+    const double nanosToMillis = 1.0 / Milliseconds(1).ns();
+
+    add("bytes_read", offsetof(Stats, bytesRead), 1.0);
+    add("lines_read", offsetof(Stats, linesRead), 1.0);
+    add("journald_errors", offsetof(Stats, journaldErrors), 1.0);
+    add("journald_eagains", offsetof(Stats, journaldEagains), 1.0);
+    add("rotations", offsetof(Stats, rotations), 1.0);
+    add("rotation_time_ms", offsetof(Stats, rotationNanos), nanosToMillis);
+    add("write_blocked_ms",
+        offsetof(Stats, writeBlockedNanos),
+        nanosToMillis);
+    add("pipe_fill_bytes", offsetof(Stats, pipeFill), 1.0);
+    add("pipe_fill_max_bytes", offsetof(Stats, pipeFillMax), 1.0);
+
+    // The rotation duration histogram, e.g. `rotation_duration/under_1ms`.
+    const size_t buckets = mesos::journald::logger::ROTATION_DURATION_BUCKETS;
+    for (size_t i = 0; i < buckets; i++) {
+      const string name = i < buckets - 1
+        ? "under_" + stringify(
+              mesos::journald::logger::ROTATION_DURATION_BOUNDS[i])
+        : "over_" + stringify(
+              mesos::journald::logger::ROTATION_DURATION_BOUNDS[i - 1]);
+
+      add("rotation_duration/" + name,
+          offsetof(Stats, rotationDurations) + i * sizeof(uint64_t),
+          1.0);
+    }
+
+    foreach (const PullGauge& gauge, metrics.gauges) {
+      process::metrics::add(gauge);
+    }
+
+    loggerMetrics[path] = metrics;
+
+    return path;
+  }
+
+  Future<double> readGauge(const string& path, size_t offset, double scale)
+  {
+    if (!loggerMetrics.contains(path)) {
+      return Failure("Unknown stats file '" + path + "'");
+    }
+
+    Try<uint64_t> value = mesos::journald::logger::readStat(
+        loggerMetrics.at(path).fd, offset);
+
+    if (value.isError()) {
+      return Failure(value.error());
+    }
+
+    return value.get() * scale;
+  }
+
+  // Removes the metrics of loggers which have exited, as there is no
+  // other indication of when a container's logs are complete.
+  void sweep()
+  {
+    foreach (const string& path, loggerMetrics.keys()) {
+      const int_fd fd = loggerMetrics.at(path).fd;
+
+      Try<uint64_t> finished = mesos::journald::logger::readStat(
+          fd, offsetof(Stats, finished));
+
+      Try<uint64_t> pid = mesos::journald::logger::readStat(
+          fd, offsetof(Stats, pid));
+
+      bool exited;
+      if (finished.isSome() && pid.isSome()) {
+        exited = finished.get() != 0 ||
+          !os::exists(static_cast<pid_t>(pid.get()));
+      } else {
+        // NOTE: This also covers loggers which never mapped the file.
+        exited = Clock::now() - loggerMetrics[path].added >
+          METRICS_GRACE_PERIOD;
+      }
+
+      if (exited) {
+        foreach (const PullGauge& gauge, loggerMetrics[path].gauges) {
+          process::metrics::remove(gauge);
+        }
+
+        os::close(fd);
+        os::rm(path);
+
+        loggerMetrics.erase(path);
+      }
+    }
+
+    delay(METRICS_SWEEP_INTERVAL, self(), &Self::sweep);
+  }
+
+  // Starts a logger for the read-end `pipe`, which is owned by the
+  // logger afterwards. A standby logger from the pool is used if one
+  // is available, so that the pipe does not wait for a subprocess to
+  // be spawned. Otherwise, a new subprocess is spawned.
+  // Returns the PID of the logger.
+  Try<pid_t> launch(
+      int_fd pipe,
+      const mesos::journald::logger::Flags& loggerFlags)
+  {
+    while (!pool.empty()) {
+      Standby standby = pool.front();
+      pool.pop_front();
+
+      // Replace the standby logger in the background, i.e. after all
+      // pending `prepare` calls.
+      dispatch(self(), &JournaldContainerLoggerProcess::refill);
+
+      Try<Nothing> send = mesos::journald::logger::sendFd(
+          standby.socket,
+          pipe,
+          mesos::journald::logger::encodeFlags(loggerFlags));
+
+      os::close(standby.socket);
+
+      if (send.isSome()) {
+        os::close(pipe);
+        return standby.pid;
+      }
+
+      // The standby logger has most likely exited, so try the next one.
+      LOG(WARNING) << "Failed to hand over pipe to standby logger "
+                   << standby.pid << ": " << send.error();
+    }
+
+    Try<Subprocess> process = subprocess(
         path::join(flags.companion_dir, mesos::journald::logger::NAME),
         {mesos::journald::logger::NAME},
-        Subprocess::FD(errfds.read, Subprocess::IO::OWNED),
+        Subprocess::FD(pipe, Subprocess::IO::OWNED),
         Subprocess::PATH("/dev/null"),
         Subprocess::FD(STDERR_FILENO),
-        &errFlags,
+        &loggerFlags,
         environment,
         None(),
-        parentHooks,
+        parentHooks(),
         {Subprocess::ChildHook::SETSID()});
 
-    if (errProcess.isError()) {
-      os::close(outfds.write.get());
-      os::close(errfds.write.get());
-      os::killtree(outProcess.get().pid(), SIGKILL);
-      return Failure("Failed to create logger process: " + errProcess.error());
+    if (process.isError()) {
+      return Error(process.error());
     }
 
-    // NOTE: The ownership of these FDs is given to the caller of this function.
-    ContainerIO io;
-    io.out = ContainerIO::IO::FD(outfds.write.get());
-    io.err = ContainerIO::IO::FD(errfds.write.get());
-    return io;
+    return process->pid();
+  }
+
+  // Spawns a standby logger, unless the pool is full. Each call
+  // spawns at most one logger, so a refill of the pool never holds
+  // up more than one `prepare` call.
+  void refill()
+  {
+    if (pool.size() >= flags.logger_pool_size) {
+      return;
+    }
+
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+      LOG(WARNING) << "Failed to create standby logger: "
+                   << ErrnoError("Failed to create socketpair").message;
+      return;
+    }
+
+    mesos::journald::logger::Flags standbyFlags;
+    standbyFlags.standby = true;
+
+    Try<Subprocess> process = subprocess(
+        path::join(flags.companion_dir, mesos::journald::logger::NAME),
+        {mesos::journald::logger::NAME},
+        Subprocess::FD(sockets[1], Subprocess::IO::OWNED),
+        Subprocess::PATH("/dev/null"),
+        Subprocess::FD(STDERR_FILENO),
+        &standbyFlags,
+        environment,
+        None(),
+        parentHooks(),
+        {Subprocess::ChildHook::SETSID()});
+
+    if (process.isError()) {
+      os::close(sockets[0]);
+      LOG(WARNING) << "Failed to create standby logger: " << process.error();
+      return;
+    }
+
+    pool.push_back(Standby{process->pid(), sockets[0]});
+
+    if (pool.size() < flags.logger_pool_size) {
+      dispatch(self(), &JournaldContainerLoggerProcess::refill);
+    }
+  }
+
+  // Returns the environment for the container logger subprocesses.
+  // We inherit agent environment variables except for those
+  // LIBPROCESS or MESOS prefixed environment variables. See MESOS-6747.
+  std::map<std::string, std::string> loggerEnvironment() const
+  {
+    std::map<std::string, std::string> environment;
+
+    foreachpair (const std::string& key, const std::string& value,
+                 os::environment()) {
+      if (!strings::startsWith(key, "LIBPROCESS_") &&
+          !strings::startsWith(key, "MESOS_")) {
+        environment.emplace(key, value);
+      }
+    }
+
+    // Make sure the libprocess of the subprocess can properly
+    // initialize and find the IP. Since we don't need to use the TCP
+    // socket for communication, it's OK to use a local address.
+    environment.emplace("LIBPROCESS_IP", "127.0.0.1");
+
+    // Use the number of worker threads for libprocess that was passed
+    // in through the flags.
+    CHECK_GT(flags.libprocess_num_worker_threads, 0u);
+    environment["LIBPROCESS_NUM_WORKER_THREADS"] =
+      stringify(flags.libprocess_num_worker_threads);
+
+    return environment;
+  }
+
+  // If we are on systemd, then extend the life of the process as we
+  // do with the executor. Any grandchildren's lives will also be
+  // extended.
+  std::vector<Subprocess::ParentHook> parentHooks() const
+  {
+    std::vector<Subprocess::ParentHook> parentHooks;
+    if (systemd::enabled()) {
+      parentHooks.emplace_back(Subprocess::ParentHook(
+          &systemd::mesos::extendLifetime));
+    }
+
+    return parentHooks;
+  }
+
+  // Hands the stdout and stderr pipes of a container over to the
+  // logger daemon, instead of spawning a logger for each of them.
+  Future<ContainerIO> handoff(
+      const mesos::journald::logger::Flags& outFlags,
+      const mesos::journald::logger::Flags& errFlags)
+  {
+    Try<array<int, 2>> outfds = os::pipe();
+    if (outfds.isError()) {
+      return Failure("Failed to create pipe: " + outfds.error());
+    }
+
+    Try<array<int, 2>> errfds = os::pipe();
+    if (errfds.isError()) {
+      os::close(outfds->at(0));
+      os::close(outfds->at(1));
+      return Failure("Failed to create pipe: " + errfds.error());
+    }
+
+    // NOTE: The read-ends are closed once they have been handed over.
+    // The ownership of the write-ends is given to the caller of this
+    // function, unless the handoff fails.
+    Future<Nothing> out = handoff(outfds->at(0), outFlags);
+    Future<Nothing> err = handoff(errfds->at(0), errFlags);
+
+    const int outWrite = outfds->at(1);
+    const int errWrite = errfds->at(1);
+
+    return collect(out, err)
+      .onAny([=](const Future<std::tuple<Nothing, Nothing>>& future) {
+        // NOTE: Closing the write-ends also stops the daemon from logging
+        // from the other pipe, in case only one handoff has failed.
+        if (!future.isReady()) {
+          os::close(outWrite);
+          os::close(errWrite);
+        }
+      })
+      .then([=](const std::tuple<Nothing, Nothing>&) {
+        ContainerIO io;
+        io.out = ContainerIO::IO::FD(outWrite);
+        io.err = ContainerIO::IO::FD(errWrite);
+        return io;
+      });
+  }
+
+  // Hands a single pipe over to the logger daemon, which is spawned
+  // if necessary. The read-end `pipe` is closed in any case.
+  Future<Nothing> handoff(
+      int_fd pipe,
+      const mesos::journald::logger::Flags& loggerFlags)
+  {
+    const string data = mesos::journald::logger::encodeFlags(loggerFlags);
+
+    return connect()
+      .then([pipe, data](int_fd connection) -> Future<Nothing> {
+        Try<Nothing> nonblock = os::nonblock(connection);
+        if (nonblock.isError()) {
+          os::close(connection);
+          return Failure(
+              "Failed to set nonblocking socket: " + nonblock.error());
+        }
+
+        // NOTE: We wait for the connection to be writable, rather than
+        // block the module, in case the daemon does not keep up.
+        return io::poll(connection, io::WRITE)
+          .then([connection, pipe, data](short) -> Future<string> {
+            Try<Nothing> send =
+              mesos::journald::logger::sendFd(connection, pipe, data);
+
+            if (send.isError()) {
+              return Failure("Failed to hand over pipe: " + send.error());
+            }
+
+            // The daemon closes the connection after replying with an
+            // error, or with nothing at all once it has started logging
+            // from the pipe.
+            return io::read(connection);
+          })
+          .onAny([connection](const Future<string>&) {
+            os::close(connection);
+          })
+          .then([](const string& reply) -> Future<Nothing> {
+            if (!reply.empty()) {
+              return Failure("Logger daemon failed: " + reply);
+            }
+
+            return Nothing();
+          });
+      })
+      .onAny([pipe](const Future<Nothing>&) {
+        os::close(pipe);
+      });
+  }
+
+  // Connects to the logger daemon. The daemon is spawned on demand,
+  // i.e. if nothing listens on `--daemon_socket`, which is the case
+  // before the first container is launched or after the daemon died.
+  // As the daemon's lifetime is extended like that of the logger
+  // subprocesses, a restarted agent reconnects to the same daemon.
+  Future<int_fd> connect()
+  {
+    Try<int_fd> connection =
+      mesos::journald::logger::connectDaemon(flags.daemon_socket);
+
+    if (connection.isSome()) {
+      return connection.get();
+    }
+
+    // Only one daemon is spawned for the handoffs which find none.
+    if (daemonStarted.isSome()) {
+      return daemonStarted->then(defer(self(), [this](const Nothing&)
+          -> Future<int_fd> {
+        Try<int_fd> connection =
+          mesos::journald::logger::connectDaemon(flags.daemon_socket);
+
+        if (connection.isError()) {
+          return Failure(
+              "Failed to connect to logger daemon: " + connection.error());
+        }
+
+        return connection.get();
+      }));
+    }
+
+    mesos::journald::logger::Flags daemonFlags;
+    daemonFlags.daemon_socket = flags.daemon_socket;
+
+    Try<Subprocess> daemon = subprocess(
+        path::join(flags.companion_dir, mesos::journald::logger::NAME),
+        {mesos::journald::logger::NAME},
+        Subprocess::PATH("/dev/null"),
+        Subprocess::PATH("/dev/null"),
+        Subprocess::FD(STDERR_FILENO),
+        &daemonFlags,
+        environment,
+        None(),
+        parentHooks(),
+        {Subprocess::ChildHook::SETSID()});
+
+    if (daemon.isError()) {
+      return Failure("Failed to create logger daemon: " + daemon.error());
+    }
+
+    Future<int_fd> started = awaitDaemon(DAEMON_STARTUP_TIMEOUT);
+
+    daemonStarted = started.then([](int_fd) { return Nothing(); });
+    daemonStarted->onAny(defer(self(), [this](const Future<Nothing>&) {
+      daemonStarted = None();
+    }));
+
+    return started;
+  }
+
+  // Connects to a newly spawned logger daemon once it accepts
+  // connections, unless that takes longer than `timeout`.
+  Future<int_fd> awaitDaemon(const Duration& timeout)
+  {
+    return after(DAEMON_STARTUP_INTERVAL)
+      .then(defer(self(), [=](const Nothing&) -> Future<int_fd> {
+        Try<int_fd> connection =
+          mesos::journald::logger::connectDaemon(flags.daemon_socket);
+
+        if (connection.isSome()) {
+          return connection.get();
+        }
+
+        if (timeout <= DAEMON_STARTUP_INTERVAL) {
+          return Failure(
+              "Failed to connect to logger daemon: " + connection.error());
+        }
+
+        return awaitDaemon(timeout - DAEMON_STARTUP_INTERVAL);
+      }));
   }
 
 protected:
   Flags flags;
+
+  // The user the agent, and so the logger daemon, runs as.
+  Option<string> agentUser;
+
+  // The environment for all logger subprocesses, which is derived from
+  // the agent's environment once.
+  const std::map<std::string, std::string> environment;
+
+  // Standby loggers, in the order in which they have been spawned.
+  std::deque<Standby> pool;
+
+  // The most recently seen agent directory and the AgentID it contains.
+  Option<std::pair<std::string, std::string>> agentDirectory;
+
+  // Keyed by the path of the stats file in `--logger_stats_dir`. See
+  // `--logger_metrics`.
+  hashmap<string, LoggerMetrics> loggerMetrics;
+
+  // Satisfied once a logger daemon spawned by `connect` accepts
+  // connections.
+  Option<Future<Nothing>> daemonStarted;
 };
 
 
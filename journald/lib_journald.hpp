@@ -7,6 +7,7 @@
 #include <mesos/slave/containerizer.hpp>
 
 #include <stout/bytes.hpp>
+#include <stout/duration.hpp>
 #include <stout/flags.hpp>
 #include <stout/foreach.hpp>
 #include <stout/hashmap.hpp>
@@ -15,7 +16,9 @@
 
 #include <stout/os/exists.hpp>
 
+#include "daemon.hpp"
 #include "journald.hpp"
+#include "stats.hpp"
 
 
 namespace mesos {
@@ -84,6 +87,66 @@ struct LoggerFlags : public virtual flags::FlagsBase
         "  }\n"
         "NOTE: The 'size' option will be overridden by this module.");
 
+    add(&LoggerFlags::logrotate_max_stdout_files,
+        "logrotate_max_stdout_files",
+        "Number of rotated stdout log files to keep.\n"
+        "Only used with '--logrotate_engine=native'.",
+        5u);
+
+    add(&LoggerFlags::logrotate_max_stderr_files,
+        "logrotate_max_stderr_files",
+        "Number of rotated stderr log files to keep.\n"
+        "Only used with '--logrotate_engine=native'.",
+        5u);
+
+    add(&LoggerFlags::logrotate_compress,
+        "logrotate_compress",
+        "Whether rotated log files are gzip compressed.\n"
+        "Only used with '--logrotate_engine=native'.",
+        false);
+
+    add(&LoggerFlags::journald_rate_limit_bytes,
+        "journald_rate_limit_bytes",
+        "Maximum number of bytes per second each of a container's stdout\n"
+        "and stderr write to journald.  Defaults to 0 (no limit).",
+        Bytes(0));
+
+    add(&LoggerFlags::journald_rate_limit_lines,
+        "journald_rate_limit_lines",
+        "Maximum number of lines per second each of a container's stdout\n"
+        "and stderr write to journald.  Defaults to 0 (no limit).",
+        0u);
+
+    add(&LoggerFlags::journald_rate_limit_policy,
+        "journald_rate_limit_policy",
+        "Determines what happens to lines beyond the journald rate limit.\n"
+        "'drop' drops them.  'sample' writes one in every\n"
+        "'journald_rate_limit_sample_rate' of them, and drops the rest.\n"
+        "Either way, the number of dropped lines is written to journald\n"
+        "periodically.  Lines are always written to the sandbox.",
+        "drop",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "drop" && value != "sample") {
+            return Error("Invalid journald rate limit policy: " + value);
+          }
+
+          return None();
+        });
+
+    add(&LoggerFlags::journald_rate_limit_sample_rate,
+        "journald_rate_limit_sample_rate",
+        "With the 'sample' journald rate limit policy, one in this many\n"
+        "lines beyond the rate limit is still written.",
+        100u,
+        [](const size_t& value) -> Option<Error> {
+          if (value < 1u) {
+            return Error(
+                "Expected --journald_rate_limit_sample_rate of at least 1");
+          }
+
+          return None();
+        });
+
     add(&LoggerFlags::extra_labels,
         "extra_labels",
         "Extra key value pairs (in JSON object format) that will be set\n"
@@ -114,6 +177,15 @@ struct LoggerFlags : public virtual flags::FlagsBase
   Bytes logrotate_max_stderr_size;
   Option<std::string> logrotate_stderr_options;
 
+  size_t logrotate_max_stdout_files;
+  size_t logrotate_max_stderr_files;
+  bool logrotate_compress;
+
+  Bytes journald_rate_limit_bytes;
+  size_t journald_rate_limit_lines;
+  std::string journald_rate_limit_policy;
+  size_t journald_rate_limit_sample_rate;
+
   JSON::Object extra_labels;
 };
 
@@ -133,6 +205,13 @@ struct Flags : public virtual LoggerFlags
         "  * LOGROTATE_STDOUT_OPTIONS\n"
         "  * LOGROTATE_MAX_STDERR_SIZE\n"
         "  * LOGROTATE_STDERR_OPTIONS\n"
+        "  * LOGROTATE_MAX_STDOUT_FILES\n"
+        "  * LOGROTATE_MAX_STDERR_FILES\n"
+        "  * LOGROTATE_COMPRESS\n"
+        "  * JOURNALD_RATE_LIMIT_BYTES\n"
+        "  * JOURNALD_RATE_LIMIT_LINES\n"
+        "  * JOURNALD_RATE_LIMIT_POLICY\n"
+        "  * JOURNALD_RATE_LIMIT_SAMPLE_RATE\n"
         "If present, these variables will override the global values set\n"
         "via module parameters.",
         "CONTAINER_LOGGER_");
@@ -175,6 +254,52 @@ struct Flags : public virtual LoggerFlags
           return None();
         });
 
+    add(&Flags::logrotate_engine,
+        "logrotate_engine",
+        "Determines how the logger companion binary rotates log files.\n"
+        "'logrotate' runs '--logrotate_path' with the configuration\n"
+        "derived from the 'logrotate_*_options'.\n"
+        "'native' rotates log files inside the companion binary, without\n"
+        "blocking the container's pipe.  Rotated files are numbered as\n"
+        "with 'logrotate'.  See the 'logrotate_max_*_files' and\n"
+        "'logrotate_compress' flags.",
+        "logrotate",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "logrotate" && value != "native") {
+            return Error("Invalid logrotate engine: " + value);
+          }
+
+          return None();
+        });
+
+    add(&Flags::logrotate_splice,
+        "logrotate_splice",
+        "Whether the logger companion binary moves logs into the sandbox\n"
+        "with 'splice' (and duplicates them for journald with 'tee'),\n"
+        "instead of reading them into memory first.  Falls back to\n"
+        "reading if splicing is not supported.",
+        false);
+
+    add(&Flags::logrotate_inline_compression,
+        "logrotate_inline_compression",
+        "Whether the logger companion binary gzip compresses the leading\n"
+        "log file as it writes it, instead of compressing rotated files.\n"
+        "The leading log files are then 'stdout.gz' and 'stderr.gz'.\n"
+        "Requires '--logrotate_engine=native'.",
+        false);
+
+    add(&Flags::logrotate_compression_flush_size,
+        "logrotate_compression_flush_size",
+        "With '--logrotate_inline_compression', how many uncompressed\n"
+        "bytes are compressed into a single gzip member.",
+        Megabytes(1));
+
+    add(&Flags::logrotate_compression_flush_interval,
+        "logrotate_compression_flush_interval",
+        "With '--logrotate_inline_compression', how long it takes at most\n"
+        "for logs to show up in the leading log file.",
+        Seconds(5));
+
     add(&Flags::max_label_payload_size,
         "max_label_payload_size",
         "Maximum size of the label data transferred to the\n"
@@ -189,6 +314,91 @@ struct Flags : public virtual LoggerFlags
           return None();
         });
 
+    add(&Flags::journald_transport,
+        "journald_transport",
+        "Determines how the logger companion binary sends logs to journald.\n"
+        "'libsystemd' sends every line via 'sd_journal_sendv'.\n"
+        "'native' speaks the native journal protocol over the journal\n"
+        "socket directly, sending all lines of a read in one batch.",
+        "libsystemd",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "libsystemd" && value != "native") {
+            return Error("Invalid journald transport: " + value);
+          }
+
+          return None();
+        });
+
+    add(&Flags::read_buffer_size,
+        "read_buffer_size",
+        "Size, in bytes, of the buffer the logger companion binary uses\n"
+        "to read from the container's stdout/stderr.  Larger buffers reduce\n"
+        "the number of reads for chatty containers.  Lines longer than\n"
+        "this are split into multiple journald entries.\n"
+        "Defaults to 1 (memory) page.  Must be at least 1 (memory) page.",
+        Bytes(os::pagesize()),
+        [](const Bytes& value) -> Option<Error> {
+          if (value.bytes() < os::pagesize()) {
+            return Error(
+                "Expected --read_buffer_size of at least " +
+                stringify(os::pagesize()) + " bytes");
+          }
+
+          return None();
+        });
+
+    add(&Flags::logger_mode,
+        "logger_mode",
+        "Determines how the logger companion binary is run.\n"
+        "'subprocess' spawns two instances of the companion binary per\n"
+        "container, one for stdout and one for stderr.\n"
+        "'daemon' hands the pipes of all containers over to a single\n"
+        "instance of the companion binary, which is spawned on demand\n"
+        "and outlives agent restarts.  Containers which run as another\n"
+        "user than the agent still get loggers of their own, which run\n"
+        "as that user.  See '--daemon_socket'.",
+        "subprocess",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "subprocess" && value != "daemon") {
+            return Error("Invalid logger mode: " + value);
+          }
+
+          return None();
+        });
+
+    add(&Flags::daemon_socket,
+        "daemon_socket",
+        "Path of the unix socket on which the logger daemon accepts pipes.\n"
+        "Only used with '--logger_mode=daemon'.",
+        mesos::journald::logger::DEFAULT_DAEMON_SOCKET);
+
+    add(&Flags::logger_pool_size,
+        "logger_pool_size",
+        "Number of logger companion binaries to spawn ahead of time, so\n"
+        "that launching a container does not wait for its loggers to be\n"
+        "spawned.  The pool is refilled in the background as loggers are\n"
+        "assigned to containers.  Only used with\n"
+        "'--logger_mode=subprocess'.  Defaults to 0 (no pool).",
+        0u);
+
+    add(&Flags::logger_metrics,
+        "logger_metrics",
+        "Whether to expose the stats of each container's loggers, such as\n"
+        "the number of bytes read and the time spent rotating, as metrics\n"
+        "of the agent.  These are named\n"
+        "'containerizer/journald_logger/<container_id>/<stream>/<stat>'\n"
+        "and are removed once the logger exits.  Each logger then shares\n"
+        "its stats on a file in '--logger_stats_dir'.",
+        false);
+
+    add(&Flags::logger_stats_dir,
+        "logger_stats_dir",
+        "Directory in which the files holding the stats of the loggers\n"
+        "are created, see '--logger_metrics'.  This must not be writable\n"
+        "by containers, i.e. it must not be inside of a sandbox.  Stats\n"
+        "files left behind by a previous agent are removed on startup.",
+        mesos::journald::logger::DEFAULT_STATS_DIR);
+
     add(&Flags::libprocess_num_worker_threads,
         "libprocess_num_worker_threads",
         "Number of Libprocess worker threads.\n"
@@ -208,9 +418,23 @@ struct Flags : public virtual LoggerFlags
 
   std::string companion_dir;
   std::string logrotate_path;
+  std::string logrotate_engine;
+  bool logrotate_splice;
+  bool logrotate_inline_compression;
+  Bytes logrotate_compression_flush_size;
+  Duration logrotate_compression_flush_interval;
 
   Bytes max_label_payload_size;
 
+  std::string journald_transport;
+  Bytes read_buffer_size;
+
+  std::string logger_mode;
+  std::string daemon_socket;
+  size_t logger_pool_size;
+  bool logger_metrics;
+  std::string logger_stats_dir;
+
   size_t libprocess_num_worker_threads;
 };
 
@@ -0,0 +1,310 @@
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h> // For `struct iovec`.
+#include <sys/un.h>
+
+#include <string>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/strings.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/int_fd.hpp>
+
+#include "native_journal.hpp"
+
+// These are defined in `linux/fcntl.h` and `linux/memfd.h`,
+// which may be missing from older glibc headers.
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+
+// Forward declare a helper found in `src/linux/memfd.hpp`.
+namespace mesos {
+namespace internal {
+namespace memfd {
+
+// Creates an anonymous in-memory file via `memfd_create`.
+Try<int_fd> create(const std::string& name, unsigned int flags);
+
+} // namespace memfd {
+} // namespace internal {
+} // namespace mesos {
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+namespace {
+
+const char MESSAGE_FIELD[] = "MESSAGE=";
+const char NEWLINE[] = "\n";
+
+// The send buffer size requested for the journal socket.
+// This matches the size used by `libsystemd`.
+const int SEND_BUFFER_SIZE = 8 * 1024 * 1024;
+
+
+// Serializes a single field into the native journal protocol.
+// Values without newlines are written as `KEY=VALUE\n`. Other values
+// are written as `KEY\n`, followed by the little-endian 64-bit length
+// of the value, the value itself, and a trailing newline.
+void encode(const std::string& key, const std::string& value, std::string* out)
+{
+  if (value.find('\n') == std::string::npos) {
+    out->append(key);
+    out->append("=");
+    out->append(value);
+    out->append("\n");
+    return;
+  }
+
+  out->append(key);
+  out->append("\n");
+
+  uint64_t length = value.size();
+  for (int i = 0; i < 8; i++) {
+    out->push_back(static_cast<char>((length >> (8 * i)) & 0xff));
+  }
+
+  out->append(value);
+  out->append("\n");
+}
+
+} // namespace {
+
+
+Try<NativeJournal*> NativeJournal::create(
+    const Labels& labels,
+    const std::string& socketPath)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    return Error("Journal socket path '" + socketPath + "' is too long");
+  }
+
+  memcpy(address.sun_path, socketPath.data(), socketPath.size());
+
+  int fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return ErrnoError("Failed to create journal socket");
+  }
+
+  // Larger entries can be sent without falling back to a memfd if the
+  // send buffer is large. This is best-effort, as the kernel may cap
+  // the value.
+  ::setsockopt(
+      fd, SOL_SOCKET, SO_SNDBUF, &SEND_BUFFER_SIZE, sizeof(SEND_BUFFER_SIZE));
+
+  // Encode the labels once, as they are the same for every entry.
+  std::string fields;
+  foreach (const Label& label, labels.labels()) {
+    encode(strings::upper(label.key()), label.value(), &fields);
+  }
+
+  return new NativeJournal(fd, address, fields);
+}
+
+
+NativeJournal::NativeJournal(
+    int _socket,
+    const struct sockaddr_un& _address,
+    const std::string& _fields)
+  : socket(_socket),
+    address(_address),
+    fields(_fields),
+    iovecs(4 * MAX_JOURNAL_BATCH_SIZE),
+    messages(MAX_JOURNAL_BATCH_SIZE),
+    queued(0),
+    dropped(0),
+    congested(0)
+{
+  // Everything except the message itself is constant, so the
+  // headers are populated once.
+  for (size_t i = 0; i < MAX_JOURNAL_BATCH_SIZE; i++) {
+    struct iovec* entry = &iovecs[4 * i];
+
+    entry[0].iov_base = const_cast<char*>(fields.data());
+    entry[0].iov_len = fields.size();
+    entry[1].iov_base = const_cast<char*>(MESSAGE_FIELD);
+    entry[1].iov_len = sizeof(MESSAGE_FIELD) - 1;
+    entry[2].iov_base = nullptr;
+    entry[2].iov_len = 0;
+    entry[3].iov_base = const_cast<char*>(NEWLINE);
+    entry[3].iov_len = sizeof(NEWLINE) - 1;
+
+    struct msghdr* header = &messages[i].msg_hdr;
+    memset(header, 0, sizeof(*header));
+
+    // NOTE: We do not `connect` the socket, so that entries can still
+    // be delivered after journald is restarted.
+    header->msg_name = const_cast<struct sockaddr_un*>(&address);
+    header->msg_namelen = sizeof(address);
+    header->msg_iov = entry;
+    header->msg_iovlen = 4;
+  }
+}
+
+
+NativeJournal::~NativeJournal()
+{
+  os::close(socket);
+}
+
+
+void NativeJournal::append(const char* message, size_t length)
+{
+  if (queued == MAX_JOURNAL_BATCH_SIZE) {
+    // Even if the write fails, we ignore the error.
+    flush();
+  }
+
+  struct iovec* entry = &iovecs[4 * queued];
+  entry[2].iov_base = const_cast<char*>(message);
+  entry[2].iov_len = length;
+
+  queued++;
+}
+
+
+Try<Nothing> NativeJournal::flush()
+{
+  Option<Error> error = None();
+
+  size_t sent = 0;
+  while (sent < queued) {
+    int result = ::sendmmsg(
+        socket, &messages[sent], queued - sent, MSG_NOSIGNAL);
+
+    if (result >= 0) {
+      sent += result;
+      continue;
+    }
+
+    if (errno == EINTR) {
+      continue;
+    }
+
+    // `sendmmsg` only fails if the first message could not be sent.
+    // Oversized entries are retried through a memfd; anything else
+    // is dropped.
+    if (errno == ENOBUFS || errno == EAGAIN) {
+      congested++;
+    }
+
+    if (errno == EMSGSIZE || errno == ENOBUFS) {
+      Try<Nothing> send = sendMemfd(messages[sent].msg_hdr);
+      if (send.isError()) {
+        error = Error(send.error());
+        dropped++;
+      }
+    } else {
+      error = ErrnoError("Failed to send journal entry");
+      dropped++;
+    }
+
+    sent++;
+  }
+
+  queued = 0;
+
+  if (error.isSome()) {
+    return error.get();
+  }
+
+  return Nothing();
+}
+
+
+Try<Nothing> NativeJournal::sendMemfd(const struct msghdr& message)
+{
+  Try<int_fd> memFd =
+    mesos::internal::memfd::create("journal-entry", MFD_ALLOW_SEALING);
+
+  if (memFd.isError()) {
+    return Error("Failed to create memfd for journal entry: " + memFd.error());
+  }
+
+  size_t expected = 0;
+  for (size_t i = 0; i < message.msg_iovlen; i++) {
+    expected += message.msg_iov[i].iov_len;
+  }
+
+  ssize_t written = ::writev(memFd.get(), message.msg_iov, message.msg_iovlen);
+  if (written < 0 || static_cast<size_t>(written) != expected) {
+    ErrnoError error("Failed to write journal entry to memfd");
+    os::close(memFd.get());
+    return error;
+  }
+
+  // journald only accepts sealed memfds, so that the content
+  // cannot change while it is being read.
+  if (::fcntl(
+          memFd.get(),
+          F_ADD_SEALS,
+          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    ErrnoError error("Failed to seal memfd for journal entry");
+    os::close(memFd.get());
+    return error;
+  }
+
+  // Pass the file descriptor as the only content of the datagram.
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr header;
+  memset(&header, 0, sizeof(header));
+  header.msg_name = message.msg_name;
+  header.msg_namelen = message.msg_namelen;
+  header.msg_control = &control;
+  header.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  const int fd = memFd.get();
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t result;
+  do {
+    result = ::sendmsg(socket, &header, MSG_NOSIGNAL);
+  } while (result < 0 && errno == EINTR);
+
+  if (result < 0) {
+    ErrnoError error("Failed to send memfd for journal entry");
+    os::close(memFd.get());
+    return error;
+  }
+
+  os::close(memFd.get());
+  return Nothing();
+}
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
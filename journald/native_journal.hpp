@@ -0,0 +1,92 @@
+#ifndef __JOURNALD_NATIVE_JOURNAL_HPP__
+#define __JOURNALD_NATIVE_JOURNAL_HPP__
+
+#include <sys/socket.h>
+#include <sys/uio.h> // For `struct iovec`.
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+
+#include <mesos/mesos.hpp>
+
+#include <stout/nothing.hpp>
+#include <stout/try.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// The socket on which journald accepts entries in its native protocol.
+// See: https://systemd.io/JOURNAL_NATIVE_PROTOCOL/
+const std::string JOURNAL_SOCKET = "/run/systemd/journal/socket";
+
+// The maximum number of entries sent with a single `sendmmsg` call.
+const size_t MAX_JOURNAL_BATCH_SIZE = 128;
+
+
+// Writes entries to journald by speaking the native journal protocol
+// over the journal socket, instead of going through `sd_journal_sendv`.
+//
+// All entries written by one instance carry the same labels. These are
+// encoded once, when the instance is created. Entries are queued via
+// `append` and sent in batches via `sendmmsg`. Entries which do not fit
+// into a single datagram are passed to journald as a sealed memfd.
+class NativeJournal
+{
+public:
+  static Try<NativeJournal*> create(
+      const Labels& labels,
+      const std::string& socketPath = JOURNAL_SOCKET);
+
+  ~NativeJournal();
+
+  // Queues an entry with the given `MESSAGE` field.
+  // NOTE: The message is not copied, so it must stay valid until the
+  // next call to `flush`. A batch is flushed implicitly when it is full.
+  void append(const char* message, size_t length);
+
+  // Sends all queued entries to journald.
+  // NOTE: Like `sd_journal_sendv`, entries which cannot be sent are
+  // dropped. The returned error describes the last dropped entry.
+  Try<Nothing> flush();
+
+  // The number of entries which have been dropped so far.
+  size_t errors() const { return dropped; }
+
+  // The number of sends so far which found the journal socket full,
+  // i.e. which failed with `ENOBUFS` or `EAGAIN`.
+  size_t eagains() const { return congested; }
+
+private:
+  NativeJournal(
+      int _socket,
+      const struct sockaddr_un& _address,
+      const std::string& _fields);
+
+  // Sends a single entry by writing it into a sealed memfd and
+  // passing the file descriptor over the journal socket.
+  Try<Nothing> sendMemfd(const struct msghdr& message);
+
+  const int socket;
+  const struct sockaddr_un address;
+
+  // The labels, serialized into the native protocol.
+  const std::string fields;
+
+  // Each queued entry consists of four `iovec`s: the labels,
+  // the `MESSAGE=` field name, the message, and the trailing newline.
+  std::vector<struct iovec> iovecs;
+  std::vector<struct mmsghdr> messages;
+  size_t queued;
+
+  size_t dropped;
+  size_t congested;
+};
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_NATIVE_JOURNAL_HPP__
@@ -0,0 +1,79 @@
+#ifndef __JOURNALD_RATE_LIMITER_HPP__
+#define __JOURNALD_RATE_LIMITER_HPP__
+
+#include <algorithm>
+
+#include <process/clock.hpp>
+#include <process/time.hpp>
+
+#include <stout/bytes.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// Limits the rate of lines, in bytes per second and lines per second,
+// with a token bucket for each. Each bucket holds up to one second
+// worth of tokens, so bursts of up to the per-second limit pass.
+//
+// NOTE: A line which is longer than the byte limit is still let through
+// once the byte bucket is full; the bucket then goes into debt.
+class RateLimiter
+{
+public:
+  // A limit of zero means no limit.
+  RateLimiter(const Bytes& _bytesPerSecond, size_t _linesPerSecond)
+    : bytesPerSecond(_bytesPerSecond.bytes()),
+      linesPerSecond(_linesPerSecond),
+      bytes(bytesPerSecond),
+      lines(linesPerSecond),
+      updated(process::Clock::now()) {}
+
+  // Returns whether a line of `length` bytes is within the limits.
+  // If so, tokens are consumed for it.
+  bool acquire(size_t length)
+  {
+    refill();
+
+    if (bytesPerSecond > 0 &&
+        bytes < std::min(static_cast<double>(length), bytesPerSecond)) {
+      return false;
+    }
+
+    if (linesPerSecond > 0 && lines < 1) {
+      return false;
+    }
+
+    bytes -= length;
+    lines -= 1;
+
+    return true;
+  }
+
+private:
+  void refill()
+  {
+    const process::Time now = process::Clock::now();
+    const double elapsed = (now - updated).secs();
+    updated = now;
+
+    bytes = std::min(bytes + elapsed * bytesPerSecond, bytesPerSecond);
+    lines = std::min(lines + elapsed * linesPerSecond, linesPerSecond);
+  }
+
+  const double bytesPerSecond;
+  const double linesPerSecond;
+
+  // The number of tokens currently in each bucket.
+  double bytes;
+  double lines;
+
+  process::Time updated;
+};
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_RATE_LIMITER_HPP__
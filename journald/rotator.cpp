@@ -0,0 +1,185 @@
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <process/id.hpp>
+#include <process/process.hpp>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/exists.hpp>
+#include <stout/os/int_fd.hpp>
+#include <stout/os/open.hpp>
+#include <stout/os/rename.hpp>
+#include <stout/os/rm.hpp>
+
+#include "rotator.hpp"
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+namespace {
+
+// The size of the chunks in which rotated files are compressed.
+const size_t COMPRESSION_CHUNK_SIZE = 64 * 1024;
+
+
+// Writes a gzip compressed copy of `source` to `target`.
+Try<Nothing> compressFile(const std::string& source, const std::string& target)
+{
+  Try<int_fd> in = os::open(source, O_RDONLY | O_CLOEXEC);
+  if (in.isError()) {
+    return Error("Failed to open '" + source + "': " + in.error());
+  }
+
+  gzFile out = gzopen(target.c_str(), "wb");
+  if (out == nullptr) {
+    os::close(in.get());
+    return Error("Failed to open '" + target + "'");
+  }
+
+  std::vector<char> buffer(COMPRESSION_CHUNK_SIZE);
+
+  Option<Error> error = None();
+  while (true) {
+    ssize_t length = ::read(in.get(), buffer.data(), buffer.size());
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (length < 0) {
+      error = ErrnoError("Failed to read '" + source + "'");
+      break;
+    }
+
+    if (length == 0) {
+      break;
+    }
+
+    if (gzwrite(out, buffer.data(), length) != length) {
+      error = Error("Failed to write '" + target + "'");
+      break;
+    }
+  }
+
+  os::close(in.get());
+
+  if (gzclose(out) != Z_OK && error.isNone()) {
+    error = Error("Failed to close '" + target + "'");
+  }
+
+  if (error.isSome()) {
+    return error.get();
+  }
+
+  return Nothing();
+}
+
+} // namespace {
+
+
+LogRotatorProcess::LogRotatorProcess(
+    const std::string& _filename,
+    size_t _maxFiles,
+    bool _compress)
+  : ProcessBase(process::ID::generate("log-rotator")),
+    filename(_filename),
+    maxFiles(_maxFiles),
+    compress(_compress) {}
+
+
+void LogRotatorProcess::rotate(
+    const std::string& rotated,
+    const std::string& suffix)
+{
+  if (maxFiles == 0) {
+    Try<Nothing> rm = os::rm(rotated);
+    if (rm.isError()) {
+      std::cerr << "Failed to remove '" << rotated << "': "
+                << rm.error() << std::endl;
+    }
+
+    return;
+  }
+
+  // Rotated files may or may not have been compressed.
+  const std::vector<std::string> suffixes = {"", GZIP_SUFFIX};
+
+  // Make room for the newly rotated file by shifting the others
+  // by one, starting with the oldest one, which is removed.
+  for (size_t index = maxFiles; index > 0; index--) {
+    foreach (const std::string& existing, suffixes) {
+      const std::string current = path(index) + existing;
+      if (!os::exists(current)) {
+        continue;
+      }
+
+      Try<Nothing> result = index == maxFiles
+        ? os::rm(current)
+        : os::rename(current, path(index + 1) + existing);
+
+      if (result.isError()) {
+        std::cerr << "Failed to rotate '" << current << "': "
+                  << result.error() << std::endl;
+      }
+    }
+  }
+
+  Try<Nothing> rename = os::rename(rotated, path(1) + suffix);
+  if (rename.isError()) {
+    std::cerr << "Failed to rename '" << rotated << "' to '"
+              << path(1) + suffix << "': " << rename.error() << std::endl;
+    return;
+  }
+
+  if (!compress || !suffix.empty()) {
+    return;
+  }
+
+  // NOTE: The compressed file is written under a temporary name, so
+  // a partially compressed file is never mistaken for a rotated one.
+  const std::string compressed = path(1) + GZIP_SUFFIX;
+  const std::string temporary = compressed + ".tmp";
+
+  Try<Nothing> result = compressFile(path(1), temporary);
+  if (result.isError()) {
+    std::cerr << "Failed to compress '" << path(1) << "': "
+              << result.error() << std::endl;
+
+    os::rm(temporary);
+    return;
+  }
+
+  result = os::rename(temporary, compressed);
+  if (result.isError()) {
+    std::cerr << "Failed to rename '" << temporary << "' to '" << compressed
+              << "': " << result.error() << std::endl;
+
+    os::rm(temporary);
+    return;
+  }
+
+  os::rm(path(1));
+}
+
+
+std::string LogRotatorProcess::path(size_t index) const
+{
+  return filename + "." + stringify(index);
+}
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
@@ -0,0 +1,61 @@
+#ifndef __JOURNALD_ROTATOR_HPP__
+#define __JOURNALD_ROTATOR_HPP__
+
+#include <string>
+
+#include <process/process.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// Infix of a leading log file which has been rotated, but which has
+// not been numbered by the `LogRotatorProcess` yet.
+const std::string ROTATING_INFIX = ".rotating.";
+
+// Suffix of rotated log files which have been compressed.
+const std::string GZIP_SUFFIX = ".gz";
+
+
+// Numbers, prunes, and optionally compresses rotated log files.
+//
+// When rotating, the logger only renames the leading log file out of
+// the way, so that it can continue writing to a fresh leading log file
+// right away. The remaining work happens inside this process, off the
+// logger's write path.
+//
+// Rotated files are named like the ones produced by `logrotate`:
+// `<filename>.1` (or `<filename>.1.gz`) is the most recent one, and
+// at most `maxFiles` rotated files are kept.
+class LogRotatorProcess : public process::Process<LogRotatorProcess>
+{
+public:
+  LogRotatorProcess(
+      const std::string& _filename,
+      size_t _maxFiles,
+      bool _compress);
+
+  // Moves the given rotated file into place as `<filename>.1`, after
+  // shifting all previously rotated files by one. If the rotated file
+  // has already been compressed, `suffix` is the `GZIP_SUFFIX`, and
+  // the file is not compressed again.
+  // NOTE: Errors are printed and otherwise ignored, so that failures
+  // to rotate never interrupt logging.
+  void rotate(const std::string& rotated, const std::string& suffix);
+
+private:
+  // Returns the path of the `index`-th rotated file, without
+  // the `GZIP_SUFFIX`.
+  std::string path(size_t index) const;
+
+  const std::string filename;
+  const size_t maxFiles;
+  const bool compress;
+};
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_ROTATOR_HPP__
@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <new>
+#include <string>
+
+#include <stout/error.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/int_fd.hpp>
+#include <stout/os/open.hpp>
+
+#include "stats.hpp"
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+static_assert(
+    ATOMIC_LLONG_LOCK_FREE == 2,
+    "The stats can only be shared if 64-bit atomics are lock-free");
+
+
+Try<int_fd> createStats(const std::string& path)
+{
+  Try<int_fd> fd = os::open(
+      path,
+      O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+      S_IRUSR | S_IWUSR);
+
+  if (fd.isError()) {
+    return Error("Failed to create '" + path + "': " + fd.error());
+  }
+
+  // Until the logger has mapped the file, readers see no stats.
+  if (::ftruncate(fd.get(), sizeof(Stats)) < 0) {
+    ErrnoError error("Failed to truncate '" + path + "'");
+    os::close(fd.get());
+    return error;
+  }
+
+  return fd.get();
+}
+
+
+Try<Stats*> mapStats(const std::string& path)
+{
+  Try<int_fd> fd = os::open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd.isError()) {
+    return Error("Failed to open '" + path + "': " + fd.error());
+  }
+
+  // Truncating first zeroes any stats of a previous logger.
+  if (::ftruncate(fd.get(), 0) < 0 ||
+      ::ftruncate(fd.get(), sizeof(Stats)) < 0) {
+    ErrnoError error("Failed to truncate '" + path + "'");
+    os::close(fd.get());
+    return error;
+  }
+
+  void* memory = ::mmap(
+      nullptr, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+
+  // NOTE: The mapping stays valid after closing the file.
+  os::close(fd.get());
+
+  if (memory == MAP_FAILED) {
+    return ErrnoError("Failed to map '" + path + "'");
+  }
+
+  Stats* stats = new (memory) Stats();
+  set(&stats->pid, ::getpid());
+
+  // Readers only look at the counters once the header is in place.
+  stats->version = STATS_VERSION;
+  std::atomic_thread_fence(std::memory_order_release);
+  stats->magic = STATS_MAGIC;
+
+  return stats;
+}
+
+
+void unmapStats(Stats* stats)
+{
+  stats->~Stats();
+  ::munmap(stats, sizeof(Stats));
+}
+
+
+Try<uint64_t> readStat(int_fd fd, size_t offset)
+{
+  if (offset + sizeof(uint64_t) > sizeof(Stats)) {
+    return Error("Invalid offset " + stringify(offset));
+  }
+
+  // NOTE: This copies the whole struct at once, which is no more
+  // expensive than reading the header and the counter separately.
+  alignas(Stats) char buffer[sizeof(Stats)];
+
+  ssize_t length;
+  do {
+    length = ::pread(fd, buffer, sizeof(buffer), 0);
+  } while (length < 0 && errno == EINTR);
+
+  if (length < 0) {
+    return ErrnoError("Failed to read stats");
+  }
+
+  if (static_cast<size_t>(length) < sizeof(Stats)) {
+    return Error("Unexpected end of stats");
+  }
+
+  uint32_t magic;
+  uint32_t version;
+  memcpy(&magic, buffer + offsetof(Stats, magic), sizeof(magic));
+  memcpy(&version, buffer + offsetof(Stats, version), sizeof(version));
+
+  if (magic != STATS_MAGIC || version != STATS_VERSION) {
+    return Error("Unexpected stats format");
+  }
+
+  uint64_t value;
+  memcpy(&value, buffer + offset, sizeof(value));
+
+  return value;
+}
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
@@ -0,0 +1,146 @@
+#ifndef __JOURNALD_STATS_HPP__
+#define __JOURNALD_STATS_HPP__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include <stout/duration.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/int_fd.hpp>
+
+
+namespace mesos {
+namespace journald {
+namespace logger {
+
+// Suffix of the files which hold the stats of a logger, see
+// `--stats_file`.
+const std::string STATS_SUFFIX = ".stats";
+
+// The default directory in which the agent creates the stats files.
+const std::string DEFAULT_STATS_DIR =
+  "/run/mesos/mesos-journald-logger-stats";
+
+// Identifies a stats file written by a compatible logger.
+const uint32_t STATS_MAGIC = 0x534c4a4d; // "MJLS"
+const uint32_t STATS_VERSION = 1;
+
+// Upper bounds of the buckets of the rotation duration histogram.
+// The last bucket counts all rotations which took longer.
+const Duration ROTATION_DURATION_BOUNDS[] = {
+  Milliseconds(1),
+  Milliseconds(10),
+  Milliseconds(100),
+  Seconds(1),
+};
+
+const size_t ROTATION_DURATION_BUCKETS =
+  sizeof(ROTATION_DURATION_BOUNDS) / sizeof(ROTATION_DURATION_BOUNDS[0]) + 1;
+
+
+// The counters of a single logger, i.e. of a single pipe.
+//
+// The agent creates the stats file, and the logger maps these from it
+// and updates them while it logs. Each counter has a single writer, so
+// no locking is needed; the counters are atomic only so that readers
+// never see torn values.
+// Readers should go through `readStat`.
+//
+// NOTE: This is shared between the logger and the agent, which may run
+// different versions of this code, so any change to the layout requires
+// bumping the `STATS_VERSION`.
+struct Stats
+{
+  uint32_t magic;
+  uint32_t version;
+
+  // The PID of the process which writes the stats.
+  std::atomic<uint64_t> pid;
+
+  // Set to 1 once the logger has reached EOF on its pipe and has
+  // written all of its logs.
+  std::atomic<uint64_t> finished;
+
+  std::atomic<uint64_t> bytesRead;
+
+  // NOTE: Lines are only counted when writing to journald, which is
+  // the only destination which needs to split the logs into lines.
+  std::atomic<uint64_t> linesRead;
+
+  // Entries which could not be sent to journald, and sends which hit
+  // a full journal socket (`EAGAIN` or `ENOBUFS`). With the native
+  // journald transport, the latter includes entries which could still
+  // be sent via a memfd; `sd_journal_sendv` only reports those which
+  // were dropped.
+  std::atomic<uint64_t> journaldErrors;
+  std::atomic<uint64_t> journaldEagains;
+
+  // The time the logger spent rotating the leading log file, while
+  // not reading from the pipe. With `--logrotate_engine=native` the
+  // rotated files are numbered and compressed in the background, which
+  // is not included.
+  std::atomic<uint64_t> rotations;
+  std::atomic<uint64_t> rotationNanos;
+  std::atomic<uint64_t> rotationDurations[ROTATION_DURATION_BUCKETS];
+
+  // The time the logger spent writing to journald and the sandbox,
+  // including rotations, while not reading from the pipe.
+  std::atomic<uint64_t> writeBlockedNanos;
+
+  // The number of bytes waiting in the pipe, as of the last read,
+  // and the most that were ever waiting.
+  std::atomic<uint64_t> pipeFill;
+  std::atomic<uint64_t> pipeFillMax;
+};
+
+
+// Adds to a counter of the `Stats`.
+// NOTE: As there is only a single writer, this does not need an atomic
+// read-modify-write, which would be considerably more expensive.
+inline void increment(std::atomic<uint64_t>* counter, uint64_t value = 1)
+{
+  counter->store(
+      counter->load(std::memory_order_relaxed) + value,
+      std::memory_order_relaxed);
+}
+
+
+// Sets a gauge of the `Stats`.
+inline void set(std::atomic<uint64_t>* gauge, uint64_t value)
+{
+  gauge->store(value, std::memory_order_relaxed);
+}
+
+
+// Creates the stats file at `path`, which must not exist yet, for a
+// logger to share its stats on. Returns the file descriptor to read
+// the stats from.
+//
+// NOTE: The file is only accessible to the owner, i.e. the agent, and
+// is neither created nor opened through a symlink, so it should be
+// created outside of the sandbox of the container.
+Try<int_fd> createStats(const std::string& path);
+
+// Maps the stats file at `path`, which has been created via
+// `createStats`, into memory. The returned stats are zeroed, except
+// for the `pid`, and must be released via `unmapStats`.
+Try<Stats*> mapStats(const std::string& path);
+
+void unmapStats(Stats* stats);
+
+
+// Reads a single counter from the stats file `fd`, where `offset` is
+// the `offsetof` the counter inside `Stats`.
+//
+// NOTE: The stats file is read instead of mapped, so that the reader
+// does not depend on the layout of the logger's mapping.
+Try<uint64_t> readStat(int_fd fd, size_t offset);
+
+} // namespace logger {
+} // namespace journald {
+} // namespace mesos {
+
+#endif // __JOURNALD_STATS_HPP__
@@ -0,0 +1,165 @@
+#ifndef __LOGSINK_DEDUPLICATOR_HPP__
+#define __LOGSINK_DEDUPLICATOR_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <stout/duration.hpp>
+
+
+namespace mesos {
+namespace logsink {
+
+// Collapses log storms, i.e. log lines which are emitted over and over
+// from the same place in the code.
+//
+// Log lines are keyed by their severity, file, and line. Of the log
+// lines with the same key, the first `burst` ones in every `interval`
+// pass, and the rest are merely counted. The count is reported once
+// the interval has passed, either when the next log line with that key
+// comes along, or by a `sweep`.
+//
+// NOTE: Times are nanoseconds of the steady clock, as passed in by the
+// caller. The libprocess clock is not used, as it may log itself.
+class Deduplicator
+{
+public:
+  // The source of a log line.
+  struct Key
+  {
+    google::LogSeverity severity;
+
+    // NOTE: This is the `__FILE__` literal, which is compared by its
+    // address, as that is the same for all log lines from a file.
+    const char* file;
+    int line;
+
+    bool operator==(const Key& that) const
+    {
+      return severity == that.severity &&
+        file == that.file &&
+        line == that.line;
+    }
+  };
+
+  Deduplicator(const Duration& _interval, size_t _burst)
+    : interval(_interval.ns()),
+      burst(_burst) {}
+
+  // Returns whether a log line from `key` should be written at `now`.
+  // The `repeated` log lines which were suppressed during the previous
+  // interval of this key, if any, should be reported first.
+  bool admit(const Key& key, int64_t now, uint64_t* repeated)
+  {
+    Shard& shard = shards[hash(key) % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    Entry& entry = shard.entries[key];
+
+    *repeated = 0;
+    if (entry.count == 0 || now - entry.start >= interval) {
+      *repeated = entry.suppressed;
+      entry.start = now;
+      entry.count = 0;
+      entry.suppressed = 0;
+    }
+
+    if (entry.count < burst) {
+      entry.count++;
+      return true;
+    }
+
+    entry.suppressed++;
+    return false;
+  }
+
+  // Reports the repeats of all keys whose interval has passed by `now`,
+  // via `report(key, repeated)`, and forgets about idle keys.
+  //
+  // NOTE: The repeats of a shard are reported after unlocking it, as
+  // the report might block, e.g. on a full queue of its own sink.
+  void sweep(
+      int64_t now,
+      const std::function<void(const Key&, uint64_t)>& report)
+  {
+    std::vector<std::pair<Key, uint64_t>> repeats;
+
+    for (size_t i = 0; i < SHARDS; i++) {
+      Shard& shard = shards[i];
+
+      {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto iterator = shard.entries.begin();
+        while (iterator != shard.entries.end()) {
+          Entry& entry = iterator->second;
+          if (now - entry.start < interval) {
+            ++iterator;
+            continue;
+          }
+
+          if (entry.suppressed > 0) {
+            repeats.emplace_back(iterator->first, entry.suppressed);
+          }
+
+          iterator = shard.entries.erase(iterator);
+        }
+      }
+
+      for (size_t j = 0; j < repeats.size(); j++) {
+        report(repeats[j].first, repeats[j].second);
+      }
+
+      repeats.clear();
+    }
+  }
+
+private:
+  struct Entry
+  {
+    Entry() : start(0), count(0), suppressed(0) {}
+
+    int64_t start;
+    size_t count;
+    uint64_t suppressed;
+  };
+
+  struct Hash
+  {
+    size_t operator()(const Key& key) const
+    {
+      return std::hash<const void*>()(key.file) ^
+        (static_cast<size_t>(key.line) * 31 + key.severity);
+    }
+  };
+
+  // Threads which log from different places rarely contend for the
+  // same shard.
+  struct Shard
+  {
+    std::mutex mutex;
+    std::unordered_map<Key, Entry, Hash> entries;
+  };
+
+  static const size_t SHARDS = 16;
+
+  size_t hash(const Key& key) const { return Hash()(key); }
+
+  const int64_t interval;
+  const size_t burst;
+
+  Shard shards[SHARDS];
+};
+
+} // namespace logsink {
+} // namespace mesos {
+
+#endif // __LOGSINK_DEDUPLICATOR_HPP__
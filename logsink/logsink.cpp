@@ -1,4 +1,23 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <glog/logging.h>
 
@@ -9,6 +28,7 @@
 #include <process/owned.hpp>
 
 #include <stout/os.hpp>
+#include <stout/stringify.hpp>
 
 #include <stout/os/close.hpp>
 #include <stout/os/exists.hpp>
@@ -28,8 +48,155 @@ using mesos::modules::Module;
 namespace mesos {
 namespace logsink {
 
+namespace {
 
-FileSink::FileSink(const Flags& _flags) : flags(_flags)
+// The most log lines the `writer` writes out at once.
+const size_t BATCH_SIZE = std::min(256, IOV_MAX);
+
+// How long the `writer` waits for log lines before checking its queue
+// again, in case a wakeup was missed.
+const std::chrono::milliseconds WRITER_WAIT_INTERVAL(100);
+
+// How long a thread which cannot queue a log line waits before retrying,
+// with `--async_overflow_policy=block`.
+const std::chrono::microseconds OVERFLOW_WAIT_INTERVAL(100);
+
+// How long `WaitTillSent` waits for a FATAL log line to be written out.
+// This keeps a stuck disk from turning an abort into a hang.
+const std::chrono::seconds FATAL_FLUSH_TIMEOUT(10);
+
+// The log line being written by this thread. This is reused for all
+// log lines of the thread, so that formatting does not allocate.
+thread_local std::string record;
+
+// The thread ID, as printed by glog.
+thread_local const pid_t tid = ::syscall(SYS_gettid);
+
+// The last FATAL log line queued by this thread, which `WaitTillSent`
+// waits for. The `fatalSink` is only set while there is such a line.
+thread_local const FileSink* fatalSink = nullptr;
+thread_local uint64_t fatalPosition = 0;
+
+// Set by the `--reopen_signal` handler, and cleared once the log file
+// has been reopened.
+std::atomic<bool> reopenRequested(false);
+
+
+void requestReopen(int signal)
+{
+  reopenRequested.store(true);
+}
+
+
+int signalNumber(const std::string& name)
+{
+  if (name == "SIGHUP") {
+    return SIGHUP;
+  } else if (name == "SIGUSR1") {
+    return SIGUSR1;
+  }
+
+  CHECK(name == "SIGUSR2") << "Unexpected signal " << name;
+  return SIGUSR2;
+}
+
+
+// The current time of the steady clock, in nanoseconds.
+int64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Formats a log line like `google::LogSink::ToString` does, into the
+// given `out` string. Unlike `ToString`, this does not allocate once
+// `out` has grown large enough.
+void format(
+    std::string* out,
+    google::LogSeverity severity,
+    const char* file,
+    int line,
+    const struct ::tm* time,
+    const char* message,
+    size_t length)
+{
+  // The `time` has no sub-second part, so the microseconds are taken
+  // from the current time.
+  //
+  // NOTE: This differs from `ToString` of glog 0.3 and 0.4, which
+  // always prints the microseconds as 0.
+  struct timeval now;
+  ::gettimeofday(&now, nullptr);
+
+  char prefix[64];
+  int size = ::snprintf(
+      prefix,
+      sizeof(prefix),
+      "%c%02d%02d %02d:%02d:%02d.%06ld %5d ",
+      google::LogSeverityNames[severity][0],
+      1 + time->tm_mon,
+      time->tm_mday,
+      time->tm_hour,
+      time->tm_min,
+      time->tm_sec,
+      static_cast<long>(now.tv_usec),
+      static_cast<int>(tid));
+
+  out->assign(prefix, size);
+  out->append(file);
+
+  size = ::snprintf(prefix, sizeof(prefix), ":%d] ", line);
+  out->append(prefix, size);
+  out->append(message, length);
+}
+
+
+// Writes all of `iov`, retrying on short writes and interrupts.
+// NOTE: Like in the synchronous case, errors are ignored, as there is
+// nowhere left to log them.
+void writeAll(int fd, struct iovec* iov, size_t count)
+{
+  while (count > 0) {
+    ssize_t length = ::writev(fd, iov, count);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return;
+    }
+
+    // Skip the fully written buffers, and advance into the partially
+    // written one, if any.
+    size_t written = length;
+    while (count > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+} // namespace {
+
+
+FileSink::FileSink(const Flags& _flags)
+  : flags(_flags),
+    flushed(0),
+    droppedPending(0),
+    droppedTotal(0),
+    sleeping(false),
+    stopping(false),
+    rotating(false),
+    bytesWritten(0),
+    openedAt(now()),
+    nextSweep(0)
 {
   if (!os::exists(flags.output_file)) {
     // Create the log directory (noop if it already exists).
@@ -44,11 +211,60 @@ FileSink::FileSink(const Flags& _flags) : flags(_flags)
   CHECK_SOME(open);
 
   logFd = open.get();
+
+  struct stat s;
+  if (::fstat(logFd, &s) == 0) {
+    bytesWritten.store(s.st_size);
+  }
+
+  if (flags.max_size.bytes() > 0 || flags.max_age > Duration::zero()) {
+    rotator.reset(new LogRotator(flags.output_file, flags.max_files));
+    rotating = true;
+  }
+
+  if (flags.reopen_signal.isSome()) {
+    reopenSignal = signalNumber(flags.reopen_signal.get());
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestReopen;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    PCHECK(::sigaction(reopenSignal.get(), &action, &previousAction) == 0)
+      << "Failed to install a handler for " << flags.reopen_signal.get();
+
+    rotating = true;
+  }
+
+  if (flags.dedup_interval > Duration::zero()) {
+    deduplicator.reset(
+        new Deduplicator(flags.dedup_interval, flags.dedup_burst));
+  }
+
+  if (flags.async) {
+    buffer.reset(new RingBuffer<std::string>(flags.async_buffer_size));
+    writer = std::thread(&FileSink::flush, this);
+  }
 }
 
 
 FileSink::~FileSink()
 {
+  // The `writer` drains the queue before exiting.
+  if (writer.joinable()) {
+    stopping.store(true);
+    wake();
+    writer.join();
+  }
+
+  if (reopenSignal.isSome()) {
+    ::sigaction(reopenSignal.get(), &previousAction, nullptr);
+  }
+
+  // Waits for a pending compression.
+  rotator.reset();
+
   os::close(logFd);
 }
 
@@ -62,20 +278,290 @@ void FileSink::send(
     const char* message,
     size_t message_len)
 {
-  os::write(
-      logFd,
-      ToString(
-          severity,
-          base_filename,
-          line,
-          tm_time,
-          message,
-          // NOTE: The LogSink's message length excludes the newline.
-          message_len + 1));
+  // FATAL log lines are never suppressed.
+  if (deduplicator.get() != nullptr && severity != google::GLOG_FATAL) {
+    const int64_t time = now();
+
+    uint64_t repeated;
+    const bool admitted = deduplicator->admit(
+        {severity, base_filename, line}, time, &repeated);
+
+    if (repeated > 0) {
+      report({severity, base_filename, line}, repeated);
+    }
+
+    sweep(time);
+
+    if (!admitted) {
+      return;
+    }
+  }
+
+  // NOTE: The LogSink's message length excludes the newline.
+  write(severity, base_filename, line, tm_time, message, message_len + 1);
 }
 
 
-void FileSink::WaitTillSent() {}
+void FileSink::write(
+    google::LogSeverity severity,
+    const char* file,
+    int line,
+    const struct ::tm* time,
+    const char* message,
+    size_t length)
+{
+  format(&record, severity, file, line, time, message, length);
+
+  if (buffer.get() == nullptr) {
+    os::write(logFd, record);
+    written(record.size());
+    return;
+  }
+
+  // FATAL log lines are always queued, so that `WaitTillSent` can
+  // make sure they are written out before the process aborts.
+  const bool fatal = severity == google::GLOG_FATAL;
+
+  // NOTE: The record is copied into the slot, which reuses the memory
+  // of the record the slot held before.
+  uint64_t position;
+  while (!buffer->push(record, &position)) {
+    if (!fatal && flags.async_overflow_policy == "drop") {
+      droppedPending++;
+      droppedTotal++;
+      return;
+    }
+
+    if (!fatal && flags.async_overflow_policy == "spill") {
+      os::write(logFd, record);
+      written(record.size());
+      return;
+    }
+
+    wake();
+    std::this_thread::sleep_for(OVERFLOW_WAIT_INTERVAL);
+  }
+
+  if (fatal) {
+    fatalSink = this;
+    fatalPosition = position;
+  }
+
+  if (sleeping.load()) {
+    wake();
+  }
+}
+
+
+void FileSink::report(const Deduplicator::Key& key, uint64_t repeated)
+{
+  const time_t now = ::time(nullptr);
+  struct ::tm time;
+  ::localtime_r(&now, &time);
+
+  char message[128];
+  int length = ::snprintf(
+      message,
+      sizeof(message),
+      "Last message repeated %llu more times\n",
+      static_cast<unsigned long long>(repeated));
+
+  write(key.severity, key.file, key.line, &time, message, length);
+}
+
+
+void FileSink::sweep(int64_t time)
+{
+  int64_t next = nextSweep.load();
+  if (time < next) {
+    return;
+  }
+
+  // Only one thread sweeps at a time.
+  if (!nextSweep.compare_exchange_strong(
+          next, time + flags.dedup_interval.ns())) {
+    return;
+  }
+
+  deduplicator->sweep(
+      time,
+      [this](const Deduplicator::Key& key, uint64_t repeated) {
+        report(key, repeated);
+      });
+}
+
+
+// NOTE: glog calls this after every log line, so this only waits
+// if the last log line of this thread was FATAL.
+void FileSink::WaitTillSent()
+{
+  if (fatalSink != this) {
+    return;
+  }
+
+  fatalSink = nullptr;
+
+  const auto deadline =
+    std::chrono::steady_clock::now() + FATAL_FLUSH_TIMEOUT;
+
+  while (flushed.load() <= fatalPosition &&
+         std::chrono::steady_clock::now() < deadline) {
+    wake();
+    std::this_thread::sleep_for(OVERFLOW_WAIT_INTERVAL);
+  }
+}
+
+
+void FileSink::flush()
+{
+  std::vector<std::string> batch(BATCH_SIZE);
+  std::vector<struct iovec> iov(BATCH_SIZE);
+
+  while (true) {
+    size_t count = 0;
+    size_t length = 0;
+    while (count < BATCH_SIZE && buffer->pop(&batch[count])) {
+      iov[count].iov_base = const_cast<char*>(batch[count].data());
+      iov[count].iov_len = batch[count].size();
+      length += batch[count].size();
+      count++;
+    }
+
+    if (count > 0) {
+      writeAll(logFd, iov.data(), count);
+      flushed.store(buffer->popped());
+      written(length);
+      continue;
+    }
+
+    // Log the discarded lines once the queue has drained.
+    const uint64_t dropped = droppedPending.exchange(0);
+    if (dropped > 0) {
+      const time_t now = ::time(nullptr);
+      struct ::tm time;
+      ::localtime_r(&now, &time);
+
+      const std::string message = "Dropped " + stringify(dropped) +
+        " log lines, as the queue was full\n";
+
+      std::string notice;
+      format(
+          &notice,
+          google::GLOG_WARNING,
+          "logsink.cpp",
+          __LINE__,
+          &time,
+          message.data(),
+          message.size());
+
+      iov[0].iov_base = const_cast<char*>(notice.data());
+      iov[0].iov_len = notice.size();
+
+      writeAll(logFd, iov.data(), 1);
+      written(notice.size());
+      continue;
+    }
+
+    if (stopping.load()) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(wakeupMutex);
+    sleeping.store(true);
+
+    // Log lines queued before `sleeping` was set did not wake us up.
+    if (buffer->empty() && !stopping.load()) {
+      wakeup.wait_for(lock, WRITER_WAIT_INTERVAL);
+    }
+
+    sleeping.store(false);
+  }
+}
+
+
+void FileSink::wake()
+{
+  std::lock_guard<std::mutex> lock(wakeupMutex);
+  wakeup.notify_one();
+}
+
+
+void FileSink::written(size_t length)
+{
+  if (!rotating) {
+    return;
+  }
+
+  const uint64_t size = bytesWritten.fetch_add(length) + length;
+  if (!reopenRequested.load() && !expired(size)) {
+    return;
+  }
+
+  // Other threads keep writing to the current log file while one of
+  // them rotates it.
+  std::unique_lock<std::recursive_mutex> lock(mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
+
+  if (reopenSignal.isSome() && reopenRequested.exchange(false)) {
+    reopen();
+    return;
+  }
+
+  // Check again, as another thread may have rotated in the meantime.
+  if (expired(bytesWritten.load())) {
+    rotator->rotate();
+    reopen();
+
+    if (flags.compress) {
+      rotator->compress();
+    }
+  }
+}
+
+
+bool FileSink::expired(uint64_t size) const
+{
+  if (rotator.get() == nullptr) {
+    return false;
+  }
+
+  if (flags.max_size.bytes() > 0 && size >= flags.max_size.bytes()) {
+    return true;
+  }
+
+  return flags.max_age > Duration::zero() &&
+    now() - openedAt.load() >= flags.max_age.ns();
+}
+
+
+void FileSink::reopen()
+{
+  Try<int> open = os::open(
+      flags.output_file,
+      O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+      S_IRUSR | S_IWUSR | S_IRGRP);
+
+  if (open.isError()) {
+    std::cerr << "Failed to reopen '" << flags.output_file << "': "
+              << open.error() << std::endl;
+    return;
+  }
+
+  // The new file takes over the descriptor number, so that concurrent
+  // writes go to either file, but never to a closed descriptor.
+  if (::dup3(open.get(), logFd, O_CLOEXEC) < 0) {
+    std::cerr << "Failed to reopen '" << flags.output_file << "': "
+              << ErrnoError().message << std::endl;
+  }
+
+  os::close(open.get());
+
+  struct stat s;
+  bytesWritten.store(::fstat(logFd, &s) == 0 ? s.st_size : 0);
+  openedAt.store(now());
+}
 
 
 // An anonymous module that owns and hooks up a new LogSink to glog.
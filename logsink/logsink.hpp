@@ -1,14 +1,29 @@
 #ifndef __LOGSINK_LOGSINK_HPP__
 #define __LOGSINK_LOGSINK_HPP__
 
+#include <signal.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 
 #include <glog/logging.h>
 
+#include <stout/bytes.hpp>
+#include <stout/duration.hpp>
+#include <stout/error.hpp>
 #include <stout/flags.hpp>
+#include <stout/option.hpp>
 #include <stout/synchronized.hpp>
 
+#include "deduplicator.hpp"
+#include "ring_buffer.hpp"
+#include "rotator.hpp"
+
 
 namespace mesos {
 namespace logsink {
@@ -24,9 +39,117 @@ struct Flags : public virtual flags::FlagsBase
         "Where the LogSink should write all logs.\n"
         "If the file already exists, we will append to the file.\n"
         "If no file exists, a new one will be created.");
+
+    add(&Flags::async,
+        "async",
+        "Whether logs are written to '--output_file' by a background\n"
+        "thread, instead of by the thread which logs.  The logs are queued\n"
+        "in memory, and written out in batches.  FATAL logs are always\n"
+        "written out before the process aborts.",
+        false);
+
+    add(&Flags::async_buffer_size,
+        "async_buffer_size",
+        "With '--async', the number of log lines which can be queued\n"
+        "before '--async_overflow_policy' applies.  This is rounded up\n"
+        "to the next power of two.",
+        8192,
+        [](size_t value) -> Option<Error> {
+          if (value == 0) {
+            return Error("Expected --async_buffer_size of at least 1");
+          }
+
+          return None();
+        });
+
+    add(&Flags::async_overflow_policy,
+        "async_overflow_policy",
+        "With '--async', what happens to log lines which do not fit into\n"
+        "the queue.  'block' waits for the background thread to make\n"
+        "room.  'drop' discards the line, and the number of discarded\n"
+        "lines is logged later on.  'spill' writes the line from the\n"
+        "thread which logs, like without '--async', so it may be written\n"
+        "ahead of queued lines.",
+        "block",
+        [](const std::string& value) -> Option<Error> {
+          if (value != "block" && value != "drop" && value != "spill") {
+            return Error("Invalid async overflow policy: " + value);
+          }
+
+          return None();
+        });
+
+    add(&Flags::max_size,
+        "max_size",
+        "Once '--output_file' has grown to this size, it is rotated:\n"
+        "it is renamed to '<output_file>.1' and a new file is opened.\n"
+        "Previously rotated files are shifted to '<output_file>.2' and\n"
+        "so on.  Zero disables size based rotation.",
+        Bytes(0));
+
+    add(&Flags::max_age,
+        "max_age",
+        "Once the LogSink has been writing to '--output_file' for this\n"
+        "long, the file is rotated, see '--max_size'.  Zero disables\n"
+        "time based rotation.",
+        Duration::zero());
+
+    add(&Flags::max_files,
+        "max_files",
+        "The number of rotated files to keep, see '--max_size'.",
+        10);
+
+    add(&Flags::compress,
+        "compress",
+        "Whether rotated files are gzip compressed, by a background\n"
+        "thread, to '<output_file>.<N>.gz'.",
+        false);
+
+    add(&Flags::reopen_signal,
+        "reopen_signal",
+        "The signal upon which the LogSink reopens '--output_file', for\n"
+        "use with external log rotation that moves the file away.\n"
+        "One of 'SIGHUP', 'SIGUSR1', or 'SIGUSR2'.  The file is reopened\n"
+        "once the next log line has been written.\n"
+        "NOTE: This replaces any handler the process has for the signal.",
+        [](const Option<std::string>& value) -> Option<Error> {
+          if (value.isSome() &&
+              value.get() != "SIGHUP" &&
+              value.get() != "SIGUSR1" &&
+              value.get() != "SIGUSR2") {
+            return Error("Invalid reopen signal: " + value.get());
+          }
+
+          return None();
+        });
+
+    add(&Flags::dedup_interval,
+        "dedup_interval",
+        "Collapses log storms: of the log lines from the same severity,\n"
+        "file, and line, only '--dedup_burst' are written per interval.\n"
+        "The others are counted, and replaced by a single 'Last message\n"
+        "repeated N more times' line once the interval has passed.\n"
+        "FATAL log lines are never suppressed.  Zero disables this.",
+        Duration::zero());
+
+    add(&Flags::dedup_burst,
+        "dedup_burst",
+        "The number of log lines from the same severity, file, and line\n"
+        "written per '--dedup_interval'.",
+        10);
   }
 
   std::string output_file;
+  bool async;
+  size_t async_buffer_size;
+  std::string async_overflow_policy;
+  Bytes max_size;
+  Duration max_age;
+  size_t max_files;
+  bool compress;
+  Option<std::string> reopen_signal;
+  Duration dedup_interval;
+  size_t dedup_burst;
 };
 
 
@@ -51,10 +174,72 @@ public:
 
   virtual void WaitTillSent();
 
+  // The number of log lines discarded due to `--async_overflow_policy`.
+  uint64_t dropped() const { return droppedTotal.load(); }
+
 protected:
+  // Formats and writes out (or queues) a log line.
+  void write(
+      google::LogSeverity severity,
+      const char* file,
+      int line,
+      const struct ::tm* time,
+      const char* message,
+      size_t length);
+
+  // Writes a summary of the log lines suppressed for `key`.
+  void report(const Deduplicator::Key& key, uint64_t repeated);
+
+  // Reports the suppressed log lines of all keys which have been quiet
+  // for a while, at most once per `--dedup_interval`.
+  void sweep(int64_t time);
+
+  // Runs on the background `writer` thread with `--async`.
+  void flush();
+
+  // Wakes up the `writer`, if it is waiting for log lines.
+  void wake();
+
+  // Accounts for `length` bytes written to the log file, and rotates
+  // or reopens the log file if that is due.
+  void written(size_t length);
+
+  // Whether the log file, now `size` bytes large, is due for rotation.
+  bool expired(uint64_t size) const;
+
+  // Opens `--output_file` in place of the current log file.
+  void reopen();
+
   Flags flags;
   int logFd;
   std::recursive_mutex mutex;
+
+  // Used for `--async`. The `writer` drains the `buffer`, and counts
+  // the log lines it has written out in `flushed`. The `writer` waits
+  // on `wakeup` while `sleeping`.
+  std::unique_ptr<RingBuffer<std::string>> buffer;
+  std::thread writer;
+  std::atomic<uint64_t> flushed;
+  std::atomic<uint64_t> droppedPending;
+  std::atomic<uint64_t> droppedTotal;
+  std::atomic<bool> sleeping;
+  std::atomic<bool> stopping;
+  std::mutex wakeupMutex;
+  std::condition_variable wakeup;
+
+  // Used for `--max_size`, `--max_age`, and `--reopen_signal`. Only one
+  // thread at a time rotates or reopens the log file, while holding the
+  // `mutex`. The `openedAt` time is in nanoseconds of the steady clock.
+  bool rotating;
+  std::unique_ptr<LogRotator> rotator;
+  std::atomic<uint64_t> bytesWritten;
+  std::atomic<int64_t> openedAt;
+  Option<int> reopenSignal;
+  struct sigaction previousAction;
+
+  // Used for `--dedup_interval`.
+  std::unique_ptr<Deduplicator> deduplicator;
+  std::atomic<int64_t> nextSweep;
 };
 
 } // namespace logsink {
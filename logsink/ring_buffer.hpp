@@ -0,0 +1,140 @@
+#ifndef __LOGSINK_RING_BUFFER_HPP__
+#define __LOGSINK_RING_BUFFER_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+
+namespace mesos {
+namespace logsink {
+
+// A bounded, lock-free queue with many producers and a single consumer.
+//
+// Every slot carries a sequence number, which tells producers whether
+// the slot is free and the consumer whether it has been filled. The
+// producers claim slots by advancing `head`; a claimed slot is filled
+// without holding up producers of the following slots.
+//
+// NOTE: Elements are popped in the order in which their slots were
+// claimed, i.e. the `position` returned by `push`.
+template <typename T>
+class RingBuffer
+{
+public:
+  // The `capacity` is rounded up to the next power of two.
+  explicit RingBuffer(size_t capacity)
+    : mask(roundUp(capacity) - 1),
+      slots(new Slot[mask + 1]),
+      head(0),
+      tail(0)
+  {
+    for (size_t i = 0; i <= mask; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Moves or copies the `value` into the queue, unless the queue is
+  // full. If given, `position` is set to the position of the `value`
+  // in the sequence of all values pushed so far.
+  template <typename U>
+  bool push(U&& value, uint64_t* position = nullptr)
+  {
+    uint64_t current = head.load(std::memory_order_relaxed);
+
+    while (true) {
+      Slot& slot = slots[current & mask];
+      const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      const int64_t difference =
+        static_cast<int64_t>(sequence) - static_cast<int64_t>(current);
+
+      if (difference == 0) {
+        // The slot is free, try to claim it.
+        if (head.compare_exchange_weak(
+                current, current + 1, std::memory_order_relaxed)) {
+          slot.value = std::forward<U>(value);
+          slot.sequence.store(current + 1, std::memory_order_release);
+
+          if (position != nullptr) {
+            *position = current;
+          }
+
+          return true;
+        }
+      } else if (difference < 0) {
+        // The slot still holds a value from the previous lap.
+        return false;
+      } else {
+        // Another producer claimed the slot first.
+        current = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Swaps the oldest value out of the queue, if it has been filled.
+  // The slot is left with the previous `value`, so that its resources
+  // (e.g. the memory of a string) are reused by a later `push`.
+  // NOTE: This may only be called by the consumer.
+  bool pop(T* value)
+  {
+    Slot& slot = slots[tail & mask];
+    if (slot.sequence.load(std::memory_order_acquire) != tail + 1) {
+      return false;
+    }
+
+    std::swap(*value, slot.value);
+
+    // Hand the slot to the producers of the next lap.
+    slot.sequence.store(tail + mask + 1, std::memory_order_release);
+    tail++;
+
+    return true;
+  }
+
+  // Whether there is nothing to pop.
+  // NOTE: This may only be called by the consumer.
+  bool empty() const
+  {
+    return slots[tail & mask].sequence.load(std::memory_order_acquire) !=
+      tail + 1;
+  }
+
+  // The number of values popped so far.
+  // NOTE: This may only be called by the consumer.
+  uint64_t popped() const { return tail; }
+
+  size_t capacity() const { return mask + 1; }
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t> sequence;
+    T value;
+  };
+
+  static size_t roundUp(size_t capacity)
+  {
+    size_t result = 1;
+    while (result < capacity) {
+      result <<= 1;
+    }
+
+    return result;
+  }
+
+  const size_t mask;
+  std::unique_ptr<Slot[]> slots;
+
+  // The producers and the consumer are kept on separate cache lines,
+  // so that they do not contend for them.
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) uint64_t tail;
+};
+
+} // namespace logsink {
+} // namespace mesos {
+
+#endif // __LOGSINK_RING_BUFFER_HPP__
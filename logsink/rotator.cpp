@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stout/error.hpp>
+#include <stout/foreach.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/close.hpp>
+#include <stout/os/exists.hpp>
+#include <stout/os/open.hpp>
+#include <stout/os/rename.hpp>
+#include <stout/os/rm.hpp>
+
+#include "rotator.hpp"
+
+
+namespace mesos {
+namespace logsink {
+
+namespace {
+
+// The size of the chunks in which rotated files are compressed.
+const size_t COMPRESSION_CHUNK_SIZE = 64 * 1024;
+
+
+// Writes a gzip compressed copy of `source` to `target`.
+Try<Nothing> compressFile(const std::string& source, const std::string& target)
+{
+  Try<int> in = os::open(source, O_RDONLY | O_CLOEXEC);
+  if (in.isError()) {
+    return Error("Failed to open '" + source + "': " + in.error());
+  }
+
+  gzFile out = gzopen(target.c_str(), "wb");
+  if (out == nullptr) {
+    os::close(in.get());
+    return Error("Failed to open '" + target + "'");
+  }
+
+  std::vector<char> buffer(COMPRESSION_CHUNK_SIZE);
+
+  Option<Error> error = None();
+  while (true) {
+    ssize_t length = ::read(in.get(), buffer.data(), buffer.size());
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (length < 0) {
+      error = ErrnoError("Failed to read '" + source + "'");
+      break;
+    }
+
+    if (length == 0) {
+      break;
+    }
+
+    if (gzwrite(out, buffer.data(), length) != length) {
+      error = Error("Failed to write '" + target + "'");
+      break;
+    }
+  }
+
+  os::close(in.get());
+
+  if (gzclose(out) != Z_OK && error.isNone()) {
+    error = Error("Failed to close '" + target + "'");
+  }
+
+  if (error.isSome()) {
+    return error.get();
+  }
+
+  return Nothing();
+}
+
+} // namespace {
+
+
+LogRotator::LogRotator(const std::string& _filename, size_t _maxFiles)
+  : filename(_filename),
+    maxFiles(_maxFiles) {}
+
+
+LogRotator::~LogRotator()
+{
+  if (compressor.joinable()) {
+    compressor.join();
+  }
+}
+
+
+void LogRotator::rotate()
+{
+  // The file being compressed is about to be shifted.
+  if (compressor.joinable()) {
+    compressor.join();
+  }
+
+  if (maxFiles == 0) {
+    Try<Nothing> rm = os::rm(filename);
+    if (rm.isError()) {
+      std::cerr << "Failed to remove '" << filename << "': "
+                << rm.error() << std::endl;
+    }
+
+    return;
+  }
+
+  // Rotated files may or may not have been compressed.
+  const std::vector<std::string> suffixes = {"", GZIP_SUFFIX};
+
+  // Make room for the newly rotated file by shifting the others
+  // by one, starting with the oldest one, which is removed.
+  for (size_t index = maxFiles; index > 0; index--) {
+    foreach (const std::string& suffix, suffixes) {
+      const std::string current = path(index) + suffix;
+      if (!os::exists(current)) {
+        continue;
+      }
+
+      Try<Nothing> result = index == maxFiles
+        ? os::rm(current)
+        : os::rename(current, path(index + 1) + suffix);
+
+      if (result.isError()) {
+        std::cerr << "Failed to rotate '" << current << "': "
+                  << result.error() << std::endl;
+      }
+    }
+  }
+
+  Try<Nothing> rename = os::rename(filename, path(1));
+  if (rename.isError()) {
+    std::cerr << "Failed to rename '" << filename << "' to '" << path(1)
+              << "': " << rename.error() << std::endl;
+  }
+}
+
+
+void LogRotator::compress()
+{
+  if (maxFiles == 0 || !os::exists(path(1))) {
+    return;
+  }
+
+  const std::string rotated = path(1);
+
+  compressor = std::thread([rotated]() {
+    // NOTE: The compressed file is written under a temporary name, so
+    // a partially compressed file is never mistaken for a rotated one.
+    const std::string compressed = rotated + GZIP_SUFFIX;
+    const std::string temporary = compressed + ".tmp";
+
+    Try<Nothing> result = compressFile(rotated, temporary);
+    if (result.isError()) {
+      std::cerr << "Failed to compress '" << rotated << "': "
+                << result.error() << std::endl;
+
+      os::rm(temporary);
+      return;
+    }
+
+    result = os::rename(temporary, compressed);
+    if (result.isError()) {
+      std::cerr << "Failed to rename '" << temporary << "' to '"
+                << compressed << "': " << result.error() << std::endl;
+
+      os::rm(temporary);
+      return;
+    }
+
+    os::rm(rotated);
+  });
+}
+
+
+std::string LogRotator::path(size_t index) const
+{
+  return filename + "." + stringify(index);
+}
+
+} // namespace logsink {
+} // namespace mesos {
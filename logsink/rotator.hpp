@@ -0,0 +1,55 @@
+#ifndef __LOGSINK_ROTATOR_HPP__
+#define __LOGSINK_ROTATOR_HPP__
+
+#include <string>
+#include <thread>
+
+
+namespace mesos {
+namespace logsink {
+
+// Suffix of rotated log files which have been compressed.
+const std::string GZIP_SUFFIX = ".gz";
+
+
+// Numbers, prunes, and optionally compresses rotated log files.
+//
+// Rotated files are named like the ones produced by `logrotate`:
+// `<filename>.1` (or `<filename>.1.gz`) is the most recent one, and
+// at most `maxFiles` rotated files are kept.
+//
+// NOTE: This is not thread-safe; the `FileSink` serializes rotations.
+// Errors are printed to stderr and otherwise ignored, as logging them
+// from inside the LogSink would recurse into it.
+class LogRotator
+{
+public:
+  LogRotator(const std::string& _filename, size_t _maxFiles);
+
+  // Waits for a pending compression, if any.
+  ~LogRotator();
+
+  // Shifts the previously rotated files by one, and renames the log
+  // file to `<filename>.1`. The caller is expected to reopen the log
+  // file afterwards.
+  void rotate();
+
+  // Compresses `<filename>.1` on a background thread.
+  void compress();
+
+private:
+  // Returns the path of the `index`-th rotated file, without
+  // the `GZIP_SUFFIX`.
+  std::string path(size_t index) const;
+
+  const std::string filename;
+  const size_t maxFiles;
+
+  // Compresses the most recently rotated file, off the write path.
+  std::thread compressor;
+};
+
+} // namespace logsink {
+} // namespace mesos {
+
+#endif // __LOGSINK_ROTATOR_HPP__
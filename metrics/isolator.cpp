@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <deque>
+#include <list>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <mesos/http.hpp>
@@ -10,18 +14,31 @@
 #include <mesos/module/module.hpp>
 
 #include <process/address.hpp>
+#include <process/clock.hpp>
 #include <process/collect.hpp>
 #include <process/defer.hpp>
+#include <process/delay.hpp>
 #include <process/future.hpp>
+#include <process/owned.hpp>
 #include <process/process.hpp>
+#include <process/timer.hpp>
+
+#include <process/metrics/counter.hpp>
+#include <process/metrics/metrics.hpp>
+#include <process/metrics/pull_gauge.hpp>
+#include <process/metrics/timer.hpp>
 
 #include <stout/assert.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
 #include <stout/hashset.hpp>
 #include <stout/ip.hpp>
+#include <stout/lambda.hpp>
 #include <stout/nothing.hpp>
 #include <stout/numify.hpp>
 #include <stout/option.hpp>
 #include <stout/os.hpp>
+#include <stout/os/fsync.hpp>
 #include <stout/path.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/strings.hpp>
@@ -46,18 +63,87 @@ using mesos::slave::ContainerLaunchInfo;
 using mesos::slave::ContainerState;
 using mesos::slave::Isolator;
 
+using mesos::modules::metrics::ContainerStartBatchRequest;
+using mesos::modules::metrics::ContainerStartBatchResponse;
 using mesos::modules::metrics::ContainerStartRequest;
 using mesos::modules::metrics::ContainerStartResponse;
+using mesos::modules::metrics::ContainerStopBatchRequest;
+using mesos::modules::metrics::StatsdBindRequest;
+using mesos::modules::metrics::StatsdLease;
+using mesos::modules::metrics::StatsdLeaseRequest;
+using mesos::modules::metrics::StatsdLeaseResponse;
 
 namespace mesosphere {
 namespace dcos {
 namespace metrics {
 
+// Suffix of a cleanup checkpoint which is still being written.
+const string TEMPORARY_SUFFIX = ".tmp";
+
+// Protobuf responses are preferred, see `MetricsIsolatorProcess::post`.
+const string ACCEPT =
+  string(APPLICATION_PROTOBUF) + ", " + APPLICATION_JSON + ";q=0.9";
+
+
+static bool isProtobuf(const http::Response& response)
+{
+  Option<string> contentType = response.headers.get("Content-Type");
+
+  return contentType.isSome() &&
+    strings::startsWith(contentType.get(), APPLICATION_PROTOBUF);
+}
+
+
+// Parses the body of the `response`, which is either serialized protobuf
+// or JSON, depending on the 'Content-Type' of the `response`.
+template <typename T>
+Try<T> decode(const http::Response& response)
+{
+  if (!isProtobuf(response)) {
+    return parse<T>(response.body);
+  }
+
+  T message;
+  if (!message.ParseFromString(response.body)) {
+    return Error("Error parsing protobuf");
+  }
+
+  return message;
+}
+
+
+// Flushes the file or directory at `path` to disk.
+static Try<Nothing> sync(const string& path)
+{
+  Try<int_fd> fd = os::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd.isError()) {
+    return Error("Failed to open '" + path + "': " + fd.error());
+  }
+
+  Try<Nothing> fsync = os::fsync(fd.get());
+  os::close(fd.get());
+
+  if (fsync.isError()) {
+    return Error("Failed to fsync '" + path + "': " + fsync.error());
+  }
+
+  return Nothing();
+}
+
 class MetricsIsolatorProcess
   : public process::Process<MetricsIsolatorProcess>
 {
 public:
-  MetricsIsolatorProcess(const isolator::Flags& _flags) : flags(_flags)
+  MetricsIsolatorProcess(const isolator::Flags& _flags)
+    : metrics(this),
+      flags(_flags),
+      nextConnectionId(0),
+      leasing(false),
+      draining(false),
+      cleanupBackoff(_flags.cleanup_backoff),
+      protobuf(false),
+      protobufRejected(false),
+      inflight(0)
   {
     // Set `serviceScheme` based on flags.
     ASSERT(flags.service_scheme.isSome());
@@ -111,11 +197,35 @@ public:
     serviceEndpoint = flags.service_endpoint.get();
   }
 
+  virtual void initialize()
+  {
+    if (flags.statsd_pool_size > 0) {
+      refill();
+    }
+
+    if (flags.cleanup_queue_dir.isSome()) {
+      recoverStops();
+    }
+  }
+
+  virtual Future<Option<ContainerLaunchInfo>> prepare(
+      const ContainerID& containerId,
+      const slave::ContainerConfig& containerConfig)
+  {
+    return metrics.prepare_latency.time(
+        _prepare(containerId, containerConfig));
+  }
+
+  virtual Future<Nothing> cleanup(const ContainerID& containerId)
+  {
+    return metrics.cleanup_latency.time(_cleanup(containerId));
+  }
+
   // Let the metrics service know about the container being launched.
   // In the response, grab the STATSD_UDP_HOST and STATSD_UDP_PORT
   // pair being returned and set it in the environment of the
   // `ContainerLaunchInfo` returned from this function.
-  virtual Future<Option<ContainerLaunchInfo>> prepare(
+  Future<Option<ContainerLaunchInfo>> _prepare(
       const ContainerID& containerId,
       const slave::ContainerConfig& containerConfig)
   {
@@ -126,14 +236,37 @@ public:
       // Add this container ID to the set of debug containers so that we will
       // not make a DELETE request for it during the cleanup phase.
       debugContainers.emplace(containerId);
+      ++metrics.debug_containers_skipped;
 
       return None();
     }
 
+    expireLeases();
+
+    if (!statsdPool.empty()) {
+      ++metrics.statsd_pool_hits;
+      return takeLease(containerId);
+    }
+
+    if (flags.statsd_pool_size > 0) {
+      ++metrics.statsd_pool_misses;
+      refill();
+    }
+
+    return start(containerId);
+  }
+
+  // Starts a listener for the container, without the pool.
+  Future<Option<ContainerLaunchInfo>> start(const ContainerID& containerId)
+  {
+    if (flags.batch_window > Duration::zero()) {
+      return batchStart(containerId);
+    }
+
     ContainerStartRequest containerStartRequest;
     containerStartRequest.set_container_id(containerId.value());
 
-    return send(containerStartRequest)
+    return post(serviceEndpoint, containerStartRequest)
       .onAny(defer(
         self(),
         [=](const Future<http::Response>& response) -> Future<http::Response> {
@@ -162,46 +295,54 @@ public:
           }
 
           Try<ContainerStartResponse> containerStartResponse =
-            parse<ContainerStartResponse>(response.body);
+            decode<ContainerStartResponse>(response);
           if (containerStartResponse.isError()) {
             return Failure("Error parsing the 'ContainerStartResponse' body for"
                            " container '" + containerId.value() + "': " +
                            containerStartResponse.error());
           }
 
-          // TODO(klueska): For now, we require both `statsd_host` and
-          // `statsd_port` to be set. This may not be true in the future.
-          // We need to revisit this if/when this changes.
-          if (!containerStartResponse->has_statsd_host() ||
-              !containerStartResponse->has_statsd_port()) {
-            return Failure("Missing 'statsd_host' or 'statsd_port' field in"
-                           " 'ContainerStartResponse' for container"
-                           " '" + containerId.value() + "'");
+          Try<ContainerLaunchInfo> launchInfo =
+            createLaunchInfo(containerId, containerStartResponse.get());
+          if (launchInfo.isError()) {
+            return Failure(launchInfo.error());
           }
 
-          Environment environment;
-          Environment::Variable* variable;
-          variable = environment.add_variables();
-          variable->set_name("STATSD_UDP_HOST");
-          variable->set_value(containerStartResponse->statsd_host());
-          variable = environment.add_variables();
-          variable->set_name("STATSD_UDP_PORT");
-          variable->set_value(stringify(containerStartResponse->statsd_port()));
-
-          ContainerLaunchInfo launchInfo;
-          launchInfo.mutable_environment()->CopyFrom(environment);
-
-          return launchInfo;
+          return launchInfo.get();
         }));
   }
 
-  virtual Future<Nothing> cleanup(const ContainerID& containerId)
+  Future<Nothing> _cleanup(const ContainerID& containerId)
   {
     if (debugContainers.contains(containerId)) {
       debugContainers.erase(containerId);
       return Nothing();
     }
 
+    if (flags.cleanup_queue_dir.isSome()) {
+      enqueueStop(containerId);
+      return Nothing();
+    }
+
+    // The listener of the container is only stopped once it has been
+    // bound to the container.
+    if (bindings.contains(containerId)) {
+      Future<Nothing> binding = bindings.at(containerId);
+      bindings.erase(containerId);
+
+      return binding
+        .then(defer(self(), &Self::__cleanup, containerId));
+    }
+
+    return __cleanup(containerId);
+  }
+
+  Future<Nothing> __cleanup(const ContainerID& containerId)
+  {
+    if (flags.batch_window > Duration::zero()) {
+      return batchStop(containerId);
+    }
+
     // If a failed future is returned at any point during the sending of the
     // DELETE request, we do not want to surface that failure to the
     // containerizer, since it would prevent other isolators from cleaning up
@@ -230,6 +371,602 @@ public:
           }));
   }
 
+  // Binds a leased StatsD listener to the container, and hands it to
+  // the container once it is bound. If the lease cannot be bound, e.g.
+  // since the metrics service has expired it, a listener is started
+  // for the container as if the pool was empty.
+  Future<Option<ContainerLaunchInfo>> takeLease(const ContainerID& containerId)
+  {
+    const StatsdLease lease = statsdPool.front().lease;
+    statsdPool.pop_front();
+
+    refill();
+
+    StatsdBindRequest bindRequest;
+    bindRequest.set_lease_id(lease.lease_id());
+    bindRequest.set_container_id(containerId.value());
+
+    Future<Future<http::Response>> bind = process::await(
+        post(serviceEndpoint + "/lease/bind", bindRequest));
+
+    // Like `cleanup`, the binding itself never fails.
+    bindings[containerId] = bind
+      .then([]() { return Nothing(); });
+
+    return bind
+      .then(defer(
+          self(),
+          [=](const Future<http::Response>& response)
+            -> Future<Option<ContainerLaunchInfo>> {
+            if (!response.isReady()) {
+              LOG(WARNING)
+                << "Failed binding StatsD lease '" << lease.lease_id() << "'"
+                << " to container '" << containerId.value() << "': "
+                << (response.isFailed() ?
+                      response.failure() : "Future discarded");
+
+              return start(containerId);
+            }
+
+            if (response->code != http::Status::ACCEPTED) {
+              LOG(WARNING)
+                << "Received unexpected response code"
+                << " '" << stringify(response->code) << "' when"
+                << " binding StatsD lease '" << lease.lease_id() << "'"
+                << " to container '" << containerId.value() << "'";
+
+              return start(containerId);
+            }
+
+            ContainerStartResponse containerStartResponse;
+            containerStartResponse.set_statsd_host(lease.statsd_host());
+            containerStartResponse.set_statsd_port(lease.statsd_port());
+
+            Try<ContainerLaunchInfo> launchInfo =
+              createLaunchInfo(containerId, containerStartResponse);
+            if (launchInfo.isError()) {
+              return Failure(launchInfo.error());
+            }
+
+            return launchInfo.get();
+          }));
+  }
+
+  // Drops the leases which have been in the pool for longer than
+  // `--statsd_lease_ttl`, as the metrics service might have expired
+  // them. The pool is refilled with new leases.
+  void expireLeases()
+  {
+    const Time now = Clock::now();
+
+    bool expired = false;
+    while (!statsdPool.empty() && statsdPool.front().expires <= now) {
+      VLOG(1) << "Dropping expired StatsD lease '"
+              << statsdPool.front().lease.lease_id() << "'";
+
+      statsdPool.pop_front();
+      expired = true;
+    }
+
+    if (expired) {
+      refill();
+    }
+  }
+
+  // Leases StatsD listeners until the pool is full, unless a lease
+  // request is in flight already. Failed lease requests are retried
+  // by the next `prepare` which finds the pool short.
+  void refill()
+  {
+    if (leasing || statsdPool.size() >= flags.statsd_pool_size) {
+      return;
+    }
+
+    leasing = true;
+
+    StatsdLeaseRequest leaseRequest;
+    leaseRequest.set_count(flags.statsd_pool_size - statsdPool.size());
+
+    post(serviceEndpoint + "/lease", leaseRequest)
+      .onAny(defer(self(), &Self::leased, lambda::_1));
+  }
+
+  void leased(const Future<http::Response>& response)
+  {
+    leasing = false;
+
+    if (!response.isReady()) {
+      LOG(WARNING)
+        << "Failed leasing StatsD listeners: "
+        << (response.isFailed() ? response.failure() : "Future discarded");
+      return;
+    }
+
+    if (response->code != http::Status::CREATED) {
+      LOG(WARNING)
+        << "Received unexpected response code"
+        << " '" << stringify(response->code) << "' when"
+        << " leasing StatsD listeners";
+      return;
+    }
+
+    Try<StatsdLeaseResponse> leaseResponse =
+      decode<StatsdLeaseResponse>(response.get());
+    if (leaseResponse.isError()) {
+      LOG(WARNING)
+        << "Error parsing the 'StatsdLeaseResponse' body: "
+        << leaseResponse.error();
+      return;
+    }
+
+    const Time expires = Clock::now() + flags.statsd_lease_ttl;
+
+    foreach (const StatsdLease& lease, leaseResponse->leases()) {
+      statsdPool.push_back(PooledLease{lease, expires});
+    }
+  }
+
+  double _statsd_pool_available()
+  {
+    return statsdPool.size();
+  }
+
+  // A container waiting for the next batch request, along with the
+  // promise of the container's `prepare` or `cleanup`.
+  typedef std::pair<ContainerID, Owned<Promise<Option<ContainerLaunchInfo>>>>
+    PendingStart;
+
+  typedef std::pair<ContainerID, Owned<Promise<Nothing>>> PendingStop;
+
+  // Sets the STATSD_UDP_HOST and STATSD_UDP_PORT returned by the metrics
+  // service in the environment of the container.
+  Try<ContainerLaunchInfo> createLaunchInfo(
+      const ContainerID& containerId,
+      const ContainerStartResponse& containerStartResponse)
+  {
+    // TODO(klueska): For now, we require both `statsd_host` and
+    // `statsd_port` to be set. This may not be true in the future.
+    // We need to revisit this if/when this changes.
+    if (!containerStartResponse.has_statsd_host() ||
+        !containerStartResponse.has_statsd_port()) {
+      return Error("Missing 'statsd_host' or 'statsd_port' field in"
+                   " 'ContainerStartResponse' for container"
+                   " '" + containerId.value() + "'");
+    }
+
+    Environment environment;
+    Environment::Variable* variable;
+    variable = environment.add_variables();
+    variable->set_name("STATSD_UDP_HOST");
+    variable->set_value(containerStartResponse.statsd_host());
+    variable = environment.add_variables();
+    variable->set_name("STATSD_UDP_PORT");
+    variable->set_value(stringify(containerStartResponse.statsd_port()));
+
+    ContainerLaunchInfo launchInfo;
+    launchInfo.mutable_environment()->CopyFrom(environment);
+
+    return launchInfo;
+  }
+
+  // Adds the container to the next batch start request. The batch is
+  // sent once it is full, or after the `--batch_window`.
+  Future<Option<ContainerLaunchInfo>> batchStart(const ContainerID& containerId)
+  {
+    Owned<Promise<Option<ContainerLaunchInfo>>> promise(
+        new Promise<Option<ContainerLaunchInfo>>());
+
+    pendingStarts.push_back(std::make_pair(containerId, promise));
+
+    if (pendingStarts.size() >= flags.batch_max_size) {
+      flushStarts();
+    } else if (startTimer.isNone()) {
+      startTimer = delay(flags.batch_window, self(), &Self::flushStarts);
+    }
+
+    return promise->future();
+  }
+
+  void flushStarts()
+  {
+    if (startTimer.isSome()) {
+      Clock::cancel(startTimer.get());
+      startTimer = None();
+    }
+
+    if (pendingStarts.empty()) {
+      return;
+    }
+
+    vector<PendingStart> batch;
+    std::swap(batch, pendingStarts);
+
+    ContainerStartBatchRequest batchRequest;
+    foreach (const PendingStart& pending, batch) {
+      batchRequest.add_containers()->set_container_id(pending.first.value());
+    }
+
+    post(serviceEndpoint + "/batch/start", batchRequest)
+      .onAny(defer(self(), &Self::startedBatch, batch, lambda::_1));
+  }
+
+  // Fans the batch start response out to the containers of the batch.
+  void startedBatch(
+      const vector<PendingStart>& batch,
+      const Future<http::Response>& response)
+  {
+    Option<string> error = None();
+    ContainerStartBatchResponse batchResponse;
+
+    if (!response.isReady()) {
+      error = "Error posting 'ContainerStartBatchRequest': " +
+        (response.isFailed() ? response.failure() : "Future discarded");
+    } else if (response->code != http::Status::OK) {
+      error = "Received unexpected response code '" +
+        stringify(response->code) + "' when posting"
+        " 'ContainerStartBatchRequest'";
+    } else {
+      Try<ContainerStartBatchResponse> parsed =
+        decode<ContainerStartBatchResponse>(response.get());
+
+      if (parsed.isError()) {
+        error = "Error parsing the 'ContainerStartBatchResponse' body: " +
+          parsed.error();
+      } else {
+        batchResponse = parsed.get();
+      }
+    }
+
+    hashmap<string, ContainerStartBatchResponse::Container> containers;
+    foreach (const ContainerStartBatchResponse::Container& container,
+             batchResponse.containers()) {
+      containers[container.container_id()] = container;
+    }
+
+    foreach (const PendingStart& pending, batch) {
+      const ContainerID& containerId = pending.first;
+
+      if (error.isSome()) {
+        pending.second->fail(
+            error.get() + " for container '" + containerId.value() + "'");
+        continue;
+      }
+
+      if (!containers.contains(containerId.value())) {
+        pending.second->fail(
+            "Missing container '" + containerId.value() + "' in"
+            " 'ContainerStartBatchResponse'");
+        continue;
+      }
+
+      const ContainerStartBatchResponse::Container& container =
+        containers.at(containerId.value());
+
+      if (container.has_error()) {
+        pending.second->fail(
+            "Failed to start listening for metrics from container"
+            " '" + containerId.value() + "': " + container.error());
+        continue;
+      }
+
+      if (!container.has_response()) {
+        pending.second->set(Option<ContainerLaunchInfo>::none());
+        continue;
+      }
+
+      Try<ContainerLaunchInfo> launchInfo =
+        createLaunchInfo(containerId, container.response());
+
+      if (launchInfo.isError()) {
+        pending.second->fail(launchInfo.error());
+      } else {
+        pending.second->set(Option<ContainerLaunchInfo>(launchInfo.get()));
+      }
+    }
+  }
+
+  // Adds the container to the next batch stop request. Like `cleanup`,
+  // this never fails, but it waits for the batch to be sent.
+  Future<Nothing> batchStop(const ContainerID& containerId)
+  {
+    Owned<Promise<Nothing>> promise(new Promise<Nothing>());
+
+    pendingStops.push_back(std::make_pair(containerId, promise));
+
+    if (pendingStops.size() >= flags.batch_max_size) {
+      flushStops();
+    } else if (stopTimer.isNone()) {
+      stopTimer = delay(flags.batch_window, self(), &Self::flushStops);
+    }
+
+    return promise->future();
+  }
+
+  void flushStops()
+  {
+    if (stopTimer.isSome()) {
+      Clock::cancel(stopTimer.get());
+      stopTimer = None();
+    }
+
+    if (pendingStops.empty()) {
+      return;
+    }
+
+    vector<PendingStop> batch;
+    std::swap(batch, pendingStops);
+
+    ContainerStopBatchRequest batchRequest;
+    foreach (const PendingStop& pending, batch) {
+      batchRequest.add_container_ids(pending.first.value());
+    }
+
+    post(serviceEndpoint + "/batch/stop", batchRequest)
+      .onAny(defer(self(), &Self::stoppedBatch, batch, lambda::_1));
+  }
+
+  void stoppedBatch(
+      const vector<PendingStop>& batch,
+      const Future<http::Response>& response)
+  {
+    if (!response.isReady()) {
+      LOG(ERROR)
+        << "Failed sending 'ContainerStopBatchRequest' for "
+        << batch.size() << " containers: "
+        << (response.isFailed() ? response.failure() : "Future discarded");
+    } else if (response->code != http::Status::ACCEPTED) {
+      LOG(ERROR)
+        << "Received unexpected response code"
+        << " '" << stringify(response->code) << "' when sending"
+        << " 'ContainerStopBatchRequest' for " << batch.size()
+        << " containers";
+    }
+
+    foreach (const PendingStop& pending, batch) {
+      pending.second->set(Nothing());
+    }
+  }
+
+  // Checkpoints the container to the `--cleanup_queue_dir`, so that
+  // its listener is stopped even if the agent restarts first.
+  void enqueueStop(const ContainerID& containerId)
+  {
+    if (std::find(stopQueue.begin(), stopQueue.end(), containerId) !=
+          stopQueue.end()) {
+      return;
+    }
+
+    // The checkpoint is written and synced to a temporary file first,
+    // and the directory is synced after renaming it, so that neither a
+    // crash nor a power loss leaves a partial checkpoint behind.
+    const string path = stopCheckpointPath(containerId);
+    const string temporary = path + TEMPORARY_SUFFIX;
+
+    Try<Nothing> write = os::write(temporary, containerId.value());
+    if (write.isSome()) {
+      write = sync(temporary);
+    }
+    if (write.isSome()) {
+      write = os::rename(temporary, path);
+    }
+    if (write.isSome()) {
+      write = sync(flags.cleanup_queue_dir.get());
+    }
+
+    if (write.isError()) {
+      LOG(ERROR)
+        << "Failed to checkpoint the cleanup of container"
+        << " '" << containerId.value() << "' to '" << path << "'; the"
+        << " listener will not be stopped if the agent restarts first: "
+        << write.error();
+    }
+
+    stopQueue.push_back(containerId);
+
+    drain();
+  }
+
+  // Queues the containers checkpointed before the agent restarted.
+  void recoverStops()
+  {
+    const string& directory = flags.cleanup_queue_dir.get();
+
+    Try<Nothing> mkdir = os::mkdir(directory);
+    if (mkdir.isError()) {
+      LOG(ERROR)
+        << "Failed to create the cleanup queue directory"
+        << " '" << directory << "': " << mkdir.error();
+      return;
+    }
+
+    Try<std::list<string>> entries = os::ls(directory);
+    if (entries.isError()) {
+      LOG(ERROR)
+        << "Failed to list the cleanup queue directory"
+        << " '" << directory << "': " << entries.error();
+      return;
+    }
+
+    foreach (const string& entry, entries.get()) {
+      if (strings::endsWith(entry, TEMPORARY_SUFFIX)) {
+        os::rm(path::join(directory, entry));
+        continue;
+      }
+
+      ContainerID containerId;
+      containerId.set_value(entry);
+
+      stopQueue.push_back(containerId);
+    }
+
+    if (!stopQueue.empty()) {
+      LOG(INFO)
+        << "Recovered " << stopQueue.size() << " containers whose"
+        << " listeners still have to be stopped";
+    }
+
+    drain();
+  }
+
+  // Stops the listeners of the next batch of queued containers, unless
+  // a batch is being stopped already or a retry is pending.
+  void drain()
+  {
+    if (draining || retryTimer.isSome() || stopQueue.empty()) {
+      return;
+    }
+
+    draining = true;
+
+    vector<ContainerID> batch(
+        stopQueue.begin(),
+        stopQueue.begin() + std::min(stopQueue.size(), flags.batch_max_size));
+
+    // Leased listeners are only stopped once they have been bound.
+    vector<Future<Nothing>> bound;
+    foreach (const ContainerID& containerId, batch) {
+      if (bindings.contains(containerId)) {
+        bound.push_back(bindings.at(containerId));
+        bindings.erase(containerId);
+      }
+    }
+
+    process::collect(bound)
+      .then(defer(self(), &Self::stopListeners, batch))
+      .onAny(defer(self(), &Self::drained, batch, lambda::_1));
+  }
+
+  // Returns the containers of the `batch` whose listeners were stopped.
+  Future<vector<ContainerID>> stopListeners(const vector<ContainerID>& batch)
+  {
+    if (flags.batch_window > Duration::zero()) {
+      ContainerStopBatchRequest batchRequest;
+      foreach (const ContainerID& containerId, batch) {
+        batchRequest.add_container_ids(containerId.value());
+      }
+
+      // Like below, the metrics service does not know about containers
+      // whose listeners were stopped already.
+      return post(serviceEndpoint + "/batch/stop", batchRequest)
+        .then([=](const http::Response& response)
+            -> Future<vector<ContainerID>> {
+          if (response.code != http::Status::ACCEPTED &&
+              response.code != http::Status::NOT_FOUND) {
+            return Failure(
+                "Received unexpected response code"
+                " '" + stringify(response.code) + "'");
+          }
+
+          return batch;
+        });
+    }
+
+    vector<Future<http::Response>> responses;
+    foreach (const ContainerID& containerId, batch) {
+      responses.push_back(sendContainerStop(containerId));
+    }
+
+    return process::await(responses)
+      .then([=](const vector<Future<http::Response>>& results) {
+        vector<ContainerID> stopped;
+        for (size_t i = 0; i < results.size(); i++) {
+          // The metrics service does not know about containers whose
+          // listeners were stopped already, e.g. if the agent restarted
+          // before the checkpoint was removed.
+          if (results[i].isReady() &&
+              (results[i]->code == http::Status::ACCEPTED ||
+               results[i]->code == http::Status::NOT_FOUND)) {
+            stopped.push_back(batch[i]);
+          }
+        }
+
+        return stopped;
+      });
+  }
+
+  void drained(
+      const vector<ContainerID>& batch,
+      const Future<vector<ContainerID>>& stopped)
+  {
+    draining = false;
+
+    size_t count = 0;
+    if (stopped.isReady()) {
+      foreach (const ContainerID& containerId, stopped.get()) {
+        stopQueue.erase(
+            std::find(stopQueue.begin(), stopQueue.end(), containerId));
+
+        Try<Nothing> rm = os::rm(stopCheckpointPath(containerId));
+        if (rm.isError()) {
+          LOG(ERROR)
+            << "Failed to remove the cleanup checkpoint of container"
+            << " '" << containerId.value() << "': " << rm.error();
+        }
+      }
+
+      count = stopped->size();
+    }
+
+    // Move the containers which failed to the back of the queue, so
+    // that containers which fail permanently do not hold up the rest.
+    size_t failed = 0;
+    foreach (const ContainerID& containerId, batch) {
+      std::deque<ContainerID>::iterator queued =
+        std::find(stopQueue.begin(), stopQueue.end(), containerId);
+
+      if (queued != stopQueue.end()) {
+        stopQueue.erase(queued);
+        stopQueue.push_back(containerId);
+        failed++;
+      }
+    }
+
+    // Only back off if no listener could be stopped at all, otherwise
+    // go on with the next batch.
+    if (failed > 0 && count > 0) {
+      LOG(WARNING)
+        << "Failed stopping the listeners of " << failed << " containers;"
+        << " retrying these later";
+    } else if (failed > 0) {
+      LOG(WARNING)
+        << "Failed stopping the listeners of " << failed
+        << " containers"
+        << (stopped.isFailed() ? ": " + stopped.failure() : "")
+        << "; retrying in " << cleanupBackoff;
+
+      retryTimer = delay(cleanupBackoff, self(), &Self::retry);
+      cleanupBackoff =
+        std::min(cleanupBackoff * 2, flags.cleanup_max_backoff);
+      return;
+    }
+
+    cleanupBackoff = flags.cleanup_backoff;
+
+    drain();
+  }
+
+  void retry()
+  {
+    retryTimer = None();
+
+    drain();
+  }
+
+  string stopCheckpointPath(const ContainerID& containerId) const
+  {
+    return path::join(flags.cleanup_queue_dir.get(), containerId.value());
+  }
+
+  double _cleanup_queue_size()
+  {
+    return stopQueue.size();
+  }
+
+  double _requests_in_flight()
+  {
+    return inflight;
+  }
+
   Future<http::Connection> connect()
   {
     if (serviceInetAddress.isSome()) {
@@ -249,26 +986,118 @@ public:
     UNREACHABLE();
   }
 
+  // Picks a connection from the pool for the next request. Idle
+  // connections are preferred, and new connections are only opened
+  // while the pool is not full. Otherwise, the request is pipelined
+  // on the connection with the fewest outstanding requests.
+  uint64_t acquire()
+  {
+    Option<uint64_t> least = None();
+    foreachpair (uint64_t id, const PooledConnection& pooled, connections) {
+      if (least.isNone() ||
+          pooled.outstanding < connections.at(least.get()).outstanding) {
+        least = id;
+      }
+    }
+
+    if (least.isSome() &&
+        (connections.at(least.get()).outstanding == 0 ||
+         connections.size() >= flags.connection_pool_size)) {
+      ++metrics.connection_pool_hits;
+      return least.get();
+    }
+
+    ++metrics.connection_pool_misses;
+
+    const uint64_t id = nextConnectionId++;
+    connections[id].connection = metrics.connect_time.time(connect());
+
+    connections[id].connection
+      .onAny(defer(self(), &Self::connected, id, lambda::_1));
+
+    return id;
+  }
+
+  // Watches for a newly opened connection to be closed, so that it is
+  // replaced by the next request which needs a connection.
+  void connected(uint64_t id, const Future<http::Connection>& connection)
+  {
+    if (!connection.isReady()) {
+      LOG(WARNING)
+        << "Failed to connect to the metrics service: "
+        << (connection.isFailed() ? connection.failure() : "discarded");
+
+      connections.erase(id);
+      return;
+    }
+
+    // The connection has been discarded while it was being opened, but
+    // the connect completed anyway. Close it, which also fails the
+    // requests which were already waiting to be sent on it.
+    if (!connections.contains(id)) {
+      connection->disconnect();
+      return;
+    }
+
+    connection->disconnected()
+      .onAny(defer(self(), &Self::disconnected, id));
+  }
+
+  void disconnected(uint64_t id)
+  {
+    connections.erase(id);
+  }
+
+  // NOTE: This is called once for every request, including those
+  // whose connection has been discarded in the meantime.
+  void release(uint64_t id)
+  {
+    inflight--;
+
+    if (connections.contains(id)) {
+      connections.at(id).outstanding--;
+    }
+  }
+
+  // Removes a connection from the pool and closes it. This is done when
+  // a request has timed out, as pipelined responses would otherwise
+  // wait for the response that never came.
+  void discard(uint64_t id)
+  {
+    if (!connections.contains(id)) {
+      return;
+    }
+
+    Future<http::Connection> connection = connections.at(id).connection;
+    connections.erase(id);
+
+    if (connection.isReady()) {
+      connection->disconnect();
+    } else {
+      connection.discard();
+    }
+  }
+
   Future<http::Response> send(
       const string& endpoint,
       const Option<string>& body,
-      const string& method)
+      const string& method,
+      const string& contentType = APPLICATION_JSON)
   {
-    return connect()
+    const uint64_t id = acquire();
+    connections.at(id).outstanding++;
+    inflight++;
+
+    return connections.at(id).connection
       .then(defer(
           self(),
           [=](http::Connection connection) -> Future<http::Response> {
-            // Capture a reference to the connection to ensure that it remains
-            // open long enough to receive the response.
-            connection.disconnected()
-              .onAny([connection]() {});
-
             http::Request request;
             request.method = method;
             request.keepAlive = true;
             request.headers = {
-              {"Accept", APPLICATION_JSON},
-              {"Content-Type", APPLICATION_JSON}};
+              {"Accept", ACCEPT},
+              {"Content-Type", contentType}};
 
             if (body.isSome()) {
               request.body = body.get();
@@ -288,20 +1117,78 @@ public:
               request.url.path = endpoint;
             }
 
-            return connection.send(request);
+            return metrics.request_time.time(connection.send(request));
           }))
+      .onReady(defer(self(), &Self::negotiate, lambda::_1))
+      .onReady(defer(self(), &Self::responded, lambda::_1))
+      .onAny(defer(self(), &Self::release, id))
       .after(
           flags.request_timeout,
-          [](const Future<http::Response>&) {
+          defer(self(), [=](const Future<http::Response>&)
+              -> Future<http::Response> {
+            ++metrics.request_timeouts;
+
+            discard(id);
             return Failure("Request timed out");
-          });
+          }));
   }
 
-  Future<http::Response> send(const ContainerStartRequest& containerStartRequest)
+  // Posts the `message` as serialized protobuf once the metrics service
+  // is known to support it, and as JSON otherwise. A service which turns
+  // down the protobuf is sent JSON from then on.
+  template <typename T>
+  Future<http::Response> post(const string& endpoint, const T& message)
   {
-    string body = jsonify(JSON::Protobuf(containerStartRequest));
+    if (!protobuf) {
+      return send(
+          endpoint,
+          string(jsonify(JSON::Protobuf(message))),
+          "POST",
+          APPLICATION_JSON);
+    }
 
-    return send(serviceEndpoint, body, "POST");
+    return send(
+        endpoint,
+        message.SerializeAsString(),
+        "POST",
+        APPLICATION_PROTOBUF)
+      .then(defer(
+          self(),
+          [=](const http::Response& response) -> Future<http::Response> {
+            if (response.code != http::Status::UNSUPPORTED_MEDIA_TYPE) {
+              return response;
+            }
+
+            if (protobuf) {
+              LOG(WARNING)
+                << "The metrics service does not accept protobuf requests,"
+                << " falling back to JSON";
+
+              protobuf = false;
+              protobufRejected = true;
+            }
+
+            return post(endpoint, message);
+          }));
+  }
+
+  void responded(const http::Response& response)
+  {
+    if (response.code < 200 || response.code >= 300) {
+      ++metrics.non_2xx_responses;
+    }
+  }
+
+  // Switches to protobuf requests once the metrics service responds
+  // with protobuf, as it prefers protobuf over JSON then, unless it has
+  // turned down a protobuf request before.
+  void negotiate(const http::Response& response)
+  {
+    if (!protobuf && !protobufRejected && isProtobuf(response)) {
+      LOG(INFO) << "Sending protobuf requests to the metrics service";
+
+      protobuf = true;
+    }
   }
 
   Future<http::Response> sendContainerStop(const ContainerID& containerId)
@@ -310,6 +1197,111 @@ public:
   }
 
 private:
+  struct PooledConnection
+  {
+    PooledConnection() : outstanding(0) {}
+
+    Future<http::Connection> connection;
+
+    // The number of requests sent or waiting to be sent on the
+    // connection, whose responses have not been received yet.
+    size_t outstanding;
+  };
+
+  struct Metrics
+  {
+    explicit Metrics(MetricsIsolatorProcess* process)
+      : connection_pool_hits("metrics_isolator/connection_pool_hits"),
+        connection_pool_misses("metrics_isolator/connection_pool_misses"),
+        statsd_pool_hits("metrics_isolator/statsd_pool_hits"),
+        statsd_pool_misses("metrics_isolator/statsd_pool_misses"),
+        statsd_pool_available(
+            "metrics_isolator/statsd_pool_available",
+            defer(process->self(),
+                  &MetricsIsolatorProcess::_statsd_pool_available)),
+        cleanup_queue_size(
+            "metrics_isolator/cleanup_queue_size",
+            defer(process->self(),
+                  &MetricsIsolatorProcess::_cleanup_queue_size)),
+        connect_time("metrics_isolator/connect_time", Hours(1)),
+        request_time("metrics_isolator/request_time", Hours(1)),
+        prepare_latency("metrics_isolator/prepare_latency", Hours(1)),
+        cleanup_latency("metrics_isolator/cleanup_latency", Hours(1)),
+        request_timeouts("metrics_isolator/request_timeouts"),
+        non_2xx_responses("metrics_isolator/non_2xx_responses"),
+        debug_containers_skipped("metrics_isolator/debug_containers_skipped"),
+        requests_in_flight(
+            "metrics_isolator/requests_in_flight",
+            defer(process->self(),
+                  &MetricsIsolatorProcess::_requests_in_flight))
+    {
+      process::metrics::add(connection_pool_hits);
+      process::metrics::add(connection_pool_misses);
+      process::metrics::add(statsd_pool_hits);
+      process::metrics::add(statsd_pool_misses);
+      process::metrics::add(statsd_pool_available);
+      process::metrics::add(cleanup_queue_size);
+      process::metrics::add(connect_time);
+      process::metrics::add(request_time);
+      process::metrics::add(prepare_latency);
+      process::metrics::add(cleanup_latency);
+      process::metrics::add(request_timeouts);
+      process::metrics::add(non_2xx_responses);
+      process::metrics::add(debug_containers_skipped);
+      process::metrics::add(requests_in_flight);
+    }
+
+    ~Metrics()
+    {
+      process::metrics::remove(connection_pool_hits);
+      process::metrics::remove(connection_pool_misses);
+      process::metrics::remove(statsd_pool_hits);
+      process::metrics::remove(statsd_pool_misses);
+      process::metrics::remove(statsd_pool_available);
+      process::metrics::remove(cleanup_queue_size);
+      process::metrics::remove(connect_time);
+      process::metrics::remove(request_time);
+      process::metrics::remove(prepare_latency);
+      process::metrics::remove(cleanup_latency);
+      process::metrics::remove(request_timeouts);
+      process::metrics::remove(non_2xx_responses);
+      process::metrics::remove(debug_containers_skipped);
+      process::metrics::remove(requests_in_flight);
+    }
+
+    // Requests which were sent on an open (or opening) connection,
+    // and requests which opened a new connection.
+    process::metrics::Counter connection_pool_hits;
+    process::metrics::Counter connection_pool_misses;
+
+    // Containers which were handed a leased StatsD listener, and
+    // containers which found the pool empty, see `--statsd_pool_size`.
+    process::metrics::Counter statsd_pool_hits;
+    process::metrics::Counter statsd_pool_misses;
+    process::metrics::PullGauge statsd_pool_available;
+
+    // Containers whose listeners still have to be stopped, see
+    // `--cleanup_queue_dir`.
+    process::metrics::PullGauge cleanup_queue_size;
+
+    // The time taken to connect to the metrics service, from sending a
+    // request until receiving its response, and by `prepare` and
+    // `cleanup` as seen by the containerizer. Each of these exposes
+    // percentiles over the last hour.
+    process::metrics::Timer<Milliseconds> connect_time;
+    process::metrics::Timer<Milliseconds> request_time;
+    process::metrics::Timer<Milliseconds> prepare_latency;
+    process::metrics::Timer<Milliseconds> cleanup_latency;
+
+    process::metrics::Counter request_timeouts;
+    process::metrics::Counter non_2xx_responses;
+    process::metrics::Counter debug_containers_skipped;
+
+    // Requests which were sent, or are waiting for a connection, and
+    // have neither been responded to nor timed out.
+    process::metrics::PullGauge requests_in_flight;
+  } metrics;
+
   const isolator::Flags flags;
   string serviceScheme;
   string serviceEndpoint;
@@ -320,6 +1312,47 @@ private:
   // This is used to skip the DELETE request during the cleanup phase, since we
   // do not set up metrics for DEBUG containers.
   hashset<ContainerID> debugContainers;
+
+  // The pool of connections to the metrics service, by their ID.
+  hashmap<uint64_t, PooledConnection> connections;
+  uint64_t nextConnectionId;
+
+  // The containers waiting for the next batch request, if batching
+  // is enabled, and the timers which send the batch requests.
+  vector<PendingStart> pendingStarts;
+  vector<PendingStop> pendingStops;
+  Option<Timer> startTimer;
+  Option<Timer> stopTimer;
+
+  // A leased StatsD listener, and when it is dropped from the pool.
+  struct PooledLease
+  {
+    StatsdLease lease;
+    Time expires;
+  };
+
+  // Used for `--statsd_pool_size`. The pool is ordered by the time the
+  // leases expire. The `bindings` of leased listeners to containers are
+  // waited for before stopping the listeners.
+  std::deque<PooledLease> statsdPool;
+  bool leasing;
+  hashmap<ContainerID, Future<Nothing>> bindings;
+
+  // Used for `--cleanup_queue_dir`. The containers whose listeners
+  // still have to be stopped, oldest first, and the pending retry.
+  std::deque<ContainerID> stopQueue;
+  bool draining;
+  Duration cleanupBackoff;
+  Option<Timer> retryTimer;
+
+  // Whether requests are sent as serialized protobuf, see `post`.
+  bool protobuf;
+
+  // Whether the metrics service has responded to a protobuf request
+  // with 415, after which we stick to JSON.
+  bool protobufRejected;
+
+  size_t inflight;
 };
 
 
@@ -121,6 +121,82 @@ struct Flags : virtual flags::FlagsBase
         "The duration after which a request to the metrics service will\n"
         "timeout and be considered failed.",
         Seconds(5));
+
+    add(&Flags::connection_pool_size,
+        "connection_pool_size",
+        "The number of connections to the metrics service which are kept\n"
+        "open and reused across requests. Requests are pipelined on busy\n"
+        "connections once this many connections are open.",
+        4,
+        [](size_t value) -> Option<Error> {
+          if (value == 0) {
+            return Error("Expected --connection_pool_size of at least 1");
+          }
+
+          return None();
+        });
+
+    add(&Flags::batch_window,
+        "batch_window",
+        "How long container start and stop requests are held back to be\n"
+        "sent to the metrics service together, as a single batch request.\n"
+        "Zero disables batching. Batching requires a metrics service\n"
+        "which supports the 'batch/start' and 'batch/stop' endpoints.",
+        Duration::zero());
+
+    add(&Flags::batch_max_size,
+        "batch_max_size",
+        "The most containers in a single batch request. A batch is sent\n"
+        "right away once it is full, without waiting for --batch_window.",
+        100,
+        [](size_t value) -> Option<Error> {
+          if (value == 0) {
+            return Error("Expected --batch_max_size of at least 1");
+          }
+
+          return None();
+        });
+
+    add(&Flags::statsd_pool_size,
+        "statsd_pool_size",
+        "The number of StatsD listeners leased from the metrics service\n"
+        "ahead of time. Containers are handed a leased listener right\n"
+        "away, which is then bound to the container in the background.\n"
+        "Once the pool runs dry, containers wait for the metrics service\n"
+        "as usual. Zero disables the pool. The pool requires a metrics\n"
+        "service which supports the 'lease' and 'lease/bind' endpoints.",
+        0);
+
+    add(&Flags::statsd_lease_ttl,
+        "statsd_lease_ttl",
+        "How long a leased StatsD listener is kept in the pool before it\n"
+        "is dropped in favor of a new lease. This should be shorter than\n"
+        "the time after which the metrics service expires leases which\n"
+        "are never bound.",
+        Minutes(1));
+
+    add(&Flags::cleanup_queue_dir,
+        "cleanup_queue_dir",
+        "A directory, e.g. below the agent's work directory, where the\n"
+        "containers whose listeners still have to be stopped are\n"
+        "checkpointed. If set, container cleanup does not wait for the\n"
+        "metrics service. Instead, the listeners are stopped in the\n"
+        "background (in batches, if --batch_window is set), retried with\n"
+        "backoff until the metrics service accepts the request, and\n"
+        "picked up again once the agent restarts.");
+
+    add(&Flags::cleanup_backoff,
+        "cleanup_backoff",
+        "How long to wait before retrying to stop listeners from the\n"
+        "--cleanup_queue_dir. The wait is doubled with each failed\n"
+        "attempt, up to --cleanup_max_backoff.",
+        Seconds(1));
+
+    add(&Flags::cleanup_max_backoff,
+        "cleanup_max_backoff",
+        "The longest wait before retrying to stop listeners from the\n"
+        "--cleanup_queue_dir.",
+        Minutes(5));
   }
 
   // TODO(greggomann): Remove the `Option`s here once we have an overload of
@@ -131,6 +207,14 @@ struct Flags : virtual flags::FlagsBase
   Option<std::string> service_address;
   Option<std::string> service_endpoint;
   Duration request_timeout;
+  size_t connection_pool_size;
+  Duration batch_window;
+  size_t batch_max_size;
+  size_t statsd_pool_size;
+  Duration statsd_lease_ttl;
+  Option<std::string> cleanup_queue_dir;
+  Duration cleanup_backoff;
+  Duration cleanup_max_backoff;
 };
 
 } // namespace isolator
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <sstream>
 #include <set>
 #include <vector>
@@ -6,15 +7,20 @@
 #include <stout/check.hpp>
 #include <stout/duration.hpp>
 #include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/hashset.hpp>
 #include <stout/json.hpp>
 #include <stout/jsonify.hpp>
 #include <stout/os.hpp>
 #include <stout/os/exists.hpp>
+#include <stout/os/fsync.hpp>
+#include <stout/os/rename.hpp>
 #include <stout/os/write.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/strings.hpp>
 #include <stout/try.hpp>
 
+#include <process/clock.hpp>
 #include <process/collect.hpp>
 #include <process/defer.hpp>
 #include <process/delay.hpp>
@@ -54,6 +60,7 @@ using std::string;
 using std::tuple;
 using std::vector;
 
+using process::Clock;
 using process::delay;
 
 using process::DESCRIPTION;
@@ -71,6 +78,8 @@ using mesos::Parameters;
 
 using mesos::master::detector::MasterDetector;
 
+using mesos::modules::common::Priority;
+using mesos::modules::common::runCommand;
 using mesos::modules::common::runScriptCommand;
 
 using mesos::modules::Anonymous;
@@ -80,11 +89,13 @@ using mesos::modules::overlay::AgentInfo;
 using mesos::modules::overlay::BridgeInfo;
 using mesos::modules::overlay::MESOS_MASTER;
 using mesos::modules::overlay::MESOS_ZK;
+using mesos::modules::overlay::internal::AgentCheckpoint;
 using mesos::modules::overlay::internal::AgentConfig;
 using mesos::modules::overlay::internal::AgentNetworkConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RetryRegistrationMessage;
 using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 
 namespace mesos {
@@ -139,27 +150,55 @@ Try<Owned<ManagerProcess>> ManagerProcess::create(
   // NOTE: We should set up the `ipset` only if `mesos_bridge` or
   // `docker_bridge` have been enabled in the `AgentNetworkConfig`.
   if (networkConfig.mesos_bridge() || networkConfig.docker_bridge()) {
-    Try<string> ipsetCommand = strings::format(
-        "ipset create -exist %s hash:net counters && "
-        "ipset add -exist %s 0.0.0.0/1 && "
-        "ipset add -exist %s 128.0.0.0/1 && "
-        "ipset add -exist %s 127.0.0.0/1",
-        IPSET_OVERLAY,
-        IPSET_OVERLAY,
-        IPSET_OVERLAY,
-        IPSET_OVERLAY);
-
-    if (ipsetCommand.isError()) {
-      return Error(
-          "Unable to create `ipset` command: " + ipsetCommand.error());
+    Duration timeout = Milliseconds(networkConfig.command_timeout());
+    const string set = IPSET_OVERLAY;
+
+    // Rather than forking a shell for a chain of `ipset` commands,
+    // create the set with a single `ipset restore`.
+    Future<string> ipset = Failure("disabled by `restore_rules`");
+    if (networkConfig.restore_rules()) {
+      ipset = runCommand(
+          "ipset",
+          {"ipset", "-exist", "restore"},
+          timeout,
+          "create " + set + " hash:net counters\n"
+          "add " + set + " 0.0.0.0/1\n"
+          "add " + set + " 128.0.0.0/1\n"
+          "add " + set + " 127.0.0.0/1\n",
+          Priority::HIGH);
+
+      ipset.await();
     }
 
-    Duration timeout = Milliseconds(networkConfig.command_timeout());
-    Future<string> ipset = runScriptCommand(
-        ipsetCommand.get(),
-        timeout);
+    if (!ipset.isReady()) {
+      if (networkConfig.restore_rules()) {
+        LOG(WARNING) << "Unable to restore ipset, falling back to the "
+                     << "`ipset` script: "
+                     << (ipset.isFailed() ? ipset.failure() : "discarded");
+      }
 
-    ipset.await();
+      Try<string> ipsetCommand = strings::format(
+          "ipset create -exist %s hash:net counters && "
+          "ipset add -exist %s 0.0.0.0/1 && "
+          "ipset add -exist %s 128.0.0.0/1 && "
+          "ipset add -exist %s 127.0.0.0/1",
+          IPSET_OVERLAY,
+          IPSET_OVERLAY,
+          IPSET_OVERLAY,
+          IPSET_OVERLAY);
+
+      if (ipsetCommand.isError()) {
+        return Error(
+            "Unable to create `ipset` command: " + ipsetCommand.error());
+      }
+
+      ipset = runScriptCommand(
+          ipsetCommand.get(),
+          timeout,
+          Priority::HIGH);
+
+      ipset.await();
+    }
 
     if (!ipset.isReady()) {
       return Error(
@@ -184,13 +223,33 @@ Try<Owned<ManagerProcess>> ManagerProcess::create(
     cniDataDir = agentConfig.cni_data_dir();
   }
 
+  Option<string> workDir;
+  if (agentConfig.has_work_dir()) {
+    workDir = agentConfig.work_dir();
+  }
+
+  Owned<DockerClient> dockerClient;
+  if (networkConfig.docker_bridge() && !networkConfig.docker_socket().empty()) {
+    Try<Owned<DockerClient>> client =
+      DockerClient::create(networkConfig.docker_socket());
+
+    if (client.isError()) {
+      LOG(WARNING) << "Using the `docker` CLI since the Docker Engine API "
+                   << "is unavailable: " << client.error();
+    } else {
+      dockerClient = client.get();
+    }
+  }
+
   return Owned<ManagerProcess>(
       new ManagerProcess(
         agentConfig.cni_dir(),
         cniDataDir,
+        workDir,
         networkConfig,
         agentConfig.max_configuration_attempts(),
-        detector.get()));
+        detector.get(),
+        dockerClient));
 }
 
 
@@ -257,8 +316,32 @@ void ManagerProcess::initialize()
 
   state = REGISTERING;
 
-  detector->detect()
-    .onAny(defer(self(), &ManagerProcess::detected, lambda::_1));
+  // Restore the overlays we had configured before restarting, so that
+  // we don't have to reconfigure them when registering. A Docker
+  // daemon which hangs must not keep us from registering, so we give
+  // up on the recovery after `command_timeout`.
+  const Duration timeout = Milliseconds(networkConfig.command_timeout());
+
+  recovering = true;
+
+  recover()
+    .after(timeout, [timeout](Future<Nothing> recovery) -> Future<Nothing> {
+      recovery.discard();
+      return Failure("Timed out after " + stringify(timeout));
+    })
+    .onAny(defer(self(), [this](const Future<Nothing>& recovered) {
+      recovering = false;
+
+      if (!recovered.isReady()) {
+        LOG(WARNING) << "Unable to recover the checkpointed overlays: "
+                     << (recovered.isFailed()
+                           ? recovered.failure()
+                           : "discarded");
+      }
+
+      detector->detect()
+        .onAny(defer(self(), &ManagerProcess::detected, lambda::_1));
+    }));
 
   // Install message handlers.
   install<UpdateAgentOverlaysMessage>(
@@ -266,6 +349,9 @@ void ManagerProcess::initialize()
 
   install<AgentRegisteredAcknowledgement>(
       &ManagerProcess::agentRegisteredAcknowledgement);
+
+  install<RetryRegistrationMessage>(
+      &ManagerProcess::retryRegistration);
 }
 
 
@@ -290,12 +376,35 @@ void ManagerProcess::updateAgentOverlays(
 {
   LOG(INFO) << "Received 'UpdateAgentOverlaysMessage' from " << from;
 
-  if (state != REGISTERING) {
+  // Once registered, the master only sends the overlays which changed.
+  if (state != REGISTERING && !message.incremental()) {
     LOG(WARNING) << "Ignored 'UpdateAgentOverlaysMessage' from " << from
                  << " because overlay agent is not in DISCONNECTED state";
     return;
   }
 
+  // An incremental update only completes our overlays if we have
+  // configured the version it is based on, which we have not if e.g.
+  // an earlier update was lost. We register again to get the overlays
+  // which changed since the version we have configured.
+  if (message.has_base_version() &&
+      (configuredVersion.isNone() ||
+       configuredVersion->epoch() != message.base_version().epoch() ||
+       configuredVersion->version() != message.base_version().version())) {
+    LOG(WARNING) << "Ignored 'UpdateAgentOverlaysMessage' from " << from
+                 << " because it is based on version "
+                 << message.base_version().version()
+                 << " which has not been configured";
+
+    if (state == REGISTERED) {
+      configAttempts = 0;
+      state = REGISTERING;
+      doReliableRegistration(INITIAL_BACKOFF_PERIOD);
+    }
+
+    return;
+  }
+
   vector<Future<Nothing>> futures;
   foreach (const AgentOverlayInfo& overlay, message.overlays()) {
     const string name = overlay.info().name();
@@ -323,10 +432,30 @@ void ManagerProcess::updateAgentOverlays(
       // Here, we assume that the overlay configuration never changes.
       // Therefore, if the overlay is in `STATUS_OK`, we will skip the
       // configuration.
-      if (status == OverlayState::STATUS_OK) {
+      //
+      // NOTE: This does not hold for overlays recovered from a
+      // checkpoint, since the master might have lost its state in
+      // the meantime. An overlay whose configuration differs (other
+      // than being enabled or disabled) is therefore reconfigured.
+      AgentOverlayInfo configured = overlays.at(name);
+      configured.clear_state();
+      configured.mutable_info()->clear_enabled();
+
+      AgentOverlayInfo updated = overlay;
+      updated.mutable_info()->clear_enabled();
+
+      if (status == OverlayState::STATUS_OK &&
+          configured.SerializeAsString() != updated.SerializeAsString()) {
+        LOG(INFO) << "Reconfiguring overlay network '" << name
+                  << "' since its configuration has changed.";
+      } else if (status == OverlayState::STATUS_OK) {
         LOG(INFO) << "Skipping configuration for overlay network '"
                   << name << "' as it has been configured.";
 
+        // An overlay can be enabled or disabled at runtime, which
+        // does not change its configuration.
+        overlays[name].mutable_info()->CopyFrom(overlay.info());
+
         // We still set a `Future` for this overlay, so as to inform
         // the Master about the state of this overlay network.
         //
@@ -361,11 +490,13 @@ void ManagerProcess::updateAgentOverlays(
   await(futures)
     .onAny(defer(self(),
           &ManagerProcess::_updateAgentOverlays,
+          message,
           lambda::_1));
 }
 
 
 void ManagerProcess::_updateAgentOverlays(
+    const UpdateAgentOverlaysMessage& update,
     const Future<vector<Future<Nothing>>>& results)
 {
   if (!results.isReady()) {
@@ -390,17 +521,38 @@ void ManagerProcess::_updateAgentOverlays(
                << strings::join("\n", messages);
   }
 
-  if (state != REGISTERING) {
+  checkpoint();
+
+  if (state != REGISTERING && !update.incremental()) {
     LOG(WARNING) << "Ignored sending registered message because "
                  << "agent is not in REGISTERING state";
     return;
   }
 
-  CHECK_SOME(overlayMaster);
+  if (overlayMaster.isNone()) {
+    LOG(WARNING) << "Ignored sending registered message because "
+                 << "the overlay master is unknown";
+    return;
+  }
 
   AgentRegisteredMessage message;
 
+  if (update.has_config_version()) {
+    message.mutable_config_version()->CopyFrom(update.config_version());
+  }
+
+  // The master only needs the state of the overlays it has sent, unless
+  // it sent all of them.
+  hashset<string> names;
+  foreach (const AgentOverlayInfo& overlay, update.overlays()) {
+    names.insert(overlay.info().name());
+  }
+
   foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+    if (update.incremental() && !names.contains(overlay.info().name())) {
+      continue;
+    }
+
     // Every overlay network should have a status, and it should be
     // either in `STATUS_OK` or `STATUS_FAILED`.
     CHECK(overlay.has_state());
@@ -422,10 +574,19 @@ void ManagerProcess::_updateAgentOverlays(
 }
 
 
-void ManagerProcess::agentRegisteredAcknowledgement(const UPID& from)
+void ManagerProcess::agentRegisteredAcknowledgement(
+    const UPID& from,
+    const AgentRegisteredAcknowledgement& message)
 {
   LOG(INFO) << "Received agent registered acknowledgment from " << from;
 
+  // The acknowledgement of an incremental update.
+  if (state == REGISTERED) {
+    updateConfiguredVersion(message);
+    checkpoint();
+    return;
+  }
+
   configAttempts++;
 
   link(from);
@@ -452,12 +613,38 @@ void ManagerProcess::agentRegisteredAcknowledgement(const UPID& from)
     }
   }
 
+  updateConfiguredVersion(message);
+  checkpoint();
+
   state = REGISTERED;
 
   connected.set(Nothing());
 }
 
 
+void ManagerProcess::updateConfiguredVersion(
+    const AgentRegisteredAcknowledgement& message)
+{
+  configuredVersion = None();
+
+  if (!message.has_config_version()) {
+    return;
+  }
+
+  // The master resends any overlay which failed to be configured only
+  // if we register without a version.
+  foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+    if (!overlay.has_state() ||
+        !overlay.state().has_status() ||
+        overlay.state().status() != OverlayState::STATUS_OK) {
+      return;
+    }
+  }
+
+  configuredVersion = message.config_version();
+}
+
+
 void ManagerProcess::detected(const Future<Option<MasterInfo>>& mesosMaster)
 {
   if (mesosMaster.isFailed()) {
@@ -522,6 +709,12 @@ void ManagerProcess::doReliableRegistration(Duration maxBackoff)
   RegisterAgentMessage registerMessage;
   registerMessage.mutable_network_config()->CopyFrom(networkConfig);
 
+  // Let the master skip the overlays we have configured already.
+  if (configuredVersion.isSome()) {
+    registerMessage.mutable_config_version()->CopyFrom(
+        configuredVersion.get());
+  }
+
   // Send registration to the overlay master.
   LOG(INFO) << "Sending registration message to master: "
             << overlayMaster.get();
@@ -537,13 +730,55 @@ void ManagerProcess::doReliableRegistration(Duration maxBackoff)
 
   VLOG(1) << "Will retry registration in " << backoff << " if necessary";
 
-  delay(backoff,
+  // Keep a single chain of attempts, even though an attempt may be
+  // started by a new master or by the master asking us to retry.
+  if (registrationTimer.isSome()) {
+    Clock::cancel(registrationTimer.get());
+  }
+
+  registrationTimer = delay(backoff,
       self(),
       &ManagerProcess::doReliableRegistration,
       maxBackoff * 2);
 }
 
 
+void ManagerProcess::retryRegistration(
+    const UPID& from,
+    const RetryRegistrationMessage& message)
+{
+  if (state == REGISTERED) {
+    LOG(INFO) << "Ignored 'RetryRegistrationMessage' from " << from
+              << " because overlay agent is already in REGISTERED state";
+    return;
+  }
+
+  if (overlayMaster.isNone() || overlayMaster.get() != from) {
+    LOG(WARNING) << "Ignored 'RetryRegistrationMessage' from " << from
+                 << " because it is not the current overlay master";
+    return;
+  }
+
+  // Spread the attempts of all agents which are asked to retry at once
+  // over another `retry_after`, so that they do not all come back at
+  // the same time.
+  const Duration retryAfter = Milliseconds(message.retry_after());
+  Duration backoff = retryAfter * (1 + (double) ::random() / RAND_MAX);
+
+  LOG(INFO) << "Overlay master " << from << " asked to retry registration"
+            << " in " << retryAfter << ", retrying in " << backoff;
+
+  if (registrationTimer.isSome()) {
+    Clock::cancel(registrationTimer.get());
+  }
+
+  registrationTimer = delay(backoff,
+      self(),
+      &ManagerProcess::doReliableRegistration,
+      INITIAL_BACKOFF_PERIOD);
+}
+
+
 Future<http::Response> ManagerProcess::overlay(const http::Request& request)
 {
   AgentInfo agent;
@@ -608,7 +843,7 @@ Future<Nothing> ManagerProcess::_configure(
     errors.push_back((docker.isFailed() ? docker.failure() : "discarded"));
   }
 
-  auto overlaySuccess = [=](const Future<string>& result) -> Future<Nothing> {
+  auto overlaySuccess = [=](const Nothing&) -> Future<Nothing> {
     CHECK(overlays.contains(name));
     overlays[name].mutable_state()->set_status(OverlayState::STATUS_OK);
 
@@ -630,74 +865,563 @@ Future<Nothing> ManagerProcess::_configure(
   }
 
   // The Mesos and Docker Networks have been configured. Setup the
-  // ipset rule in `IPSET_OVERLAY`. If the ipset rule succeeds
-  // proceed to check the iptables rule exists for masquerading
-  // traffic from the overlay subnet. If the iptables rule does not
-  // exist insert one in the POSTROUTING chain of the NAT table.
-  // The below command is a script consisting of three commands:
-  // <set ipset> && <check iptables rule exists> ||
-  // <insert iptables rule>
+  // ipset rule in `IPSET_OVERLAY` and the iptables rule for
+  // masquerading traffic from the overlay subnet, see `scriptRules`
+  // and `restoreRules`.
   if (!networkConfig.mesos_bridge() &&
       !networkConfig.docker_bridge()) {
-    return overlaySuccess("");
-  } else {
-    Try<string> command = strings::format("");
+    return overlaySuccess(Nothing());
+  }
+
+  Future<Nothing> rules = networkConfig.restore_rules()
+    ? installRules(name)
+    : scriptRules({name}, false);
+
+  // We have to explicitly chain the `onFailed` and `onDiscarded`
+  // events since we need to update the `State` of the overlay
+  // network on failure to execute the iptables script.
+  //
+  // NOTE: If we use `onAny` instead of `onFailed` and
+  // `onDiscarded`, and handle all conditions (success as well as
+  // failure) in the `onAny` callback, it causes a race with the
+  // callback setup in the `await` which listens to this future
+  // (checkout `updateAgentOverlays` method). Reason being that
+  // when a future is READY, all the READY callbacks are invoked
+  // before the `onAny` callbacks are invoked. This can result in
+  // the callback setup by `await` being invoked before the
+  // `onAny` call we seutp in this `Future`. This can cause
+  // problems since we check the overlay `State` in
+  // `_updateAgentOverlays`, which might not be set if this race
+  // were to occur, even though the overlay configuration went
+  // through fine.
+  return rules
+    .then(defer(self(), overlaySuccess))
+    .onFailed(defer(self(), overlayFailure))
+    .onDiscarded(defer(self(), lambda::bind(overlayFailure, "discarded")));
+}
+
+
+Future<Nothing> ManagerProcess::installRules(const string& name)
+{
+  pendingRules.push_back(name);
+
+  if (rulesApplied.get() == nullptr) {
+    rulesApplied.reset(new Promise<Nothing>());
+  }
+
+  Future<Nothing> future = rulesApplied->future();
+
+  // The rules of the overlays configured while a batch is being
+  // applied go into the next batch, so that we fork and take the
+  // xtables lock once per batch rather than once per overlay.
+  //
+  // NOTE: All the overlays of a batch share `rulesApplied`, so if the
+  // rules of one of them cannot be installed, neither by the restore
+  // nor by the scripts, all the overlays of the batch fail and are
+  // configured again on the next registration attempt.
+  if (!applyingRules) {
+    applyRules();
+  }
+
+  return future;
+}
+
+
+void ManagerProcess::applyRules()
+{
+  if (pendingRules.empty()) {
+    applyingRules = false;
+    return;
+  }
+
+  applyingRules = true;
+
+  vector<string> names;
+  std::swap(names, pendingRules);
+
+  Owned<Promise<Nothing>> promise = rulesApplied;
+  rulesApplied.reset();
+
+  // The Docker networks of these overlays need the DOCKER-ISOLATION
+  // bypass, see `bypassDockerIsolation`.
+  bool isolation = false;
+  if (networkConfig.docker_bridge()) {
+    foreach (const string& name, names) {
+      CHECK(overlays.contains(name));
+      isolation = isolation || overlays[name].has_docker_bridge();
+    }
+  }
+
+  restoreRules(names, isolation)
+    .repair(defer(self(), [=](const Future<Nothing>& future) {
+      LOG(WARNING) << "Unable to restore the rules for overlays "
+                   << strings::join(", ", names) << ", falling back to "
+                   << "scripts: "
+                   << (future.isFailed() ? future.failure() : "discarded");
+
+      return scriptRules(names, isolation);
+    }))
+    .onAny(defer(self(), [=](const Future<Nothing>& future) {
+      promise->associate(future);
+      applyRules();
+    }));
+}
+
+
+Try<string> restoreInput(
+    const string& current,
+    const vector<string>& subnets,
+    bool isolation)
+{
+  hashset<string> chains;
+  hashmap<string, vector<string>> rules;
+
+  Option<string> table;
+  foreach (const string& line, strings::tokenize(current, "\n")) {
+    if (strings::startsWith(line, "*")) {
+      table = line.substr(1);
+    } else if (table.isSome() && strings::startsWith(line, ":")) {
+      vector<string> tokens = strings::tokenize(line.substr(1), " ");
+      if (!tokens.empty()) {
+        chains.insert(table.get() + " " + tokens[0]);
+      }
+    } else if (table.isSome() && strings::startsWith(line, "-A ")) {
+      rules[table.get()].push_back(strings::trim(line));
+    }
+  }
+
+  auto contains = [](const vector<string>& rules, const string& rule) {
+    return std::find(rules.begin(), rules.end(), rule) != rules.end();
+  };
+
+  string nat;
+  foreach (const string& subnet, subnets) {
+    const string rule =
+      "-A POSTROUTING -s " + subnet + " -m set --match-set " +
+      IPSET_OVERLAY + " dst -j MASQUERADE";
+
+    if (!contains(rules["nat"], rule)) {
+      nat += rule + "\n";
+    }
+  }
+
+  string filter;
+  if (isolation) {
+    string chain = "DOCKER-ISOLATION";
+    if (!chains.contains("filter " + chain)) {
+      chain = "DOCKER-ISOLATION-STAGE-2";
+    }
+
+    if (!chains.contains("filter " + chain)) {
+      return Error("Unable to find the Docker isolation chain");
+    }
+
+    const string rule = "-A " + chain + " -j RETURN";
+
+    vector<string> chainRules;
+    foreach (const string& _rule, rules["filter"]) {
+      if (strings::startsWith(_rule, "-A " + chain + " ")) {
+        chainRules.push_back(_rule);
+      }
+    }
+
+    if (chainRules.empty() || chainRules.front() != rule) {
+      if (contains(chainRules, rule)) {
+        filter += "-D " + chain + " -j RETURN\n";
+      }
+
+      filter += "-I " + chain + " 1 -j RETURN\n";
+    }
+  }
+
+  string input;
+  if (!nat.empty()) {
+    input += "*nat\n" + nat + "COMMIT\n";
+  }
+
+  if (!filter.empty()) {
+    input += "*filter\n" + filter + "COMMIT\n";
+  }
+
+  return input;
+}
+
+
+Future<Nothing> ManagerProcess::restoreRules(
+    const vector<string>& names,
+    bool isolation)
+{
+  vector<string> subnets;
+  string ipset;
+
+  foreach (const string& name, names) {
+    CHECK(overlays.contains(name));
 
     if (overlays[name].info().has_subnet()) {
-      const string overlaySubnet = overlays[name].info().subnet();
-
-      command = strings::format(
-          "ipset add -exist %s %s" " nomatch &&"
-          " iptables -w -t nat -C POSTROUTING -s %s -m set"
-          " --match-set %s dst -j MASQUERADE ||"
-          " iptables -w -t nat -A POSTROUTING -s %s -m"
-          " set --match-set %s dst -j MASQUERADE",
-          IPSET_OVERLAY,
-          overlaySubnet,
-          overlaySubnet,
-          IPSET_OVERLAY,
-          overlaySubnet,
-          IPSET_OVERLAY);
+      const string subnet = overlays[name].info().subnet();
+
+      subnets.push_back(subnet);
+      ipset += "add " + string(IPSET_OVERLAY) + " " + subnet + " nomatch\n";
+    }
+  }
+
+  Duration timeout = Milliseconds(networkConfig.command_timeout());
 
-      if (command.isError()) {
-        overlayFailure(command.error());
+  Future<string> added = string();
+  if (!ipset.empty()) {
+    added = runCommand(
+        "ipset",
+        {"ipset", "-exist", "restore"},
+        timeout,
+        ipset);
+  }
+
+  // `iptables-restore` has no equivalent of `iptables -C`, so we
+  // look up the rules which already exist with `iptables-save`
+  // (which does not take the xtables lock) and only restore the
+  // missing ones.
+  return added
+    .then([timeout](const string&) {
+      return runCommand("iptables-save", {"iptables-save"}, timeout);
+    })
+    .then(defer(self(), [=](const string& current) -> Future<Nothing> {
+      Try<string> input = restoreInput(current, subnets, isolation);
+      if (input.isError()) {
+        return Failure(input.error());
+      }
 
-        return Failure(
-            "Unable to create iptables rule for overlay " +
-            name + ": " + command.error());
+      if (input->empty()) {
+        return Nothing();
       }
 
-      LOG(INFO) << "Insert following iptables rule for overlay " << name
-                << ": " << command.get();
+      LOG(INFO) << "Restoring following iptables rules for overlays "
+                << strings::join(", ", names) << ":\n" << input.get();
+
+      return runCommand(
+          "iptables-restore",
+          {"iptables-restore", "-w", "--noflush"},
+          timeout,
+          input.get())
+        .then([]() -> Future<Nothing> {
+          return Nothing();
+        });
+    }));
+}
+
+
+Future<Nothing> ManagerProcess::scriptRules(
+    const vector<string>& names,
+    bool isolation)
+{
+  Duration timeout = Milliseconds(networkConfig.command_timeout());
+
+  // The below command is a script consisting of three commands:
+  // <set ipset> && <check iptables rule exists> ||
+  // <insert iptables rule>
+  vector<Future<string>> futures;
+  foreach (const string& name, names) {
+    CHECK(overlays.contains(name));
+
+    if (!overlays[name].info().has_subnet()) {
+      continue;
     }
 
-    // We have to explicitly chain the `onFailed` and `onDiscarded`
-    // events since we need to update the `State` of the overlay
-    // network on failure to execute the iptables script.
-    //
-    // NOTE: If we use `onAny` instead of `onFailed` and
-    // `onDiscarded`, and handle all conditions (success as well as
-    // failure) in the `onAny` callback, it causes a race with the
-    // callback setup in the `await` which listens to this future
-    // (checkout `updateAgentOverlays` method). Reason being that
-    // when a future is READY, all the READY callbacks are invoked
-    // before the `onAny` callbacks are invoked. This can result in
-    // the callback setup by `await` being invoked before the
-    // `onAny` call we seutp in this `Future`. This can cause
-    // problems since we check the overlay `State` in
-    // `_updateAgentOverlays`, which might not be set if this race
-    // were to occur, even though the overlay configuration went
-    // through fine.
-    Duration timeout = Milliseconds(networkConfig.command_timeout());
-    return runScriptCommand(command.get(), timeout)
-      .then(defer(self(), overlaySuccess))
-      .onFailed(defer(self(), overlayFailure))
-      .onDiscarded(defer(self(), lambda::bind(overlayFailure, "discarded")));
+    const string overlaySubnet = overlays[name].info().subnet();
+
+    Try<string> command = strings::format(
+        "ipset add -exist %s %s" " nomatch &&"
+        " iptables -w -t nat -C POSTROUTING -s %s -m set"
+        " --match-set %s dst -j MASQUERADE ||"
+        " iptables -w -t nat -A POSTROUTING -s %s -m"
+        " set --match-set %s dst -j MASQUERADE",
+        IPSET_OVERLAY,
+        overlaySubnet,
+        overlaySubnet,
+        IPSET_OVERLAY,
+        overlaySubnet,
+        IPSET_OVERLAY);
+
+    if (command.isError()) {
+      return Failure(
+          "Unable to create iptables rule for overlay " +
+          name + ": " + command.error());
+    }
+
+    LOG(INFO) << "Insert following iptables rule for overlay " << name
+              << ": " << command.get();
+
+    futures.push_back(runScriptCommand(command.get(), timeout));
+  }
+
+  Future<Nothing> masquerade = collect(futures)
+    .then([]() -> Future<Nothing> {
+      return Nothing();
+    });
+
+  if (!isolation) {
+    return masquerade;
+  }
+
+  return masquerade
+    .then(defer(self(), &Self::bypassDockerIsolation));
+}
+
+
+// Returns whether `current`, the output of `ipset save`, has the
+// `nomatch` entry of `subnet` in the overlay set.
+static bool hasIpsetEntry(const string& current, const string& subnet)
+{
+  foreach (const string& line, strings::tokenize(current, "\n")) {
+    vector<string> tokens = strings::tokenize(line, " ");
+
+    if (tokens.size() > 2 &&
+        tokens[0] == "add" &&
+        tokens[1] == IPSET_OVERLAY &&
+        tokens[2] == subnet &&
+        std::find(tokens.begin(), tokens.end(), "nomatch") != tokens.end()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+Future<Nothing> ManagerProcess::recover()
+{
+  if (workDir.isNone()) {
+    return Nothing();
+  }
+
+  const string path = path::join(workDir.get(), AGENT_CHECKPOINT);
+  if (!os::exists(path)) {
+    LOG(INFO) << "No checkpointed overlays found at " << path;
+    return Nothing();
+  }
+
+  Result<AgentCheckpoint> checkpoint =
+    ::protobuf::read<AgentCheckpoint>(path);
+
+  if (checkpoint.isError()) {
+    return Failure("Unable to read checkpoint: " + checkpoint.error());
+  }
+
+  if (checkpoint.isNone()) {
+    return Failure("Checkpoint " + path + " is empty");
+  }
+
+  if (checkpoint->network_config().SerializeAsString() !=
+      networkConfig.SerializeAsString()) {
+    LOG(INFO) << "Not recovering the checkpointed overlays since the "
+              << "network configuration of the agent has changed";
+    return Nothing();
+  }
+
+  // Rather than reconfiguring the overlays we look up the state they
+  // need with a single `iptables-save`, a single `ipset save` and a
+  // `docker network inspect` per Docker network.
+  Duration timeout = Milliseconds(networkConfig.command_timeout());
+
+  Future<string> iptables = string();
+  Future<string> ipset = string();
+  if (networkConfig.mesos_bridge() || networkConfig.docker_bridge()) {
+    iptables = runCommand(
+        "iptables-save",
+        {"iptables-save"},
+        timeout,
+        None(),
+        Priority::HIGH);
+
+    ipset = runCommand(
+        "ipset",
+        {"ipset", "save", IPSET_OVERLAY},
+        timeout,
+        None(),
+        Priority::HIGH);
+  }
+
+  vector<Future<bool>> docker;
+  foreach (const AgentCheckpoint::Overlay& overlay, checkpoint->overlays()) {
+    if (networkConfig.docker_bridge() &&
+        overlay.overlay().has_docker_bridge()) {
+      docker.push_back(checkDockerNetwork(overlay.overlay().info().name()));
+    } else {
+      docker.push_back(true);
+    }
+  }
+
+  return collect(iptables, ipset, collect(docker))
+    .then(defer(self(), &Self::_recover, checkpoint.get(), lambda::_1));
+}
+
+
+Future<Nothing> ManagerProcess::_recover(
+    const AgentCheckpoint& checkpoint,
+    const tuple<string, string, vector<bool>>& t)
+{
+  // The recovery has timed out meanwhile, and we might be registering
+  // with the overlays we have not recovered already.
+  if (!recovering) {
+    return Nothing();
+  }
+
+  const string& iptables = std::get<0>(t);
+  const string& ipset = std::get<1>(t);
+  const vector<bool>& docker = std::get<2>(t);
+
+  CHECK_EQ((size_t) checkpoint.overlays_size(), docker.size());
+
+  bool drifted = false;
+  for (int i = 0; i < checkpoint.overlays_size(); i++) {
+    const AgentOverlayInfo& overlay = checkpoint.overlays(i).overlay();
+    const string name = overlay.info().name();
+
+    Option<string> drift;
+
+    if (!docker[i]) {
+      drift = "Docker network is missing";
+    }
+
+    if (networkConfig.mesos_bridge() &&
+        overlay.has_mesos_bridge() &&
+        overlay.has_subnet()) {
+      Try<string> config = os::read(path::join(cniDir, name + ".conf"));
+
+      if (config.isError() ||
+          !checkpoint.overlays(i).has_cni_config() ||
+          checkpoint.overlays(i).cni_config() != config.get()) {
+        drift = "CNI config has changed";
+      } else {
+        cniConfigs[name] = config.get();
+      }
+    }
+
+    if ((networkConfig.mesos_bridge() || networkConfig.docker_bridge()) &&
+        overlay.info().has_subnet()) {
+      const string subnet = overlay.info().subnet();
+
+      Try<string> input = restoreInput(iptables, {subnet}, false);
+
+      if (!hasIpsetEntry(ipset, subnet)) {
+        drift = "ipset entry is missing";
+      } else if (input.isError() || !input->empty()) {
+        drift = "masquerade rule is missing";
+      }
+    }
+
+    if (drift.isSome()) {
+      LOG(INFO) << "Not recovering overlay '" << name << "' since its "
+                << drift.get();
+
+      cniConfigs.erase(name);
+      drifted = true;
+      continue;
+    }
+
+    LOG(INFO) << "Recovered overlay '" << name << "'";
+
+    overlays[name] = overlay;
   }
+
+  // If all the overlays are still configured, the master only needs to
+  // acknowledge our registration.
+  //
+  // NOTE: We only let the agent progress, see `ready()`, once the
+  // master has acknowledged it, since it might have changed or removed
+  // the overlays while we were down.
+  if (!drifted && !overlays.empty()) {
+    if (checkpoint.has_config_version()) {
+      configuredVersion = checkpoint.config_version();
+    }
+  }
+
   return Nothing();
 }
 
 
+// Flushes the file or directory at `path` to disk.
+static Try<Nothing> sync(const string& path)
+{
+  Try<int_fd> fd = os::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd.isError()) {
+    return Error("Unable to open '" + path + "': " + fd.error());
+  }
+
+  Try<Nothing> fsync = os::fsync(fd.get());
+  os::close(fd.get());
+
+  if (fsync.isError()) {
+    return Error("Unable to fsync '" + path + "': " + fsync.error());
+  }
+
+  return Nothing();
+}
+
+
+void ManagerProcess::checkpoint()
+{
+  if (workDir.isNone()) {
+    return;
+  }
+
+  AgentCheckpoint checkpoint;
+  checkpoint.mutable_network_config()->CopyFrom(networkConfig);
+
+  if (configuredVersion.isSome()) {
+    checkpoint.mutable_config_version()->CopyFrom(configuredVersion.get());
+  }
+
+  foreachvalue (const AgentOverlayInfo& overlay, overlays) {
+    if (!overlay.has_state() ||
+        overlay.state().status() != OverlayState::STATUS_OK) {
+      continue;
+    }
+
+    AgentCheckpoint::Overlay* _overlay = checkpoint.add_overlays();
+    _overlay->mutable_overlay()->CopyFrom(overlay);
+
+    const string name = overlay.info().name();
+    if (cniConfigs.contains(name)) {
+      _overlay->set_cni_config(cniConfigs.at(name));
+    }
+  }
+
+  Try<Nothing> mkdir = os::mkdir(workDir.get());
+  if (mkdir.isError()) {
+    LOG(ERROR) << "Unable to create work dir: " << mkdir.error();
+    return;
+  }
+
+  // Write and sync a temporary file first, and sync the directory
+  // after renaming it, so that neither a crash nor a power loss leaves
+  // a partial checkpoint behind.
+  const string path = path::join(workDir.get(), AGENT_CHECKPOINT);
+
+  Try<Nothing> write = ::protobuf::write(path + ".tmp", checkpoint);
+  if (write.isError()) {
+    LOG(ERROR) << "Unable to checkpoint the overlays: " << write.error();
+    return;
+  }
+
+  Try<Nothing> synced = sync(path + ".tmp");
+  if (synced.isError()) {
+    LOG(ERROR) << "Unable to checkpoint the overlays: " << synced.error();
+    return;
+  }
+
+  Try<Nothing> rename = os::rename(path + ".tmp", path);
+  if (rename.isError()) {
+    LOG(ERROR) << "Unable to checkpoint the overlays: " << rename.error();
+    return;
+  }
+
+  synced = sync(workDir.get());
+  if (synced.isError()) {
+    LOG(ERROR) << "Unable to checkpoint the overlays: " << synced.error();
+  }
+}
+
+
 Future<Nothing> ManagerProcess::configureMesosNetwork(const string& name)
 {
   CHECK(overlays.contains(name));
@@ -774,14 +1498,15 @@ Future<Nothing> ManagerProcess::configureMesosNetwork(const string& name)
       });
   };
 
-  Try<Nothing> write = os::write(
-      path::join(cniDir, name + ".conf"),
-      jsonify(config));
+  const string json = jsonify(config);
 
+  Try<Nothing> write = os::write(path::join(cniDir, name + ".conf"), json);
   if (write.isError()) {
     return Failure("Failed to write CNI config: " + write.error());
   }
 
+  cniConfigs[name] = json;
+
   return Nothing();
 }
 
@@ -811,7 +1536,9 @@ Future<Nothing> ManagerProcess::configureDockerNetwork(const string& name)
 }
 
 
-Future<bool> ManagerProcess::checkDockerNetwork(const string& name)
+// Checks whether the Docker network `name` exists with the `docker`
+// CLI.
+static Future<bool> inspectDockerNetwork(const string& name)
 {
   vector<string> argv = {
     "docker",
@@ -846,6 +1573,26 @@ Future<bool> ManagerProcess::checkDockerNetwork(const string& name)
 }
 
 
+Future<bool> ManagerProcess::checkDockerNetwork(const string& name)
+{
+  if (dockerClient.get() == nullptr) {
+    return inspectDockerNetwork(name);
+  }
+
+  return dockerClient->networkExists(
+      name,
+      Milliseconds(networkConfig.command_timeout()))
+    .repair(defer(self(), [name](const Future<bool>& exists) {
+      LOG(WARNING) << "Unable to inspect Docker network '" << name
+                   << "' through the Docker Engine API, falling back to "
+                   << "the `docker` CLI: "
+                   << (exists.isFailed() ? exists.failure() : "discarded");
+
+      return inspectDockerNetwork(name);
+    }));
+}
+
+
 Future<Nothing> ManagerProcess::_configureDockerNetwork(
     const string& name,
     bool exists)
@@ -914,7 +1661,60 @@ Future<Nothing> ManagerProcess::_configureDockerNetwork(
   }
 
   Duration timeout = Milliseconds(networkConfig.command_timeout());
-  return runScriptCommand(dockerCommand.get(), timeout)
+
+  if (dockerClient.get() == nullptr) {
+    return runScriptCommand(dockerCommand.get(), timeout)
+      .then(defer(self(),
+            &Self::__configureDockerNetwork,
+            name,
+            lambda::_1));
+  }
+
+  // The same network as with the above command, as described by the
+  // Docker Engine API.
+  JSON::Object options;
+  options.values["com.docker.network.bridge.name"] =
+    overlay.docker_bridge().name();
+  options.values["com.docker.network.bridge.enable_ip_masquerade"] = "false";
+  options.values["com.docker.network.driver.mtu"] =
+    stringify(networkConfig.overlay_mtu());
+
+  JSON::Array config;
+  const vector<Option<Network>> subnets = {subnet, subnet6};
+  foreach (const Option<Network>& _subnet, subnets) {
+    if (_subnet.isSome()) {
+      JSON::Object ipam;
+      ipam.values["Subnet"] = stringify(_subnet.get());
+      config.values.push_back(ipam);
+    }
+  }
+
+  JSON::Object ipam;
+  ipam.values["Config"] = config;
+
+  JSON::Object network;
+  network.values["Name"] = name;
+  network.values["Driver"] = "bridge";
+  network.values["CheckDuplicate"] = JSON::Boolean(true);
+  network.values["EnableIPv6"] = JSON::Boolean(subnet6.isSome());
+  network.values["IPAM"] = ipam;
+  network.values["Options"] = options;
+
+  const string command = dockerCommand.get();
+
+  return dockerClient->createNetwork(network, timeout)
+    .then([]() -> Future<string> {
+      return string();
+    })
+    .repair(defer(self(), [name, command, timeout](
+        const Future<string>& create) {
+      LOG(WARNING) << "Unable to create Docker network '" << name
+                   << "' through the Docker Engine API, falling back to "
+                   << "the `docker` CLI: "
+                   << (create.isFailed() ? create.failure() : "discarded");
+
+      return runScriptCommand(command, timeout);
+    }))
     .then(defer(self(),
           &Self::__configureDockerNetwork,
           name,
@@ -933,6 +1733,18 @@ Future<Nothing> ManagerProcess::__configureDockerNetwork(
         (result.isDiscarded() ? "discarded" : result.failure()));
   }
 
+  // With `restore_rules` the bypass is installed together with the
+  // other iptables rules of the overlay, see `applyRules`.
+  if (networkConfig.restore_rules()) {
+    return Nothing();
+  }
+
+  return bypassDockerIsolation();
+}
+
+
+Future<Nothing> ManagerProcess::bypassDockerIsolation()
+{
   // We want all overlay instances to talk to each other.
   // However, Docker disallows this. So we will install a de-funct
   // rule in the DOCKER-ISOLATION chain to bypass any isolation
@@ -957,17 +1769,23 @@ Future<Nothing> ManagerProcess::__configureDockerNetwork(
 ManagerProcess::ManagerProcess(
     const string& _cniDir,
     Option<string> _cniDataDir,
+    Option<string> _workDir,
     const AgentNetworkConfig _networkConfig,
     const uint32_t _maxConfigAttempts,
-    Owned<MasterDetector> _detector)
+    Owned<MasterDetector> _detector,
+    Owned<DockerClient> _dockerClient)
 : ProcessBase(AGENT_MANAGER_PROCESS_ID),
   cniDir(_cniDir),
   cniDataDir(_cniDataDir),
+  workDir(_workDir),
   networkConfig(_networkConfig),
   maxConfigAttempts(_maxConfigAttempts),
-  detector(_detector)
+  detector(_detector),
+  dockerClient(_dockerClient)
 {
   configAttempts = 0;
+  applyingRules = false;
+  recovering = false;
 
   // Make the Manager wait only if we have to configure mesos
   // networks.
@@ -1,15 +1,22 @@
 #ifndef __AGENT_OVERLAY_MANAGER_HPP__
 #define __AGENT_OVERLAY_MANAGER_HPP__
 
+#include <string>
+#include <vector>
+
 #include <process/future.hpp>
 #include <process/http.hpp>
 #include <process/process.hpp>
 #include <process/protobuf.hpp>
+#include <process/timer.hpp>
+
+#include <stout/try.hpp>
 
 #include <mesos/master/detector.hpp>
 #include <mesos/mesos.hpp>
 #include <mesos/module/anonymous.hpp>
 
+#include <overlay/docker.hpp>
 #include <overlay/messages.hpp>
 
 namespace mesos {
@@ -17,6 +24,15 @@ namespace modules {
 namespace overlay {
 namespace agent {
 
+// Returns the `iptables-restore` input installing the rules for
+// `subnets`, and the DOCKER-ISOLATION bypass if `isolation` is set,
+// which are missing from `current`, the output of `iptables-save`.
+Try<std::string> restoreInput(
+    const std::string& current,
+    const std::vector<std::string>& subnets,
+    bool isolation);
+
+
 class ManagerProcess : public ProtobufProcess<ManagerProcess>
 {
 public:
@@ -28,16 +44,34 @@ public:
   process::Future<Nothing> ready();
 
 protected:
-  void agentRegisteredAcknowledgement(const process::UPID& from);
+  void agentRegisteredAcknowledgement(
+      const process::UPID& from,
+      const overlay::internal::AgentRegisteredAcknowledgement& message);
+
+  void updateConfiguredVersion(
+      const overlay::internal::AgentRegisteredAcknowledgement& message);
 
   void detected(const process::Future<Option<MasterInfo>>& mesosMaster);
 
   void doReliableRegistration(Duration maxBackoff);
 
+  void retryRegistration(
+      const process::UPID& from,
+      const overlay::internal::RetryRegistrationMessage& message);
+
   virtual void exited(const process::UPID& pid);
 
   virtual void initialize();
 
+  // Restores the checkpointed overlays which are still configured.
+  process::Future<Nothing> recover();
+
+  process::Future<Nothing> _recover(
+      const overlay::internal::AgentCheckpoint& checkpoint,
+      const std::tuple<std::string, std::string, std::vector<bool>>& t);
+
+  void checkpoint();
+
   process::Future<process::http::Response> overlay(
       const process::http::Request& request);
 
@@ -61,11 +95,28 @@ protected:
 
   process::Future<bool> checkDockerNetwork(const std::string& name);
 
+  process::Future<Nothing> bypassDockerIsolation();
+
+  // Installs the ipset and iptables rules for the overlay `name`,
+  // together with the rules of any other overlay being configured.
+  process::Future<Nothing> installRules(const std::string& name);
+
+  void applyRules();
+
+  process::Future<Nothing> restoreRules(
+      const std::vector<std::string>& names,
+      bool isolation);
+
+  process::Future<Nothing> scriptRules(
+      const std::vector<std::string>& names,
+      bool isolation);
+
   void updateAgentOverlays(
       const process::UPID& from,
       const overlay::internal::UpdateAgentOverlaysMessage& message);
 
   void _updateAgentOverlays(
+      const overlay::internal::UpdateAgentOverlaysMessage& update,
       const process::Future<std::vector<process::Future<Nothing>>>& results);
 
 private:
@@ -79,9 +130,11 @@ private:
   ManagerProcess(
       const std::string& _cniDir,
       Option<std::string> _cniDataDir,
+      Option<std::string> _workDir,
       const overlay::internal::AgentNetworkConfig _networkConfig,
       const uint32_t _maxConfigAttempts,
-      process::Owned<master::detector::MasterDetector> _detector);
+      process::Owned<master::detector::MasterDetector> _detector,
+      process::Owned<DockerClient> _dockerClient);
 
   static Try<process::Owned<master::detector::MasterDetector>> createDetector(
       const internal::AgentConfig& agentConfig);
@@ -90,6 +143,8 @@ private:
 
   Option<std::string> cniDataDir;
 
+  const Option<std::string> workDir;
+
   const overlay::internal::AgentNetworkConfig networkConfig;
 
   State state;
@@ -98,13 +153,36 @@ private:
 
   Option<process::UPID> overlayMaster;
 
+  // The next attempt of `doReliableRegistration`, if any.
+  Option<process::Timer> registrationTimer;
+
   hashmap<std::string, overlay::AgentOverlayInfo> overlays;
 
+  // Whether the checkpointed overlays are still being recovered.
+  bool recovering;
+
+  // The CNI configs written for the `overlays`.
+  hashmap<std::string, std::string> cniConfigs;
+
+  // The version of the `overlays` acknowledged by the overlay master,
+  // if all of them have been configured.
+  Option<overlay::internal::ConfigVersion> configuredVersion;
+
+  // Overlays whose rules wait for the next `iptables-restore` batch,
+  // and the promise satisfied once that batch has been applied, or
+  // failed if the rules of any of its overlays could not be installed.
+  std::vector<std::string> pendingRules;
+  process::Owned<process::Promise<Nothing>> rulesApplied;
+  bool applyingRules;
+
   const uint32_t maxConfigAttempts;
 
   uint32_t configAttempts;
 
   process::Owned<master::detector::MasterDetector> detector;
+
+  // Client of the Docker Engine API, unless the `docker` CLI is used.
+  process::Owned<DockerClient> dockerClient;
 };
 
 
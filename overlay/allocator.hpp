@@ -0,0 +1,432 @@
+#ifndef __OVERLAY_ALLOCATOR_HPP__
+#define __OVERLAY_ALLOCATOR_HPP__
+
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include <stout/error.hpp>
+#include <stout/ip.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+#include "network.hpp"
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+
+// A set of the indices in `[0, size)`, each of which is either free or
+// allocated. The lowest free index is allocated first.
+//
+// The indices are kept in a tree of 64 bit bitmaps: the leaves mark
+// the allocated indices, and the inner nodes mark the children whose
+// indices are all allocated. A subtree is only materialized once one
+// of its indices is allocated, and is released once all of them are
+// free again, so the footprint follows the number of allocated indices
+// rather than the `size`. Every operation walks a single path of the
+// tree, i.e. takes O(log64(size)) steps.
+class IndexAllocator
+{
+public:
+  // The most indices an allocator can hold.
+  static constexpr uint64_t MAX_SIZE = uint64_t(1) << 62;
+
+  explicit IndexAllocator(uint64_t _size)
+    : size_(_size < MAX_SIZE ? _size : MAX_SIZE),
+      levels(1),
+      allocated_(0)
+  {
+    // Each level multiplies the indices covered by the root by 64.
+    while (levels * BITS < 64 && (uint64_t(1) << (levels * BITS)) < size_) {
+      levels++;
+    }
+  }
+
+  // Allocates the lowest free index, if any.
+  Option<uint64_t> allocate()
+  {
+    const uint64_t index = lowest();
+    if (index >= size_) {
+      return None();
+    }
+
+    set(&root, levels - 1, index);
+    allocated_++;
+
+    return index;
+  }
+
+  // Allocates the given index. Returns false if it is not free.
+  bool reserve(uint64_t index)
+  {
+    if (index >= size_ || !set(&root, levels - 1, index)) {
+      return false;
+    }
+
+    allocated_++;
+    return true;
+  }
+
+  // Frees the given index. Returns false if it is not allocated.
+  bool free(uint64_t index)
+  {
+    if (index >= size_ || !clear(&root, levels - 1, index)) {
+      return false;
+    }
+
+    allocated_--;
+    return true;
+  }
+
+  // Whether the given index is free.
+  bool contains(uint64_t index) const
+  {
+    if (index >= size_) {
+      return false;
+    }
+
+    const Node* node = root.get();
+    for (int level = levels - 1; node != nullptr; level--) {
+      const uint64_t mask = uint64_t(1) << slot(index, level);
+      if (node->full & mask) {
+        return false;
+      }
+
+      if (level == 0) {
+        return true;
+      }
+
+      node = node->children[slot(index, level)].get();
+    }
+
+    return true;
+  }
+
+  uint64_t size() const { return size_; }
+
+  uint64_t allocated() const { return allocated_; }
+
+private:
+  static constexpr int BITS = 6;
+  static constexpr uint64_t ALL = ~uint64_t(0);
+
+  struct Node
+  {
+    Node() : full(0), present(0) {}
+
+    // In a leaf, the allocated indices. In an inner node, the children
+    // whose indices are all allocated.
+    uint64_t full;
+
+    // In an inner node, the materialized children.
+    uint64_t present;
+    std::unique_ptr<std::unique_ptr<Node>[]> children;
+  };
+
+  // The position of the `index` among the 64 slots of its node at the
+  // given level.
+  static unsigned slot(uint64_t index, int level)
+  {
+    return (index >> (level * BITS)) & 63;
+  }
+
+  // Returns the lowest free index, which may be beyond the `size_`.
+  uint64_t lowest() const
+  {
+    const Node* node = root.get();
+    uint64_t index = 0;
+
+    for (int level = levels - 1; level >= 0; level--) {
+      if (node == nullptr) {
+        // All indices of this subtree are free.
+        //
+        // NOTE: An empty root would be shifted by 64 bits or more,
+        // e.g. by 66 bits for 2^62 indices, which is undefined.
+        return index == 0 ? 0 : index << ((level + 1) * BITS);
+      }
+
+      if (node->full == ALL) {
+        return size_;
+      }
+
+      const unsigned bit = __builtin_ctzll(~node->full);
+      index = (index << BITS) | bit;
+
+      if (level > 0) {
+        node = node->children[bit].get();
+      }
+    }
+
+    return index;
+  }
+
+  static bool set(std::unique_ptr<Node>* node, int level, uint64_t index)
+  {
+    if (*node == nullptr) {
+      node->reset(new Node());
+    }
+
+    const unsigned bit = slot(index, level);
+    const uint64_t mask = uint64_t(1) << bit;
+
+    if ((*node)->full & mask) {
+      return false;
+    }
+
+    if (level == 0) {
+      (*node)->full |= mask;
+      return true;
+    }
+
+    if ((*node)->children == nullptr) {
+      (*node)->children.reset(new std::unique_ptr<Node>[64]);
+    }
+
+    std::unique_ptr<Node>* child = &(*node)->children[bit];
+    if (!set(child, level - 1, index)) {
+      return false;
+    }
+
+    (*node)->present |= mask;
+    if ((*child)->full == ALL) {
+      (*node)->full |= mask;
+    }
+
+    return true;
+  }
+
+  static bool clear(std::unique_ptr<Node>* node, int level, uint64_t index)
+  {
+    if (*node == nullptr) {
+      return false;
+    }
+
+    const unsigned bit = slot(index, level);
+    const uint64_t mask = uint64_t(1) << bit;
+
+    if (level == 0) {
+      if (!((*node)->full & mask)) {
+        return false;
+      }
+
+      (*node)->full &= ~mask;
+    } else {
+      std::unique_ptr<Node>* child = &(*node)->children[bit];
+      if (!clear(child, level - 1, index)) {
+        return false;
+      }
+
+      (*node)->full &= ~mask;
+      if (*child == nullptr) {
+        (*node)->present &= ~mask;
+      }
+    }
+
+    // Release the node once all of its indices are free.
+    if ((*node)->full == 0 && (*node)->present == 0) {
+      node->reset();
+    }
+
+    return true;
+  }
+
+  const uint64_t size_;
+  int levels;
+  uint64_t allocated_;
+
+  std::unique_ptr<Node> root;
+};
+
+
+// Allocates the subnets with a fixed `prefix` of a `network`, e.g. the
+// agent subnets of an overlay. With the full prefix length (32 or 128)
+// this allocates the addresses of the `network` instead.
+//
+// NOTE: Of IPv6 networks with more than 2^62 subnets, only the first
+// 2^62 subnets are allocated.
+class SubnetAllocator
+{
+public:
+  SubnetAllocator(const Network& _network, uint8_t _prefix)
+    : network(_network),
+      prefix(_prefix),
+      width(_network.address().family() == AF_INET ? 32 : 128),
+      base(toInteger(_network.begin())),
+      mask(toInteger(_network.netmask())),
+      indices(count(_network.prefix(), _prefix))
+  {}
+
+  Try<Network> allocate()
+  {
+    Option<uint64_t> index = indices.allocate();
+    if (index.isNone()) {
+      return Error("All subnets of " + stringify(network) + " are allocated");
+    }
+
+    return subnet(index.get());
+  }
+
+  Try<Nothing> reserve(const Network& subnet)
+  {
+    Try<uint64_t> _index = index(subnet);
+    if (_index.isError()) {
+      return Error(_index.error());
+    }
+
+    if (!indices.reserve(_index.get())) {
+      return Error(stringify(subnet) + " is allocated already");
+    }
+
+    return Nothing();
+  }
+
+  // Allocates all of the given subnets, stopping at the first one which
+  // cannot be allocated.
+  //
+  // NOTE: The subnets are not sorted first, as that takes longer than
+  // setting their bits one by one.
+  Try<Nothing> reserve(const std::vector<Network>& subnets)
+  {
+    for (const Network& subnet : subnets) {
+      Try<uint64_t> _index = index(subnet);
+      if (_index.isError()) {
+        return Error(_index.error());
+      }
+
+      if (!indices.reserve(_index.get())) {
+        return Error(stringify(subnet) + " is allocated already");
+      }
+    }
+
+    return Nothing();
+  }
+
+  Try<Nothing> free(const Network& subnet)
+  {
+    Try<uint64_t> _index = index(subnet);
+    if (_index.isError()) {
+      return Error(_index.error());
+    }
+
+    if (!indices.free(_index.get())) {
+      return Error(stringify(subnet) + " is not allocated");
+    }
+
+    return Nothing();
+  }
+
+  // Whether the given subnet is free.
+  bool contains(const Network& subnet) const
+  {
+    Try<uint64_t> _index = index(subnet);
+    return _index.isSome() && indices.contains(_index.get());
+  }
+
+  // The first and last subnet of the `network`.
+  Network first() const { return subnet(0); }
+  Network last() const { return subnet(indices.size() - 1); }
+
+  // Whether all subnets of the `network` can be allocated, i.e. the
+  // `last` subnet is the last one of the `network`.
+  bool complete() const
+  {
+    return prefix <= network.prefix() + 62;
+  }
+
+  uint64_t size() const { return indices.size(); }
+  uint64_t allocated() const { return indices.allocated(); }
+
+private:
+  typedef unsigned __int128 Integer;
+
+  // The number of subnets with the `prefix` in a network with the
+  // `networkPrefix`, which may be capped by the `IndexAllocator`.
+  static uint64_t count(uint8_t networkPrefix, uint8_t prefix)
+  {
+    const int bits = prefix > networkPrefix ? prefix - networkPrefix : 0;
+    return bits >= 62 ? IndexAllocator::MAX_SIZE : uint64_t(1) << bits;
+  }
+
+  static Integer toInteger(const net::IP& ip)
+  {
+    if (ip.family() == AF_INET) {
+      return ntohl(ip.in().get().s_addr);
+    }
+
+    const in6_addr in6 = ip.in6().get();
+
+    Integer value = 0;
+    for (int i = 0; i < 16; i++) {
+      value = (value << 8) | in6.s6_addr[i];
+    }
+
+    return value;
+  }
+
+  net::IP toIP(Integer value) const
+  {
+    if (width == 32) {
+      return net::IP(static_cast<uint32_t>(value));
+    }
+
+    in6_addr in6;
+    for (int i = 15; i >= 0; i--) {
+      in6.s6_addr[i] = static_cast<uint8_t>(value);
+      value >>= 8;
+    }
+
+    return net::IP(in6);
+  }
+
+  Try<uint64_t> index(const Network& subnet) const
+  {
+    if (subnet.address().family() != network.address().family()) {
+      return Error(
+          stringify(subnet) + " is not of the family of " +
+          stringify(network));
+    }
+
+    if (subnet.prefix() != prefix) {
+      return Error(
+          "The prefix of " + stringify(subnet) + " does not match the"
+          " prefix " + stringify(prefix) + " of " + stringify(network));
+    }
+
+    const Integer address = toInteger(subnet.address());
+    if ((address & mask) != base) {
+      return Error(stringify(subnet) + " is not in " + stringify(network));
+    }
+
+    const Integer offset = (address - base) >> (width - prefix);
+    if (offset >= indices.size()) {
+      return Error(stringify(subnet) + " is beyond the allocated range");
+    }
+
+    return static_cast<uint64_t>(offset);
+  }
+
+  Network subnet(uint64_t index) const
+  {
+    const Integer address = base + (Integer(index) << (width - prefix));
+    return Network(toIP(address), prefix);
+  }
+
+  const Network network;
+  const uint8_t prefix;
+  const int width;
+  const Integer base;
+  const Integer mask;
+
+  IndexAllocator indices;
+};
+
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_ALLOCATOR_HPP__
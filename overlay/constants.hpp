@@ -12,6 +12,9 @@ namespace agent {
 
 constexpr char IPSET_OVERLAY[] = "overlay";
 
+// File under the `work_dir` where the agent checkpoints its overlays.
+constexpr char AGENT_CHECKPOINT[] = "agent_checkpoint";
+
 } // namespace agent {
 } // namespace overlay {
 } // namespace modules {
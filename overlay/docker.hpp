@@ -0,0 +1,353 @@
+#ifndef __OVERLAY_DOCKER_HPP__
+#define __OVERLAY_DOCKER_HPP__
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <process/address.hpp>
+#include <process/defer.hpp>
+#include <process/dispatch.hpp>
+#include <process/future.hpp>
+#include <process/http.hpp>
+#include <process/id.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
+#include <stout/lambda.hpp>
+#include <stout/nothing.hpp>
+#include <stout/option.hpp>
+#include <stout/stringify.hpp>
+#include <stout/try.hpp>
+
+namespace mesos {
+namespace modules {
+namespace overlay {
+namespace agent {
+
+// Sends requests to the Docker Engine API over the unix socket of the
+// Docker daemon. The connections are kept open and reused. Up to
+// `maxConnections` of them are opened on demand, so that concurrent
+// requests do not wait for each other. A request which is discarded,
+// e.g. since it has timed out, is dropped, and the connection it was
+// sent on is closed.
+class DockerClientProcess : public process::Process<DockerClientProcess>
+{
+public:
+  DockerClientProcess(
+      const process::network::unix::Address& _address,
+      size_t _maxConnections)
+    : ProcessBase(process::ID::generate("overlay-docker-client")),
+      address(_address),
+      maxConnections(_maxConnections),
+      connections(0),
+      connecting(0),
+      nextRequestId(0) {}
+
+  process::Future<process::http::Response> send(
+      const std::string& method,
+      const std::string& path,
+      const Option<std::string>& body)
+  {
+    Request request;
+    request.request.method = method;
+    request.request.keepAlive = true;
+    request.request.url.scheme = "http";
+    request.request.url.domain = "";
+    request.request.url.path = path;
+
+    // The Docker daemon insists on a `Host` header, even though it
+    // is meaningless on a unix socket.
+    request.request.headers = {{"Host", "docker"}};
+
+    if (body.isSome()) {
+      request.request.headers["Content-Type"] = "application/json";
+      request.request.body = body.get();
+    }
+
+    request.id = nextRequestId++;
+
+    request.promise->future()
+      .onDiscard(process::defer(self(), &Self::discarded, request.id));
+
+    pending.push_back(request);
+
+    schedule();
+
+    return request.promise->future();
+  }
+
+protected:
+  virtual void finalize()
+  {
+    fail("Docker client terminated");
+
+    foreach (process::http::Connection connection, idle) {
+      connection.disconnect();
+    }
+  }
+
+private:
+  struct Request
+  {
+    Request() : promise(new process::Promise<process::http::Response>()) {}
+
+    uint64_t id;
+    process::http::Request request;
+    process::Owned<process::Promise<process::http::Response>> promise;
+  };
+
+  // Sends the pending requests on the idle connections, and opens
+  // new connections for the rest while we can.
+  void schedule()
+  {
+    while (!pending.empty() && !idle.empty()) {
+      process::http::Connection connection = idle.back();
+      idle.pop_back();
+
+      Request request = pending.front();
+      pending.pop_front();
+
+      sending.put(request.id, connection);
+
+      request.promise->associate(connection.send(request.request));
+
+      request.promise->future()
+        .onAny(process::defer(
+            self(),
+            &Self::sent,
+            request.id,
+            connection,
+            lambda::_1));
+    }
+
+    while (pending.size() > connecting && connections < maxConnections) {
+      connections++;
+      connecting++;
+
+      process::http::connect(address, process::http::Scheme::HTTP)
+        .onAny(process::defer(self(), &Self::connected, lambda::_1));
+    }
+  }
+
+  void connected(const process::Future<process::http::Connection>& connection)
+  {
+    connecting--;
+
+    if (!connection.isReady()) {
+      connections--;
+
+      // Without any connection, the pending requests would never be
+      // sent.
+      if (connections == 0) {
+        fail("Unable to connect to Docker: " +
+             (connection.isFailed() ? connection.failure() : "discarded"));
+      }
+
+      return;
+    }
+
+    idle.push_back(connection.get());
+
+    connection->disconnected()
+      .onAny(process::defer(
+          self(),
+          &Self::disconnected,
+          connection.get()));
+
+    schedule();
+  }
+
+  void sent(
+      uint64_t id,
+      process::http::Connection connection,
+      const process::Future<process::http::Response>& response)
+  {
+    sending.erase(id);
+
+    // The connection is in an unknown state after a failed request, so
+    // we close it rather than reusing it.
+    if (!response.isReady()) {
+      connection.disconnect();
+      return;
+    }
+
+    if (connection.disconnected().isPending()) {
+      idle.push_back(connection);
+      schedule();
+    }
+  }
+
+  // Drops a request which has not been sent yet. Otherwise, we do not
+  // know whether the Docker daemon is still working on it, so we close
+  // its connection rather than queueing further requests behind it.
+  void discarded(uint64_t id)
+  {
+    if (sending.contains(id)) {
+      process::http::Connection connection = sending.at(id);
+      connection.disconnect();
+      return;
+    }
+
+    std::deque<Request>::iterator request = std::find_if(
+        pending.begin(),
+        pending.end(),
+        [id](const Request& request) { return request.id == id; });
+
+    if (request != pending.end()) {
+      request->promise->discard();
+      pending.erase(request);
+    }
+  }
+
+  void disconnected(const process::http::Connection& connection)
+  {
+    connections--;
+
+    idle.erase(
+        std::remove(idle.begin(), idle.end(), connection),
+        idle.end());
+
+    schedule();
+  }
+
+  void fail(const std::string& message)
+  {
+    while (!pending.empty()) {
+      pending.front().promise->fail(message);
+      pending.pop_front();
+    }
+  }
+
+  const process::network::unix::Address address;
+  const size_t maxConnections;
+
+  // Connections which are open or being opened.
+  size_t connections;
+  size_t connecting;
+
+  uint64_t nextRequestId;
+
+  std::vector<process::http::Connection> idle;
+  std::deque<Request> pending;
+
+  // The connections of the requests which have been sent.
+  hashmap<uint64_t, process::http::Connection> sending;
+};
+
+
+class DockerClient
+{
+public:
+  static Try<process::Owned<DockerClient>> create(
+      const std::string& socket,
+      size_t maxConnections = 4)
+  {
+    Try<process::network::unix::Address> address =
+      process::network::unix::Address::create(socket);
+
+    if (address.isError()) {
+      return Error(
+          "Invalid Docker socket '" + socket + "': " + address.error());
+    }
+
+    return process::Owned<DockerClient>(
+        new DockerClient(address.get(), maxConnections));
+  }
+
+  ~DockerClient()
+  {
+    process::terminate(process.get());
+    process::wait(process.get());
+  }
+
+  // Returns whether the Docker network `name` exists.
+  process::Future<bool> networkExists(
+      const std::string& name,
+      const Duration& timeout)
+  {
+    return send("GET", "/networks/" + name, None(), timeout)
+      .then([name](const process::http::Response& response)
+          -> process::Future<bool> {
+        if (response.code == process::http::Status::OK) {
+          return true;
+        }
+
+        if (response.code == process::http::Status::NOT_FOUND) {
+          return false;
+        }
+
+        return process::Failure(
+            "Unable to inspect Docker network '" + name + "': " +
+            process::http::Status::string(response.code) + ": " +
+            response.body);
+      });
+  }
+
+  // Creates a Docker network, as described by the `network` object
+  // of the Docker Engine API.
+  process::Future<Nothing> createNetwork(
+      const JSON::Object& network,
+      const Duration& timeout)
+  {
+    return send("POST", "/networks/create", stringify(network), timeout)
+      .then([](const process::http::Response& response)
+          -> process::Future<Nothing> {
+        if (response.code != process::http::Status::CREATED) {
+          return process::Failure(
+              "Unable to create Docker network: " +
+              process::http::Status::string(response.code) + ": " +
+              response.body);
+        }
+
+        return Nothing();
+      });
+  }
+
+private:
+  process::Future<process::http::Response> send(
+      const std::string& method,
+      const std::string& path,
+      const Option<std::string>& body,
+      const Duration& timeout)
+  {
+    return process::dispatch(
+        process.get(),
+        &DockerClientProcess::send,
+        method,
+        path,
+        body)
+      .after(timeout, [=](process::Future<process::http::Response> response)
+          -> process::Future<process::http::Response> {
+        // Let the client drop the request, and its connection if it has
+        // been sent.
+        response.discard();
+
+        return process::Failure(
+            "Docker request '" + method + " " + path + "' timed out after " +
+            stringify(timeout));
+      });
+  }
+
+  DockerClient(
+      const process::network::unix::Address& address,
+      size_t maxConnections)
+    : process(new DockerClientProcess(address, maxConnections))
+  {
+    process::spawn(process.get());
+  }
+
+  process::Owned<DockerClientProcess> process;
+};
+
+} // namespace agent {
+} // namespace overlay {
+} // namespace modules {
+} // namespace mesos {
+
+#endif // __OVERLAY_DOCKER_HPP__
@@ -1,16 +1,22 @@
 #include <stdio.h>
 
+#include <algorithm>
 #include <list>
 
 #include <stout/check.hpp>
+#include <stout/hashset.hpp>
 #include <stout/interval.hpp>
 #include <stout/json.hpp>
+#include <stout/jsonify.hpp>
 #include <stout/mac.hpp>
 #include <stout/os.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/stringify.hpp>
 #include <stout/try.hpp>
 
+#include <process/async.hpp>
+#include <process/authenticator.hpp>
+#include <process/clock.hpp>
 #include <process/collect.hpp>
 #include <process/defer.hpp>
 #include <process/delay.hpp>
@@ -18,10 +24,16 @@
 #include <process/help.hpp>
 #include <process/http.hpp>
 #include <process/io.hpp>
+#include <process/metrics/counter.hpp>
+#include <process/metrics/metrics.hpp>
+#include <process/metrics/pull_gauge.hpp>
+#include <process/metrics/push_gauge.hpp>
+#include <process/metrics/timer.hpp>
 #include <process/process.hpp>
 #include <process/protobuf.hpp>
 #include <process/subprocess.hpp>
 
+#include <mesos/http.hpp>
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
 #include <mesos/module/anonymous.hpp>
@@ -30,6 +42,7 @@
 #include <mesos/state/storage.hpp>
 #include <mesos/zookeeper/detector.hpp>
 
+#include "allocator.hpp"
 #include "messages.hpp"
 #include "network.hpp"
 #include "overlay.hpp"
@@ -47,11 +60,14 @@ using std::vector;
 
 using net::MAC;
 
+using process::AUTHENTICATION;
+using process::AUTHORIZATION;
 using process::DESCRIPTION;
 using process::HELP;
 using process::Owned;
 using process::Failure;
 using process::Future;
+using process::Promise;
 using process::TLDR;
 using process::UPID;
 using process::USAGE;
@@ -69,8 +85,10 @@ using mesos::modules::overlay::MESOS_QUORUM;
 using mesos::modules::overlay::internal::AgentNetworkConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::ConfigVersion;
 using mesos::modules::overlay::internal::MasterConfig;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RetryRegistrationMessage;
 using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 using mesos::modules::overlay::supervisor::ProcessSupervisor;
 using mesos::Parameters;
@@ -85,14 +103,42 @@ namespace master {
 
 constexpr char REPLICATED_LOG_STORE[] = "overlay_replicated_log";
 constexpr char REPLICATED_LOG_STORE_KEY[] = "network-state";
+constexpr char REPLICATED_LOG_STORE_AGENT_PREFIX[] = "network-state/agents/";
 constexpr char REPLICATED_LOG_STORE_REPLICAS[] = "overlay_log_replicas";
 
+// The number of agents whose addresses are parsed by each thread of a
+// recovering master, see `parseReservations`.
+constexpr int RECOVERY_BATCH_SIZE = 1024;
+
+// How long an agent is asked to wait before registering again, when
+// the master cannot take its registration right away. This grows with
+// the number of registrations which are pending or have been turned
+// away.
+constexpr Duration REGISTRATION_RETRY_AFTER = Seconds(1);
+
+// The authentication realm of the endpoints of the Mesos master which
+// change its state.
+constexpr char READWRITE_HTTP_AUTHENTICATION_REALM[] =
+  "mesos-master-readwrite";
+
 const string OVERLAY_HELP = HELP(
     TLDR("Allocate overlay network resources for Master."),
     USAGE("/overlay-master/overlays"),
     DESCRIPTION("Allocate subnets, VTEP IP and the MAC addresses.", "")
 );
 
+const string ENABLE_OVERLAY_HELP = HELP(
+    TLDR("Enable or disable an overlay network."),
+    USAGE("/overlay-master/overlays?name=<overlay>&enabled=<true|false>"),
+    DESCRIPTION(
+        "Enables or disables the named overlay network, and pushes the",
+        "change to the registered agents. Expects a POST request."),
+    AUTHENTICATION(true),
+    AUTHORIZATION(
+        "Only the principals in the `authorized_principals` of the",
+        "master configuration are authorized, if it is set.")
+);
+
 // Helper function to convert std::string to `net::MAC`.
 static Try<net::MAC> createMAC(const string& _mac, const bool& oui)
 {
@@ -132,40 +178,27 @@ struct Vtep
       oui(_oui),
       mtu(_mtu)
   {
-    freeIP += (
-      Bound<IP>::open(network.begin()),
-      Bound<IP>::open(network.end()));
-
-    // IPv6
-    if (network6.isSome()) {
-      freeIP6 +=
-        (Bound<IP>::open(network6.get().begin()),
-         Bound<IP>::open(network6.get().end()));
-    }
+    reset();
   }
 
   Try<Network> allocateIP()
   {
-    if (freeIP.empty()) {
+    Try<Network> ip = freeIP->allocate();
+    if (ip.isError()) {
       return Error("Unable to allocate a VTEP IP due to exhaustion");
     }
 
-    IP ip = freeIP.begin()->lower();
-    freeIP -= ip;
-
-    return Network(ip, network.prefix());
+    return Network(ip.get().address(), network.prefix());
   }
 
   Try<Network> allocateIP6()
   {
-    if (freeIP6.empty()) {
+    Try<Network> ip6 = freeIP6->allocate();
+    if (ip6.isError()) {
       return Error("Unable to allocate a VTEP IPv6 due to exhaustion");
     }
 
-    IP ip6 = freeIP6.begin()->lower();
-    freeIP6 -= ip6;
-
-    return Network(ip6, network6.get().prefix());
+    return Network(ip6.get().address(), network6.get().prefix());
   }
 
   Try<Nothing> reserve(const Network& ip)
@@ -173,14 +206,29 @@ struct Vtep
     uint32_t addr = ntohl(ip.address().in().get().s_addr);
     IP _ip = IP(addr);
 
-    if (!freeIP.contains(_ip)) {
-      VLOG(1) << "Current free IPs: " << freeIP;
+    if (freeIP->reserve(Network(_ip, 32)).isError()) {
+      VLOG(1) << "Allocated IPs: " << freeIP->allocated();
       return Error(
           "Cannot reserve an unavailable IP: "  + stringify(ip) +
           "(" + stringify(_ip) + ")");
     }
 
-    freeIP -= _ip;
+    return Nothing();
+  }
+
+  Try<Nothing> reserve(const vector<Network>& ips)
+  {
+    vector<Network> _ips;
+    _ips.reserve(ips.size());
+    foreach (const Network& ip, ips) {
+      _ips.push_back(Network(ip.address(), 32));
+    }
+
+    Try<Nothing> result = freeIP->reserve(_ips);
+    if (result.isError()) {
+      VLOG(1) << "Allocated IPs: " << freeIP->allocated();
+      return Error("Cannot reserve an unavailable IP: " + result.error());
+    }
 
     return Nothing();
   }
@@ -190,14 +238,35 @@ struct Vtep
     in6_addr addr6 = ip6.address().in6().get();
     IP _ip6 = IP(addr6);
 
-    if (!freeIP6.contains(_ip6)) {
-      VLOG(1) << "Current free IPv6s: " << freeIP6;
+    if (freeIP6.get() == nullptr ||
+        freeIP6->reserve(Network(_ip6, 128)).isError()) {
+      VLOG(1) << "Allocated IPv6s: "
+              << (freeIP6.get() == nullptr ? 0 : freeIP6->allocated());
       return Error(
           "Cannot reserve an unavailable IPv6: "  + stringify(ip6) +
           "(" + stringify(_ip6) + ")");
     }
 
-    freeIP6 -= _ip6;
+    return Nothing();
+  }
+
+  Try<Nothing> reserve6(const vector<Network>& ip6s)
+  {
+    if (freeIP6.get() == nullptr) {
+      return Error("Cannot reserve IPv6s without a VTEP IPv6 network");
+    }
+
+    vector<Network> _ip6s;
+    _ip6s.reserve(ip6s.size());
+    foreach (const Network& ip6, ip6s) {
+      _ip6s.push_back(Network(ip6.address(), 128));
+    }
+
+    Try<Nothing> result = freeIP6->reserve(_ip6s);
+    if (result.isError()) {
+      VLOG(1) << "Allocated IPv6s: " << freeIP6->allocated();
+      return Error("Cannot reserve an unavailable IPv6: " + result.error());
+    }
 
     return Nothing();
   }
@@ -235,20 +304,28 @@ struct Vtep
 
   void reset()
   {
-    freeIP = IntervalSet<IP>();
-
-    freeIP +=
-      (Bound<IP>::open(network.begin()),
-       Bound<IP>::open(network.end()));
+    freeIP = addresses(network, 32);
 
     // IPv6
     if (network6.isSome()) {
-      freeIP6 = IntervalSet<IP>();
+      freeIP6 = addresses(network6.get(), 128);
+    }
+  }
+
+  // Returns the addresses of the `network`, less its network and
+  // broadcast address.
+  static Owned<SubnetAllocator> addresses(
+      const Network& network,
+      uint8_t width)
+  {
+    Owned<SubnetAllocator> allocator(new SubnetAllocator(network, width));
 
-      freeIP6 +=
-        (Bound<IP>::open(network6.get().begin()),
-         Bound<IP>::open(network6.get().end()));
+    allocator->reserve(allocator->first());
+    if (allocator->complete()) {
+      allocator->reserve(allocator->last());
     }
+
+    return allocator;
   }
 
   // Network allocated to the VTEP.
@@ -260,9 +337,9 @@ struct Vtep
 
   Option<size_t> mtu;
 
-  IntervalSet<IP> freeIP;
+  Owned<SubnetAllocator> freeIP;
 
-  IntervalSet<IP> freeIP6;
+  Owned<SubnetAllocator> freeIP6;
 };
 
 struct Overlay
@@ -294,9 +371,7 @@ struct Overlay
 
       LOG(INFO) << name << " IPv4: " << startSubnet << " - " << endSubnet;
 
-      freeNetworks +=
-        (Bound<Network>::closed(startSubnet),
-         Bound<Network>::closed(endSubnet));
+      freeNetworks.reset(new SubnetAllocator(network.get(), prefix.get()));
     }
 
     // IPv6
@@ -316,9 +391,7 @@ struct Overlay
 
       LOG(INFO) << "IPv6: " << startSubnet6 << " - " << endSubnet6;
 
-      freeNetworks6 +=
-        (Bound<Network>::closed(startSubnet6),
-         Bound<Network>::closed(endSubnet6));
+      freeNetworks6.reset(new SubnetAllocator(network6.get(), prefix6.get()));
     }
   }
 
@@ -346,14 +419,12 @@ struct Overlay
       return Error("The " + name + "overlay is disabled");
     }
 
-    if (freeNetworks.empty()) {
+    Try<Network> agentSubnet = freeNetworks->allocate();
+    if (agentSubnet.isError()) {
       return Error("No free subnets available in the " + name + "overlay");
     }
 
-    Network agentSubnet = freeNetworks.begin()->lower();
-    freeNetworks -= agentSubnet;
-
-    return agentSubnet;
+    return agentSubnet.get();
   }
 
   Try<Network> allocate6()
@@ -362,14 +433,12 @@ struct Overlay
       return Error("The " + name + "overlay is disabled");
     }
 
-    if (freeNetworks6.empty()) {
+    Try<Network> agentSubnet6 = freeNetworks6->allocate();
+    if (agentSubnet6.isError()) {
       return Error("No free IPv6 subnets available in the " + name + "overlay");
     }
 
-    Network agentSubnet6 = freeNetworks6.begin()->lower();
-    freeNetworks6 -= agentSubnet6;
-
-    return agentSubnet6;
+    return agentSubnet6.get();
   }
 
   Try<Nothing> free(const Network& subnet)
@@ -387,9 +456,7 @@ struct Overlay
           " to the overlay subnet");
     }
 
-    freeNetworks += Network(subnet.address(), prefix.get());
-
-    return Nothing();
+    return freeNetworks->free(Network(subnet.address(), prefix.get()));
   }
 
   Try<Nothing> free6(const Network& subnet6)
@@ -407,9 +474,7 @@ struct Overlay
           " to the overlay subnet");
     }
 
-    freeNetworks6 += Network(subnet6.address(), prefix6.get());
-
-    return Nothing();
+    return freeNetworks6->free(Network(subnet6.address(), prefix6.get()));
   }
 
   Try<Nothing> reserve(const Network& subnet)
@@ -419,13 +484,26 @@ struct Overlay
     Network _subnet = Network(IP(_address & _mask), subnet.prefix());
 
 
-    if (!freeNetworks.contains(_subnet)) {
+    if (freeNetworks.get() == nullptr ||
+        freeNetworks->reserve(_subnet).isError()) {
       return Error(
           "Unable to reserve unavailable subnet " +
           stringify(subnet) + "(" + stringify(_subnet) + ")");
     }
 
-    freeNetworks -= _subnet;
+    return Nothing();
+  }
+
+  Try<Nothing> reserve(const vector<Network>& subnets)
+  {
+    if (freeNetworks.get() == nullptr) {
+      return Error("Unable to reserve subnets of an overlay without IPv4");
+    }
+
+    Try<Nothing> result = freeNetworks->reserve(subnets);
+    if (result.isError()) {
+      return Error("Unable to reserve unavailable subnet: " + result.error());
+    }
 
     return Nothing();
   }
@@ -441,13 +519,27 @@ struct Overlay
     Network _subnet6 = Network(IP(_maskedAddr6), subnet6.prefix());
 
 
-    if (!freeNetworks6.contains(_subnet6)) {
+    if (freeNetworks6.get() == nullptr ||
+        freeNetworks6->reserve(_subnet6).isError()) {
       return Error(
           "Unable to reserve unavailable IPv6 subnet " +
           stringify(subnet6) + "(" + stringify(_subnet6) + ")");
     }
 
-    freeNetworks6 -= _subnet6;
+    return Nothing();
+  }
+
+  Try<Nothing> reserve6(const vector<Network>& subnets6)
+  {
+    if (freeNetworks6.get() == nullptr) {
+      return Error("Unable to reserve IPv6 subnets of an overlay without IPv6");
+    }
+
+    Try<Nothing> result = freeNetworks6->reserve(subnets6);
+    if (result.isError()) {
+      return Error(
+          "Unable to reserve unavailable IPv6 subnet: " + result.error());
+    }
 
     return Nothing();
   }
@@ -456,8 +548,6 @@ struct Overlay
   {
     // Re-initialize `freeNetworks`.
     if (network.isSome()) {
-      freeNetworks = IntervalSet<Network>();
-
       uint32_t addr = ntohl(network.get().address().in().get().s_addr);
       uint32_t startMask = ntohl(network.get().netmask().in().get().s_addr);
       uint32_t endMask = 0xffffffff << (32 - prefix.get());
@@ -469,15 +559,13 @@ struct Overlay
 
       LOG(INFO) << name << " Reset IPv4: " << startSubnet << " - " << endSubnet;
 
-      freeNetworks +=
-        (Bound<Network>::open(startSubnet),
-         Bound<Network>::open(endSubnet));
+      freeNetworks.reset(new SubnetAllocator(network.get(), prefix.get()));
+      freeNetworks->reserve(startSubnet);
+      freeNetworks->reserve(endSubnet);
     }
 
     // IPv6
     if (network6.isSome()) {
-      freeNetworks6 = IntervalSet<Network>();
-
       in6_addr startAddr6, endAddr6;
       in6_addr addr6 = network6.get().address().in6().get();
       in6_addr startMask6 = network6.get().netmask().in6().get();
@@ -494,9 +582,9 @@ struct Overlay
       LOG(INFO) << name
                 << " Reset IPv6: " << startSubnet6 << " - " << endSubnet6;
 
-      freeNetworks6 +=
-        (Bound<Network>::open(startSubnet6),
-         Bound<Network>::open(endSubnet6));
+      freeNetworks6.reset(new SubnetAllocator(network6.get(), prefix6.get()));
+      freeNetworks6->reserve(startSubnet6);
+      freeNetworks6->reserve(endSubnet6);
     }
   }
 
@@ -518,16 +606,109 @@ struct Overlay
   // Free subnets available in this network. The subnets are
   // calcualted using the prefix length set for the agents in
   // `prefix`.
-  IntervalSet<Network> freeNetworks;
+  Owned<SubnetAllocator> freeNetworks;
 
   // Free IPv6 subnets
-  IntervalSet<Network> freeNetworks6;
+  Owned<SubnetAllocator> freeNetworks6;
 
   // Enalbed/Disabled this overlay network.
   bool enabled;
 };
 
 
+// The addresses allocated to a batch of agents, which a recovering
+// master reserves again.
+struct Reservations
+{
+  // The agent subnets, keyed by the name of their overlay.
+  hashmap<string, vector<Network>> subnets;
+  hashmap<string, vector<Network>> subnets6;
+
+  vector<Network> vtepIPs;
+  vector<Network> vtepIP6s;
+};
+
+
+// Parses the addresses allocated to the agents `[begin, end)` of the
+// `state`. This does not touch the master, so that several batches of
+// agents can be parsed in parallel.
+static Try<Reservations> parseReservations(
+    const State& state,
+    int begin,
+    int end)
+{
+  Reservations reservations;
+
+  for (int i = begin; i < end; i++) {
+    const AgentInfo& agentInfo = state.agents(i);
+
+    for (int j = 0; j < agentInfo.overlays_size(); j++) {
+      const AgentOverlayInfo& overlay = agentInfo.overlays(j);
+
+      // IPv4
+      if (overlay.has_subnet()) {
+        Try<Network> network = Network::parse(overlay.subnet(), AF_INET);
+        if (network.isError()) {
+          return Error(
+              "Unable to parse the retrieved network: " +
+              overlay.subnet() + ": " + network.error());
+        }
+
+        reservations.subnets[overlay.info().name()].push_back(network.get());
+      }
+
+      // IPv6
+      if (overlay.has_subnet6()) {
+        Try<Network> network6 = Network::parse(overlay.subnet6(), AF_INET6);
+        if (network6.isError()) {
+          return Error(
+              "Unable to parse the retrieved network: " +
+              overlay.subnet6() + ": " + network6.error());
+        }
+
+        reservations.subnets6[overlay.info().name()]
+          .push_back(network6.get());
+      }
+
+      // All overlay instances on an Agent share the same VTEP IP
+      // and MAC. Hence, the backend information on all the overlay
+      // information would be the same. We therefore need to reserve
+      // the VTEP IP and MAC only once.
+      //
+      // NOTE: We only need to reserve the VTEP IP and not the VTEP
+      // MAC since the VTEP MAC is derived from the VTEP IP. Look at
+      // the `generateMAC` method in `VTEP` to see how this is done.
+      if (j == 0) {
+        const VxLANInfo& vxlan = overlay.backend().vxlan();
+
+        Try<Network> vtepIP = Network::parse(vxlan.vtep_ip(), AF_INET);
+        if (vtepIP.isError()) {
+          return Error(
+              "Unable to parse the retrieved `vtepIP`: " +
+              vxlan.vtep_ip() + ": " + vtepIP.error());
+        }
+
+        reservations.vtepIPs.push_back(vtepIP.get());
+
+        // IPv6
+        if (vxlan.has_vtep_ip6()) {
+          Try<Network> vtepIP6 = Network::parse(vxlan.vtep_ip6(), AF_INET6);
+          if (vtepIP6.isError()) {
+            return Error(
+                "Unable to parse the retrieved `vtep IPv6`: " +
+                vxlan.vtep_ip6() + ": " + vtepIP6.error());
+          }
+
+          reservations.vtepIP6s.push_back(vtepIP6.get());
+        }
+      }
+    }
+  }
+
+  return reservations;
+}
+
+
 class Agent
 {
 public:
@@ -561,7 +742,8 @@ public:
 
   Agent(const IP& _ip, const Option<BackendInfo>& _backend = None())
     : backend(_backend),
-      ip(_ip) {};
+      ip(_ip),
+      version(0) {};
   const IP getIP() const { return ip; };
 
   void addOverlay(const AgentOverlayInfo& overlay)
@@ -576,6 +758,22 @@ public:
         Owned<AgentOverlayInfo>(new AgentOverlayInfo()));
 
     overlays[overlay.info().name()]->CopyFrom(overlay);
+    overlayVersions[overlay.info().name()] = ++version;
+  }
+
+  // Marks an overlay on this agent as enabled or disabled. Returns
+  // whether the overlay changed.
+  bool setOverlayEnabled(const string& name, bool enabled)
+  {
+    if (!overlays.contains(name) ||
+        overlays.at(name)->info().enabled() == enabled) {
+      return false;
+    }
+
+    overlays.at(name)->mutable_info()->set_enabled(enabled);
+    overlayVersions[name] = ++version;
+
+    return true;
   }
 
   bool addOverlays(
@@ -701,6 +899,70 @@ public:
     return _overlays;
   }
 
+  // Returns the overlays which changed after the given `version`.
+  list<AgentOverlayInfo> getOverlays(uint64_t since) const
+  {
+    list<AgentOverlayInfo> _overlays;
+
+    foreachpair (const string& name,
+                 const Owned<AgentOverlayInfo>& overlay,
+                 overlays) {
+      if (overlayVersions.at(name) > since) {
+        _overlays.push_back(*overlay);
+      }
+    }
+
+    return _overlays;
+  }
+
+  uint64_t getVersion() const { return version; }
+
+  // The version of the overlays the agent has last reported as
+  // configured, either when registering or by acknowledging an update.
+  Option<ConfigVersion> getConfiguredVersion() const
+  {
+    return configuredVersion;
+  }
+
+  // Records the version acknowledged by an `AgentRegisteredMessage`.
+  // Like the agent, we only take it on once every overlay up to that
+  // version is in `STATUS_OK`.
+  void setConfiguredVersion(const ConfigVersion& _configuredVersion)
+  {
+    foreachpair (const string& name,
+                 const Owned<AgentOverlayInfo>& overlay,
+                 overlays) {
+      if (overlayVersions.at(name) <= _configuredVersion.version() &&
+          (!overlay->has_state() ||
+           !overlay->state().has_status() ||
+           overlay->state().status() != OverlayState::STATUS_OK)) {
+        configuredVersion = None();
+        return;
+      }
+    }
+
+    configuredVersion = _configuredVersion;
+  }
+
+  // Records the `pid` and the network config of the agent, as of its
+  // latest registration, so that changed overlays can be pushed to it.
+  void setRegistration(
+      const UPID& _pid,
+      const AgentNetworkConfig& _networkConfig,
+      const Option<ConfigVersion>& _configuredVersion)
+  {
+    pid = _pid;
+    networkConfig = _networkConfig;
+    configuredVersion = _configuredVersion;
+  }
+
+  Option<UPID> getPID() const { return pid; }
+
+  Option<AgentNetworkConfig> getNetworkConfig() const
+  {
+    return networkConfig;
+  }
+
   void clearOverlaysState()
   {
     foreachvalue (Owned<AgentOverlayInfo>& overlay, overlays) {
@@ -825,6 +1087,16 @@ private:
   hashmap<string, Owned<AgentOverlayInfo>> overlays;
 
   IP ip;
+
+  // Every change of the `overlays` bumps the `version`, which is then
+  // recorded as the version of the changed overlay.
+  uint64_t version;
+  hashmap<string, uint64_t> overlayVersions;
+
+  // Only set once the agent has registered with this master.
+  Option<UPID> pid;
+  Option<AgentNetworkConfig> networkConfig;
+  Option<ConfigVersion> configuredVersion;
 };
 
 // Defines an operation that can be performed on a `State` object for
@@ -852,6 +1124,9 @@ public:
 
   virtual const string description() const = 0;
 
+  // The IP of the agent whose `AgentInfo` is changed by the operation.
+  virtual const string ip() const = 0;
+
   // Sets the promise based on whether the operation was successful.
   bool set() { return process::Promise<bool>::set(success); }
 
@@ -878,6 +1153,8 @@ public:
     return "Add operation for agent: " + agentInfo.ip();
   }
 
+  const std::string ip() const { return agentInfo.ip(); }
+
 protected:
   Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
   {
@@ -915,6 +1192,8 @@ public:
     return "Modify operation for agent: " + agentInfo.ip();
   }
 
+  const std::string ip() const { return agentInfo.ip(); }
+
 protected:
   Try<bool> perform(State* networkState, hashmap<IP, Agent>* agents)
   {
@@ -1247,6 +1526,11 @@ public:
       }
     }
 
+    hashset<string> authorizedPrincipals;
+    foreach (const string& principal, masterConfig.authorized_principals()) {
+      authorizedPrincipals.insert(principal);
+    }
+
     return Owned<ManagerProcess>(new ManagerProcess(
           overlays,
           vtepSubnet.get(),
@@ -1256,6 +1540,8 @@ public:
           networkConfig,
           replicatedLog,
           replicatedLogTimeout.get(),
+          std::max(masterConfig.max_pending_registrations(), 1u),
+          authorizedPrincipals,
           storage,
           log));
   }
@@ -1285,6 +1571,11 @@ protected:
           OVERLAY_HELP,
           &ManagerProcess::state);
 
+    route("/overlays",
+          READWRITE_HTTP_AUTHENTICATION_REALM,
+          ENABLE_OVERLAY_HELP,
+          &ManagerProcess::enableOverlay);
+
     // When a new agent comes up or an existing agent reconnects with
     // the master, it'll first send a `RegisterAgentMessage` to the
     // master. The master will reply with `UpdateAgentNetworkMessage`.
@@ -1311,13 +1602,15 @@ protected:
           << " state . Hence, not sending an update to agent"
           << pid;
         recover();
+        retryRegistration(pid);
         return;
       } else if (storedState.isNone() && recovering) {
-        // We are recovering. Drop the message, the agent will try to
-        // re-register.
-        LOG(INFO) << MASTER_MANAGER_PROCESS_ID << " in `RECOVERING`"
+        // We are recovering. Ask the agent to re-register once we
+        // are likely done.
+        VLOG(1) << MASTER_MANAGER_PROCESS_ID << " in `RECOVERING`"
           << " state . Hence, not sending an update to agent"
           << pid;
+        retryRegistration(pid);
         return;
       } // else -> `storedState.isSome` , we have recovered.
     }
@@ -1330,10 +1623,36 @@ protected:
       return;
     }
 
+    const Option<ConfigVersion> configuredVersion =
+      registerMessage.has_config_version()
+        ? registerMessage.config_version()
+        : Option<ConfigVersion>::none();
+
+    // An agent retries its registration until it hears back from us,
+    // so a registration which is still being stored is only answered
+    // once, at the latest `pid` of the agent.
+    if (pendingRegistrations.contains(agentIP.get())) {
+      VLOG(1) << "Coalescing registration from " << pid
+              << " with the pending one";
+      pendingRegistrations[agentIP.get()] = pid;
+
+      if (agents.contains(agentIP.get())) {
+        agents.at(agentIP.get()).setRegistration(
+            pid,
+            registerMessage.network_config(),
+            configuredVersion);
+      }
+      return;
+    }
+
     if (agents.contains(agentIP.get())) {
       LOG(INFO) << "Agent " << pid << " re-registering.";
 
       Agent* agent = &(agents.at(agentIP.get()));
+      agent->setRegistration(
+          pid,
+          registerMessage.network_config(),
+          configuredVersion);
       // Check if IPv6 address is added to a vtep interface
       // and it is not present on the agent vtep
       BackendInfo backendInfo = agent->getBackendInfo();
@@ -1355,6 +1674,8 @@ protected:
       // agent.
       if (agent->addOverlays(overlays, registerMessage.network_config())) {
         // We installed a new overlay on this agent.
+        pendingRegistrations[agentIP.get()] = pid;
+
         update(Owned<Operation>(
                new ModifyAgent(agent->getAgentInfo())))
           .onAny(defer(self(),
@@ -1381,16 +1702,31 @@ protected:
 
       // The fact that we have reached here implies that the Agent
       // exists in the `agents` database, but its information has not
-      // been updated in the replicated log. Simply drop this message
-      // since the Agent will re-register.
+      // been updated in the replicated log. Ask the Agent to
+      // re-register.
       LOG(INFO) << "Agent " << pid
                 << " info has not been updated in the replicated log."
-                << " Hence dropping this registration request.";
+                << " Hence asking the agent to retry this registration.";
+      retryRegistration(pid);
       return;
     } else {
       // New Agent.
       LOG(INFO) << "New registration from pid: " << pid;
 
+      // Bound the work queued up for the replicated log, e.g. when
+      // many agents register after a failover.
+      if (replicatedLog.get() != nullptr &&
+          pendingRegistrations.size() >= maxPendingRegistrations) {
+        LOG(INFO) << "Asking agent " << pid << " to retry its registration,"
+                  << " since " << pendingRegistrations.size()
+                  << " registrations are pending";
+        rejectedRegistrations.insert(agentIP.get());
+        retryRegistration(pid);
+        return;
+      }
+
+      rejectedRegistrations.erase(agentIP.get());
+
       Try<Network> vtepIP = vtep.allocateIP();
       if (vtepIP.isError()) {
         LOG(ERROR)
@@ -1451,9 +1787,15 @@ protected:
       agents.emplace(agentIP.get(), Agent(agentIP.get(), backend));
 
       Agent* agent = &(agents.at(agentIP.get()));
+      agent->setRegistration(
+          pid,
+          registerMessage.network_config(),
+          configuredVersion);
 
       agent->addOverlays(overlays, registerMessage.network_config());
 
+      pendingRegistrations[agentIP.get()] = pid;
+
       // Update the `networkState in the replicated log before
       // sending the overlay configuration to the Agent.
       update(Owned<Operation>(
@@ -1471,10 +1813,17 @@ protected:
 
   // Will be called once the operation is successfully applied to the
   // `networkState`.
-  void _registerAgent(const UPID& pid,
+  void _registerAgent(const UPID& _pid,
                       const IP& agentIP,
                       const Future<bool>& result)
   {
+    // Reply to the latest of the coalesced registrations, if any.
+    UPID pid = _pid;
+    if (pendingRegistrations.contains(agentIP)) {
+      pid = pendingRegistrations.at(agentIP);
+      pendingRegistrations.erase(agentIP);
+    }
+
     if (!result.isReady()) {
       LOG(WARNING) << "Unable to process registration request from "
                    << pid << " due to: "
@@ -1484,10 +1833,61 @@ protected:
 
     CHECK(agents.contains(agentIP));
 
-    list<AgentOverlayInfo> _overlays = agents.at(agentIP).getOverlays();
+    const Agent& agent = agents.at(agentIP);
+
+    Option<uint64_t> since = configuredVersion(agent);
+
+    // An agent which has configured all of its overlays already only
+    // needs the acknowledgement.
+    if (since.isSome() && since.get() == agent.getVersion()) {
+      LOG(INFO) << "Agent " << pid << " has configured version "
+                << since.get() << " of its overlays already";
+
+      AgentRegisteredAcknowledgement acknowledgement;
+      acknowledgement.mutable_config_version()->CopyFrom(
+          agent.getConfiguredVersion().get());
+
+      send(pid, acknowledgement);
+      return;
+    }
+
+    send(pid, overlaysUpdate(agent, since));
+  }
+
+  // The version of its overlays the agent has configured. It is only
+  // known to us if it was handed out by this master, since the
+  // versions of other masters are unrelated.
+  Option<uint64_t> configuredVersion(const Agent& agent) const
+  {
+    Option<ConfigVersion> configured = agent.getConfiguredVersion();
+    if (configured.isSome() &&
+        configured->epoch() == stateEpoch &&
+        configured->version() <= agent.getVersion()) {
+      return configured->version();
+    }
+
+    return None();
+  }
+
+  // Creates the message with the overlays of the `agent` which changed
+  // after the version `since`, or with all of them. The agent only
+  // applies the former on top of the version `since`.
+  UpdateAgentOverlaysMessage overlaysUpdate(
+      const Agent& agent,
+      const Option<uint64_t>& since)
+  {
+    list<AgentOverlayInfo> _overlays = agent.getOverlays(since.getOrElse(0));
 
     // Create the network update message and send it to the Agent.
     UpdateAgentOverlaysMessage update;
+    update.mutable_config_version()->set_epoch(stateEpoch);
+    update.mutable_config_version()->set_version(agent.getVersion());
+    update.set_incremental(since.isSome());
+
+    if (since.isSome()) {
+      update.mutable_base_version()->set_epoch(stateEpoch);
+      update.mutable_base_version()->set_version(since.get());
+    }
 
     foreach(const AgentOverlayInfo& overlay, _overlays) {
       update.add_overlays()->CopyFrom(overlay);
@@ -1498,7 +1898,28 @@ protected:
       update.mutable_overlays(i)->clear_state();
     }
 
-    send(pid, update);
+    return update;
+  }
+
+  double _pending_registrations()
+  {
+    return pendingRegistrations.size();
+  }
+
+  // Asks the agent to register again later, rather than leaving it to
+  // back off on its own, which may take minutes.
+  void retryRegistration(const UPID& pid)
+  {
+    const size_t backlog =
+      pendingRegistrations.size() + rejectedRegistrations.size();
+
+    const Duration retryAfter = REGISTRATION_RETRY_AFTER *
+      (1 + static_cast<double>(backlog) / maxPendingRegistrations);
+
+    RetryRegistrationMessage message;
+    message.set_retry_after(retryAfter.ms());
+
+    send(pid, message);
   }
 
   void agentRegistered(const UPID& from, const AgentRegisteredMessage& message)
@@ -1512,8 +1933,13 @@ protected:
 
     if(agents.contains(_agentIP.get())) {
       LOG(INFO) << "Got ACK for addition of networks from " << from;
+      Agent& agent = agents.at(_agentIP.get());
       for(int i = 0; i < message.overlays_size(); i++) {
-        agents.at(_agentIP.get()).updateOverlayState(message.overlays(i));
+        agent.updateOverlayState(message.overlays(i));
+      }
+
+      if (message.has_config_version()) {
+        agent.setConfiguredVersion(message.config_version());
       }
 
       // We don't need to store the "state" of an overlay network on
@@ -1524,8 +1950,28 @@ protected:
           networkState.mutable_agents(i)->CopyFrom(
               agents.at(_agentIP.get()).getAgentInfo());
 
+          stateChanged();
+
+          AgentRegisteredAcknowledgement acknowledgement;
+          if (message.has_config_version()) {
+            acknowledgement.mutable_config_version()->CopyFrom(
+                message.config_version());
+          }
+
           LOG(INFO) << "Sending register ACK to: " << from;
-          send(from, AgentRegisteredAcknowledgement());
+          send(from, acknowledgement);
+
+          // The agent drops an update while it is still configuring an
+          // earlier one, so we send whatever changed since the version
+          // it has now configured again.
+          Option<uint64_t> since = configuredVersion(agent);
+          if (since.isSome() &&
+              since.get() < agent.getVersion() &&
+              !pendingRegistrations.contains(_agentIP.get()) &&
+              agent.getPID().isSome()) {
+            send(agent.getPID().get(), overlaysUpdate(agent, since));
+          }
+
           return;
         }
       }
@@ -1536,13 +1982,299 @@ protected:
     }
   }
 
+  // Responds with the `networkState` as JSON or protobuf. Both are
+  // serialized at most once per change of the `networkState`, and
+  // carry an ETag, so that pollers can skip unchanged state via
+  // 'If-None-Match'. JSONP responses, whose body depends on the
+  // callback, carry no ETag.
   Future<http::Response> state(const http::Request& request)
   {
     VLOG(1) << "Responding to `state` endpoint";
 
-    return http::OK(
-        JSON::protobuf(networkState),
-        request.url.query.get("jsonp"));
+    Option<string> body = None();
+    string contentType;
+    Option<string> etag = None();
+
+    if (request.acceptsMediaType(APPLICATION_JSON)) {
+      if (stateJSON.isNone()) {
+        stateJSON = string(jsonify(JSON::Protobuf(networkState)));
+      }
+
+      body = stateJSON.get();
+      contentType = APPLICATION_JSON;
+      etag = stateETag("json");
+
+      Option<string> jsonp = request.url.query.get("jsonp");
+      if (jsonp.isSome()) {
+        body = jsonp.get() + "(" + body.get() + ");";
+        contentType = "text/javascript";
+        etag = None();
+      }
+    } else if (request.acceptsMediaType(APPLICATION_PROTOBUF)) {
+      if (stateProtobuf.isNone()) {
+        stateProtobuf = networkState.SerializeAsString();
+      }
+
+      body = stateProtobuf.get();
+      contentType = stringify(ContentType::PROTOBUF);
+      etag = stateETag("protobuf");
+    } else {
+      return http::UnsupportedMediaType(
+          string("Client needs to support either ") +
+          APPLICATION_JSON + " or " + APPLICATION_PROTOBUF);
+    }
+
+    Option<string> ifNoneMatch = request.headers.get("If-None-Match");
+    if (etag.isSome() && ifNoneMatch.isSome()) {
+      foreach (const string& token, strings::tokenize(ifNoneMatch.get(), ",")) {
+        const string tag = strings::trim(token);
+        if (tag == etag.get() || tag == "*") {
+          http::Response response(http::Status::NOT_MODIFIED);
+          response.headers["ETag"] = etag.get();
+          return response;
+        }
+      }
+    }
+
+    http::OK ok(body.get());
+    ok.headers["Content-Type"] = contentType;
+    if (etag.isSome()) {
+      ok.headers["ETag"] = etag.get();
+    }
+
+    return ok;
+  }
+
+  // Enables or disables an overlay, and pushes the change to the
+  // registered agents as an incremental update.
+  //
+  // NOTE: The change is stored in the replicated log as a toggle of the
+  // overlay, which a new master applies on top of its `MasterConfig`.
+  // Disabling an overlay stops allocating it to further agents, while
+  // agents which have the overlay keep it configured.
+  Future<http::Response> enableOverlay(
+      const http::Request& request,
+      const Option<http::authentication::Principal>& principal)
+  {
+    if (request.method != "POST") {
+      return http::MethodNotAllowed({"POST"}, request.method);
+    }
+
+    if (!authorizedPrincipals.empty() &&
+        (principal.isNone() ||
+         principal->value.isNone() ||
+         !authorizedPrincipals.contains(principal->value.get()))) {
+      return http::Forbidden(
+          "The principal is not authorized to enable or disable overlays");
+    }
+
+    Option<string> name = request.url.query.get("name");
+    Option<string> enabled = request.url.query.get("enabled");
+    if (name.isNone() || enabled.isNone()) {
+      return http::BadRequest(
+          "Expecting the 'name' and 'enabled' query parameters");
+    }
+
+    if (enabled.get() != "true" && enabled.get() != "false") {
+      return http::BadRequest("Expecting 'enabled' to be 'true' or 'false'");
+    }
+
+    if (!overlays.contains(name.get())) {
+      return http::NotFound("Unknown overlay '" + name.get() + "'");
+    }
+
+    if (replicatedLog.get() != nullptr && storedState.isNone()) {
+      return http::ServiceUnavailable(
+          MASTER_MANAGER_PROCESS_ID + string(" is recovering"));
+    }
+
+    const bool _enabled = enabled.get() == "true";
+
+    LOG(INFO) << (_enabled ? "Enabling" : "Disabling")
+              << " overlay " << name.get();
+
+    toggle(&networkState, name.get(), _enabled);
+
+    stateChanged();
+
+    Future<Nothing> stored = Nothing();
+    if (replicatedLog.get() != nullptr) {
+      stored = storeNetwork();
+    }
+
+    list<Future<bool>> updates;
+    foreachpair (const IP& agentIP, Agent& agent, agents) {
+      bool mutated = agent.setOverlayEnabled(name.get(), _enabled);
+      if (!mutated && _enabled && agent.getNetworkConfig().isSome()) {
+        mutated = agent.addOverlays(overlays, agent.getNetworkConfig().get());
+      }
+
+      if (mutated) {
+        updates.push_back(
+            update(Owned<Operation>(new ModifyAgent(agent.getAgentInfo())))
+              .onAny(defer(self(),
+                           &ManagerProcess::pushOverlays,
+                           agentIP,
+                           lambda::_1)));
+      }
+    }
+
+    return stored
+      .then([updates]() {
+        return process::collect(updates);
+      })
+      .then([](const list<bool>&) -> http::Response {
+        return http::OK();
+      });
+  }
+
+  // Enables or disables the overlay `name` in the `overlays` and in
+  // `state`, and records the toggle in `state`.
+  void toggle(overlay::State* state, const string& name, bool enabled)
+  {
+    overlays.at(name)->enabled = enabled;
+
+    for (int i = 0; i < state->network().overlays_size(); i++) {
+      if (state->network().overlays(i).name() == name) {
+        state->mutable_network()->mutable_overlays(i)->set_enabled(enabled);
+      }
+    }
+
+    for (int i = 0; i < state->toggles_size(); i++) {
+      if (state->toggles(i).name() == name) {
+        state->mutable_toggles(i)->set_enabled(enabled);
+        return;
+      }
+    }
+
+    overlay::State::Toggle* _toggle = state->add_toggles();
+    _toggle->set_name(name);
+    _toggle->set_enabled(enabled);
+  }
+
+  // Stores the network configuration and the toggles of the overlays
+  // under the `REPLICATED_LOG_STORE_KEY`. The stores requested while
+  // one is in flight are done together, once it is done.
+  Future<Nothing> storeNetwork()
+  {
+    if (networkStored.get() == nullptr) {
+      networkStored.reset(new Promise<Nothing>());
+    }
+
+    Future<Nothing> future = networkStored->future();
+
+    if (!storingNetwork) {
+      _storeNetwork();
+    }
+
+    return future;
+  }
+
+  void _storeNetwork()
+  {
+    CHECK(storedState.isSome());
+    CHECK_NOTNULL(replicatedLog.get());
+
+    storingNetwork = true;
+
+    Owned<Promise<Nothing>> promise = networkStored;
+    networkStored.reset();
+
+    overlay::State index;
+    index.mutable_network()->CopyFrom(networkState.network());
+    index.mutable_toggles()->CopyFrom(networkState.toggles());
+
+    replicatedLog->store(storedState->mutate(index))
+      .after(replicatedLogTimeout,
+             defer(self(),
+                   &ManagerProcess::timeout<Option<Variable<overlay::State>>>,
+                   "store",
+                   replicatedLogTimeout,
+                   lambda::_1))
+      .onAny(defer(self(),
+                   &ManagerProcess::__storeNetwork,
+                   promise,
+                   lambda::_1));
+  }
+
+  void __storeNetwork(
+      const Owned<Promise<Nothing>>& promise,
+      const Future<Option<Variable<overlay::State>>>& variable)
+  {
+    storingNetwork = false;
+
+    if (!variable.isReady() || variable->isNone()) {
+      LOG(WARNING) << "Not updating `State` due to failure to store the"
+                   << " network state"
+                   << (variable.isReady() ? "" : ": " +
+                       (variable.isDiscarded() ? "discarded"
+                        : variable.failure()));
+
+      promise->fail("Unable to store the network state");
+      demote();
+      return;
+    }
+
+    storedState = variable->get();
+    promise->set(Nothing());
+
+    if (networkStored.get() != nullptr) {
+      _storeNetwork();
+    }
+  }
+
+  // Sends the overlays of an agent which changed after the version it
+  // has configured to the agent, once they are stored.
+  //
+  // NOTE: The changes are computed against the version the agent has
+  // acknowledged rather than the one it was last sent, since an
+  // earlier update might not have been configured by the agent.
+  void pushOverlays(
+      const IP& agentIP,
+      const Future<bool>& result)
+  {
+    if (!result.isReady()) {
+      LOG(WARNING) << "Unable to store the overlays of agent " << agentIP
+                   << " due to: "
+                   << (result.isDiscarded() ? "discarded" : result.failure());
+      return;
+    }
+
+    // A pending registration is answered with all changes anyway.
+    if (!agents.contains(agentIP) ||
+        pendingRegistrations.contains(agentIP)) {
+      return;
+    }
+
+    const Agent& agent = agents.at(agentIP);
+    if (agent.getPID().isNone()) {
+      return;
+    }
+
+    // An agent without a configured version of ours gets all of its
+    // overlays, which is still an incremental update to a registered
+    // agent.
+    UpdateAgentOverlaysMessage update =
+      overlaysUpdate(agent, configuredVersion(agent));
+    update.set_incremental(true);
+
+    send(agent.getPID().get(), update);
+  }
+
+  // The ETag of the current `networkState` in the given representation.
+  // The `stateEpoch` tells apart the states of different masters.
+  string stateETag(const string& representation) const
+  {
+    return "\"" + stringify(stateEpoch) + "-" + stringify(stateVersion) +
+      "-" + representation + "\"";
+  }
+
+  // Must be called whenever the `networkState` changes.
+  void stateChanged()
+  {
+    stateVersion++;
+    stateJSON = None();
+    stateProtobuf = None();
   }
 
   void recover()
@@ -1578,24 +2310,95 @@ protected:
       return;
     }
 
-    overlay::State _networkState = variable.get().get();
+    // Each agent is stored in a variable of its own, see `store`.
+    replicatedLog->names()
+      .after(replicatedLogTimeout,
+             defer(self(),
+                 &ManagerProcess::timeout<set<string>>,
+                 "names",
+                 replicatedLogTimeout,
+                 lambda::_1))
+      .onAny(defer(self(),
+                   &ManagerProcess::__recover,
+                   variable.get(),
+                   lambda::_1));
+  }
+
+  void __recover(
+      const Variable<overlay::State>& variable,
+      const Future<set<string>>& names)
+  {
+    if (!names.isReady()) {
+      LOG(WARNING) << "Aborting recovery of replicated log, unable to"
+                   << " list the stored agents: "
+                   << (names.isDiscarded() ? "discarded" : names.failure());
 
-    // Only if the `network_config` is present does it imply that the
-    // overlay-master stored state in the replicated log, else  this
-    // is the first time an overlay-master is accessing the
-    // replicated log and hence the state will be empty.
-    if (!_networkState.has_network()) {
-      LOG(INFO) << "No network state present, hence nothing to"
-                << " recover from replicated log";
+      demote();
+      return;
+    }
 
-      // Update the `storeState` variable so that we know where to
-      // update the `State` in the replicated log.
-      storedState = variable.get();
+    vector<Future<Variable<AgentInfo>>> fetches;
+    foreach (const string& name, names.get()) {
+      if (strings::startsWith(name, REPLICATED_LOG_STORE_AGENT_PREFIX)) {
+        fetches.push_back(replicatedLog->fetch<AgentInfo>(name));
+      }
+    }
 
-      LOG(INFO) << "Moving " << self() << " to `RECOVERED` state.";
+    process::collect(fetches)
+      .after(replicatedLogTimeout,
+             defer(self(),
+                 &ManagerProcess::timeout<vector<Variable<AgentInfo>>>,
+                 "fetch",
+                 replicatedLogTimeout,
+                 lambda::_1))
+      .onAny(defer(self(),
+                   &ManagerProcess::___recover,
+                   variable,
+                   lambda::_1));
+  }
+
+  void ___recover(
+      const Variable<overlay::State>& variable,
+      const Future<vector<Variable<AgentInfo>>>& agentVariables)
+  {
+    if (!agentVariables.isReady()) {
+      LOG(WARNING) << "Aborting recovery of replicated log, unable to"
+                   << " fetch the stored agents: "
+                   << (agentVariables.isDiscarded() ? "discarded"
+                       : agentVariables.failure());
+
+      demote();
       return;
     }
 
+    // State written by masters which predate the per-agent layout
+    // keeps all agents in the `REPLICATED_LOG_STORE_KEY` variable.
+    // These are migrated to the per-agent layout once recovered.
+    overlay::State _networkState = variable.get();
+
+    hashmap<string, int> indices;
+    for (int i = 0; i < _networkState.agents_size(); i++) {
+      indices[_networkState.agents(i).ip()] = i;
+    }
+
+    foreach (const Variable<AgentInfo>& agentVariable, agentVariables.get()) {
+      const AgentInfo& agentInfo = agentVariable.get();
+
+      storedAgents.put(agentInfo.ip(), agentVariable);
+
+      if (indices.contains(agentInfo.ip())) {
+        _networkState.mutable_agents(indices.at(agentInfo.ip()))
+          ->CopyFrom(agentInfo);
+      } else {
+        _networkState.add_agents()->CopyFrom(agentInfo);
+      }
+    }
+
+    if (_networkState.agents_size() == 0) {
+      LOG(INFO) << "No agents present, hence nothing to"
+                << " recover from replicated log";
+    }
+
     // Re-populate the agents, the overlay subnets that have been
     // allocated, and the VTEP IP and VTEP MAC that have been
     // allocated. The information stored in the replicated log should
@@ -1615,143 +2418,212 @@ protected:
       VLOG(1) << "Recovered agent: " << agent->getIP();
 
       for (int j = 0; j < agentInfo.overlays_size(); j++) {
-        const AgentOverlayInfo& overlay = agentInfo.overlays(j);
-
         // clear the overlay state.
         _networkState.mutable_agents(i)->mutable_overlays(j)->clear_state();
+      }
+    }
 
-        // IPv4
-        if (overlay.has_subnet()) {
-          Try<Network> network = Network::parse(
-              overlay.subnet(),
-              AF_INET);
-
-          if (network.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved network: "
-                       << overlay.subnet() << ": "
-                       << network.error();
-
-            demote();
-            return;
-          }
-
-          // We should already have this particular overlay at bootup.
-          CHECK(overlays.contains(overlay.info().name()));
-
-          LOG(INFO) << "reserving IPv4 " << stringify(network.get());
-          Try<Nothing> result =
-            overlays.at(overlay.info().name())->reserve(network.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve the subnet " << network.get()
-                       << ": " << result.error();
-
-            demote();
-            return;
-          }
-        }
+    Owned<overlay::State> state(new overlay::State());
+    state->Swap(&_networkState);
 
-        // IPv6
-        if (overlay.has_subnet6()) {
-          Try<Network> network6 = Network::parse(
-              overlay.subnet6(),
-              AF_INET6);
-
-          if (network6.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved network: "
-              << overlay.subnet6() << ": "
-              << network6.error();
-            demote();
-            return;
-          }
+    // The addresses of the agents are parsed in batches, in parallel,
+    // rather than one by one by this process.
+    vector<Future<Try<Reservations>>> batches;
+    for (int i = 0; i < state->agents_size(); i += RECOVERY_BATCH_SIZE) {
+      const int end = std::min(i + RECOVERY_BATCH_SIZE, state->agents_size());
 
-          // We should already have this particular overlay at bootup.
-          CHECK(overlays.contains(overlay.info().name()));
+      batches.push_back(process::async([=]() {
+        return parseReservations(*state, i, end);
+      }));
+    }
 
-          LOG(INFO) << "reserving IPv6 " << stringify(network6.get());
-          Try<Nothing> result =
-            overlays.at(overlay.info().name())->reserve6(network6.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve the IPv6 subnet " << network6.get()
-                       << ": " << result.error();
-            demote();
-            return;
-          }
-        }
+    process::collect(batches)
+      .onAny(defer(self(),
+                   &ManagerProcess::____recover,
+                   variable,
+                   state,
+                   lambda::_1));
+  }
 
-        // All overlay instances on an Agent share the same VTEP IP
-        // and MAC. Hence, the backend information on all the overlay
-        // information would be the same. We therefore need to reserve
-        // the VTEP IP and MAC only once.
-        if (j == 0) {
-          Try<Network> vtepIP =
-            Network::parse(overlay.backend().vxlan().vtep_ip(), AF_INET);
-
-          if (vtepIP.isError()) {
-            LOG(ERROR) << "Unable to parse the retrieved `vtepIP`: "
-                       << overlay.backend().vxlan().vtep_ip() << ": "
-                       << vtepIP.error();
-
-            demote();
-            return;
-          }
+  void ____recover(
+      const Variable<overlay::State>& variable,
+      const Owned<overlay::State>& state,
+      const Future<vector<Try<Reservations>>>& batches)
+  {
+    if (!batches.isReady()) {
+      LOG(ERROR) << "Unable to parse the recovered agents: "
+                 << (batches.isDiscarded() ? "discarded" : batches.failure());
 
-          // NOTE: We only need to reserve the VTEP IP and not the
-          // VTEP MAC since the VTEP MAC is derived from the VTEP IP.
-          // Look at the `generateMAC` method in `VTEP` to see how
-          // this is done.
-          LOG(INFO) << "Reserving VTEP IP: " << vtepIP.get();
-          Try<Nothing> result = vtep.reserve(vtepIP.get());
-          if (result.isError()) {
-            LOG(ERROR) << "Unable to reserve VTEP IP: "
-                       << vtepIP.get() << ": " << result.error();
+      demote();
+      return;
+    }
 
-            demote();
-            return;
-          }
+    foreach (const Try<Reservations>& batch, batches.get()) {
+      if (batch.isError()) {
+        LOG(ERROR) << batch.error();
+        demote();
+        return;
+      }
 
-          // IPv6
-          if (overlay.backend().vxlan().has_vtep_ip6()) {
-            Try<Network> vtepIP6 =
-              Network::parse(overlay.backend().vxlan().vtep_ip6(), AF_INET6);
-
-            if (vtepIP6.isError()) {
-              LOG(ERROR) << "Unable to parse the retrieved `vtep IPv6`: "
-                << overlay.backend().vxlan().vtep_ip6() << ": "
-                << vtepIP6.error();
-              demote();
-              return;
-            }
-
-            LOG(INFO) << "Reserving VTEP IPv6: " << vtepIP6.get();
-            result = vtep.reserve6(vtepIP6.get());
-            if (result.isError()) {
-              LOG(ERROR) << "Unable to reserve VTEP IPv6: "
-                         << vtepIP6.get() << ": " << result.error();
-              demote();
-              return;
-            }
-          }
-        }
+      Try<Nothing> result = reserve(batch.get());
+      if (result.isError()) {
+        LOG(ERROR) << result.error();
+        demote();
+        return;
       }
     }
 
+    LOG(INFO) << "Reserved the subnets and VTEP IPs of "
+              << state->agents_size() << " agents";
+
     // Recovery done. Copy the recovered state into the `State`
     // object.
     //
     // NOTE: We are retaining the current configuration so that we can
     // remember any new overlay networks that might have been added by
-    // the operator during the restart.
-    _networkState.mutable_network()->CopyFrom(networkState.network());
+    // the operator during the restart. The overlays enabled or disabled
+    // through the `overlays` endpoint stay so.
+    state->mutable_network()->CopyFrom(networkState.network());
+
+    google::protobuf::RepeatedPtrField<overlay::State::Toggle> toggles;
+    toggles.Swap(state->mutable_toggles());
+
+    foreach (const overlay::State::Toggle& _toggle, toggles) {
+      if (overlays.contains(_toggle.name())) {
+        toggle(state.get(), _toggle.name(), _toggle.enabled());
+      }
+    }
+
+    networkState.Swap(state.get());
+    stateChanged();
+
+    migrate(variable);
+  }
+
+  // Reserves the subnets and VTEP IPs of recovered agents.
+  Try<Nothing> reserve(const Reservations& reservations)
+  {
+    foreachpair (const string& name,
+                 const vector<Network>& subnets,
+                 reservations.subnets) {
+      // We should already have this particular overlay at bootup.
+      CHECK(overlays.contains(name));
+
+      Try<Nothing> result = overlays.at(name)->reserve(subnets);
+      if (result.isError()) {
+        return Error(result.error());
+      }
+    }
+
+    foreachpair (const string& name,
+                 const vector<Network>& subnets6,
+                 reservations.subnets6) {
+      // We should already have this particular overlay at bootup.
+      CHECK(overlays.contains(name));
+
+      Try<Nothing> result = overlays.at(name)->reserve6(subnets6);
+      if (result.isError()) {
+        return Error(result.error());
+      }
+    }
+
+    Try<Nothing> result = vtep.reserve(reservations.vtepIPs);
+    if (result.isError()) {
+      return Error("Unable to reserve VTEP IP: " + result.error());
+    }
+
+    if (!reservations.vtepIP6s.empty()) {
+      result = vtep.reserve6(reservations.vtepIP6s);
+      if (result.isError()) {
+        return Error("Unable to reserve VTEP IPv6: " + result.error());
+      }
+    }
+
+    return Nothing();
+  }
+
+  // Stores the agents which are not stored in the per-agent layout yet,
+  // followed by the current network configuration, under the
+  // `REPLICATED_LOG_STORE_KEY`.
+  //
+  // NOTE: The agents are stored before they are removed from the
+  // `REPLICATED_LOG_STORE_KEY`, so that a migration which fails half
+  // way through is simply redone by the next master.
+  void migrate(const Variable<overlay::State>& variable)
+  {
+    vector<Future<Option<Variable<AgentInfo>>>> stores;
+    foreach (const AgentInfo& agentInfo, networkState.agents()) {
+      if (!storedAgents.contains(agentInfo.ip())) {
+        stores.push_back(storeAgent(agentInfo));
+      }
+    }
+
+    if (!stores.empty()) {
+      LOG(INFO) << "Migrating " << stores.size() << " agents to the"
+                << " per-agent layout of the replicated log";
+    }
+
+    overlay::State index;
+    index.mutable_network()->CopyFrom(networkState.network());
+    index.mutable_toggles()->CopyFrom(networkState.toggles());
 
-    networkState.CopyFrom(_networkState);
+    process::collect(stores)
+      .then(defer(self(),
+                  [=](const vector<Option<Variable<AgentInfo>>>& stored)
+                      -> Future<Option<Variable<overlay::State>>> {
+        foreach (const Option<Variable<AgentInfo>>& agentVariable, stored) {
+          if (agentVariable.isNone()) {
+            return None();
+          }
+
+          storedAgents.put(agentVariable->get().ip(), agentVariable.get());
+        }
+
+        return replicatedLog->store(variable.mutate(index));
+      }))
+      .after(replicatedLogTimeout,
+             defer(self(),
+                   &ManagerProcess::timeout<Option<Variable<overlay::State>>>,
+                   "store",
+                   replicatedLogTimeout,
+                   lambda::_1))
+      .onAny(defer(self(), &ManagerProcess::_migrate, lambda::_1));
+  }
+
+  void _migrate(const Future<Option<Variable<overlay::State>>>& variable)
+  {
+    if (!variable.isReady() || variable->isNone()) {
+      LOG(WARNING) << "Aborting recovery of replicated log, unable to"
+                   << " store the network state"
+                   << (variable.isReady() ? "" : ": " +
+                       (variable.isDiscarded() ? "discarded"
+                        : variable.failure()));
+
+      demote();
+      return;
+    }
 
     // Update the `storeState` variable so that we know where to
     // update the `State` in the replicated log.
-    storedState = variable.get();
+    storedState = variable->get();
 
     LOG(INFO) << "Moving " << self() << " to `RECOVERED` state.";
     recovering = false;
-    return;
+  }
+
+  // Stores the `agentInfo` in its own variable of the replicated log.
+  Future<Option<Variable<AgentInfo>>> storeAgent(const AgentInfo& agentInfo)
+  {
+    Future<Variable<AgentInfo>> agentVariable =
+      storedAgents.contains(agentInfo.ip())
+        ? Future<Variable<AgentInfo>>(storedAgents.at(agentInfo.ip()))
+        : replicatedLog->fetch<AgentInfo>(
+              REPLICATED_LOG_STORE_AGENT_PREFIX + agentInfo.ip());
+
+    return agentVariable
+      .then(defer(self(), [=](const Variable<AgentInfo>& _agentVariable) {
+        return replicatedLog->store(_agentVariable.mutate(agentInfo));
+      }));
   }
 
 private:
@@ -1764,10 +2636,28 @@ private:
   Owned<mesos::state::protobuf::State> replicatedLog;
   Duration replicatedLogTimeout;
 
+  // The variable holding the network configuration, and the variables
+  // holding the agents, by their IP.
   Option<Variable<overlay::State>> storedState;
+  hashmap<string, Variable<AgentInfo>> storedAgents;
+
+  // Whether the network configuration is being stored, and the promise
+  // satisfied once the next store of it is done, see `storeNetwork`.
+  bool storingNetwork;
+  Owned<Promise<Nothing>> networkStored;
+
+  // The principals authorized to enable or disable overlays, if any is
+  // set in the `MasterConfig`.
+  hashset<string> authorizedPrincipals;
 
   overlay::State networkState;
 
+  // The cached serializations of the `networkState`, see `state`.
+  Option<string> stateJSON;
+  Option<string> stateProtobuf;
+  int64_t stateEpoch;
+  uint64_t stateVersion;
+
   // We need to keep track of `storage` and `log`, since we will need
   // to free them up when the master manager process is deleted.
   Storage* storage;
@@ -1778,8 +2668,60 @@ private:
   // `networkState` before writing to the replicated log.
   std::deque<Owned<Operation>> operations;
 
+  // The agents whose registration is being stored in the replicated
+  // log, and the `pid` to reply to once it is stored.
+  hashmap<IP, UPID> pendingRegistrations;
+  size_t maxPendingRegistrations;
+
+  // The new agents which have been asked to retry their registration
+  // since `maxPendingRegistrations` were pending.
+  hashset<IP> rejectedRegistrations;
+
   Vtep vtep;
 
+  struct Metrics
+  {
+    explicit Metrics(ManagerProcess* process)
+      : pending_registrations(
+            "overlay_master/pending_registrations",
+            defer(process->self(),
+                  &ManagerProcess::_pending_registrations)),
+        store_latency("overlay_master/store_latency", Hours(1)),
+        stores("overlay_master/stores"),
+        stored_agents("overlay_master/stored_agents"),
+        store_batch_size("overlay_master/store_batch_size")
+    {
+      process::metrics::add(pending_registrations);
+      process::metrics::add(store_latency);
+      process::metrics::add(stores);
+      process::metrics::add(stored_agents);
+      process::metrics::add(store_batch_size);
+    }
+
+    ~Metrics()
+    {
+      process::metrics::remove(pending_registrations);
+      process::metrics::remove(store_latency);
+      process::metrics::remove(stores);
+      process::metrics::remove(stored_agents);
+      process::metrics::remove(store_batch_size);
+    }
+
+    // Registrations which are being stored in the replicated log.
+    process::metrics::PullGauge pending_registrations;
+
+    // The time taken to store a batch of agents in the replicated log,
+    // with percentiles over the last hour.
+    process::metrics::Timer<Milliseconds> store_latency;
+
+    // The batches stored, and the agents stored in them, so that their
+    // ratio is the mean batch size. Along with the size of the latest
+    // batch.
+    process::metrics::Counter stores;
+    process::metrics::Counter stored_agents;
+    process::metrics::PushGauge store_batch_size;
+  } metrics;
+
   ManagerProcess(
       const hashmap<string, Owned<Overlay>>& _overlays,
       const Network& vtepSubnet,
@@ -1789,6 +2731,8 @@ private:
       const NetworkConfig& _networkConfig,
       const Owned<mesos::state::protobuf::State> _replicatedLog,
       const Duration _replicatedLogTimeout,
+      size_t _maxPendingRegistrations,
+      const hashset<string>& _authorizedPrincipals,
       Storage* _storage,
       Log* _log)
     : ProcessBase("overlay-master"),
@@ -1798,9 +2742,15 @@ private:
       replicatedLog(_replicatedLog),
       replicatedLogTimeout(_replicatedLogTimeout),
       storedState(None()),
+      storingNetwork(false),
+      authorizedPrincipals(_authorizedPrincipals),
+      stateEpoch(process::Clock::now().duration().ns()),
+      stateVersion(0),
       storage(_storage),
       log(_log),
-      vtep(vtepSubnet, vtepSubnet6, vtepMACOUI, vtepMTU)
+      maxPendingRegistrations(_maxPendingRegistrations),
+      vtep(vtepSubnet, vtepSubnet6, vtepMACOUI, vtepMTU),
+      metrics(this)
   {
     networkState.mutable_network()->CopyFrom(_networkConfig);
   };
@@ -1817,6 +2767,8 @@ private:
   {
     if (replicatedLog.get() == nullptr) {
       Try<bool> result = (*operation)(&networkState, &agents);
+      stateChanged();
+
       if (result.isError()) {
         return Failure(
             "Unable to perform operation: " + result.error());
@@ -1835,6 +2787,12 @@ private:
     return future;
   }
 
+  // Stores the agents changed by the queued operations, each in its
+  // own variable, so that the writes to the replicated log do not grow
+  // with the number of agents.
+  //
+  // NOTE: The operations are still applied to a copy of the whole
+  // `networkState`, so each batch costs O(number of agents) of CPU.
   void store()
   {
       // We should not be trying to store to the replicated log till
@@ -1845,72 +2803,77 @@ private:
 
       CHECK_NOTNULL(replicatedLog.get());
 
-      overlay::State _networkState;
-      _networkState.CopyFrom(networkState);
+      Owned<overlay::State> _networkState(new overlay::State());
+      _networkState->CopyFrom(networkState);
 
+      hashset<string> changed;
       foreach (Owned<Operation> operation, operations) {
-        (*operation)(&_networkState, &agents);
+        (*operation)(_networkState.get(), &agents);
+        changed.insert(operation->ip());
       }
 
+      vector<Future<Option<Variable<AgentInfo>>>> stores;
+      foreach (const AgentInfo& agentInfo, _networkState->agents()) {
+        if (changed.contains(agentInfo.ip())) {
+          stores.push_back(storeAgent(agentInfo));
+        }
+      }
 
-      Variable<overlay::State> stateVariable = storedState.get();
-      stateVariable = stateVariable.mutate(_networkState);
+      ++metrics.stores;
+      metrics.stored_agents += stores.size();
+      metrics.store_batch_size = stores.size();
 
-      replicatedLog->store(stateVariable)
+      metrics.store_latency.time(process::collect(stores))
         .after(replicatedLogTimeout,
                defer(self(),
-                     &ManagerProcess::timeout<Option<Variable<overlay::State>>>,
+                     &ManagerProcess::timeout<
+                         vector<Option<Variable<AgentInfo>>>>,
                      "store",
                      replicatedLogTimeout,
                      lambda::_1))
-        .onAny(defer(self(), &ManagerProcess::_store, lambda::_1, operations));
+        .onAny(defer(self(),
+                     &ManagerProcess::_store,
+                     lambda::_1,
+                     _networkState,
+                     operations));
 
       operations.clear();
   }
 
   void _store(
-      const Future<Option<Variable<overlay::State>>>& variable,
+      const Future<vector<Option<Variable<AgentInfo>>>>& variables,
+      Owned<overlay::State> storedNetworkState,
       std::deque<Owned<Operation>> applied)
   {
     storing = false;
 
-    if (!variable.isReady()) {
+    if (!variables.isReady()) {
       LOG(WARNING) << "Not updating `State` due to failure to write to log."
-                   << (variable.isDiscarded() ? "discarded"
-                       : variable.failure());
+                   << (variables.isDiscarded() ? "discarded"
+                       : variables.failure());
       demote();
       return;
     }
 
-    if (variable.get().isNone()) {
-      LOG(WARNING) << "Not updating `State` since this Master might"
-                   << "have been demoted.";
-      demote();
-      return;
-    }
-
-    LOG(INFO) << "Stored the network state successfully";
-
-    overlay::State storedNetworkState = variable.get().get().get();
-
-    VLOG(1) << "Stored the following network state:";
-    if (storedNetworkState.has_network()) {
-      VLOG(1) << "VTEP: " << storedNetworkState.network().vtep_subnet();
-      if (storedNetworkState.network().has_vtep_subnet6()) {
-        VLOG(1) << "VTEP IPv6: " << storedNetworkState.network().vtep_subnet6();
+    foreach (const Option<Variable<AgentInfo>>& variable, variables.get()) {
+      if (variable.isNone()) {
+        LOG(WARNING) << "Not updating `State` since this Master might"
+                     << "have been demoted.";
+        demote();
+        return;
       }
-      VLOG(1) << "VTEP OUI: " << storedNetworkState.network().vtep_mac_oui();
-      VLOG(1) << "Total overlays: "
-              << storedNetworkState.network().overlays_size();
-    }
 
-    if (storedNetworkState.agents_size() > 0) {
-      VLOG(1) << "Total agents: " << storedNetworkState.agents_size();
+      storedAgents.put(variable->get().ip(), variable.get());
     }
 
-    networkState.CopyFrom(storedNetworkState);
+    LOG(INFO) << "Stored " << variables->size() << " agents successfully";
+
+    if (storedNetworkState->agents_size() > 0) {
+      VLOG(1) << "Total agents: " << storedNetworkState->agents_size();
+    }
 
-    storedState = variable.get();
+    networkState.Swap(storedNetworkState.get());
+    stateChanged();
 
     // Signal all operations are complete.
     while (!applied.empty()) {
@@ -1,10 +1,17 @@
+#include <list>
 #include <string>
 #include <vector>
 
 #include <gmock/gmock.h>
 
+#include <stout/path.hpp>
+#include <stout/stopwatch.hpp>
 #include <stout/strings.hpp>
 
+#include <stout/os/exists.hpp>
+#include <stout/os/read.hpp>
+#include <stout/os/rm.hpp>
+
 #include "tests/mesos.hpp"
 
 #include "common/shell.hpp"
@@ -50,6 +57,136 @@ TEST_F(CommonTest, CheckRunScriptCommandTimeout)
   EXPECT_EQ(true, endsWith(r1.failure(), "timeout after 100ms"));
 }
 
+
+TEST_F(CommonTest, CheckRunCommandInput)
+{
+  Future<string> r = runCommand("cat", {"cat"}, Seconds(5), string("foobar"));
+  AWAIT_READY(r);
+  EXPECT_EQ("foobar", r.get());
+}
+
+TEST_F(CommonTest, CheckRunScriptCommandOutputLimit)
+{
+  Future<string> r = runScriptCommand("head -c 17M /dev/zero", Seconds(15));
+  r.await();
+  CHECK_FAILED(r);
+  EXPECT_TRUE(strings::contains(r.failure(), "exceeds"));
+}
+
+// Identical commands in flight at the same time are only run once.
+TEST_F(CommonTest, CheckRunScriptCommandDeduplicated)
+{
+  Future<string> r0 = runScriptCommand("sleep 0.5; date +%s%N");
+  Future<string> r1 = runScriptCommand("sleep 0.5; date +%s%N");
+
+  AWAIT_READY(r0);
+  AWAIT_READY(r1);
+  EXPECT_EQ(r0.get(), r1.get());
+}
+
+// Discarding the result of one of the identical commands does not
+// affect the others, and the command is killed once all of them
+// have discarded their results.
+TEST_F(CommonTest, CheckRunScriptCommandDeduplicatedDiscard)
+{
+  const string file = path::join(os::getcwd(), "done");
+  const string command = "sleep 0.5; echo done >> " + file;
+
+  Future<string> r0 = runScriptCommand(command);
+  Future<string> r1 = runScriptCommand(command);
+
+  r0.discard();
+  AWAIT_READY(r1);
+  EXPECT_TRUE(os::exists(file));
+
+  ASSERT_SOME(os::rm(file));
+
+  Future<string> r2 = runScriptCommand(command);
+  Future<string> r3 = runScriptCommand(command);
+
+  r2.discard();
+  r3.discard();
+  AWAIT_DISCARDED(r2);
+  AWAIT_DISCARDED(r3);
+
+  // Give the command the time it would have needed to finish.
+  AWAIT_READY(runScriptCommand("sleep 1"));
+  EXPECT_FALSE(os::exists(file));
+}
+
+// No more than 4 commands run at the same time.
+TEST_F(CommonTest, CheckRunScriptCommandConcurrency)
+{
+  Stopwatch stopwatch;
+  stopwatch.start();
+
+  list<Future<string>> futures;
+  for (int i = 0; i < 8; i++) {
+    futures.push_back(runScriptCommand("sleep 0.5; echo " + stringify(i)));
+  }
+
+  AWAIT_READY(collect(futures));
+  EXPECT_LE(Seconds(1), stopwatch.elapsed());
+}
+
+// Queued commands run in the order of their priority.
+TEST_F(CommonTest, CheckRunScriptCommandPriority)
+{
+  const string file = path::join(os::getcwd(), "order");
+
+  // Keep all the workers busy, one of them only for a short while.
+  list<Future<string>> futures;
+  futures.push_back(runScriptCommand("sleep 0.3"));
+  for (int i = 0; i < 3; i++) {
+    futures.push_back(runScriptCommand("sleep 1; echo " + stringify(i)));
+  }
+
+  futures.push_back(runScriptCommand(
+      "echo low >> " + file,
+      Seconds(5),
+      Priority::LOW));
+
+  futures.push_back(runScriptCommand(
+      "echo high >> " + file + "; sleep 1",
+      Seconds(5),
+      Priority::HIGH));
+
+  AWAIT_READY(collect(futures));
+
+  Try<string> order = os::read(file);
+  ASSERT_SOME(order);
+  EXPECT_EQ("high\nlow\n", order.get());
+}
+
+// A queued command is promoted to the priority of an identical one.
+TEST_F(CommonTest, CheckRunScriptCommandDeduplicatedPriority)
+{
+  const string file = path::join(os::getcwd(), "order");
+
+  list<Future<string>> futures;
+  futures.push_back(runScriptCommand("sleep 0.3"));
+  for (int i = 0; i < 3; i++) {
+    futures.push_back(runScriptCommand("sleep 1; echo " + stringify(i)));
+  }
+
+  const string promoted = "echo promoted >> " + file;
+
+  futures.push_back(runScriptCommand(promoted, Seconds(5), Priority::LOW));
+
+  futures.push_back(runScriptCommand(
+      "echo normal >> " + file,
+      Seconds(5),
+      Priority::NORMAL));
+
+  futures.push_back(runScriptCommand(promoted, Seconds(5), Priority::HIGH));
+
+  AWAIT_READY(collect(futures));
+
+  Try<string> order = os::read(file);
+  ASSERT_SOME(order);
+  EXPECT_EQ("promoted\nnormal\n", order.get());
+}
+
 } // namespace tests {
 } // namespace common {
 } // namespace mesos {
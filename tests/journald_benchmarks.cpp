@@ -0,0 +1,539 @@
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <gmock/gmock.h>
+
+#include <mesos/mesos.hpp>
+
+#include <mesos/module/module.hpp>
+
+#include <mesos/slave/container_logger.hpp>
+
+#include <process/clock.hpp>
+#include <process/collect.hpp>
+#include <process/future.hpp>
+#include <process/gtest.hpp>
+#include <process/io.hpp>
+#include <process/owned.hpp>
+#include <process/subprocess.hpp>
+#include <process/time.hpp>
+
+#include <stout/bytes.hpp>
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/gtest.hpp>
+#include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/protobuf.hpp>
+#include <stout/stopwatch.hpp>
+#include <stout/strings.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/read.hpp>
+#include <stout/os/write.hpp>
+
+#include "journald/journald.hpp"
+
+#include "module/manager.hpp"
+
+#include "tests/mesos.hpp"
+
+using namespace process;
+
+using namespace mesos::internal::tests;
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+using mesos::modules::ModuleManager;
+
+using mesos::slave::ContainerConfig;
+using mesos::slave::ContainerIO;
+using mesos::slave::ContainerLogger;
+
+using testing::WithParamInterface;
+
+namespace mesos {
+namespace journald {
+namespace tests {
+
+const char JOURNALD_LOGGER_NAME[] = "com_mesosphere_mesos_JournaldLogger";
+
+// Logger flags can be set for all benchmarks via environment variables
+// with this prefix, e.g. `BENCHMARK_LOGGER_JOURNALD_TRANSPORT=native`.
+// This allows the logger's tunables to be compared on the same workloads.
+const char LOGGER_FLAGS_PREFIX[] = "BENCHMARK_LOGGER_";
+
+// Likewise, the module parameters for the `prepare()` benchmark can be
+// set via environment variables with this prefix,
+// e.g. `BENCHMARK_MODULE_LOGGER_POOL_SIZE=8`.
+const char MODULE_PARAMETERS_PREFIX[] = "BENCHMARK_MODULE_";
+
+// The amount of data written through the logger in each throughput run.
+const Bytes THROUGHPUT_SIZE = Megabytes(64);
+
+// The size of each `write()` of the producer. This is the default
+// capacity of a pipe, so a slow logger makes these writes stall.
+const Bytes WRITE_SIZE = Kilobytes(64);
+
+
+// Describes what a container writes to its stdout.
+struct Workload
+{
+  std::string name;
+
+  // Length of each line, including the newline.
+  size_t lineLength;
+
+  // Number of labels attached to each line written to journald,
+  // in addition to the ones identifying the benchmark.
+  size_t labels;
+
+  // If not zero, the container writes this much data back to back,
+  // and then stays quiet for `pause`.
+  Bytes burst;
+  Duration pause;
+};
+
+
+std::ostream& operator<<(std::ostream& stream, const Workload& workload)
+{
+  return stream << workload.name;
+}
+
+
+const vector<Workload> WORKLOADS = {
+  {"ShortLines", 64, 0, Bytes(0), Duration::zero()},
+  {"MediumLines", 512, 0, Bytes(0), Duration::zero()},
+  {"LongLines", 16 * 1024, 0, Bytes(0), Duration::zero()},
+  {"ManyLabels", 512, 64, Bytes(0), Duration::zero()},
+  {"Bursts", 512, 0, Megabytes(4), Milliseconds(100)},
+};
+
+
+// Returns the CPU time (user and system) used by all reaped children.
+Duration childrenCpuTime()
+{
+  struct rusage usage;
+  ::getrusage(RUSAGE_CHILDREN, &usage);
+
+  return Seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+    Microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+
+// Returns the `p`-th percentile of `samples`, which must not be empty.
+Duration percentile(vector<Duration> samples, double p)
+{
+  std::sort(samples.begin(), samples.end());
+
+  size_t index = static_cast<size_t>(samples.size() * p);
+  return samples[std::min(index, samples.size() - 1)];
+}
+
+
+class JournaldLoggerBenchmarkTest : public MesosTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    // The logger's companion binary needs to be able to find
+    // libmesos from the test's environment.
+    os::setenv("LD_LIBRARY_PATH", path::join(BUILD_DIR, "src/.libs"));
+  }
+
+protected:
+  // Returns the logger's flags, with any overrides from the environment.
+  // The caller is expected to fill in the flags of the benchmark itself.
+  Try<logger::Flags> loggerFlags()
+  {
+    logger::Flags flags;
+
+    Try<flags::Warnings> load = flags.load(std::string(LOGGER_FLAGS_PREFIX));
+    if (load.isError()) {
+      return Error(load.error());
+    }
+
+    return flags;
+  }
+
+  // Launches the logger's companion binary, with its stdin connected
+  // to the returned pipe.
+  Try<Subprocess> launch(const logger::Flags& flags, int_fd* pipe)
+  {
+    Try<std::array<int_fd, 2>> pipefd = os::pipe();
+    if (pipefd.isError()) {
+      return Error(pipefd.error());
+    }
+
+    std::map<std::string, std::string> environment = os::environment();
+    environment["LIBPROCESS_IP"] = "127.0.0.1";
+
+    Try<Subprocess> logger = subprocess(
+        path::join(MODULES_BUILD_DIR, ".libs", logger::NAME),
+        {logger::NAME},
+        Subprocess::FD(pipefd->at(0), Subprocess::IO::OWNED),
+        Subprocess::PATH("/dev/null"),
+        Subprocess::FD(STDERR_FILENO),
+        &flags,
+        environment);
+
+    if (logger.isError()) {
+      os::close(pipefd->at(1));
+      return Error(logger.error());
+    }
+
+    *pipe = pipefd->at(1);
+
+    return logger;
+  }
+};
+
+
+class JournaldTransportBenchmarkTest
+  : public JournaldLoggerBenchmarkTest,
+    public WithParamInterface<std::string> {};
+
+
+INSTANTIATE_TEST_CASE_P(
+    JournaldTransport,
+    JournaldTransportBenchmarkTest,
+    ::testing::Values(
+        std::string("libsystemd"),
+        std::string("native")));
+
+
+// Pipes a fixed number of lines through the logger's companion binary
+// and reports how many lines per second reach journald with each of
+// the supported journald transports.
+TEST_P(JournaldTransportBenchmarkTest, ROOT_BENCHMARK_JournaldTransport)
+{
+  const size_t lineCount = 200000;
+  const size_t linesPerChunk = 1000;
+
+  // Every line is 100 bytes long, including the newline.
+  std::string chunk;
+  for (size_t i = 0; i < linesPerChunk; i++) {
+    chunk += strings::format("%-99zu\n", i).get();
+  }
+
+  Labels labels;
+  Label* label = labels.add_labels();
+  label->set_key("BENCHMARK_ID");
+  label->set_value(id::UUID::random().toString());
+
+  label = labels.add_labels();
+  label->set_key("JOURNALD_TRANSPORT");
+  label->set_value(GetParam());
+
+  Try<logger::Flags> flags = loggerFlags();
+  ASSERT_SOME(flags);
+
+  flags->destination_type = "journald";
+  flags->journald_transport = GetParam();
+  flags->journald_labels = stringify(JSON::protobuf(labels));
+  flags->logrotate_filename = path::join(sandbox.get(), "stdout");
+
+  int_fd pipe;
+  Try<Subprocess> logger = launch(flags.get(), &pipe);
+  ASSERT_SOME(logger);
+  ASSERT_SOME(os::nonblock(pipe));
+
+  Stopwatch watch;
+  watch.start();
+
+  for (size_t i = 0; i < lineCount; i += linesPerChunk) {
+    AWAIT_READY(io::write(pipe, chunk));
+  }
+
+  // Closing the pipe makes the logger exit once it has drained the pipe.
+  os::close(pipe);
+
+  AWAIT_READY_FOR(logger->status(), Minutes(5));
+  watch.stop();
+
+  ASSERT_SOME(logger->status().get());
+  EXPECT_WEXITSTATUS_EQ(EXIT_SUCCESS, logger->status()->get());
+
+  cout << "Logged " << lineCount << " lines in " << watch.elapsed()
+       << " (" << (lineCount / watch.elapsed().secs()) << " lines/sec)"
+       << " using the '" << GetParam() << "' journald transport" << endl;
+}
+
+
+class JournaldThroughputBenchmarkTest
+  : public JournaldLoggerBenchmarkTest,
+    public WithParamInterface<std::tuple<std::string, Workload>> {};
+
+
+INSTANTIATE_TEST_CASE_P(
+    DestinationAndWorkload,
+    JournaldThroughputBenchmarkTest,
+    ::testing::Combine(
+        ::testing::Values(
+            std::string("journald"),
+            std::string("logrotate"),
+            std::string("journald+logrotate")),
+        ::testing::ValuesIn(WORKLOADS)));
+
+
+// Pipes `THROUGHPUT_SIZE` worth of lines through the logger's companion
+// binary with each destination, and reports the throughput, the CPU
+// time the logger spent per MB, and how long the producer's `write()`
+// calls stalled because the logger did not keep up.
+TEST_P(JournaldThroughputBenchmarkTest, ROOT_BENCHMARK_Throughput)
+{
+  const std::string destination = std::get<0>(GetParam());
+  const Workload workload = std::get<1>(GetParam());
+
+  // Every line is numbered and padded to the line length.
+  std::string data;
+  for (size_t i = 0; data.size() < WRITE_SIZE.bytes(); i++) {
+    data += strings::format(
+        "%-*zu\n", static_cast<int>(workload.lineLength - 1), i).get();
+  }
+
+  const size_t lines = data.size() / workload.lineLength;
+  const size_t writes = std::max<size_t>(
+      1, THROUGHPUT_SIZE.bytes() / data.size());
+
+  Labels labels;
+  Label* label = labels.add_labels();
+  label->set_key("BENCHMARK_ID");
+  label->set_value(id::UUID::random().toString());
+
+  for (size_t i = 0; i < workload.labels; i++) {
+    label = labels.add_labels();
+    label->set_key("BENCHMARK_LABEL_" + stringify(i));
+    label->set_value("benchmark-label-value-" + stringify(i));
+  }
+
+  Try<logger::Flags> flags = loggerFlags();
+  ASSERT_SOME(flags);
+
+  flags->destination_type = destination;
+  flags->journald_labels = stringify(JSON::protobuf(labels));
+  flags->logrotate_filename = path::join(sandbox.get(), "stdout");
+
+  const Duration cpuBefore = childrenCpuTime();
+
+  int_fd pipe;
+  Try<Subprocess> logger = launch(flags.get(), &pipe);
+  ASSERT_SOME(logger);
+
+  vector<Duration> stalls;
+  stalls.reserve(writes);
+
+  Stopwatch watch;
+  watch.start();
+
+  Bytes burst;
+  for (size_t i = 0; i < writes; i++) {
+    // The pipe is blocking, so this measures how long the container
+    // would be stuck in `write()`.
+    Stopwatch stall;
+    stall.start();
+
+    ASSERT_SOME(os::write(pipe, data));
+
+    stall.stop();
+    stalls.push_back(stall.elapsed());
+
+    burst += Bytes(data.size());
+    if (workload.burst > 0 && burst >= workload.burst) {
+      os::sleep(workload.pause);
+      burst = 0;
+    }
+  }
+
+  // Closing the pipe makes the logger exit once it has drained the pipe.
+  os::close(pipe);
+
+  AWAIT_READY_FOR(logger->status(), Minutes(5));
+  watch.stop();
+
+  ASSERT_SOME(logger->status().get());
+  EXPECT_WEXITSTATUS_EQ(EXIT_SUCCESS, logger->status()->get());
+
+  // NOTE: The logger has been reaped at this point, so its CPU time,
+  // including that of any `logrotate` it ran, is accounted for.
+  const Duration cpu = childrenCpuTime() - cpuBefore;
+
+  const Bytes total(writes * data.size());
+  const double megabytes =
+    static_cast<double>(total.bytes()) / Megabytes(1).bytes();
+
+  cout << "Logged " << total << " (" << writes * lines << " lines) in "
+       << watch.elapsed() << " to '" << destination << "' with the '"
+       << workload << "' workload: "
+       << (megabytes / watch.elapsed().secs()) << " MB/s, "
+       << (writes * lines / watch.elapsed().secs()) << " lines/sec, "
+       << (cpu / megabytes) << " CPU time per MB, "
+       << percentile(stalls, 0.99) << " p99 write stall, "
+       << percentile(stalls, 1.0) << " max write stall" << endl;
+}
+
+
+class JournaldPrepareBenchmarkTest
+  : public JournaldLoggerBenchmarkTest,
+    public WithParamInterface<size_t>
+{
+protected:
+  virtual void SetUp()
+  {
+    JournaldLoggerBenchmarkTest::SetUp();
+
+    // Read in the example `modules.json`.
+    Try<std::string> read =
+      os::read(path::join(MODULES_BUILD_DIR, "journald", "modules.json"));
+    ASSERT_SOME(read);
+
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(read.get());
+    ASSERT_SOME(json);
+
+    Try<Modules> _modules = protobuf::parse<Modules>(json.get());
+    ASSERT_SOME(_modules);
+
+    modules = _modules.get();
+
+    // Pass on any module parameters from the environment.
+    foreachpair (const std::string& key,
+                 const std::string& value,
+                 os::environment()) {
+      if (!strings::startsWith(key, MODULE_PARAMETERS_PREFIX)) {
+        continue;
+      }
+
+      foreach (Modules::Library& library, *modules.mutable_libraries()) {
+        foreach (Modules::Library::Module& module,
+                 *library.mutable_modules()) {
+          if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+            Parameter* parameter = module.add_parameters();
+            parameter->set_key(strings::lower(strings::remove(
+                key, MODULE_PARAMETERS_PREFIX, strings::PREFIX)));
+            parameter->set_value(value);
+          }
+        }
+      }
+    }
+
+    // Initialize the modules.
+    Try<Nothing> result = ModuleManager::load(modules);
+    ASSERT_SOME(result);
+  }
+
+  virtual void TearDown()
+  {
+    // Unload all modules.
+    foreach (const Modules::Library& library, modules.libraries()) {
+      foreach (const Modules::Library::Module& module, library.modules()) {
+        if (module.has_name()) {
+          ASSERT_SOME(ModuleManager::unload(module.name()));
+        }
+      }
+    }
+
+    JournaldLoggerBenchmarkTest::TearDown();
+  }
+
+  Modules modules;
+};
+
+
+INSTANTIATE_TEST_CASE_P(
+    Concurrency,
+    JournaldPrepareBenchmarkTest,
+    ::testing::Values(1u, 8u, 32u, 128u));
+
+
+// Calls `prepare()` on the journald ContainerLogger for many containers
+// at once, like an agent launching a batch of tasks, and reports how
+// long each call takes until the container's stdout and stderr are
+// ready to be used.
+TEST_P(JournaldPrepareBenchmarkTest, ROOT_BENCHMARK_Prepare)
+{
+  const size_t concurrency = GetParam();
+  const size_t rounds = std::max<size_t>(1, 256 / concurrency);
+
+  Try<ContainerLogger*> _logger =
+    ModuleManager::create<ContainerLogger>(JOURNALD_LOGGER_NAME);
+  ASSERT_SOME(_logger);
+
+  Owned<ContainerLogger> logger(_logger.get());
+  ASSERT_SOME(logger->initialize());
+
+  // The sandboxes look like the agent's, so that the AgentID
+  // is derived the same way.
+  const std::string agentDirectory =
+    path::join(sandbox.get(), "slaves", id::UUID::random().toString());
+
+  vector<Duration> latencies;
+
+  Stopwatch watch;
+  watch.start();
+
+  for (size_t round = 0; round < rounds; round++) {
+    vector<Future<Duration>> prepares;
+
+    for (size_t i = 0; i < concurrency; i++) {
+      ContainerID containerId;
+      containerId.set_value(id::UUID::random().toString());
+
+      ExecutorInfo executorInfo;
+      executorInfo.mutable_executor_id()->set_value(
+          id::UUID::random().toString());
+      executorInfo.mutable_framework_id()->set_value(
+          id::UUID::random().toString());
+
+      ContainerConfig containerConfig;
+      containerConfig.mutable_executor_info()->CopyFrom(executorInfo);
+      containerConfig.mutable_command_info()->set_value("exit 0");
+      containerConfig.set_directory(path::join(
+          agentDirectory,
+          "frameworks",
+          executorInfo.framework_id().value(),
+          "executors",
+          executorInfo.executor_id().value(),
+          "runs",
+          containerId.value()));
+
+      ASSERT_SOME(os::mkdir(containerConfig.directory()));
+
+      const Time start = Clock::now();
+
+      // NOTE: Dropping the `ContainerIO` closes the container's ends of
+      // the pipes, which makes the loggers exit right away.
+      prepares.push_back(logger->prepare(containerId, containerConfig)
+        .then([start](const ContainerIO&) -> Duration {
+          return Clock::now() - start;
+        }));
+    }
+
+    Future<vector<Duration>> collected = collect(prepares);
+    AWAIT_READY_FOR(collected, Minutes(5));
+
+    latencies.insert(
+        latencies.end(), collected->begin(), collected->end());
+  }
+
+  watch.stop();
+
+  cout << "Prepared " << latencies.size() << " containers, "
+       << concurrency << " at a time, in " << watch.elapsed() << ": "
+       << percentile(latencies, 0.5) << " median latency, "
+       << percentile(latencies, 0.99) << " p99 latency, "
+       << percentile(latencies, 1.0) << " max latency" << endl;
+}
+
+} // namespace tests {
+} // namespace journald {
+} // namespace mesos {
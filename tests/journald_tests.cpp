@@ -1,3 +1,7 @@
+#include <stddef.h>
+
+#include <algorithm>
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
@@ -30,11 +34,15 @@
 #include <stout/strings.hpp>
 #include <stout/try.hpp>
 
+#include <stout/os/killtree.hpp>
 #include <stout/os/pstree.hpp>
 #include <stout/os/read.hpp>
 
 #include "common/shell.hpp"
 
+#include "journald/rate_limiter.hpp"
+#include "journald/stats.hpp"
+
 #include "module/manager.hpp"
 
 #include "slave/flags.hpp"
@@ -109,6 +117,59 @@ namespace tests {
 const char JOURNALD_LOGGER_NAME[] = "com_mesosphere_mesos_JournaldLogger";
 
 
+// Checks that the rate limiter lets bursts of up to one second worth
+// of lines through, and then refills over time.
+TEST(JournaldRateLimiterTest, TokenBuckets)
+{
+  Clock::pause();
+
+  mesos::journald::logger::RateLimiter bytes(Bytes(100), 0);
+
+  EXPECT_TRUE(bytes.acquire(60));
+  EXPECT_FALSE(bytes.acquire(60));
+  EXPECT_TRUE(bytes.acquire(40));
+  EXPECT_FALSE(bytes.acquire(1));
+
+  Clock::advance(Milliseconds(500));
+
+  EXPECT_TRUE(bytes.acquire(50));
+  EXPECT_FALSE(bytes.acquire(1));
+
+  // A line longer than the limit passes once the bucket is full,
+  // and then has to be paid back.
+  Clock::advance(Seconds(10));
+
+  EXPECT_TRUE(bytes.acquire(300));
+
+  Clock::advance(Seconds(1));
+
+  EXPECT_FALSE(bytes.acquire(1));
+
+  Clock::advance(Seconds(2));
+
+  EXPECT_TRUE(bytes.acquire(1));
+
+  mesos::journald::logger::RateLimiter lines(Bytes(0), 2);
+
+  EXPECT_TRUE(lines.acquire(1024));
+  EXPECT_TRUE(lines.acquire(1024));
+  EXPECT_FALSE(lines.acquire(1));
+
+  Clock::advance(Milliseconds(500));
+
+  EXPECT_TRUE(lines.acquire(1));
+  EXPECT_FALSE(lines.acquire(1));
+
+  mesos::journald::logger::RateLimiter unlimited(Bytes(0), 0);
+
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_TRUE(unlimited.acquire(1024 * 1024));
+  }
+
+  Clock::resume();
+}
+
+
 class JournaldLoggerTest : public MesosTest,
                            public WithParamInterface<std::string>
 {
@@ -303,6 +364,238 @@ TEST_F(JournaldLoggerTest, ROOT_LogToJournaldWithBigLabel)
 }
 
 
+// Loads the journald ContainerLogger module and runs a task which
+// writes a single line with two separate writes. The line should
+// show up in journald as a single entry.
+TEST_F(JournaldLoggerTest, ROOT_LogToJournaldPartialLine)
+{
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  // The sleep makes sure the logger reads each half separately.
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "printf 'some-partial-'; sleep 1; echo 'line'");
+
+  // Make sure the destination of the logs is journald.
+  Environment::Variable* variable =
+    task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_DESTINATION_TYPE");
+  variable->set_value("journald");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // Query journald for an entry holding the whole line.
+  Future<std::string> query = runCommand(
+      "journalctl",
+      {"journalctl",
+       "FRAMEWORK_ID=" + frameworkId.get().value(),
+       "MESSAGE=some-partial-line"});
+
+  AWAIT_READY(query);
+  ASSERT_TRUE(strings::contains(query.get(), "some-partial-line"));
+}
+
+
+// Loads the journald ContainerLogger module and runs a task which
+// writes more lines than its journald rate limit allows. The excess
+// lines should be dropped from journald, but not from the sandbox,
+// and a notice about them should be written to journald instead.
+TEST_F(JournaldLoggerTest, ROOT_LogToJournaldRateLimit)
+{
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  const size_t lines = 1000;
+
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "for i in $(seq 1 " + stringify(lines) + "); do "
+      "echo rate-limited-line-$i; done");
+
+  // Log to both journald and the sandbox, and only allow a burst
+  // of 10 lines into journald.
+  Environment::Variable* variable =
+    task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_DESTINATION_TYPE");
+  variable->set_value("journald+logrotate");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_JOURNALD_RATE_LIMIT_LINES");
+  variable->set_value("10");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // Only part of the lines should have made it into journald.
+  Future<std::string> query = runCommand(
+      "journalctl",
+      {"journalctl",
+       "FRAMEWORK_ID=" + frameworkId.get().value(),
+       "--output=cat"});
+
+  AWAIT_READY(query);
+
+  size_t found = 0;
+  foreach (const std::string& line, strings::split(query.get(), "\n")) {
+    if (strings::startsWith(line, "rate-limited-line-")) {
+      found++;
+    }
+  }
+
+  EXPECT_LE(10u, found);
+  EXPECT_GT(lines, found);
+  EXPECT_TRUE(strings::contains(query.get(), "Suppressed"));
+
+  // But all of them should be in the sandbox.
+  std::string sandboxDirectory = path::join(
+      flags.work_dir,
+      "slaves",
+      offers.get()[0].slave_id().value(),
+      "frameworks",
+      frameworkId.get().value(),
+      "executors",
+      statusRunning->executor_id().value(),
+      "runs",
+      "latest");
+
+  ASSERT_TRUE(os::exists(sandboxDirectory));
+
+  std::string stdoutPath = path::join(sandboxDirectory, "stdout");
+  ASSERT_TRUE(os::exists(stdoutPath));
+
+  Try<std::string> stdout = os::read(stdoutPath);
+  ASSERT_SOME(stdout);
+  EXPECT_TRUE(strings::contains(
+      stdout.get(), "rate-limited-line-" + stringify(lines) + "\n"));
+}
+
+
 // Loads the journald ContainerLogger module and checks for the
 // non-existence of the logrotate config file.
 TEST_F(JournaldLoggerTest, ROOT_LogrotateCustomOptions)
@@ -486,6 +779,977 @@ TEST_F(JournaldLoggerTest, ROOT_LogrotateCustomOptions)
 }
 
 
+// Loads the journald ContainerLogger module with the native logrotate
+// engine and checks that rotated files are numbered, pruned, and
+// compressed.
+TEST_F(JournaldLoggerTest, ROOT_LogrotateNativeEngine)
+{
+  // The engine can only be changed when loading the module.
+  // So this test will unload the module, change the engine,
+  // and then reload the module.
+  ASSERT_SOME(ModuleManager::unload(JOURNALD_LOGGER_NAME));
+
+  foreach (Modules::Library& library, *modules.mutable_libraries()) {
+    foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+      if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+        Parameter* parameter = module.add_parameters();
+        parameter->set_key("logrotate_engine");
+        parameter->set_value("native");
+      }
+    }
+  }
+
+  // Initialize the modules.
+  Try<Nothing> result = ModuleManager::load(modules);
+  ASSERT_SOME(result);
+
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  // Start a task that spams stdout with 10 MB of (mostly blank) output.
+  // With files of at most 1 MB each, this rotates stdout several times.
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "i=0; while [ $i -lt 10240 ]; "
+      "do printf '%-1023d\\n' $i; i=$((i+1)); done");
+
+  Environment::Variable* variable =
+    task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_DESTINATION_TYPE");
+  variable->set_value("logrotate");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_LOGROTATE_MAX_STDOUT_SIZE");
+  variable->set_value("1MB");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_LOGROTATE_MAX_STDOUT_FILES");
+  variable->set_value("3");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_LOGROTATE_COMPRESS");
+  variable->set_value("true");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // The logger processes finish all pending rotations before exiting.
+  const Duration maxReapWaitTime = Seconds(30);
+  Try<os::ProcessTree> pstrees = os::pstree(0);
+  ASSERT_SOME(pstrees);
+  foreach (const os::ProcessTree& pstree, pstrees->children) {
+    // Wait for the logger subprocesses to exit, for up to 30 seconds each.
+    Duration waited = Duration::zero();
+    do {
+      if (!os::exists(pstree.process.pid)) {
+        break;
+      }
+
+      // Push the clock ahead to speed up the reaping of subprocesses.
+      Clock::pause();
+      Clock::settle();
+      Clock::advance(Seconds(1));
+      Clock::resume();
+
+      os::sleep(Milliseconds(100));
+      waited += Milliseconds(100);
+    } while (waited < maxReapWaitTime);
+
+    EXPECT_LE(waited, maxReapWaitTime);
+  }
+
+  std::string sandboxDirectory = path::join(
+      flags.work_dir,
+      "slaves",
+      offers.get()[0].slave_id().value(),
+      "frameworks",
+      frameworkId.get().value(),
+      "executors",
+      statusRunning->executor_id().value(),
+      "runs",
+      "latest");
+
+  ASSERT_TRUE(os::exists(sandboxDirectory));
+  ASSERT_TRUE(os::exists(path::join(sandboxDirectory, "stdout")));
+
+  // Only the configured number of rotated files should be kept,
+  // and all of them should be compressed.
+  EXPECT_TRUE(os::exists(path::join(sandboxDirectory, "stdout.1.gz")));
+  EXPECT_TRUE(os::exists(path::join(sandboxDirectory, "stdout.2.gz")));
+  EXPECT_TRUE(os::exists(path::join(sandboxDirectory, "stdout.3.gz")));
+  EXPECT_FALSE(os::exists(path::join(sandboxDirectory, "stdout.4.gz")));
+  EXPECT_FALSE(os::exists(path::join(sandboxDirectory, "stdout.1")));
+
+  // No file should be left behind in its intermediate state.
+  Try<std::list<std::string>> files = os::ls(sandboxDirectory);
+  ASSERT_SOME(files);
+
+  foreach (const std::string& file, files.get()) {
+    EXPECT_FALSE(strings::contains(file, ".rotating."))
+      << "Unexpected file " << file << " in " << sandboxDirectory;
+  }
+}
+
+
+// Loads the journald ContainerLogger module with inline compression,
+// and checks that the leading log file and the rotated files can be
+// decompressed back into the container's output.
+TEST_F(JournaldLoggerTest, ROOT_LogrotateInlineCompression)
+{
+  // Compression can only be enabled when loading the module.
+  ASSERT_SOME(ModuleManager::unload(JOURNALD_LOGGER_NAME));
+
+  foreach (Modules::Library& library, *modules.mutable_libraries()) {
+    foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+      if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+        Parameter* parameter = module.add_parameters();
+        parameter->set_key("logrotate_engine");
+        parameter->set_value("native");
+
+        parameter = module.add_parameters();
+        parameter->set_key("logrotate_inline_compression");
+        parameter->set_value("true");
+      }
+    }
+  }
+
+  // Initialize the modules.
+  Try<Nothing> result = ModuleManager::load(modules);
+  ASSERT_SOME(result);
+
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  // Start a task that prints about 4 MB of poorly compressible output,
+  // and keeps a copy of it in the sandbox. With compressed files of at
+  // most 1 MB each, this rotates stdout a few times.
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "head -c 3000000 /dev/urandom | base64 | tee output");
+
+  Environment::Variable* variable =
+    task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_DESTINATION_TYPE");
+  variable->set_value("logrotate");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_LOGROTATE_MAX_STDOUT_SIZE");
+  variable->set_value("1MB");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_LOGROTATE_MAX_STDOUT_FILES");
+  variable->set_value("10");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // The logger processes finish their last gzip member before exiting.
+  const Duration maxReapWaitTime = Seconds(30);
+  Try<os::ProcessTree> pstrees = os::pstree(0);
+  ASSERT_SOME(pstrees);
+  foreach (const os::ProcessTree& pstree, pstrees->children) {
+    // Wait for the logger subprocesses to exit, for up to 30 seconds each.
+    Duration waited = Duration::zero();
+    do {
+      if (!os::exists(pstree.process.pid)) {
+        break;
+      }
+
+      // Push the clock ahead to speed up the reaping of subprocesses.
+      Clock::pause();
+      Clock::settle();
+      Clock::advance(Seconds(1));
+      Clock::resume();
+
+      os::sleep(Milliseconds(100));
+      waited += Milliseconds(100);
+    } while (waited < maxReapWaitTime);
+
+    EXPECT_LE(waited, maxReapWaitTime);
+  }
+
+  std::string sandboxDirectory = path::join(
+      flags.work_dir,
+      "slaves",
+      offers.get()[0].slave_id().value(),
+      "frameworks",
+      frameworkId.get().value(),
+      "executors",
+      statusRunning->executor_id().value(),
+      "runs",
+      "latest");
+
+  ASSERT_TRUE(os::exists(sandboxDirectory));
+  ASSERT_TRUE(os::exists(path::join(sandboxDirectory, "stdout.gz")));
+  EXPECT_FALSE(os::exists(path::join(sandboxDirectory, "stdout")));
+
+  // All rotated files should have been compressed already.
+  ASSERT_TRUE(os::exists(path::join(sandboxDirectory, "stdout.1.gz")));
+  EXPECT_FALSE(os::exists(path::join(sandboxDirectory, "stdout.1")));
+
+  // Decompress the rotated files, oldest first, and then the leading
+  // log file, which should give back the output of the task.
+  vector<std::string> argv = {"gzip", "-dc"};
+
+  size_t index = 1;
+  while (os::exists(
+      path::join(sandboxDirectory, "stdout." + stringify(index) + ".gz"))) {
+    index++;
+  }
+
+  while (--index > 0) {
+    argv.push_back(
+        path::join(sandboxDirectory, "stdout." + stringify(index) + ".gz"));
+  }
+
+  argv.push_back(path::join(sandboxDirectory, "stdout.gz"));
+
+  Future<std::string> decompressed = runCommand("gzip", argv);
+  AWAIT_READY(decompressed);
+
+  Try<std::string> output = os::read(path::join(sandboxDirectory, "output"));
+  ASSERT_SOME(output);
+
+  EXPECT_EQ(output.get(), decompressed.get());
+}
+
+
+// Loads the journald ContainerLogger module with splicing enabled,
+// and checks that logs still reach both journald and the sandbox.
+TEST_F(JournaldLoggerTest, ROOT_LogrotateSplice)
+{
+  // Splicing can only be enabled when loading the module.
+  // So this test will unload the module, enable splicing,
+  // and then reload the module.
+  ASSERT_SOME(ModuleManager::unload(JOURNALD_LOGGER_NAME));
+
+  foreach (Modules::Library& library, *modules.mutable_libraries()) {
+    foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+      if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+        Parameter* parameter = module.add_parameters();
+        parameter->set_key("logrotate_splice");
+        parameter->set_value("true");
+      }
+    }
+  }
+
+  // Initialize the modules.
+  Try<Nothing> result = ModuleManager::load(modules);
+  ASSERT_SOME(result);
+
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  // Start a task that writes 2 MB of (mostly blank) output to stdout,
+  // followed by a line we can look for.
+  // With files of at most 1 MB each, this rotates stdout at least once.
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "i=0; while [ $i -lt 2048 ]; "
+      "do printf '%-1023d\\n' $i; i=$((i+1)); done; "
+      "echo 'spliced-last-line'");
+
+  Environment::Variable* variable =
+    task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_DESTINATION_TYPE");
+  variable->set_value("journald+logrotate");
+
+  variable = task.mutable_command()->mutable_environment()->add_variables();
+  variable->set_name("CONTAINER_LOGGER_LOGROTATE_MAX_STDOUT_SIZE");
+  variable->set_value("1MB");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // Query journald for the last line.
+  Future<std::string> query = runCommand(
+      "journalctl",
+      {"journalctl",
+       "FRAMEWORK_ID=" + frameworkId.get().value(),
+       "MESSAGE=spliced-last-line"});
+
+  AWAIT_READY(query);
+  ASSERT_TRUE(strings::contains(query.get(), "spliced-last-line"));
+
+  std::string sandboxDirectory = path::join(
+      flags.work_dir,
+      "slaves",
+      offers.get()[0].slave_id().value(),
+      "frameworks",
+      frameworkId.get().value(),
+      "executors",
+      statusRunning->executor_id().value(),
+      "runs",
+      "latest");
+
+  ASSERT_TRUE(os::exists(sandboxDirectory));
+
+  std::string stdoutPath = path::join(sandboxDirectory, "stdout");
+  ASSERT_TRUE(os::exists(stdoutPath));
+
+  // The leading log file must end with the last line, and must
+  // respect the maximum size.
+  Try<std::string> stdout = os::read(stdoutPath);
+  ASSERT_SOME(stdout);
+  EXPECT_TRUE(strings::endsWith(stdout.get(), "spliced-last-line\n"));
+
+  Try<Bytes> stdoutSize = os::stat::size(stdoutPath);
+  ASSERT_SOME(stdoutSize);
+  EXPECT_LE(stdoutSize.get(), Megabytes(1));
+}
+
+
+// Loads the journald ContainerLogger module in daemon mode, and checks
+// that the logs of a container are written by a single logger daemon.
+TEST_F(JournaldLoggerTest, ROOT_LogToJournaldDaemonMode)
+{
+  // The mode can only be changed when loading the module.
+  // So this test will unload the module, change the mode,
+  // and then reload the module.
+  ASSERT_SOME(ModuleManager::unload(JOURNALD_LOGGER_NAME));
+
+  const std::string socket = path::join(sandbox.get(), "logger.sock");
+
+  foreach (Modules::Library& library, *modules.mutable_libraries()) {
+    foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+      if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+        Parameter* parameter = module.add_parameters();
+        parameter->set_key("logger_mode");
+        parameter->set_value("daemon");
+
+        parameter = module.add_parameters();
+        parameter->set_key("daemon_socket");
+        parameter->set_value(socket);
+      }
+    }
+  }
+
+  // Initialize the modules.
+  Try<Nothing> result = ModuleManager::load(modules);
+  ASSERT_SOME(result);
+
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "echo 'daemon-mode-stdout'; echo 'daemon-mode-stderr' 1>&2");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // Exactly one logger should have been spawned, namely the daemon,
+  // which keeps running after the container has exited.
+  Try<os::ProcessTree> pstrees = os::pstree(0);
+  ASSERT_SOME(pstrees);
+
+  vector<pid_t> loggers;
+  foreach (const os::ProcessTree& pstree, pstrees->children) {
+    if (strings::contains(
+            pstree.process.command,
+            mesos::journald::logger::NAME)) {
+      loggers.push_back(pstree.process.pid);
+    }
+  }
+
+  ASSERT_EQ(1u, loggers.size());
+
+  // Query journald for both streams.
+  Future<std::string> query = runCommand(
+      "journalctl",
+      {"journalctl",
+       "FRAMEWORK_ID=" + frameworkId.get().value(),
+       "MESSAGE=daemon-mode-stdout"});
+
+  AWAIT_READY(query);
+  EXPECT_TRUE(strings::contains(query.get(), "daemon-mode-stdout"));
+
+  query = runCommand(
+      "journalctl",
+      {"journalctl",
+       "FRAMEWORK_ID=" + frameworkId.get().value(),
+       "STREAM=STDERR",
+       "MESSAGE=daemon-mode-stderr"});
+
+  AWAIT_READY(query);
+  EXPECT_TRUE(strings::contains(query.get(), "daemon-mode-stderr"));
+
+  // The daemon writes to the sandbox with absolute paths.
+  std::string sandboxDirectory = path::join(
+      flags.work_dir,
+      "slaves",
+      offers.get()[0].slave_id().value(),
+      "frameworks",
+      frameworkId.get().value(),
+      "executors",
+      statusRunning->executor_id().value(),
+      "runs",
+      "latest");
+
+  Try<std::string> stdout = os::read(path::join(sandboxDirectory, "stdout"));
+  ASSERT_SOME(stdout);
+  EXPECT_TRUE(strings::contains(stdout.get(), "daemon-mode-stdout"));
+
+  Try<std::string> stderr = os::read(path::join(sandboxDirectory, "stderr"));
+  ASSERT_SOME(stderr);
+  EXPECT_TRUE(strings::contains(stderr.get(), "daemon-mode-stderr"));
+
+  // The daemon outlives the module, so it must be stopped explicitly.
+  EXPECT_SOME(os::killtree(loggers[0], SIGKILL));
+}
+
+
+// Loads the journald ContainerLogger module with a pool of standby
+// loggers, and checks that containers are logged by pooled loggers
+// and that the pool is refilled afterwards.
+TEST_F(JournaldLoggerTest, ROOT_LogToJournaldLoggerPool)
+{
+  // The pool size can only be changed when loading the module.
+  // So this test will unload the module, change the pool size,
+  // and then reload the module.
+  ASSERT_SOME(ModuleManager::unload(JOURNALD_LOGGER_NAME));
+
+  foreach (Modules::Library& library, *modules.mutable_libraries()) {
+    foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+      if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+        Parameter* parameter = module.add_parameters();
+        parameter->set_key("logger_pool_size");
+        parameter->set_value("2");
+      }
+    }
+  }
+
+  // Initialize the modules.
+  Try<Nothing> result = ModuleManager::load(modules);
+  ASSERT_SOME(result);
+
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  // Returns the PIDs of the standby loggers among our children.
+  auto standbys = []() {
+    vector<pid_t> pids;
+
+    Try<os::ProcessTree> pstrees = os::pstree(0);
+    if (pstrees.isSome()) {
+      foreach (const os::ProcessTree& pstree, pstrees->children) {
+        if (strings::contains(pstree.process.command, "--standby=true")) {
+          pids.push_back(pstree.process.pid);
+        }
+      }
+    }
+
+    return pids;
+  };
+
+  // Wait for the pool to fill up.
+  Duration waited = Duration::zero();
+  while (standbys().size() < 2u && waited < Seconds(10)) {
+    os::sleep(Milliseconds(100));
+    waited += Milliseconds(100);
+  }
+
+  const vector<pid_t> pool = standbys();
+  ASSERT_EQ(2u, pool.size());
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  TaskInfo task = createTask(offers.get()[0], "echo 'pooled-logger-line'");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  Future<TaskStatus> statusFinished;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillOnce(FutureArg<1>(&statusFinished))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+
+  AWAIT_READY(statusFinished);
+  EXPECT_EQ(TASK_FINISHED, statusFinished.get().state());
+
+  driver.stop();
+  driver.join();
+
+  // Query journald for the line, which was logged by a pooled logger.
+  Future<std::string> query = runCommand(
+      "journalctl",
+      {"journalctl",
+       "FRAMEWORK_ID=" + frameworkId.get().value(),
+       "MESSAGE=pooled-logger-line"});
+
+  AWAIT_READY(query);
+  EXPECT_TRUE(strings::contains(query.get(), "pooled-logger-line"));
+
+  // The pooled loggers have been handed to the executor's container,
+  // so the pool should have been refilled with new standby loggers.
+  waited = Duration::zero();
+  vector<pid_t> refilled = standbys();
+  while (waited < Seconds(10) &&
+         (refilled.size() < 2u ||
+          std::find(refilled.begin(), refilled.end(), pool[0]) !=
+            refilled.end())) {
+    os::sleep(Milliseconds(100));
+    waited += Milliseconds(100);
+    refilled = standbys();
+  }
+
+  EXPECT_EQ(2u, refilled.size());
+  foreach (pid_t pid, pool) {
+    EXPECT_EQ(refilled.end(), std::find(refilled.begin(), refilled.end(), pid));
+  }
+}
+
+
+// Loads the journald ContainerLogger module with metrics enabled, and
+// checks that the stats written by the loggers are exposed as metrics
+// of the agent while the container runs.
+TEST_F(JournaldLoggerTest, ROOT_LoggerMetrics)
+{
+  // We want to set the module parameters before loading the module.
+  // So this test will unload the module, enable the metrics,
+  // and then reload the module.
+  ASSERT_SOME(ModuleManager::unload(JOURNALD_LOGGER_NAME));
+
+  foreach (Modules::Library& library, *modules.mutable_libraries()) {
+    foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+      if (module.has_name() && module.name() == JOURNALD_LOGGER_NAME) {
+        Parameter* parameter = module.add_parameters();
+        parameter->set_key("logger_metrics");
+        parameter->set_value("true");
+
+        parameter = module.add_parameters();
+        parameter->set_key("logger_stats_dir");
+        parameter->set_value(path::join(os::getcwd(), "stats"));
+      }
+    }
+  }
+
+  // Initialize the modules.
+  Try<Nothing> result = ModuleManager::load(modules);
+  ASSERT_SOME(result);
+
+  // Create a master, agent, and framework.
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  // We'll need access to these flags later.
+  mesos::internal::slave::Flags flags = CreateSlaveFlags();
+
+  // Use the journald container logger.
+  flags.container_logger = JOURNALD_LOGGER_NAME;
+
+  Fetcher fetcher(flags);
+
+  // We use an actual containerizer + executor since we want something to run.
+  Try<MesosContainerizer*> _containerizer =
+    MesosContainerizer::create(flags, false, &fetcher);
+
+  CHECK_SOME(_containerizer);
+  Owned<MesosContainerizer> containerizer(_containerizer.get());
+
+  Owned<MasterDetector> detector = master.get()->createDetector();
+
+  Try<Owned<cluster::Slave>> slave =
+    StartSlave(detector.get(), containerizer.get(), flags);
+  ASSERT_SOME(slave);
+
+  MockScheduler sched;
+  MesosSchedulerDriver driver(
+      &sched, DEFAULT_FRAMEWORK_INFO, master.get()->pid, DEFAULT_CREDENTIAL);
+
+  Future<FrameworkID> frameworkId;
+  EXPECT_CALL(sched, registered(&driver, _, _))
+    .WillOnce(FutureArg<1>(&frameworkId));
+
+  // Wait for an offer, and start a task.
+  Future<vector<Offer>> offers;
+  EXPECT_CALL(sched, resourceOffers(&driver, _))
+    .WillOnce(FutureArg<1>(&offers))
+    .WillRepeatedly(Return()); // Ignore subsequent offers.
+
+  driver.start();
+  AWAIT_READY(frameworkId);
+
+  AWAIT_READY(offers);
+  EXPECT_NE(0u, offers.get().size());
+
+  // The task keeps running, so that its loggers do not exit.
+  TaskInfo task = createTask(
+      offers.get()[0],
+      "echo logger-metrics-line; sleep 1000");
+
+  Future<TaskStatus> statusStarting;
+  Future<TaskStatus> statusRunning;
+  EXPECT_CALL(sched, statusUpdate(&driver, _))
+    .WillOnce(FutureArg<1>(&statusStarting))
+    .WillOnce(FutureArg<1>(&statusRunning))
+    .WillRepeatedly(Return());       // Ignore subsequent updates.
+
+  driver.launchTasks(offers.get()[0].id(), {task});
+
+  AWAIT_READY(statusStarting);
+  EXPECT_EQ(TASK_STARTING, statusStarting.get().state());
+
+  AWAIT_READY(statusRunning);
+  EXPECT_EQ(TASK_RUNNING, statusRunning.get().state());
+  ASSERT_TRUE(statusRunning->has_container_status());
+  ASSERT_TRUE(statusRunning->container_status().has_container_id());
+
+  // The stats file is created by the agent, outside of the sandbox.
+  const std::string statsPath = path::join(
+      os::getcwd(),
+      "stats",
+      stringify(statusRunning->container_status().container_id()) +
+        ".stdout" + mesos::journald::logger::STATS_SUFFIX);
+
+  Try<int_fd> statsFd = os::open(statsPath, O_RDONLY | O_CLOEXEC);
+  ASSERT_SOME(statsFd);
+
+  // Wait for the line to be read by the logger.
+  Try<uint64_t> lines = Error("Not read yet");
+  Duration waited = Duration::zero();
+  do {
+    lines = mesos::journald::logger::readStat(
+        statsFd.get(), offsetof(mesos::journald::logger::Stats, linesRead));
+
+    if (lines.isSome() && lines.get() > 0) {
+      break;
+    }
+
+    os::sleep(Milliseconds(100));
+    waited += Milliseconds(100);
+  } while (waited < Seconds(15));
+
+  ASSERT_SOME(lines);
+  EXPECT_EQ(1u, lines.get());
+
+  Try<uint64_t> bytes = mesos::journald::logger::readStat(
+      statsFd.get(), offsetof(mesos::journald::logger::Stats, bytesRead));
+
+  os::close(statsFd.get());
+
+  ASSERT_SOME(bytes);
+  EXPECT_LE(strlen("logger-metrics-line\n"), bytes.get());
+
+  // The same stats should be exposed as metrics of the agent.
+  const std::string prefix = "containerizer/journald_logger/" +
+    stringify(statusRunning->container_status().container_id()) +
+    "/stdout/";
+
+  JSON::Object metrics = Metrics();
+
+  Result<JSON::Number> linesRead =
+    metrics.at<JSON::Number>(prefix + "lines_read");
+
+  ASSERT_SOME(linesRead);
+  EXPECT_EQ(1, linesRead->as<int>());
+
+  EXPECT_SOME(metrics.at<JSON::Number>(prefix + "bytes_read"));
+  EXPECT_SOME(metrics.at<JSON::Number>(prefix + "write_blocked_ms"));
+  EXPECT_SOME(metrics.at<JSON::Number>(prefix + "rotation_duration/under_1ms"));
+
+  driver.stop();
+  driver.join();
+}
+
+
 // This test verfies that the executor information will be passed to
 // the container logger the same way before and after an agent
 // restart. Note that this is different than the behavior before Mesos
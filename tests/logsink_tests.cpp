@@ -1,5 +1,11 @@
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
 #include <list>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gmock/gmock.h>
 
@@ -16,17 +22,26 @@
 #include <process/owned.hpp>
 #include <process/process.hpp>
 
+#include <stout/bytes.hpp>
 #include <stout/duration.hpp>
 #include <stout/gtest.hpp>
+#include <stout/numify.hpp>
 #include <stout/os.hpp>
 #include <stout/path.hpp>
+#include <stout/stringify.hpp>
 #include <stout/strings.hpp>
 
 #include <stout/os/exists.hpp>
 #include <stout/os/read.hpp>
 
+#include <stout/tests/utils.hpp>
+
 #include "hook/manager.hpp"
 
+#include "logsink/deduplicator.hpp"
+#include "logsink/logsink.hpp"
+#include "logsink/ring_buffer.hpp"
+
 #include "module/manager.hpp"
 
 #include "tests/mesos.hpp"
@@ -219,6 +234,369 @@ TEST_F(LogSinkTest, LogStress)
   }
 }
 
+
+// Checks that the ring buffer rounds up its capacity, rejects values
+// while it is full, and hands out values in order.
+TEST(LogSinkRingBufferTest, PushPop)
+{
+  RingBuffer<std::string> buffer(3);
+  EXPECT_EQ(4u, buffer.capacity());
+  EXPECT_TRUE(buffer.empty());
+
+  for (int i = 0; i < 4; i++) {
+    uint64_t position;
+    EXPECT_TRUE(buffer.push(stringify(i), &position));
+    EXPECT_EQ(static_cast<uint64_t>(i), position);
+  }
+
+  EXPECT_FALSE(buffer.push("full"));
+
+  std::string value;
+  ASSERT_TRUE(buffer.pop(&value));
+  EXPECT_EQ("0", value);
+  EXPECT_EQ(1u, buffer.popped());
+
+  // The freed slot can be reused.
+  EXPECT_TRUE(buffer.push("4"));
+
+  for (int i = 1; i < 5; i++) {
+    ASSERT_TRUE(buffer.pop(&value));
+    EXPECT_EQ(stringify(i), value);
+  }
+
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_FALSE(buffer.pop(&value));
+}
+
+
+class FileSinkTest : public TemporaryDirectoryTest {};
+
+
+// Logs from several threads via an asynchronous `FileSink`, with a
+// queue much smaller than the number of log lines, and checks that
+// every line is written out, in order.
+TEST_F(FileSinkTest, AsyncWrite)
+{
+  Flags flags;
+  flags.output_file = path::join(sandbox.get(), "async.log");
+  flags.async = true;
+  flags.async_buffer_size = 16;
+  flags.async_overflow_policy = "block";
+
+  const int THREADS = 4;
+  const int LINES = 1000;
+
+  {
+    FileSink sink(flags);
+
+    const time_t now = ::time(nullptr);
+    struct ::tm time;
+    ::localtime_r(&now, &time);
+
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < THREADS; thread++) {
+      threads.emplace_back([&sink, &time, thread]() {
+        for (int line = 0; line < LINES; line++) {
+          const std::string message =
+            "thread " + stringify(thread) + " line " + stringify(line) + "\n";
+
+          sink.send(
+              google::GLOG_INFO,
+              __FILE__,
+              "logsink_tests.cpp",
+              __LINE__,
+              &time,
+              message.data(),
+              message.size() - 1);
+
+          sink.WaitTillSent();
+        }
+      });
+    }
+
+    foreach (std::thread& thread, threads) {
+      thread.join();
+    }
+
+    EXPECT_EQ(0u, sink.dropped());
+
+    // The sink writes out all queued lines when destroyed.
+  }
+
+  Try<std::string> logContents = os::read(flags.output_file);
+  ASSERT_SOME(logContents);
+
+  std::vector<int> next(THREADS, 0);
+  foreach (const std::string& line, strings::split(logContents.get(), "\n")) {
+    if (line.empty()) {
+      continue;
+    }
+
+    std::vector<std::string> tokens = strings::tokenize(line, " ");
+    ASSERT_LE(4u, tokens.size()) << line;
+
+    Try<int> thread = numify<int>(tokens[tokens.size() - 3]);
+    Try<int> number = numify<int>(tokens[tokens.size() - 1]);
+    ASSERT_SOME(thread) << line;
+    ASSERT_SOME(number) << line;
+    ASSERT_LE(0, thread.get());
+    ASSERT_GT(THREADS, thread.get());
+
+    EXPECT_EQ(next[thread.get()]++, number.get()) << line;
+  }
+
+  foreach (int lines, next) {
+    EXPECT_EQ(LINES, lines);
+  }
+}
+
+
+// Checks that a `FileSink` with size based rotation keeps the
+// configured number of compressed rotated files.
+TEST_F(FileSinkTest, Rotate)
+{
+  Flags flags;
+  flags.output_file = path::join(sandbox.get(), "rotate.log");
+  flags.max_size = Kilobytes(1);
+  flags.max_files = 2;
+  flags.compress = true;
+
+  {
+    FileSink sink(flags);
+
+    const time_t now = ::time(nullptr);
+    struct ::tm time;
+    ::localtime_r(&now, &time);
+
+    // Each line takes a little more than 100 bytes with its prefix,
+    // so this rotates the log file several times.
+    const std::string message = std::string(100, 'x') + "\n";
+    for (int line = 0; line < 100; line++) {
+      sink.send(
+          google::GLOG_INFO,
+          __FILE__,
+          "logsink_tests.cpp",
+          __LINE__,
+          &time,
+          message.data(),
+          message.size() - 1);
+    }
+
+    // The sink waits for pending compressions when destroyed.
+  }
+
+  EXPECT_TRUE(os::exists(flags.output_file));
+  EXPECT_TRUE(os::exists(flags.output_file + ".1.gz"));
+  EXPECT_TRUE(os::exists(flags.output_file + ".2.gz"));
+  EXPECT_FALSE(os::exists(flags.output_file + ".3.gz"));
+  EXPECT_FALSE(os::exists(flags.output_file + ".1"));
+
+  Try<std::string> logContents = os::read(flags.output_file);
+  ASSERT_SOME(logContents);
+  EXPECT_GE(flags.max_size.bytes(), logContents->size());
+}
+
+
+// Checks that a `FileSink` reopens its log file upon the configured
+// signal, after the log file has been moved away.
+TEST_F(FileSinkTest, ReopenOnSignal)
+{
+  Flags flags;
+  flags.output_file = path::join(sandbox.get(), "reopen.log");
+  flags.reopen_signal = "SIGUSR2";
+
+  const time_t now = ::time(nullptr);
+  struct ::tm time;
+  ::localtime_r(&now, &time);
+
+  FileSink sink(flags);
+
+  const std::string before = "before the signal\n";
+  sink.send(
+      google::GLOG_INFO,
+      __FILE__,
+      "logsink_tests.cpp",
+      __LINE__,
+      &time,
+      before.data(),
+      before.size() - 1);
+
+  const std::string moved = flags.output_file + ".moved";
+  ASSERT_SOME(os::rename(flags.output_file, moved));
+  ASSERT_EQ(0, ::raise(SIGUSR2));
+
+  // The log file is only reopened once this line has been written,
+  // so it still goes to the moved file.
+  const std::string signaled = "after the signal\n";
+  sink.send(
+      google::GLOG_INFO,
+      __FILE__,
+      "logsink_tests.cpp",
+      __LINE__,
+      &time,
+      signaled.data(),
+      signaled.size() - 1);
+
+  const std::string after = "after reopening\n";
+  sink.send(
+      google::GLOG_INFO,
+      __FILE__,
+      "logsink_tests.cpp",
+      __LINE__,
+      &time,
+      after.data(),
+      after.size() - 1);
+
+  Try<std::string> movedContents = os::read(moved);
+  ASSERT_SOME(movedContents);
+  EXPECT_TRUE(strings::contains(movedContents.get(), "before the signal"));
+  EXPECT_FALSE(strings::contains(movedContents.get(), "after reopening"));
+
+  Try<std::string> logContents = os::read(flags.output_file);
+  ASSERT_SOME(logContents);
+  EXPECT_TRUE(strings::contains(logContents.get(), "after reopening"));
+}
+
+
+// Checks that the deduplicator lets bursts through, and reports the
+// suppressed repeats once the interval has passed.
+TEST(LogSinkDeduplicatorTest, Burst)
+{
+  const int64_t SECOND = Seconds(1).ns();
+
+  Deduplicator deduplicator(Seconds(1), 2);
+
+  const Deduplicator::Key key = {google::GLOG_WARNING, __FILE__, __LINE__};
+  const Deduplicator::Key other = {google::GLOG_WARNING, __FILE__, __LINE__};
+
+  uint64_t repeated;
+  EXPECT_TRUE(deduplicator.admit(key, 0, &repeated));
+  EXPECT_EQ(0u, repeated);
+  EXPECT_TRUE(deduplicator.admit(key, 1, &repeated));
+  EXPECT_FALSE(deduplicator.admit(key, 2, &repeated));
+  EXPECT_FALSE(deduplicator.admit(key, 3, &repeated));
+
+  // Other keys are not affected.
+  EXPECT_TRUE(deduplicator.admit(other, 4, &repeated));
+
+  // The next interval reports the repeats of the previous one.
+  EXPECT_TRUE(deduplicator.admit(key, SECOND, &repeated));
+  EXPECT_EQ(2u, repeated);
+
+  EXPECT_TRUE(deduplicator.admit(key, SECOND + 1, &repeated));
+  EXPECT_FALSE(deduplicator.admit(key, SECOND + 2, &repeated));
+
+  // A sweep reports the repeats of keys which went quiet.
+  std::vector<uint64_t> reports;
+  deduplicator.sweep(
+      3 * SECOND,
+      [&reports](const Deduplicator::Key& key, uint64_t repeated) {
+        reports.push_back(repeated);
+      });
+
+  EXPECT_EQ(std::vector<uint64_t>({1u}), reports);
+}
+
+
+// Checks that the `FileSink` formats log lines like glog does.
+TEST_F(FileSinkTest, Format)
+{
+  Flags flags;
+  flags.output_file = path::join(sandbox.get(), "format.log");
+
+  const time_t now = ::time(nullptr);
+  struct ::tm time;
+  ::localtime_r(&now, &time);
+
+  const std::string message = "formatted\n";
+
+  {
+    FileSink sink(flags);
+    sink.send(
+        google::GLOG_ERROR,
+        __FILE__,
+        "logsink_tests.cpp",
+        42,
+        &time,
+        message.data(),
+        message.size() - 1);
+  }
+
+  std::string expected = google::LogSink::ToString(
+      google::GLOG_ERROR,
+      "logsink_tests.cpp",
+      42,
+      &time,
+      message.data(),
+      message.size());
+
+  Try<std::string> logContents = os::read(flags.output_file);
+  ASSERT_SOME(logContents);
+
+  // The microseconds come from the current time, so skip them.
+  const size_t MICROSECONDS = strlen("I1014 12:34:56.");
+  ASSERT_EQ(expected.size(), logContents->size());
+  EXPECT_EQ(expected.substr(0, MICROSECONDS),
+            logContents->substr(0, MICROSECONDS));
+  EXPECT_EQ(expected.substr(MICROSECONDS + 6),
+            logContents->substr(MICROSECONDS + 6));
+}
+
+
+// Logs the same line over and over, and checks that the `FileSink`
+// only writes a burst of it, followed by a summary of the repeats.
+TEST_F(FileSinkTest, Deduplicate)
+{
+  Flags flags;
+  flags.output_file = path::join(sandbox.get(), "dedup.log");
+  flags.dedup_interval = Milliseconds(100);
+  flags.dedup_burst = 5;
+
+  const time_t now = ::time(nullptr);
+  struct ::tm time;
+  ::localtime_r(&now, &time);
+
+  const std::string message = "storm\n";
+
+  {
+    FileSink sink(flags);
+
+    for (int i = 0; i < 100; i++) {
+      sink.send(
+          google::GLOG_WARNING,
+          __FILE__,
+          "logsink_tests.cpp",
+          42,
+          &time,
+          message.data(),
+          message.size() - 1);
+    }
+
+    os::sleep(Milliseconds(150));
+
+    sink.send(
+        google::GLOG_WARNING,
+        __FILE__,
+        "logsink_tests.cpp",
+        42,
+        &time,
+        message.data(),
+        message.size() - 1);
+  }
+
+  Try<std::string> logContents = os::read(flags.output_file);
+  ASSERT_SOME(logContents);
+
+  std::vector<std::string> lines =
+    strings::tokenize(logContents.get(), "\n");
+
+  ASSERT_EQ(7u, lines.size()) << logContents.get();
+  EXPECT_TRUE(strings::endsWith(lines[4], "] storm"));
+  EXPECT_TRUE(strings::endsWith(
+      lines[5], "] Last message repeated 95 more times"));
+  EXPECT_TRUE(strings::endsWith(lines[6], "] storm"));
+}
+
 } // namespace tests {
 } // namespace logsink {
 } // namespace mesos {
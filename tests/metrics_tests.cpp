@@ -3,6 +3,7 @@
 
 #include <gmock/gmock.h>
 
+#include <mesos/http.hpp>
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
 
@@ -45,8 +46,15 @@ using namespace mesos::internal::tests;
 
 using mesos::modules::ModuleManager;
 
+using mesos::modules::metrics::ContainerStartBatchRequest;
+using mesos::modules::metrics::ContainerStartBatchResponse;
 using mesos::modules::metrics::ContainerStartRequest;
 using mesos::modules::metrics::ContainerStartResponse;
+using mesos::modules::metrics::ContainerStopBatchRequest;
+using mesos::modules::metrics::StatsdBindRequest;
+using mesos::modules::metrics::StatsdLease;
+using mesos::modules::metrics::StatsdLeaseRequest;
+using mesos::modules::metrics::StatsdLeaseResponse;
 
 using mesos::slave::Isolator;
 
@@ -56,11 +64,13 @@ using mesosphere::dcos::metrics::parse;
 using process::Clock;
 using process::Future;
 using process::Owned;
+using process::Promise;
 
 using std::string;
 using std::vector;
 
 using testing::DoAll;
+using testing::Invoke;
 using testing::Return;
 
 namespace mesos {
@@ -114,6 +124,15 @@ protected:
 
     modules = _modules.get();
 
+    // Add the parameters of the test, if any.
+    foreachpair (const string& key, const string& value, parameters()) {
+      Parameter* parameter =
+        modules.mutable_libraries(0)->mutable_modules(0)->add_parameters();
+
+      parameter->set_key(key);
+      parameter->set_value(value);
+    }
+
     // Initialize the metrics module.
     Try<Nothing> result = ModuleManager::load(modules);
     ASSERT_SOME(result);
@@ -143,6 +162,9 @@ protected:
     MesosTest::TearDown();
   }
 
+  // Additional parameters of the metrics module.
+  virtual hashmap<string, string> parameters() const { return {}; }
+
   Isolator* isolator;
 
 private:
@@ -150,6 +172,64 @@ private:
 };
 
 
+// Loads the metrics module with batching enabled.
+class MetricsBatchTest : public MetricsTest
+{
+protected:
+  hashmap<string, string> parameters() const override
+  {
+    return {{"batch_window", stringify(BATCH_WINDOW)}};
+  }
+
+  const Duration BATCH_WINDOW = Seconds(1);
+};
+
+
+// Loads the metrics module with a pool of leased StatsD listeners.
+class MetricsStatsdPoolTest : public MetricsTest
+{
+protected:
+  hashmap<string, string> parameters() const override
+  {
+    return {{"statsd_pool_size", stringify(STATSD_POOL_SIZE)}};
+  }
+
+  const size_t STATSD_POOL_SIZE = 2;
+};
+
+
+// Loads the metrics module with a checkpointed cleanup queue.
+class MetricsCleanupQueueTest : public MetricsTest
+{
+protected:
+  hashmap<string, string> parameters() const override
+  {
+    return {{"cleanup_queue_dir", cleanupQueueDir()},
+            {"cleanup_backoff", stringify(Milliseconds(10))}};
+  }
+
+  string cleanupQueueDir() const
+  {
+    return path::join(sandbox.get(), "cleanup");
+  }
+
+  // Waits for the listener of the container to be stopped, i.e. for
+  // its checkpoint to be removed.
+  void awaitStopped(const string& containerId) const
+  {
+    const string checkpoint = path::join(cleanupQueueDir(), containerId);
+
+    Duration waited = Duration::zero();
+    while (os::exists(checkpoint)) {
+      ASSERT_LT(waited, REQUEST_TIMEOUT);
+
+      os::sleep(Milliseconds(10));
+      waited += Milliseconds(10);
+    }
+  }
+};
+
+
 // Simulates the DC/OS metrics service.
 class MockMetricsServiceProcess
   : public process::Process<MockMetricsServiceProcess>
@@ -443,6 +523,142 @@ TEST_F(MetricsTest, CleanupSuccessRequestTimeout)
 }
 
 
+// Consecutive requests to the metrics service should reuse the
+// connection opened by the first one.
+TEST_F(MetricsTest, ConnectionReuse)
+{
+  MockMetricsService metricsService;
+
+  ContainerStartResponse responseBody;
+  responseBody.set_statsd_port(1111);
+  responseBody.set_statsd_host("127.0.0.1");
+
+  process::http::Response response(
+      string(jsonify(JSON::Protobuf(responseBody))),
+      process::http::Status::CREATED,
+      "application/json");
+
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillRepeatedly(Return(response));
+
+  for (int i = 0; i < 3; i++) {
+    ContainerID containerId;
+    containerId.set_value("new-container-" + stringify(i));
+
+    Future<Option<mesos::slave::ContainerLaunchInfo>> prepared =
+      isolator->prepare(containerId, mesos::slave::ContainerConfig());
+
+    AWAIT_READY(prepared);
+  }
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(1, metrics.values["metrics_isolator/connection_pool_misses"]);
+  EXPECT_EQ(2, metrics.values["metrics_isolator/connection_pool_hits"]);
+}
+
+
+// Once the metrics service responds with protobuf, the isolator should
+// send its requests as protobuf, too.
+TEST_F(MetricsTest, PrepareProtobuf)
+{
+  MockMetricsService metricsService;
+
+  ContainerStartResponse responseBody;
+  responseBody.set_statsd_port(1111);
+  responseBody.set_statsd_host("127.0.0.1");
+
+  process::http::Response response(
+      responseBody.SerializeAsString(),
+      process::http::Status::CREATED,
+      APPLICATION_PROTOBUF);
+
+  Future<process::http::Request> first;
+  Future<process::http::Request> second;
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillOnce(DoAll(FutureArg<0>(&first),
+                    Return(response)))
+    .WillOnce(DoAll(FutureArg<0>(&second),
+                    Return(response)));
+
+  vector<Future<Option<mesos::slave::ContainerLaunchInfo>>> prepared;
+  for (int i = 0; i < 2; i++) {
+    ContainerID containerId;
+    containerId.set_value("new-container-" + stringify(i));
+
+    prepared.push_back(
+        isolator->prepare(containerId, mesos::slave::ContainerConfig()));
+
+    AWAIT_READY(prepared.back());
+    ASSERT_SOME(prepared.back().get());
+    ASSERT_EQ(2, prepared.back().get()->environment().variables_size());
+    EXPECT_EQ(
+        "1111", prepared.back().get()->environment().variables(1).value());
+  }
+
+  // The first request is sent as JSON, accepting either.
+  AWAIT_READY(first);
+  EXPECT_SOME_EQ(APPLICATION_JSON, first->headers.get("Content-Type"));
+  ASSERT_SOME(first->headers.get("Accept"));
+  EXPECT_TRUE(strings::contains(
+      first->headers.get("Accept").get(), APPLICATION_PROTOBUF));
+
+  // The second request is sent as protobuf.
+  AWAIT_READY(second);
+  EXPECT_SOME_EQ(APPLICATION_PROTOBUF, second->headers.get("Content-Type"));
+
+  ContainerStartRequest requestBody;
+  ASSERT_TRUE(requestBody.ParseFromString(second->body));
+  EXPECT_EQ("new-container-1", requestBody.container_id());
+}
+
+
+// The isolator should expose how long its requests take, and how many
+// of them did not succeed.
+TEST_F(MetricsTest, Instrumentation)
+{
+  MockMetricsService metricsService;
+
+  ContainerStartResponse responseBody;
+  responseBody.set_statsd_port(1111);
+  responseBody.set_statsd_host("127.0.0.1");
+
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillOnce(Return(process::http::Response(
+        string(jsonify(JSON::Protobuf(responseBody))),
+        process::http::Status::CREATED,
+        "application/json")))
+    .WillOnce(Return(process::http::InternalServerError()));
+
+  ContainerID containerId;
+  containerId.set_value("new-container");
+
+  AWAIT_READY(isolator->prepare(containerId, mesos::slave::ContainerConfig()));
+
+  containerId.set_value("failed-container");
+
+  AWAIT_FAILED(
+      isolator->prepare(containerId, mesos::slave::ContainerConfig()));
+
+  mesos::slave::ContainerConfig containerConfig;
+  containerConfig.set_container_class(mesos::slave::ContainerClass::DEBUG);
+
+  containerId.set_value("debug-container");
+
+  AWAIT_READY(isolator->prepare(containerId, containerConfig));
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(1, metrics.values["metrics_isolator/connection_pool_misses"]);
+  EXPECT_EQ(2, metrics.values["metrics_isolator/request_time_ms/count"]);
+  EXPECT_EQ(3, metrics.values["metrics_isolator/prepare_latency_ms/count"]);
+  EXPECT_EQ(0, metrics.values["metrics_isolator/request_timeouts"]);
+  EXPECT_EQ(1, metrics.values["metrics_isolator/non_2xx_responses"]);
+  EXPECT_EQ(1, metrics.values["metrics_isolator/debug_containers_skipped"]);
+  EXPECT_EQ(0, metrics.values["metrics_isolator/requests_in_flight"]);
+}
+
+
 TEST_F(MetricsTest, PrepareAndCleanupSuccessDebugContainer)
 {
   Clock::pause();
@@ -478,6 +694,367 @@ TEST_F(MetricsTest, PrepareAndCleanupSuccessDebugContainer)
   Clock::resume();
 }
 
+
+// Containers prepared within the batch window should be started with
+// a single request, whose response is fanned out to the containers.
+TEST_F(MetricsBatchTest, PrepareBatch)
+{
+  Clock::pause();
+
+  MockMetricsService metricsService;
+
+  ContainerStartBatchResponse responseBody;
+  ContainerStartBatchResponse::Container* container =
+    responseBody.add_containers();
+  container->set_container_id("statsd-container");
+  container->mutable_response()->set_statsd_host("127.0.0.1");
+  container->mutable_response()->set_statsd_port(1111);
+
+  container = responseBody.add_containers();
+  container->set_container_id("plain-container");
+
+  container = responseBody.add_containers();
+  container->set_container_id("failed-container");
+  container->set_error("No more listeners");
+
+  process::http::Response response(
+      string(jsonify(JSON::Protobuf(responseBody))),
+      process::http::Status::OK,
+      "application/json");
+
+  Future<process::http::Request> request;
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillOnce(DoAll(FutureArg<0>(&request),
+                    Return(response)));
+
+  vector<Future<Option<mesos::slave::ContainerLaunchInfo>>> prepared;
+  foreach (const string& id,
+           vector<string>(
+               {"statsd-container", "plain-container", "failed-container"})) {
+    ContainerID containerId;
+    containerId.set_value(id);
+
+    prepared.push_back(
+        isolator->prepare(containerId, mesos::slave::ContainerConfig()));
+  }
+
+  // Nothing is sent before the batch window has passed.
+  Clock::settle();
+  EXPECT_TRUE(request.isPending());
+
+  Clock::advance(BATCH_WINDOW);
+
+  AWAIT_READY(request);
+  EXPECT_EQ("POST", request->method);
+  EXPECT_TRUE(strings::endsWith(request->url.path, "/batch/start"));
+
+  Try<ContainerStartBatchRequest> requestBody =
+    parse<ContainerStartBatchRequest>(request->body);
+
+  ASSERT_SOME(requestBody);
+  ASSERT_EQ(3, requestBody->containers_size());
+  EXPECT_EQ("statsd-container", requestBody->containers(0).container_id());
+
+  AWAIT_READY(prepared[0]);
+  ASSERT_SOME(prepared[0].get());
+  ASSERT_EQ(2, prepared[0].get()->environment().variables_size());
+  EXPECT_EQ("1111", prepared[0].get()->environment().variables(1).value());
+
+  AWAIT_READY(prepared[1]);
+  EXPECT_NONE(prepared[1].get());
+
+  AWAIT_FAILED(prepared[2]);
+
+  Clock::resume();
+}
+
+
+// Containers cleaned up within the batch window should be stopped with
+// a single request.
+TEST_F(MetricsBatchTest, CleanupBatch)
+{
+  Clock::pause();
+
+  MockMetricsService metricsService;
+
+  process::http::Response response(process::http::Status::ACCEPTED);
+
+  Future<process::http::Request> request;
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillOnce(DoAll(FutureArg<0>(&request),
+                    Return(response)));
+
+  ContainerID first;
+  first.set_value("first-container");
+
+  ContainerID second;
+  second.set_value("second-container");
+
+  Future<Nothing> firstCleanedUp = isolator->cleanup(first);
+  Future<Nothing> secondCleanedUp = isolator->cleanup(second);
+
+  Clock::advance(BATCH_WINDOW);
+
+  AWAIT_READY(request);
+  EXPECT_EQ("POST", request->method);
+  EXPECT_TRUE(strings::endsWith(request->url.path, "/batch/stop"));
+
+  Try<ContainerStopBatchRequest> requestBody =
+    parse<ContainerStopBatchRequest>(request->body);
+
+  ASSERT_SOME(requestBody);
+  ASSERT_EQ(2, requestBody->container_ids_size());
+  EXPECT_EQ("first-container", requestBody->container_ids(0));
+  EXPECT_EQ("second-container", requestBody->container_ids(1));
+
+  AWAIT_READY(firstCleanedUp);
+  AWAIT_READY(secondCleanedUp);
+
+  Clock::resume();
+}
+
+
+// Containers should be handed a leased StatsD listener right after it
+// has been bound to the container.
+TEST_F(MetricsStatsdPoolTest, PrepareLeased)
+{
+  MockMetricsService metricsService;
+
+  int leased = 0;
+  Promise<process::http::Request> bound;
+
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillRepeatedly(Invoke(
+        [&](const process::http::Request& request)
+            -> Future<process::http::Response> {
+          if (strings::endsWith(request.url.path, "/lease")) {
+            Try<StatsdLeaseRequest> leaseRequest =
+              parse<StatsdLeaseRequest>(request.body);
+            if (leaseRequest.isError()) {
+              return process::http::BadRequest(leaseRequest.error());
+            }
+
+            StatsdLeaseResponse leaseResponse;
+            for (uint32_t i = 0; i < leaseRequest->count(); i++) {
+              StatsdLease* lease = leaseResponse.add_leases();
+              lease->set_lease_id("lease-" + stringify(leased));
+              lease->set_statsd_host("127.0.0.1");
+              lease->set_statsd_port(2000 + leased);
+              leased++;
+            }
+
+            return process::http::Response(
+                string(jsonify(JSON::Protobuf(leaseResponse))),
+                process::http::Status::CREATED,
+                "application/json");
+          }
+
+          if (strings::endsWith(request.url.path, "/lease/bind")) {
+            bound.set(request);
+          }
+
+          return process::http::Response(process::http::Status::ACCEPTED);
+        }));
+
+  // Recreate the isolator, so that it fills its pool from the mock.
+  delete isolator;
+
+  Try<Isolator*> isolator_ =
+    ModuleManager::create<Isolator>(
+        "com_mesosphere_dcos_MetricsIsolatorModule");
+
+  ASSERT_SOME(isolator_);
+  isolator = isolator_.get();
+
+  // Wait for the pool to be filled.
+  Duration waited = Duration::zero();
+  while (Metrics().values["metrics_isolator/statsd_pool_available"] !=
+           JSON::Number(STATSD_POOL_SIZE)) {
+    ASSERT_LT(waited, REQUEST_TIMEOUT);
+
+    os::sleep(Milliseconds(10));
+    waited += Milliseconds(10);
+  }
+
+  ContainerID containerId;
+  containerId.set_value("new-container");
+
+  Future<Option<mesos::slave::ContainerLaunchInfo>> prepared =
+    isolator->prepare(containerId, mesos::slave::ContainerConfig());
+
+  AWAIT_READY(prepared);
+  ASSERT_SOME(prepared.get());
+  ASSERT_EQ(2, prepared.get()->environment().variables_size());
+  EXPECT_EQ("2000", prepared.get()->environment().variables(1).value());
+
+  AWAIT_READY(bound.future());
+  EXPECT_EQ("POST", bound.future()->method);
+
+  Try<StatsdBindRequest> bindRequest =
+    parse<StatsdBindRequest>(bound.future()->body);
+
+  ASSERT_SOME(bindRequest);
+  EXPECT_EQ("lease-0", bindRequest->lease_id());
+  EXPECT_EQ("new-container", bindRequest->container_id());
+
+  AWAIT_READY(isolator->cleanup(containerId));
+
+  JSON::Object metrics = Metrics();
+
+  EXPECT_EQ(1, metrics.values["metrics_isolator/statsd_pool_hits"]);
+  EXPECT_EQ(0, metrics.values["metrics_isolator/statsd_pool_misses"]);
+}
+
+
+// A container whose leased StatsD listener cannot be bound, e.g. since
+// the metrics service has expired the lease, should be started as if
+// the pool was empty.
+TEST_F(MetricsStatsdPoolTest, PrepareLeaseBindFailed)
+{
+  MockMetricsService metricsService;
+
+  Promise<process::http::Request> promise;
+
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillRepeatedly(Invoke(
+        [&](const process::http::Request& request)
+            -> Future<process::http::Response> {
+          if (strings::endsWith(request.url.path, "/lease")) {
+            StatsdLeaseResponse leaseResponse;
+            StatsdLease* lease = leaseResponse.add_leases();
+            lease->set_lease_id("expired-lease");
+            lease->set_statsd_host("127.0.0.1");
+            lease->set_statsd_port(2000);
+
+            return process::http::Response(
+                string(jsonify(JSON::Protobuf(leaseResponse))),
+                process::http::Status::CREATED,
+                "application/json");
+          }
+
+          if (strings::endsWith(request.url.path, "/lease/bind")) {
+            return process::http::NotFound();
+          }
+
+          promise.set(request);
+
+          ContainerStartResponse responseBody;
+          responseBody.set_statsd_host("127.0.0.1");
+          responseBody.set_statsd_port(1111);
+
+          return process::http::Response(
+              string(jsonify(JSON::Protobuf(responseBody))),
+              process::http::Status::CREATED,
+              "application/json");
+        }));
+
+  // Recreate the isolator, so that it fills its pool from the mock.
+  delete isolator;
+
+  Try<Isolator*> isolator_ =
+    ModuleManager::create<Isolator>(
+        "com_mesosphere_dcos_MetricsIsolatorModule");
+
+  ASSERT_SOME(isolator_);
+  isolator = isolator_.get();
+
+  // Wait for the pool to hold the lease.
+  Duration waited = Duration::zero();
+  while (Metrics().values["metrics_isolator/statsd_pool_available"] ==
+           JSON::Number(0)) {
+    ASSERT_LT(waited, REQUEST_TIMEOUT);
+
+    os::sleep(Milliseconds(10));
+    waited += Milliseconds(10);
+  }
+
+  ContainerID containerId;
+  containerId.set_value("new-container");
+
+  Future<Option<mesos::slave::ContainerLaunchInfo>> prepared =
+    isolator->prepare(containerId, mesos::slave::ContainerConfig());
+
+  AWAIT_READY(promise.future());
+
+  Try<ContainerStartRequest> requestBody =
+    parse<ContainerStartRequest>(promise.future()->body);
+
+  ASSERT_SOME(requestBody);
+  EXPECT_EQ("new-container", requestBody->container_id());
+
+  AWAIT_READY(prepared);
+  ASSERT_SOME(prepared.get());
+  ASSERT_EQ(2, prepared.get()->environment().variables_size());
+  EXPECT_EQ("1111", prepared.get()->environment().variables(1).value());
+}
+
+
+// With a cleanup queue, the cleanup should complete right away, while
+// the listener is stopped in the background, retrying failed attempts.
+TEST_F(MetricsCleanupQueueTest, CleanupQueued)
+{
+  MockMetricsService metricsService;
+
+  Future<process::http::Request> failed;
+  Future<process::http::Request> accepted;
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillOnce(DoAll(FutureArg<0>(&failed),
+                    Return(process::http::ServiceUnavailable())))
+    .WillOnce(DoAll(FutureArg<0>(&accepted),
+                    Return(process::http::Accepted())));
+
+  ContainerID containerId;
+  containerId.set_value("new-container");
+
+  AWAIT_READY(isolator->cleanup(containerId));
+
+  // The container is checkpointed until its listener is stopped.
+  EXPECT_TRUE(os::exists(path::join(cleanupQueueDir(), "new-container")));
+
+  AWAIT_READY(failed);
+  EXPECT_EQ("DELETE", failed->method);
+  EXPECT_TRUE(strings::endsWith(failed->url.path, "/new-container"));
+
+  AWAIT_READY(accepted);
+  EXPECT_EQ("DELETE", accepted->method);
+  EXPECT_TRUE(strings::endsWith(accepted->url.path, "/new-container"));
+
+  awaitStopped("new-container");
+}
+
+
+// Containers checkpointed before a restart should be stopped by the
+// next instance of the isolator.
+TEST_F(MetricsCleanupQueueTest, RecoverQueued)
+{
+  MockMetricsService metricsService;
+
+  Future<process::http::Request> request;
+  EXPECT_CALL(*metricsService.mock, container(_))
+    .WillOnce(DoAll(FutureArg<0>(&request),
+                    Return(process::http::Accepted())));
+
+  // Recreate the isolator, which picks up the checkpointed container.
+  delete isolator;
+
+  ASSERT_SOME(os::mkdir(cleanupQueueDir()));
+  ASSERT_SOME(os::write(
+      path::join(cleanupQueueDir(), "old-container"), "old-container"));
+
+  Try<Isolator*> isolator_ =
+    ModuleManager::create<Isolator>(
+        "com_mesosphere_dcos_MetricsIsolatorModule");
+
+  ASSERT_SOME(isolator_);
+  isolator = isolator_.get();
+
+  AWAIT_READY(request);
+  EXPECT_EQ("DELETE", request->method);
+  EXPECT_TRUE(strings::endsWith(request->url.path, "/old-container"));
+
+  awaitStopped("old-container");
+}
+
 } // namespace tests {
 } // namespace metrics {
 } // namespace mesos {
@@ -0,0 +1,834 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <ostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <gmock/gmock.h>
+
+#include <mesos/module/anonymous.hpp>
+#include <mesos/module/module.hpp>
+
+#include <process/async.hpp>
+#include <process/clock.hpp>
+#include <process/collect.hpp>
+#include <process/delay.hpp>
+#include <process/dispatch.hpp>
+#include <process/future.hpp>
+#include <process/gtest.hpp>
+#include <process/http.hpp>
+#include <process/id.hpp>
+#include <process/owned.hpp>
+#include <process/protobuf.hpp>
+#include <process/socket.hpp>
+#include <process/time.hpp>
+#include <process/timer.hpp>
+
+#include <stout/bytes.hpp>
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/gtest.hpp>
+#include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/protobuf.hpp>
+#include <stout/stringify.hpp>
+#include <stout/stopwatch.hpp>
+#include <stout/try.hpp>
+
+#include <stout/os/read.hpp>
+#include <stout/os/write.hpp>
+
+#include "module/manager.hpp"
+
+#include "overlay/allocator.hpp"
+#include "overlay/messages.pb.h"
+#include "overlay/network.hpp"
+#include "overlay/overlay.hpp"
+#include "overlay/overlay.pb.h"
+
+#include "tests/mesos.hpp"
+
+namespace http = process::http;
+namespace inet = process::network::inet;
+
+using namespace mesos::internal::tests;
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+using mesos::modules::Anonymous;
+using mesos::modules::ModuleManager;
+using mesos::modules::overlay::AgentOverlayInfo;
+using mesos::modules::overlay::MASTER_MANAGER_PROCESS_ID;
+using mesos::modules::overlay::Network;
+using mesos::modules::overlay::NetworkConfig;
+using mesos::modules::overlay::OverlayInfo;
+using mesos::modules::overlay::OverlayState;
+using mesos::modules::overlay::SubnetAllocator;
+using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
+using mesos::modules::overlay::internal::AgentRegisteredMessage;
+using mesos::modules::overlay::internal::ConfigVersion;
+using mesos::modules::overlay::internal::MasterConfig;
+using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RetryRegistrationMessage;
+using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
+
+using process::Clock;
+using process::Future;
+using process::Owned;
+using process::Promise;
+using process::Time;
+using process::UPID;
+
+using testing::TestWithParam;
+using testing::WithParamInterface;
+
+namespace mesos {
+namespace overlay {
+namespace tests {
+
+// The number of agents registered with the overlay master.
+const size_t AGENTS = 50000;
+
+// The number of agents which are replaced by a new agent, one at a
+// time, after all agents have registered.
+const size_t CHURN = 500000;
+
+// The number of stored agents whose addresses are parsed by each
+// thread of a recovering master, as in `overlay/master.cpp`.
+const size_t RECOVERY_BATCH_SIZE = 1024;
+
+
+// Describes the address space the master allocates the agents from.
+struct AddressSpace
+{
+  std::string name;
+  int family;
+
+  // The overlay network, and the prefix of the subnet of each agent.
+  std::string network;
+  uint8_t prefix;
+
+  // The VTEP network, from which each agent gets one address.
+  std::string vtep;
+  uint8_t vtepPrefix;
+};
+
+
+std::ostream& operator<<(std::ostream& stream, const AddressSpace& space)
+{
+  return stream << space.name;
+}
+
+
+const vector<AddressSpace> ADDRESS_SPACES = {
+  {"IPv4", AF_INET, "9.0.0.0/8", 24, "44.128.0.0/16", 32},
+  {"IPv6", AF_INET6, "fd01:b::/48", 80, "fd03::/64", 128},
+};
+
+
+class OverlayAllocatorBenchmarkTest
+  : public TestWithParam<AddressSpace> {};
+
+
+INSTANTIATE_TEST_CASE_P(
+    AddressSpaces,
+    OverlayAllocatorBenchmarkTest,
+    ::testing::ValuesIn(ADDRESS_SPACES));
+
+
+// Measures how the master allocates the subnets and VTEP addresses of
+// a large cluster: all agents registering, agents being replaced one
+// at a time, and the allocations being reserved again on recovery.
+TEST_P(OverlayAllocatorBenchmarkTest, BENCHMARK_Allocate)
+{
+  const int family = GetParam().family;
+
+  Try<Network> network = Network::parse(GetParam().network, family);
+  ASSERT_SOME(network);
+
+  Try<Network> vtep = Network::parse(GetParam().vtep, family);
+  ASSERT_SOME(vtep);
+
+  SubnetAllocator subnets(network.get(), GetParam().prefix);
+  SubnetAllocator addresses(vtep.get(), GetParam().vtepPrefix);
+
+  vector<Network> agentSubnets;
+  vector<Network> agentAddresses;
+
+  Stopwatch watch;
+  watch.start();
+
+  for (size_t i = 0; i < AGENTS; i++) {
+    Try<Network> subnet = subnets.allocate();
+    ASSERT_SOME(subnet);
+
+    Try<Network> address = addresses.allocate();
+    ASSERT_SOME(address);
+
+    agentSubnets.push_back(subnet.get());
+    agentAddresses.push_back(address.get());
+  }
+
+  watch.stop();
+
+  cout << "Registered " << AGENTS << " agents in " << watch.elapsed()
+       << " using " << GetParam() << endl;
+
+  // Replace random agents, so that the freed subnets are scattered
+  // across the address space.
+  std::mt19937 random(AGENTS);
+
+  watch.start();
+
+  for (size_t i = 0; i < CHURN; i++) {
+    const size_t agent = random() % AGENTS;
+
+    ASSERT_SOME(subnets.free(agentSubnets[agent]));
+    ASSERT_SOME(addresses.free(agentAddresses[agent]));
+
+    Try<Network> subnet = subnets.allocate();
+    ASSERT_SOME(subnet);
+
+    Try<Network> address = addresses.allocate();
+    ASSERT_SOME(address);
+
+    agentSubnets[agent] = subnet.get();
+    agentAddresses[agent] = address.get();
+  }
+
+  watch.stop();
+
+  cout << "Replaced " << CHURN << " agents in " << watch.elapsed()
+       << " (" << (CHURN / watch.elapsed().secs()) << " agents/sec)"
+       << " using " << GetParam() << endl;
+
+  // On recovery, a new master reserves the allocations of all agents.
+  SubnetAllocator recoveredSubnets(network.get(), GetParam().prefix);
+  SubnetAllocator recoveredAddresses(vtep.get(), GetParam().vtepPrefix);
+
+  watch.start();
+
+  for (size_t i = 0; i < AGENTS; i++) {
+    ASSERT_SOME(recoveredSubnets.reserve(agentSubnets[i]));
+    ASSERT_SOME(recoveredAddresses.reserve(agentAddresses[i]));
+  }
+
+  watch.stop();
+
+  cout << "Recovered " << AGENTS << " agents in " << watch.elapsed()
+       << " using " << GetParam() << endl;
+}
+
+
+
+class OverlayRecoveryBenchmarkTest
+  : public TestWithParam<std::tuple<AddressSpace, size_t>> {};
+
+
+INSTANTIATE_TEST_CASE_P(
+    AddressSpacesAndAgents,
+    OverlayRecoveryBenchmarkTest,
+    ::testing::Combine(
+        ::testing::ValuesIn(ADDRESS_SPACES),
+        ::testing::Values(1000u, 10000u, 50000u)));
+
+
+// Parses the stored subnets `[begin, end)`.
+static Try<vector<Network>> parse(
+    const vector<std::string>& stored,
+    size_t begin,
+    size_t end,
+    int family)
+{
+  vector<Network> subnets;
+  subnets.reserve(end - begin);
+
+  for (size_t i = begin; i < end; i++) {
+    Try<Network> subnet = Network::parse(stored[i], family);
+    if (subnet.isError()) {
+      return Error(subnet.error());
+    }
+
+    subnets.push_back(subnet.get());
+  }
+
+  return subnets;
+}
+
+
+// Measures how long a recovering master takes to reserve the subnets
+// of the stored agents again, parsing them one by one, and in batches
+// in parallel.
+TEST_P(OverlayRecoveryBenchmarkTest, BENCHMARK_Recover)
+{
+  const AddressSpace& space = std::get<0>(GetParam());
+  const size_t agents = std::get<1>(GetParam());
+
+  Try<Network> network = Network::parse(space.network, space.family);
+  ASSERT_SOME(network);
+
+  // Scatter the subnets of the agents across the address space, as
+  // they would be after some churn.
+  vector<std::string> stored;
+  {
+    SubnetAllocator subnets(network.get(), space.prefix);
+
+    const size_t count = std::min<size_t>(agents * 2, subnets.size());
+
+    vector<Network> allocated;
+    for (size_t i = 0; i < count; i++) {
+      Try<Network> subnet = subnets.allocate();
+      ASSERT_SOME(subnet);
+
+      allocated.push_back(subnet.get());
+    }
+
+    std::shuffle(allocated.begin(), allocated.end(), std::mt19937(agents));
+
+    for (size_t i = 0; i < agents; i++) {
+      stored.push_back(stringify(allocated[i]));
+    }
+  }
+
+  Stopwatch watch;
+  watch.start();
+
+  SubnetAllocator sequential(network.get(), space.prefix);
+  foreach (const std::string& subnet, stored) {
+    Try<Network> parsed = Network::parse(subnet, space.family);
+    ASSERT_SOME(parsed);
+    ASSERT_SOME(sequential.reserve(parsed.get()));
+  }
+
+  watch.stop();
+
+  cout << "Recovered " << agents << " agents one by one in "
+       << watch.elapsed() << " using " << space << endl;
+
+  watch.start();
+
+  vector<Future<Try<vector<Network>>>> batches;
+  for (size_t i = 0; i < agents; i += RECOVERY_BATCH_SIZE) {
+    const size_t end = std::min(i + RECOVERY_BATCH_SIZE, agents);
+    const int family = space.family;
+
+    batches.push_back(process::async([&stored, i, end, family]() {
+      return parse(stored, i, end, family);
+    }));
+  }
+
+  Future<vector<Try<vector<Network>>>> parsed = process::collect(batches);
+  AWAIT_READY(parsed);
+
+  SubnetAllocator batched(network.get(), space.prefix);
+  foreach (const Try<vector<Network>>& batch, parsed.get()) {
+    ASSERT_SOME(batch);
+    ASSERT_SOME(batched.reserve(batch.get()));
+  }
+
+  watch.stop();
+
+  cout << "Recovered " << agents << " agents in batches in "
+       << watch.elapsed() << " using " << space << endl;
+
+  EXPECT_EQ(sequential.allocated(), batched.allocated());
+}
+
+
+// The registration backoff of the overlay agent, see `overlay/agent.cpp`.
+const Duration INITIAL_BACKOFF_PERIOD = Seconds(5);
+const Duration REGISTRATION_RETRY_INTERVAL_MAX = Minutes(10);
+
+const char MASTER_JSON_CONFIG[] = "master.json";
+const char MASTER_OVERLAY_MODULE_NAME[] =
+  "com_mesosphere_mesos_OverlayMasterManager";
+
+// The simulated agents get the addresses following this one.
+const uint32_t SIMULATED_AGENTS_IP = 0x7f010000; // 127.1.0.0
+
+
+// Returns the `p`-th percentile of `samples`, which must not be empty.
+static Duration percentile(vector<Duration> samples, double p)
+{
+  std::sort(samples.begin(), samples.end());
+
+  size_t index = static_cast<size_t>(samples.size() * p);
+  return samples[std::min(index, samples.size() - 1)];
+}
+
+
+// Returns the resident memory of this process, which hosts both the
+// overlay master and the simulated agents.
+static Bytes rss()
+{
+  Result<os::Process> process = os::process(::getpid());
+  if (!process.isSome() || process->rss.isNone()) {
+    return Bytes(0);
+  }
+
+  return process->rss.get();
+}
+
+
+// A lightweight overlay agent, which speaks the registration protocol
+// of `overlay/agent.cpp` without configuring any network.
+//
+// The master tells agents apart by the IP of their `pid`, so each
+// simulated agent sends its messages as a `pid` on a loopback address
+// of its own. The replies of the master to that `pid` reach this
+// process as long as libprocess listens on all addresses.
+class SimulatedAgent : public ProtobufProcess<SimulatedAgent>
+{
+public:
+  SimulatedAgent(const UPID& _master, const net::IP& ip)
+    : ProcessBase(process::ID::generate("simulated-agent")),
+      master(_master),
+      pid(self().id, inet::Address(ip, process::address().port)),
+      registered(false),
+      acknowledged(0),
+      retries(0) {}
+
+  // Returns the time the `n`-th registration of the agent took, from
+  // its first attempt until it was acknowledged.
+  Future<Duration> registration(size_t n)
+  {
+    while (registrations.size() < n) {
+      registrations.push_back(
+          Owned<Promise<Duration>>(new Promise<Duration>()));
+    }
+
+    return registrations[n - 1]->future();
+  }
+
+  // The number of times the master asked the agent to retry.
+  size_t retried()
+  {
+    return retries;
+  }
+
+protected:
+  virtual void initialize()
+  {
+    install<UpdateAgentOverlaysMessage>(
+        &SimulatedAgent::updateAgentOverlays);
+
+    install<AgentRegisteredAcknowledgement>(
+        &SimulatedAgent::agentRegisteredAcknowledgement);
+
+    install<RetryRegistrationMessage>(
+        &SimulatedAgent::retryRegistration);
+
+    start();
+  }
+
+  virtual void exited(const UPID& _pid)
+  {
+    if (_pid == master && registered) {
+      start();
+    }
+  }
+
+private:
+  // Starts over registering, like an agent which lost its master.
+  void start()
+  {
+    registered = false;
+    started = Clock::now();
+
+    doReliableRegistration(INITIAL_BACKOFF_PERIOD);
+  }
+
+  void doReliableRegistration(Duration maxBackoff)
+  {
+    if (registered) {
+      return;
+    }
+
+    RegisterAgentMessage message;
+    message.mutable_network_config()->set_mesos_bridge(false);
+    message.mutable_network_config()->set_docker_bridge(false);
+
+    if (configuredVersion.isSome()) {
+      message.mutable_config_version()->CopyFrom(configuredVersion.get());
+    }
+
+    process::post(pid, master, message);
+
+    maxBackoff = std::min(maxBackoff, REGISTRATION_RETRY_INTERVAL_MAX);
+    Duration backoff = maxBackoff * ((double) ::random() / RAND_MAX);
+
+    retry(backoff, maxBackoff * 2);
+  }
+
+  void retry(const Duration& backoff, const Duration& maxBackoff)
+  {
+    if (timer.isSome()) {
+      Clock::cancel(timer.get());
+    }
+
+    timer = process::delay(
+        backoff,
+        self(),
+        &SimulatedAgent::doReliableRegistration,
+        maxBackoff);
+  }
+
+  void updateAgentOverlays(
+      const UPID& from,
+      const UpdateAgentOverlaysMessage& update)
+  {
+    // Report all overlays as configured.
+    AgentRegisteredMessage message;
+
+    foreach (const AgentOverlayInfo& overlay, update.overlays()) {
+      AgentOverlayInfo* _overlay = message.add_overlays();
+      _overlay->CopyFrom(overlay);
+      _overlay->mutable_state()->set_status(OverlayState::STATUS_OK);
+    }
+
+    if (update.has_config_version()) {
+      message.mutable_config_version()->CopyFrom(update.config_version());
+    }
+
+    process::post(pid, from, message);
+  }
+
+  void agentRegisteredAcknowledgement(
+      const UPID& from,
+      const AgentRegisteredAcknowledgement& message)
+  {
+    configuredVersion = None();
+    if (message.has_config_version()) {
+      configuredVersion = message.config_version();
+    }
+
+    if (registered) {
+      return;
+    }
+
+    registered = true;
+
+    if (timer.isSome()) {
+      Clock::cancel(timer.get());
+      timer = None();
+    }
+
+    // Notice when the master exits, e.g. when it is restarted.
+    link(from);
+
+    // Creates the promise of this registration, if need be.
+    registration(++acknowledged);
+    registrations[acknowledged - 1]->set(Clock::now() - started);
+  }
+
+  void retryRegistration(
+      const UPID& from,
+      const RetryRegistrationMessage& message)
+  {
+    if (registered) {
+      return;
+    }
+
+    retries++;
+
+    const Duration retryAfter = Milliseconds(message.retry_after());
+    retry(retryAfter * (1 + (double) ::random() / RAND_MAX),
+          INITIAL_BACKOFF_PERIOD);
+  }
+
+  const UPID master;
+
+  // The `pid` the agent sends its messages as.
+  const UPID pid;
+
+  bool registered;
+  Time started;
+  Option<process::Timer> timer;
+  Option<ConfigVersion> configuredVersion;
+
+  vector<Owned<Promise<Duration>>> registrations;
+  size_t acknowledged;
+  size_t retries;
+};
+
+
+class OverlayMasterBenchmarkTest
+  : public MesosTest,
+    public WithParamInterface<size_t>
+{
+public:
+  static void SetUpTestCase()
+  {
+    // The master keeps a connection to each agent, and each of these
+    // takes up two file descriptors of this process.
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+      limit.rlim_cur = limit.rlim_max;
+      ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+  }
+
+protected:
+  virtual void SetUp()
+  {
+    MesosTest::SetUp();
+
+    // Use the replicated log, with a single replica, so that the stores
+    // and the recovery of the master are part of the benchmark.
+    MasterConfig masterConfig;
+    masterConfig.set_replicated_log_dir("overlay_replicated_log");
+
+    NetworkConfig* network = masterConfig.mutable_network();
+    network->set_vtep_subnet("44.128.0.0/16");
+    network->set_vtep_mac_oui("70:B3:D5:00:00:00");
+
+    OverlayInfo* overlay = network->add_overlays();
+    overlay->set_name("benchmark-overlay");
+    overlay->set_subnet("9.0.0.0/8");
+    overlay->set_prefix(24);
+
+    ASSERT_SOME(os::write(
+        MASTER_JSON_CONFIG,
+        stringify(JSON::protobuf(masterConfig))));
+
+    // Read in the example `master_modules.json`, and point the master
+    // module at the configuration above.
+    Try<std::string> read = os::read(
+        path::join(MODULES_BUILD_DIR, "overlay", "master_modules.json"));
+    ASSERT_SOME(read);
+
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(read.get());
+    ASSERT_SOME(json);
+
+    Try<Modules> _modules = protobuf::parse<Modules>(json.get());
+    ASSERT_SOME(_modules);
+
+    modules = _modules.get();
+
+    foreach (Modules::Library& library, *modules.mutable_libraries()) {
+      foreach (Modules::Library::Module& module, *library.mutable_modules()) {
+        foreach (Parameter& parameter, *module.mutable_parameters()) {
+          if (parameter.key() == "master_config") {
+            parameter.set_value(path::join(os::getcwd(), MASTER_JSON_CONFIG));
+          }
+        }
+      }
+    }
+
+    Try<Nothing> result = ModuleManager::load(modules);
+    ASSERT_SOME(result);
+  }
+
+  virtual void TearDown()
+  {
+    foreach (const Modules::Library& library, modules.libraries()) {
+      foreach (const Modules::Library::Module& module, library.modules()) {
+        if (module.has_name()) {
+          ASSERT_SOME(ModuleManager::unload(module.name()));
+        }
+      }
+    }
+
+    MesosTest::TearDown();
+  }
+
+  // Whether the replies of the master can reach the simulated agents,
+  // see `SimulatedAgent`.
+  bool reachable()
+  {
+    Try<inet::Socket> socket = inet::Socket::create();
+    if (socket.isError()) {
+      return false;
+    }
+
+    Future<Nothing> connect = socket->connect(inet::Address(
+        net::IP(SIMULATED_AGENTS_IP + 1),
+        process::address().port));
+
+    connect.await(Seconds(5));
+    return connect.isReady();
+  }
+
+  // Returns the current value of the metric of the master.
+  double metric(const JSON::Object& snapshot, const std::string& name)
+  {
+    Result<JSON::Number> value = snapshot.find<JSON::Number>(name);
+    return value.isSome() ? value->as<double>() : 0;
+  }
+
+  // Reports the registrations, and the stores of the master since it
+  // was (re)started.
+  void report(
+      const std::string& phase,
+      const vector<Duration>& latencies,
+      size_t retries)
+  {
+    cout << phase << " latency: p50 " << percentile(latencies, 0.5)
+         << ", p90 " << percentile(latencies, 0.9)
+         << ", p99 " << percentile(latencies, 0.99)
+         << ", max " << percentile(latencies, 1)
+         << "; asked to retry " << retries << " times" << endl;
+
+    Future<http::Response> response = http::get(
+        UPID("metrics", process::address()),
+        "snapshot");
+
+    AWAIT_READY(response);
+
+    Try<JSON::Object> snapshot = JSON::parse<JSON::Object>(response->body);
+    ASSERT_SOME(snapshot);
+
+    const double stores = metric(snapshot.get(), "overlay_master/stores");
+    const double agents =
+      metric(snapshot.get(), "overlay_master/stored_agents");
+
+    const std::string latency = "overlay_master/store_latency_ms/";
+
+    cout << phase << " stored " << agents << " agents in " << stores
+         << " batches (" << (stores > 0 ? agents / stores : 0)
+         << " agents per batch), store latency: p50 "
+         << metric(snapshot.get(), latency + "p50") << "ms, p90 "
+         << metric(snapshot.get(), latency + "p90") << "ms, p99 "
+         << metric(snapshot.get(), latency + "p99") << "ms, max "
+         << metric(snapshot.get(), latency + "max") << "ms" << endl;
+  }
+
+  Modules modules;
+};
+
+
+INSTANTIATE_TEST_CASE_P(
+    Agents,
+    OverlayMasterBenchmarkTest,
+    ::testing::Values(1000u, 5000u, 10000u));
+
+
+// Registers many simulated agents with an overlay master, which stores
+// them in its replicated log, then restarts the master and measures
+// how long the agents take to register with the recovered master.
+//
+// NOTE: The `LIBPROCESS_IP` must be left unset, or set to `0.0.0.0`,
+// for the simulated agents to receive the replies of the master.
+TEST_P(OverlayMasterBenchmarkTest, BENCHMARK_RegisterAgents)
+{
+  const size_t agents = GetParam();
+
+  if (!reachable()) {
+    LOG(WARNING) << "Skipping the benchmark, since libprocess does not"
+                 << " accept connections on 127.1.0.0/16";
+    return;
+  }
+
+  const Bytes baseline = rss();
+
+  Try<Anonymous*> module =
+    ModuleManager::create<Anonymous>(MASTER_OVERLAY_MODULE_NAME);
+  ASSERT_SOME(module);
+
+  Owned<Anonymous> masterModule(module.get());
+
+  const UPID master(MASTER_MANAGER_PROCESS_ID, process::address());
+
+  Stopwatch watch;
+  watch.start();
+
+  vector<Owned<SimulatedAgent>> simulated;
+  vector<Future<Duration>> registrations;
+  for (size_t i = 0; i < agents; i++) {
+    Owned<SimulatedAgent> agent(
+        new SimulatedAgent(master, net::IP(SIMULATED_AGENTS_IP + 1 + i)));
+
+    process::spawn(agent.get());
+
+    registrations.push_back(process::dispatch(
+        agent->self(),
+        &SimulatedAgent::registration,
+        size_t(1)));
+
+    simulated.push_back(agent);
+  }
+
+  Future<vector<Duration>> registered = process::collect(registrations);
+  AWAIT_READY_FOR(registered, Minutes(30));
+
+  watch.stop();
+
+  cout << "Registered " << agents << " agents in " << watch.elapsed()
+       << endl;
+
+  vector<Future<size_t>> retries;
+  foreach (const Owned<SimulatedAgent>& agent, simulated) {
+    retries.push_back(
+        process::dispatch(agent->self(), &SimulatedAgent::retried));
+  }
+
+  Future<vector<size_t>> _retries = process::collect(retries);
+  AWAIT_READY(_retries);
+
+  size_t retried = 0;
+  foreach (size_t count, _retries.get()) {
+    retried += count;
+  }
+
+  report("Registration", registered.get(), retried);
+
+  const Bytes registeredRSS = rss();
+  cout << "Resident memory grew by "
+       << (registeredRSS > baseline ? registeredRSS - baseline : Bytes(0))
+       << " for " << agents << " agents" << endl;
+
+  // Restart the master. It is respawned by its supervisor, recovers the
+  // agents from the replicated log, and the agents register again once
+  // they notice the master has exited.
+  vector<Future<Duration>> reregistrations;
+  foreach (const Owned<SimulatedAgent>& agent, simulated) {
+    reregistrations.push_back(process::dispatch(
+        agent->self(),
+        &SimulatedAgent::registration,
+        size_t(2)));
+  }
+
+  watch.start();
+
+  process::terminate(master);
+
+  Future<vector<Duration>> reregistered = process::collect(reregistrations);
+  AWAIT_READY_FOR(reregistered, Minutes(30));
+
+  watch.stop();
+
+  cout << "Reconverged " << agents << " agents in " << watch.elapsed()
+       << " after restarting the master" << endl;
+
+  retries.clear();
+  foreach (const Owned<SimulatedAgent>& agent, simulated) {
+    retries.push_back(
+        process::dispatch(agent->self(), &SimulatedAgent::retried));
+  }
+
+  _retries = process::collect(retries);
+  AWAIT_READY(_retries);
+
+  size_t reretried = 0;
+  foreach (size_t count, _retries.get()) {
+    reretried += count;
+  }
+
+  report("Re-registration", reregistered.get(), reretried - retried);
+
+  foreach (const Owned<SimulatedAgent>& agent, simulated) {
+    process::terminate(agent.get());
+    process::wait(agent.get());
+  }
+}
+
+} // namespace tests {
+} // namespace overlay {
+} // namespace mesos {
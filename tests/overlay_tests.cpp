@@ -1,3 +1,4 @@
+#include <set>
 #include <string>
 #include <ostream>
 
@@ -7,6 +8,8 @@
 #include <mesos/mesos.hpp>
 #include <mesos/resources.hpp>
 
+#include <mesos/log/log.hpp>
+
 #include <mesos/module/module.hpp>
 #include <mesos/module/anonymous.hpp>
 
@@ -14,6 +17,9 @@
 
 #include <mesos/slave/isolator.hpp>
 
+#include <mesos/state/log.hpp>
+#include <mesos/state/protobuf.hpp>
+
 #include <process/clock.hpp>
 #include <process/future.hpp>
 #include <process/gmock.hpp>
@@ -41,6 +47,7 @@
 #include "module/manager.hpp"
 
 #include "overlay/agent.hpp"
+#include "overlay/allocator.hpp"
 #include "overlay/constants.hpp"
 #include "overlay/messages.pb.h"
 #include "overlay/overlay.hpp"
@@ -72,6 +79,8 @@ using process::http::Response;
 
 using mesos::internal::master::Master;
 
+using mesos::log::Log;
+
 using mesos::internal::slave::Containerizer;
 using mesos::internal::slave::MesosContainerizerProcess;
 using mesos::internal::slave::Slave;
@@ -88,17 +97,26 @@ using mesos::modules::overlay::AgentInfo;
 using mesos::modules::overlay::AgentOverlayInfo;
 using mesos::modules::overlay::AGENT_MANAGER_PROCESS_ID;
 using mesos::modules::overlay::MASTER_MANAGER_PROCESS_ID;
+using mesos::modules::overlay::Network;
 using mesos::modules::overlay::RESERVED_NETWORKS;
+using mesos::modules::overlay::internal::AgentCheckpoint;
 using mesos::modules::overlay::internal::AgentConfig;
 using mesos::modules::overlay::internal::AgentRegisteredAcknowledgement;
 using mesos::modules::overlay::internal::AgentRegisteredMessage;
 using mesos::modules::overlay::internal::RegisterAgentMessage;
+using mesos::modules::overlay::internal::RetryRegistrationMessage;
+using mesos::modules::overlay::internal::UpdateAgentOverlaysMessage;
 using mesos::modules::overlay::internal::MasterConfig;
 using mesos::modules::overlay::OverlayInfo;
+using mesos::modules::overlay::OverlayState;
 using mesos::modules::overlay::State;
+using mesos::modules::overlay::SubnetAllocator;
 using mesos::modules::overlay::agent::IPSET_OVERLAY;
 using mesos::modules::overlay::supervisor::ProcessSupervisor;
 
+using mesos::state::LogStorage;
+using mesos::state::protobuf::Variable;
+
 namespace mesos {
 namespace overlay {
 namespace tests {
@@ -114,6 +132,13 @@ constexpr char MASTER_JSON_CONFIG[] = "master.json";
 constexpr char MASTER_OVERLAY_MODULE_NAME[] =
   "com_mesosphere_mesos_OverlayMasterManager";
 
+// The replicated log of the overlay master, when started with a
+// `replicated_log_dir` of "overlay_replicated_log", and its variables.
+constexpr char REPLICATED_LOG_PATH[] =
+  "overlay_replicated_log/overlay_replicated_log";
+constexpr char REPLICATED_LOG_STORE_KEY[] = "network-state";
+constexpr char REPLICATED_LOG_STORE_AGENT_PREFIX[] = "network-state/agents/";
+
 constexpr uint32_t OVERLAY_PREFIX = 24;
 constexpr uint32_t OVERLAY_PREFIX6 = 80;
 
@@ -635,6 +660,63 @@ TEST_F(OverlayTest, ROOT_checkMesosNetwork)
 }
 
 
+// Tests that the `Agent overlay module` installs the masquerade rules
+// with shell scripts when `restore_rules` has been disabled.
+TEST_F(OverlayTest, ROOT_checkScriptRules)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.mutable_network_config()->set_mesos_bridge(true);
+  agentOverlayConfig.mutable_network_config()->set_restore_rules(false);
+
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+  ASSERT_EQ(1, agentRegisteredMessage->overlays_size());
+  EXPECT_EQ(
+      OverlayState::STATUS_OK,
+      agentRegisteredMessage->overlays(0).state().status());
+
+  AWAIT_READY(agentModule.get()->ready());
+
+  Future<string> ipset = runCommand("ipset",
+      {"ipset",
+      "test",
+      IPSET_OVERLAY,
+      OVERLAY_SUBNET});
+  AWAIT_READY(ipset);
+
+  Future<string> iptables = runCommand("iptables",
+      {"iptables", "-w",
+      "-t", "nat",
+      "-C", "POSTROUTING",
+      "-s", OVERLAY_SUBNET,
+      "-m", "set",
+      "--match-set", stringify(IPSET_OVERLAY), "dst",
+      "-j", "MASQUERADE",
+      });
+  AWAIT_READY(iptables);
+}
+
+
 // Tests the ability of the `Agent overlay module` to create Docker
 // network.
 TEST_F(OverlayTest, ROOT_checkDockerNetwork)
@@ -709,6 +791,52 @@ TEST_F(OverlayTest, ROOT_checkDockerNetwork)
 }
 
 
+// Tests that the `Agent overlay module` falls back to the `docker`
+// CLI when the Docker Engine API cannot be reached.
+TEST_F(OverlayTest, ROOT_checkDockerNetworkCLIFallback)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+  agentOverlayConfig.mutable_network_config()->set_docker_socket(
+      path::join(os::getcwd(), "missing.sock"));
+
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+  ASSERT_EQ(1, agentRegisteredMessage->overlays_size());
+  EXPECT_EQ(
+      OverlayState::STATUS_OK,
+      agentRegisteredMessage->overlays(0).state().status());
+
+  AWAIT_READY(agentModule.get()->ready());
+
+  Future<string> docker = runCommand("docker",
+      {"docker",
+      "network",
+      "inspect",
+      OVERLAY_NAME});
+
+  AWAIT_READY(docker);
+}
+
+
 // Tests the ability of the `Master overlay module` to recover
 // checkpointed overlay `State`.
 TEST_F(OverlayTest, ROOT_checkMasterRecovery)
@@ -1004,6 +1132,101 @@ TEST_F(OverlayTest, ROOT_checkAgentRecovery)
 }
 
 
+// Tests that the `Agent overlay module` checkpoints its overlays and
+// recovers them on restart, so that the master only needs to
+// acknowledge its re-registration.
+TEST_F(OverlayTest, checkAgentCheckpointRecovery)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  agentOverlayConfig.set_work_dir("overlay_agent");
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+  ASSERT_TRUE(agentRegisteredAcknowledgement->has_config_version());
+
+  // The agent processes this request after the acknowledgement, so
+  // the checkpoint has been written once we get the response.
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  Result<AgentCheckpoint> checkpoint = ::protobuf::read<AgentCheckpoint>(
+      path::join("overlay_agent", overlayAgent::AGENT_CHECKPOINT));
+
+  ASSERT_SOME(checkpoint);
+  ASSERT_EQ(1, checkpoint->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, checkpoint->overlays(0).overlay().info().name());
+  EXPECT_EQ(
+      OverlayState::STATUS_OK,
+      checkpoint->overlays(0).overlay().state().status());
+
+  ASSERT_TRUE(checkpoint->has_config_version());
+  EXPECT_EQ(
+      agentRegisteredAcknowledgement->config_version().SerializeAsString(),
+      checkpoint->config_version().SerializeAsString());
+
+  ASSERT_SOME(stopOverlayAgent());
+
+  // The restarted agent registers with the checkpointed version, which
+  // the master acknowledges without sending the overlays again.
+  Future<RegisterAgentMessage> registerAgentMessage =
+    FUTURE_PROTOBUF(RegisterAgentMessage(), _, _);
+
+  Future<AgentRegisteredAcknowledgement> agentReRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  EXPECT_NO_FUTURE_PROTOBUFS(UpdateAgentOverlaysMessage(), _, _);
+
+  agentModule = startOverlayAgent(agentOverlayConfig);
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(registerAgentMessage);
+  ASSERT_TRUE(registerAgentMessage->has_config_version());
+  EXPECT_EQ(
+      checkpoint->config_version().SerializeAsString(),
+      registerAgentMessage->config_version().SerializeAsString());
+
+  AWAIT_READY(agentReRegisteredAcknowledgement);
+  AWAIT_READY(agentModule.get()->ready());
+
+  agentResponse = process::http::get(overlayAgent, "overlay");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+
+  Try<AgentInfo> recoveredInfo = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(recoveredInfo);
+
+  EXPECT_EQ(
+      info->SerializeAsString(),
+      recoveredInfo->SerializeAsString());
+}
+
+
 // Tests the ability of the `Agent overlay module` to honor the
 // `AgentNetworkConfig` over the overlay the network configuration
 // specified by the Master.
@@ -1440,84 +1663,142 @@ TEST_F(OverlayTest, checkAgentResetConfigurationAttempts)
 }
 
 
-// Tests the custom mtu configuration
-TEST_F(OverlayTest, checkMTUConfiguration)
+// Tests that the overlay master migrates the network state stored by
+// older masters, which keep all agents in a single variable of the
+// replicated log, to a variable per agent.
+TEST_F(OverlayTest, checkMasterStateMigration)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
-  LOG(INFO) << "Master PID: " << master.get()->pid;
 
-  // Ask overlay Master to use the replicated log by setting
-  // `replicated_log_dir`. We are not specifying `zk` configuration so
-  // the `quorum` will default to "1".
   MasterConfig masterOverlayConfig;
   masterOverlayConfig
     .set_replicated_log_dir("overlay_replicated_log");
-  masterOverlayConfig.mutable_network()->set_vtep_mtu(9000);
 
   Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
   ASSERT_SOME(masterModule);
 
-  // Master `Anonymous` module created successfully.
   UPID overlayMaster = UPID(
       MASTER_MANAGER_PROCESS_ID,
       master.get()->pid.address);
 
   AgentConfig agentOverlayConfig;
   agentOverlayConfig.set_master(stringify(overlayMaster.address));
-  // Set number of times the agent will attempt to configure virtual
-  // networks by re-registering with the master.
-  agentOverlayConfig.set_max_configuration_attempts(1);
 
-  // Setup futures to notify the test that Agent overlay module has
-  // registered.
   Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
     FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
 
   Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
       agentOverlayConfig);
 
-  AWAIT_READY(agentRegisteredAcknowledgement);
-
   ASSERT_SOME(agentModule);
 
-  // Check the agent is allowed to progress.
+  AWAIT_READY(agentRegisteredAcknowledgement);
   AWAIT_READY(agentModule.get()->ready());
 
-  // Hit the `overlay` endpoint of the agent to check that
-  // there it got a custom mtu configuration
-  UPID overlayAgent = UPID(master.get()->pid);
-  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+  Future<http::Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
 
-  Future<Response> agentResponse = process::http::get(
-      overlayAgent,
-      "overlay");
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
 
-  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
-  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
-      APPLICATION_JSON,
-      "Content-Type",
-      agentResponse);
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
 
-  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
-  ASSERT_SOME(info);
+  const string agentKey =
+    REPLICATED_LOG_STORE_AGENT_PREFIX + state->agents(0).ip();
 
-  // MTU should be equal to the value in master configuration
-  ASSERT_EQ(9000, info->overlays(0).backend().vxlan().vtep_mtu());
+  // Kill the master, and rewrite its replicated log the way older
+  // masters stored the network state.
+  masterModule->reset();
+
+  {
+    Log log(1, REPLICATED_LOG_PATH, std::set<UPID>(), true);
+    LogStorage storage(&log);
+    mesos::state::protobuf::State replicatedLog(&storage);
+
+    Future<Variable<State>> index =
+      replicatedLog.fetch<State>(REPLICATED_LOG_STORE_KEY);
+
+    AWAIT_READY(index);
+    EXPECT_TRUE(index->get().has_network());
+    EXPECT_EQ(0, index->get().agents_size());
+
+    Future<Variable<AgentInfo>> agent =
+      replicatedLog.fetch<AgentInfo>(agentKey);
+
+    AWAIT_READY(agent);
+    EXPECT_EQ(state->agents(0).ip(), agent->get().ip());
+
+    AWAIT_EXPECT_TRUE(replicatedLog.expunge(agent.get()));
+    AWAIT_READY(replicatedLog.store(index->mutate(state.get())));
+  }
+
+  // Re-start the master and wait for the agent to re-register.
+  agentRegisteredAcknowledgement = FUTURE_PROTOBUF(
+      AgentRegisteredAcknowledgement(), _, _);
+
+  masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> recoveredState = parseMasterState(masterResponse->body);
+  ASSERT_SOME(recoveredState);
+  ASSERT_EQ(1, recoveredState->agents_size());
+  ASSERT_EQ(1, recoveredState->agents(0).overlays_size());
+  EXPECT_EQ(
+      state->agents(0).overlays(0).subnet(),
+      recoveredState->agents(0).overlays(0).subnet());
+
+  // The agent should have been moved to a variable of its own.
+  masterModule->reset();
+
+  {
+    Log log(1, REPLICATED_LOG_PATH, std::set<UPID>(), true);
+    LogStorage storage(&log);
+    mesos::state::protobuf::State replicatedLog(&storage);
+
+    Future<Variable<State>> index =
+      replicatedLog.fetch<State>(REPLICATED_LOG_STORE_KEY);
+
+    AWAIT_READY(index);
+    EXPECT_TRUE(index->get().has_network());
+    EXPECT_EQ(0, index->get().agents_size());
+
+    Future<Variable<AgentInfo>> agent =
+      replicatedLog.fetch<AgentInfo>(agentKey);
+
+    AWAIT_READY(agent);
+    EXPECT_EQ(state->agents(0).ip(), agent->get().ip());
+  }
 }
 
 
-// Test enable/disable IPv6 configuration.
-TEST_F(OverlayTest, ROOT_checkEnableDisableIPv6Configuration)
+// Tests that only the authorized principals can disable an overlay
+// through the `overlays` endpoint, and that a new master keeps it
+// disabled.
+TEST_F(OverlayTest, checkEnableOverlay)
 {
   Try<Owned<cluster::Master>> master = StartMaster();
   ASSERT_SOME(master);
-  LOG(INFO) << "Master PID: " << master.get()->pid;
 
-  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+  masterOverlayConfig.add_authorized_principals(
+      DEFAULT_CREDENTIAL.principal());
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
   ASSERT_SOME(masterModule);
 
-  // Master `Anonymous` module created successfully.
   UPID overlayMaster = UPID(
       MASTER_MANAGER_PROCESS_ID,
       master.get()->pid.address);
@@ -1525,27 +1806,528 @@ TEST_F(OverlayTest, ROOT_checkEnableDisableIPv6Configuration)
   AgentConfig agentOverlayConfig;
   agentOverlayConfig.set_master(stringify(overlayMaster.address));
 
-  // Enable docker bridge. IPv6 is enabled by default so
-  // this should create an IPv6 docker bridge
-  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
-
-  // Setup futures to notify the test that Agent overlay module has
-  // registered.
-  Future<AgentRegisteredMessage> agentRegisteredMessage =
-    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
 
   Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
       agentOverlayConfig);
 
   ASSERT_SOME(agentModule);
 
-  AWAIT_READY(agentRegisteredMessage);
+  AWAIT_READY(agentRegisteredAcknowledgement);
 
-  // Check the agent is allowed to progress.
-  AWAIT_READY(agentModule.get()->ready());
+  http::URL url(
+      "http",
+      overlayMaster.address.ip,
+      overlayMaster.address.port,
+      "/" + string(MASTER_MANAGER_PROCESS_ID) + "/overlays");
 
-  // Verify the docker network has been installed correctly.
-  Future<string> docker = runCommand("docker",
+  url.query["name"] = OVERLAY_NAME;
+  url.query["enabled"] = "false";
+
+  Future<Response> response = process::http::post(
+      url,
+      createBasicAuthHeaders(DEFAULT_CREDENTIAL_2));
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(http::Forbidden().status, response);
+
+  response = process::http::post(
+      url,
+      createBasicAuthHeaders(DEFAULT_CREDENTIAL));
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, response);
+
+  // Re-start the master and wait for the agent to re-register.
+  masterModule->reset();
+
+  agentRegisteredAcknowledgement = FUTURE_PROTOBUF(
+      AgentRegisteredAcknowledgement(), _, _);
+
+  masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  Future<Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+
+  ASSERT_EQ(1, state->toggles_size());
+  EXPECT_EQ(OVERLAY_NAME, state->toggles(0).name());
+  EXPECT_FALSE(state->toggles(0).enabled());
+
+  foreach (const OverlayInfo& overlay, state->network().overlays()) {
+    if (overlay.name() == OVERLAY_NAME) {
+      EXPECT_FALSE(overlay.enabled());
+    }
+  }
+}
+
+
+// Tests that the `state` endpoint of the overlay master serves both
+// JSON and protobuf, and skips unchanged state via 'If-None-Match'.
+TEST_F(OverlayTest, checkMasterStateCaching)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(agentModule.get()->ready());
+
+  Future<http::Response> masterResponse = process::http::get(
+      overlayMaster,
+      "state");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      masterResponse);
+
+  Option<string> etag = masterResponse->headers.get("ETag");
+  ASSERT_SOME(etag);
+
+  Try<State> state = parseMasterState(masterResponse->body);
+  ASSERT_SOME(state);
+  ASSERT_EQ(1, state->agents_size());
+
+  // The state has not changed, so it should not be sent again.
+  masterResponse = process::http::get(
+      overlayMaster,
+      "state",
+      None(),
+      http::Headers({{"If-None-Match", etag.get()}}));
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(
+      http::Status::string(http::Status::NOT_MODIFIED),
+      masterResponse);
+
+  EXPECT_TRUE(masterResponse->body.empty());
+
+  // The protobuf representation has an ETag of its own.
+  masterResponse = process::http::get(
+      overlayMaster,
+      "state",
+      None(),
+      http::Headers({{"Accept", APPLICATION_PROTOBUF},
+                     {"If-None-Match", etag.get()}}));
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_PROTOBUF,
+      "Content-Type",
+      masterResponse);
+
+  State protobufState;
+  ASSERT_TRUE(protobufState.ParseFromString(masterResponse->body));
+  ASSERT_EQ(1, protobufState.agents_size());
+  EXPECT_EQ(state->agents(0).ip(), protobufState.agents(0).ip());
+
+  // JSONP responses depend on the callback, so they carry no ETag.
+  masterResponse = process::http::get(
+      overlayMaster,
+      "state",
+      "jsonp=callback",
+      http::Headers({{"If-None-Match", etag.get()}}));
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      "text/javascript",
+      "Content-Type",
+      masterResponse);
+
+  EXPECT_NONE(masterResponse->headers.get("ETag"));
+}
+
+
+// Tests that a recovering master asks the agents to retry their
+// registration, rather than dropping it.
+TEST_F(OverlayTest, checkRegistrationRetryAfter)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  // The first registration makes the master start its recovery.
+  Future<RetryRegistrationMessage> retryRegistrationMessage =
+    FUTURE_PROTOBUF(RetryRegistrationMessage(), overlayMaster, _);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(retryRegistrationMessage);
+  EXPECT_LT(0u, retryRegistrationMessage->retry_after());
+
+  // The agent registers again as asked, well before its own backoff
+  // would have made it.
+  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(agentModule.get()->ready());
+}
+
+
+// Tests that disabling an overlay sends only the changed overlay to a
+// registered agent, without the agent having to register again.
+TEST_F(OverlayTest, checkIncrementalOverlayUpdate)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<UpdateAgentOverlaysMessage> updateAgentOverlaysMessage =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(updateAgentOverlaysMessage);
+  EXPECT_FALSE(updateAgentOverlaysMessage->incremental());
+  ASSERT_TRUE(updateAgentOverlaysMessage->has_config_version());
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(agentModule.get()->ready());
+
+  // The agent has configured this version of its overlays.
+  ASSERT_TRUE(agentRegisteredAcknowledgement->has_config_version());
+  EXPECT_EQ(
+      updateAgentOverlaysMessage->config_version().SerializeAsString(),
+      agentRegisteredAcknowledgement->config_version().SerializeAsString());
+
+  Future<UpdateAgentOverlaysMessage> incrementalUpdate =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, overlayMaster);
+
+  Future<AgentRegisteredAcknowledgement> incrementalAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  http::Request request;
+  request.method = "POST";
+  request.url = http::URL(
+      "http",
+      overlayMaster.address.ip,
+      overlayMaster.address.port,
+      overlayMaster.id + "/overlays");
+  request.url.query["name"] = OVERLAY_NAME;
+  request.url.query["enabled"] = "false";
+
+  Future<http::Response> masterResponse = http::request(request);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  AWAIT_READY(incrementalUpdate);
+  EXPECT_TRUE(incrementalUpdate->incremental());
+  ASSERT_EQ(1, incrementalUpdate->overlays_size());
+  EXPECT_EQ(OVERLAY_NAME, incrementalUpdate->overlays(0).info().name());
+  EXPECT_FALSE(incrementalUpdate->overlays(0).info().enabled());
+  EXPECT_LT(
+      updateAgentOverlaysMessage->config_version().version(),
+      incrementalUpdate->config_version().version());
+
+  // The agent only reports the state of the changed overlay.
+  AWAIT_READY(agentRegisteredMessage);
+  ASSERT_EQ(1, agentRegisteredMessage->overlays_size());
+  EXPECT_FALSE(agentRegisteredMessage->overlays(0).info().enabled());
+
+  AWAIT_READY(incrementalAcknowledgement);
+  EXPECT_EQ(
+      incrementalUpdate->config_version().SerializeAsString(),
+      incrementalAcknowledgement->config_version().SerializeAsString());
+
+  // The overlay remains configured on the agent.
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  Future<http::Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+  ASSERT_EQ(1, info->overlays_size());
+  EXPECT_FALSE(info->overlays(0).info().enabled());
+  EXPECT_EQ(
+      OverlayState::STATUS_OK,
+      info->overlays(0).state().status());
+}
+
+
+// Tests that an incremental update which does not reach the agent is
+// sent again with the next one, since the master computes the changes
+// from the version the agent has acknowledged.
+TEST_F(OverlayTest, checkLostIncrementalOverlayUpdate)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+
+  OverlayInfo overlay;
+  overlay.set_name(OVERLAY_NAME_2);
+  overlay.set_subnet("11.0.0.0/8");
+  overlay.set_subnet6("fd04::/64");
+  overlay.set_prefix(OVERLAY_PREFIX);
+  overlay.set_prefix6(OVERLAY_PREFIX6);
+
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig.mutable_network()->add_overlays()->CopyFrom(overlay);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  Future<UpdateAgentOverlaysMessage> updateAgentOverlaysMessage =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(updateAgentOverlaysMessage);
+  ASSERT_EQ(2, updateAgentOverlaysMessage->overlays_size());
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+  AWAIT_READY(agentModule.get()->ready());
+
+  http::Request request;
+  request.method = "POST";
+  request.url = http::URL(
+      "http",
+      overlayMaster.address.ip,
+      overlayMaster.address.port,
+      overlayMaster.id + "/overlays");
+  request.url.query["enabled"] = "false";
+
+  // Drop the update which disables the first overlay.
+  Future<UpdateAgentOverlaysMessage> lostUpdate =
+    DROP_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+
+  request.url.query["name"] = OVERLAY_NAME;
+
+  Future<http::Response> masterResponse = http::request(request);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  AWAIT_READY(lostUpdate);
+  ASSERT_EQ(1, lostUpdate->overlays_size());
+
+  Future<UpdateAgentOverlaysMessage> incrementalUpdate =
+    FUTURE_PROTOBUF(UpdateAgentOverlaysMessage(), overlayMaster, _);
+
+  Future<AgentRegisteredAcknowledgement> incrementalAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  request.url.query["name"] = OVERLAY_NAME_2;
+
+  masterResponse = http::request(request);
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, masterResponse);
+
+  // The update carries the lost change as well, on top of the version
+  // the agent has acknowledged.
+  AWAIT_READY(incrementalUpdate);
+  EXPECT_TRUE(incrementalUpdate->incremental());
+  EXPECT_EQ(2, incrementalUpdate->overlays_size());
+  ASSERT_TRUE(incrementalUpdate->has_base_version());
+  EXPECT_EQ(
+      updateAgentOverlaysMessage->config_version().SerializeAsString(),
+      incrementalUpdate->base_version().SerializeAsString());
+
+  AWAIT_READY(incrementalAcknowledgement);
+  EXPECT_EQ(
+      incrementalUpdate->config_version().SerializeAsString(),
+      incrementalAcknowledgement->config_version().SerializeAsString());
+
+  // Both overlays have been disabled on the agent.
+  UPID overlayAgent = UPID(
+      AGENT_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  Future<http::Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+  ASSERT_EQ(2, info->overlays_size());
+  foreach (const AgentOverlayInfo& _overlay, info->overlays()) {
+    EXPECT_FALSE(_overlay.info().enabled());
+    EXPECT_EQ(OverlayState::STATUS_OK, _overlay.state().status());
+  }
+}
+
+
+// Tests the custom mtu configuration
+TEST_F(OverlayTest, checkMTUConfiguration)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  // Ask overlay Master to use the replicated log by setting
+  // `replicated_log_dir`. We are not specifying `zk` configuration so
+  // the `quorum` will default to "1".
+  MasterConfig masterOverlayConfig;
+  masterOverlayConfig
+    .set_replicated_log_dir("overlay_replicated_log");
+  masterOverlayConfig.mutable_network()->set_vtep_mtu(9000);
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster(masterOverlayConfig);
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully.
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+  // Set number of times the agent will attempt to configure virtual
+  // networks by re-registering with the master.
+  agentOverlayConfig.set_max_configuration_attempts(1);
+
+  // Setup futures to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredAcknowledgement> agentRegisteredAcknowledgement =
+    FUTURE_PROTOBUF(AgentRegisteredAcknowledgement(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  AWAIT_READY(agentRegisteredAcknowledgement);
+
+  ASSERT_SOME(agentModule);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Hit the `overlay` endpoint of the agent to check that
+  // there it got a custom mtu configuration
+  UPID overlayAgent = UPID(master.get()->pid);
+  overlayAgent.id = AGENT_MANAGER_PROCESS_ID;
+
+  Future<Response> agentResponse = process::http::get(
+      overlayAgent,
+      "overlay");
+
+  AWAIT_EXPECT_RESPONSE_STATUS_EQ(OK().status, agentResponse);
+  AWAIT_EXPECT_RESPONSE_HEADER_EQ(
+      APPLICATION_JSON,
+      "Content-Type",
+      agentResponse);
+
+  Try<AgentInfo> info = parseAgentOverlay(agentResponse->body);
+  ASSERT_SOME(info);
+
+  // MTU should be equal to the value in master configuration
+  ASSERT_EQ(9000, info->overlays(0).backend().vxlan().vtep_mtu());
+}
+
+
+// Test enable/disable IPv6 configuration.
+TEST_F(OverlayTest, ROOT_checkEnableDisableIPv6Configuration)
+{
+  Try<Owned<cluster::Master>> master = StartMaster();
+  ASSERT_SOME(master);
+  LOG(INFO) << "Master PID: " << master.get()->pid;
+
+  Try<Owned<Anonymous>> masterModule = startOverlayMaster();
+  ASSERT_SOME(masterModule);
+
+  // Master `Anonymous` module created successfully.
+  UPID overlayMaster = UPID(
+      MASTER_MANAGER_PROCESS_ID,
+      master.get()->pid.address);
+
+  AgentConfig agentOverlayConfig;
+  agentOverlayConfig.set_master(stringify(overlayMaster.address));
+
+  // Enable docker bridge. IPv6 is enabled by default so
+  // this should create an IPv6 docker bridge
+  agentOverlayConfig.mutable_network_config()->set_docker_bridge(true);
+
+  // Setup futures to notify the test that Agent overlay module has
+  // registered.
+  Future<AgentRegisteredMessage> agentRegisteredMessage =
+    FUTURE_PROTOBUF(AgentRegisteredMessage(), _, _);
+
+  Try<Owned<overlayAgent::ManagerProcess>> agentModule = startOverlayAgent(
+      agentOverlayConfig);
+
+  ASSERT_SOME(agentModule);
+
+  AWAIT_READY(agentRegisteredMessage);
+
+  // Check the agent is allowed to progress.
+  AWAIT_READY(agentModule.get()->ready());
+
+  // Verify the docker network has been installed correctly.
+  Future<string> docker = runCommand("docker",
       {"docker",
        "network",
        "inspect",
@@ -1946,6 +2728,102 @@ TEST_F(OverlayTest, ROOT_checkDockerIsolation)
 }
 
 
+// Test that the `iptables-restore` input only installs the rules
+// which are missing from the output of `iptables-save`, and moves the
+// DOCKER-ISOLATION bypass to the front of the isolation chain.
+TEST_F(OverlayTest, checkRestoreInput)
+{
+  const string masquerade =
+    "-A POSTROUTING -s 44.128.0.0/24 -m set --match-set " +
+    string(IPSET_OVERLAY) + " dst -j MASQUERADE";
+
+  const string nat =
+    "*nat\n"
+    ":POSTROUTING ACCEPT [0:0]\n"
+    "COMMIT\n";
+
+  // A missing rule is installed.
+  Try<string> input =
+    overlayAgent::restoreInput(nat, {"44.128.0.0/24"}, false);
+  ASSERT_SOME(input);
+  EXPECT_EQ("*nat\n" + masquerade + "\nCOMMIT\n", input.get());
+
+  // An existing rule is not installed again.
+  const string existing =
+    "*nat\n"
+    ":POSTROUTING ACCEPT [0:0]\n" +
+    masquerade + "\n"
+    "COMMIT\n";
+
+  input = overlayAgent::restoreInput(existing, {"44.128.0.0/24"}, false);
+  ASSERT_SOME(input);
+  EXPECT_EQ("", input.get());
+
+  // The bypass is inserted if it is missing, and left alone if it is
+  // the first rule of the chain.
+  const string missing =
+    "*filter\n"
+    ":DOCKER-ISOLATION - [0:0]\n"
+    "-A DOCKER-ISOLATION -i docker0 -o d-dcos -j DROP\n"
+    "COMMIT\n";
+
+  input = overlayAgent::restoreInput(missing, {}, true);
+  ASSERT_SOME(input);
+  EXPECT_EQ(
+      "*filter\n"
+      "-I DOCKER-ISOLATION 1 -j RETURN\n"
+      "COMMIT\n",
+      input.get());
+
+  const string first =
+    "*filter\n"
+    ":DOCKER-ISOLATION - [0:0]\n"
+    "-A DOCKER-ISOLATION -j RETURN\n"
+    "-A DOCKER-ISOLATION -i docker0 -o d-dcos -j DROP\n"
+    "COMMIT\n";
+
+  input = overlayAgent::restoreInput(first, {}, true);
+  ASSERT_SOME(input);
+  EXPECT_EQ("", input.get());
+
+  // A bypass which is not the first rule is moved to the front.
+  const string last =
+    "*filter\n"
+    ":DOCKER-ISOLATION - [0:0]\n"
+    "-A DOCKER-ISOLATION -i docker0 -o d-dcos -j DROP\n"
+    "-A DOCKER-ISOLATION -j RETURN\n"
+    "COMMIT\n";
+
+  input = overlayAgent::restoreInput(last, {}, true);
+  ASSERT_SOME(input);
+  EXPECT_EQ(
+      "*filter\n"
+      "-D DOCKER-ISOLATION -j RETURN\n"
+      "-I DOCKER-ISOLATION 1 -j RETURN\n"
+      "COMMIT\n",
+      input.get());
+
+  // Newer Docker versions only have the -STAGE-2 chain.
+  const string stage2 =
+    "*filter\n"
+    ":DOCKER-ISOLATION-STAGE-1 - [0:0]\n"
+    ":DOCKER-ISOLATION-STAGE-2 - [0:0]\n"
+    "-A DOCKER-ISOLATION-STAGE-2 -o docker0 -j DROP\n"
+    "COMMIT\n";
+
+  input = overlayAgent::restoreInput(stage2, {}, true);
+  ASSERT_SOME(input);
+  EXPECT_EQ(
+      "*filter\n"
+      "-I DOCKER-ISOLATION-STAGE-2 1 -j RETURN\n"
+      "COMMIT\n",
+      input.get());
+
+  // Without any isolation chain the bypass cannot be installed.
+  EXPECT_ERROR(overlayAgent::restoreInput(nat, {}, true));
+}
+
+
 // Test the supervisor.
 TEST_F(OverlayTest, supervisor)
 {
@@ -1981,6 +2859,64 @@ TEST_F(OverlayTest, supervisor)
   wait(supervisor.get());
 }
 
+
+// Test that the subnet allocator hands out the lowest free subnets,
+// and takes back the ones which are freed or reserved.
+TEST_F(OverlayTest, subnetAllocator)
+{
+  Try<Network> network = Network::parse("192.168.0.0/22", AF_INET);
+  ASSERT_SOME(network);
+
+  SubnetAllocator allocator(network.get(), 24);
+  EXPECT_EQ(4u, allocator.size());
+  EXPECT_TRUE(allocator.complete());
+
+  Try<Network> subnet = Network::parse("192.168.1.0/24", AF_INET);
+  ASSERT_SOME(subnet);
+  EXPECT_SOME(allocator.reserve(subnet.get()));
+  EXPECT_ERROR(allocator.reserve(subnet.get()));
+
+  Try<Network> first = allocator.allocate();
+  ASSERT_SOME(first);
+  EXPECT_EQ("192.168.0.0/24", stringify(first.get()));
+
+  Try<Network> second = allocator.allocate();
+  ASSERT_SOME(second);
+  EXPECT_EQ("192.168.2.0/24", stringify(second.get()));
+
+  EXPECT_SOME(allocator.free(subnet.get()));
+  EXPECT_ERROR(allocator.free(subnet.get()));
+
+  Try<Network> third = allocator.allocate();
+  ASSERT_SOME(third);
+  EXPECT_EQ(subnet.get(), third.get());
+
+  ASSERT_SOME(allocator.allocate());
+  EXPECT_ERROR(allocator.allocate());
+  EXPECT_EQ(4u, allocator.allocated());
+
+  // Subnets of other networks, or with another prefix, are rejected.
+  Try<Network> outside = Network::parse("192.168.4.0/24", AF_INET);
+  ASSERT_SOME(outside);
+  EXPECT_ERROR(allocator.free(outside.get()));
+
+  Try<Network> prefix = Network::parse("192.168.0.0/23", AF_INET);
+  ASSERT_SOME(prefix);
+  EXPECT_ERROR(allocator.free(prefix.get()));
+
+  // Only the first 2^62 addresses of an IPv6 /64 are allocated.
+  Try<Network> network6 = Network::parse("fd02:a::/64", AF_INET6);
+  ASSERT_SOME(network6);
+
+  SubnetAllocator allocator6(network6.get(), 128);
+  EXPECT_FALSE(allocator6.complete());
+  EXPECT_EQ("fd02:a::3fff:ffff:ffff:ffff/128", stringify(allocator6.last()));
+
+  Try<Network> address6 = allocator6.allocate();
+  ASSERT_SOME(address6);
+  EXPECT_EQ("fd02:a::/128", stringify(address6.get()));
+}
+
 } // namespace tests {
 } // namespace overlay {
 } // namespace mesos {